@@ -11,15 +11,56 @@
  * - Analytics and reporting
  */
 
+#define _POSIX_C_SOURCE 200809L     // clock_gettime, nanosleep, pthreads
+#define _DEFAULT_SOURCE             // M_PI
+
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <termios.h>
+#ifdef __SSE2__
+#include <emmintrin.h>              // Roster CSV parser classifies 16 bytes per compare
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>                 // mallinfo2 for the --footprint heap check
+#endif
 
 // =================== SYSTEM CONSTANTS ===================
-#define MAX_USERS 1000              // Maximum number of users in system
-#define MAX_TRANSACTIONS 5000       // Maximum transaction history
+
+// Build profile: -DWATER_ATM_EMBEDDED sizes every table for low-RAM dispenser
+// controllers (see --footprint); capacities marked #ifndef can also be set
+// individually, e.g. -DMAX_USERS=500
+#ifdef WATER_ATM_EMBEDDED
+#define PROFILE(full, embedded) (embedded)
+#else
+#define PROFILE(full, embedded) (full)
+#endif
+
+#ifndef MAX_USERS
+#define MAX_USERS PROFILE(1000, 200) // Maximum number of users in system (-DMAX_USERS=1100000 for a 1M-row roster, about 450 MB)
+#endif
+#ifndef MAX_TRANSACTIONS
+#define MAX_TRANSACTIONS PROFILE(5000, 500) // Maximum transaction history
+#endif
 #define WATER_PRICE_PER_LITER 2.0   // Base price per liter of water
 #define DIGITAL_FEE 1.0             // Fee charged for digital payments
 #define MIN_BULK_LITERS 10          // Minimum liters for bulk discount
@@ -27,6 +68,262 @@
 #define WEEKLY_PASS_COST 15.0       // Cost of weekly pass (no digital fees)
 #define MONTHLY_PASS_COST 50.0      // Cost of monthly pass (no digital fees)
 
+// ID generation (Snowflake layout: 41-bit ms | 10-bit kiosk | 4-bit thread | 8-bit sequence)
+#define ID_EPOCH_MS 1735689600000LL // Custom epoch: 2025-01-01 00:00:00 UTC
+#define ID_KIOSK_BITS 10            // Up to 1024 kiosks
+#define ID_THREAD_BITS 4            // Up to 16 generator threads per kiosk
+#define ID_SEQUENCE_BITS 8          // 256 IDs per thread per millisecond
+#define DEFAULT_KIOSK_ID 1          // Used when WATER_ATM_KIOSK_ID is not set
+
+// Receipt spooler (printer output runs on its own thread)
+#ifndef RECEIPT_QUEUE_SIZE
+#define RECEIPT_QUEUE_SIZE PROFILE(32, 4) // Receipts waiting for the printer
+#endif
+#define RECEIPT_MAX_LEN 1024        // Rendered receipt size limit
+#define RECEIPT_RETRY_MS 200        // First retry delay after a failed print
+#define RECEIPT_MAX_RETRY_MS 5000   // Retry delay cap (printer offline/out of paper)
+
+// UPI payment gateway client
+#define PAYMENT_POOL_SIZE 4         // Persistent connections to the gateway
+#ifndef PAYMENT_MAX_INFLIGHT
+#define PAYMENT_MAX_INFLIGHT PROFILE(256, 16) // Outstanding payments per kiosk (pipelined over the pool)
+#endif
+#define PAYMENT_TIMEOUT_MS 5000     // Give up on a payment after this long
+#define PAYMENT_HEDGE_MS 600        // Send a hedged duplicate if no answer by then
+#define PAYMENT_MAX_ATTEMPTS 2      // Original request + one hedge
+#define PAYMENT_TICK_MS 20          // Event loop timer resolution
+#define PAYMENT_CONNECT_MS 250      // Give up on a (re)connect after this long
+#define PAYMENT_VOID_SLOTS PROFILE(512, 32) // Timed-out payments awaiting a confirmed cancel
+#define PAYMENT_RBUF_SIZE PROFILE(8192, 1024) // Per-connection read buffer
+#define PAYMENT_BENCH_MAX PROFILE(4096, 256) // Purchases per benchmark round
+#define MOCK_DEFAULT_LATENCY_MS 300 // Bundled mock gateway: mean answer time
+#define MOCK_DEFAULT_FAILURE_RATE 0.02 // Bundled mock gateway: fraction declined
+#define MOCK_SLOW_TAIL_PERCENT 5    // Bundled mock gateway: stragglers at 5x latency
+#define MOCK_MAX_PENDING PROFILE(1024, 64) // Bundled mock gateway: queued answers per connection
+#define MOCK_IDEMPOTENCY_SLOTS PROFILE(16384, 1024) // Bundled mock gateway: remembered request IDs
+
+// Telemetry store (Gorilla-compressed sensor time series)
+#define TELEMETRY_SERIES 3          // Sensors per kiosk
+#define SENSOR_FLOW_RATE 0          // Flow meter (liters/minute)
+#define SENSOR_TANK_LEVEL 1         // Tank level (liters)
+#define SENSOR_PUMP_CURRENT 2       // Pump current (amps)
+#define TELEMETRY_BLOCK_WORDS 128   // 1 KB compressed bit stream per block
+#ifndef TELEMETRY_MAX_BLOCKS
+#define TELEMETRY_MAX_BLOCKS PROFILE(1024, 32) // 1 MB of compressed readings, oldest recycled
+#endif
+#define TANK_CAPACITY_LITERS 5000.0 // Full tank
+#define NOZZLE_FLOW_LPM 10.0        // Nominal nozzle flow rate (liters/minute)
+#define PUMP_CURRENT_AMPS 2.4       // Pump current while dispensing
+
+// Dispense reconciliation (sold liters vs flow meter)
+#ifndef RECON_MAX_KIOSKS
+#define RECON_MAX_KIOSKS PROFILE(64, 4) // Kiosks tracked at once (fixed table)
+#endif
+#define RECON_WINDOW_MS 60000       // Tumbling window width
+#define RECON_OPEN_WINDOWS 8        // Windows open ahead of the watermark
+#define RECON_HORIZON_WINDOWS 10    // Closed windows summed for drift
+#define RECON_LATENESS_MS 10000     // Allowed sale/reading lateness behind the meter
+#define RECON_MAX_GAP_MS 5000       // Longer meter gaps are not integrated
+#define RECON_TOLERANCE_LITERS 2.0  // Drift allowed over the horizon...
+#define RECON_TOLERANCE_PERCENT 5.0 // ...plus this share of liters sold
+
+// RFID/NFC card tap-to-dispense
+#define CARD_INDEX_BITS PROFILE(18, 9) // Card UID hash index (2x the most cards linked)
+#define CARD_INDEX_SLOTS (1 << CARD_INDEX_BITS)
+#define TAP_DEFAULT_LITERS 5.0      // Quantity dispensed by a bare tap
+#define TAP_ELIG_STUDENT 0x01       // Tap profile: student discount applies
+#define TAP_ELIG_LOYALTY 0x02       // Tap profile: loyalty discount applies
+#define TAP_ELIG_POINTS 0x04        // Tap profile: points redeemable
+#define TAP_ELIG_PASS 0x08          // Tap profile: valid pass (no digital fee)
+
+// QR code payment tokens
+#define QR_BENCH_KEY "water-atm-bench-qr-key" // Offline benchmark/replay runs only (never at the counter)
+#define QR_MAX_MESSAGE 63           // Signed part of a token (55 fits one SHA-256 block)
+#define QR_TOKEN_TTL_S 300          // Lifetime of tokens issued by --qr-token
+#define QR_MAX_LIFETIME_S 3600      // Tokens valid for longer are refused
+#define QR_REPLAY_BITS PROFILE(13, 10) // 8192-slot nonce replay cache
+#define QR_REPLAY_SLOTS (1 << QR_REPLAY_BITS)
+#define QR_REPLAY_MAX_PROBE 64      // Probe window before the cache reports full
+#define QR_BATCH_WAIT_US 50         // How long a batch leader waits for others to join
+#define QR_OK 0                     // Verification results
+#define QR_MALFORMED 1
+#define QR_BAD_SIGNATURE 2
+#define QR_EXPIRED 3
+#define QR_REPLAYED 4
+#define QR_REPLAY_FULL 5
+#define QR_NO_KEY 6                 // WATER_ATM_QR_KEY not set: QR payments refused
+
+// Kiosk registry and nearest-kiosk search
+#ifndef MAX_KIOSK_SITES
+#define MAX_KIOSK_SITES PROFILE(65536, 1024) // Kiosk sites known to this process
+#endif
+#define GRID_CELL_DEG 0.01          // Grid cell side (~1.1 km)
+#ifndef GRID_SLOTS
+#define GRID_SLOTS PROFILE(131072, 2048) // Grid cell hash table size (power of 2, >= 2x sites)
+#endif
+#define EARTH_RADIUS_KM 6371.0
+#define NEAREST_RESULTS 5           // Kiosks listed by the nearest-kiosk search
+#define NEAREST_MAX_KM 50.0         // Search radius
+
+// Group (family/hostel) wallets
+#ifndef MAX_GROUPS
+#define MAX_GROUPS PROFILE(256, 16) // Group wallets in system
+#endif
+#define GROUP_STRIPES PROFILE(8, 2) // Independent sub-balances per group wallet
+
+// PIN authentication (scrypt) and kiosk sessions
+#define PIN_MIN_DIGITS 4
+#define PIN_MAX_DIGITS 6
+#ifndef PIN_KDF_N
+#define PIN_KDF_N PROFILE(16384, 1024) // scrypt cost (power of 2): 128 * r * N bytes per hash
+#endif
+#define PIN_KDF_R 8                 // scrypt block size (16 MB / 1 MB per hash)
+#define PIN_MAX_FAILURES 5          // Wrong PINs in a row before lockout
+#define PIN_LOCKOUT_S 300           // Lockout after too many wrong PINs
+#define PIN_OK 0                    // PIN check results
+#define PIN_WRONG 1
+#define PIN_LOCKED 2
+#define SESSION_SLOTS 64            // Live session tokens (power of 2)
+#define SESSION_IDLE_MS 60000       // Session ends after this long unused
+#define SESSION_MAX_MS 300000       // ...and never lives longer than this
+
+// Flash transaction log (append-only ring of erase blocks)
+#define FLASH_PAGE_SIZE 4096        // Erase block size
+#define FLASH_LOG_PAGES PROFILE(256, 16) // Pages in the ring (1 MB / 64 KB)
+#define FLASH_RECORD_SIZE 32        // Packed sale record
+#define FLASH_RECORDS_PER_PAGE (FLASH_PAGE_SIZE / FLASH_RECORD_SIZE - 1) // First slot is the page header
+#define FLASH_PAGE_MAGIC 0x57415432u // "WAT2": refunds keep their customer, a link record names the sale
+#define FLASH_PAGE_MAGIC_V1 0x57415431u // "WAT1": refunds carried the sale's ID instead of the customer (read only)
+
+// User indexes and bulk roster import
+#define USER_INDEX_SLOTS (2 * MAX_USERS) // Open-addressing slots per user index
+#define IMPORT_MAX_THREADS 8        // CSV parser threads
+#define IMPORT_ROUND_ROWS PROFILE(262144, 1024) // Rows parsed per round (all threads)
+#define IMPORT_OK 0                 // Per-row import results
+#define IMPORT_DUPLICATE 1          // Phone already registered (or earlier in the file)
+#define IMPORT_BAD_NAME 2
+#define IMPORT_BAD_PHONE 3
+#define IMPORT_BAD_STUDENT 4
+#define IMPORT_BAD_FORMAT 5         // Not exactly three fields
+#define IMPORT_FULL 6               // User store full
+#define IMPORT_HEADER 7             // Column header line (skipped)
+#define CREDIT_MAX_PAISE 10000000LL // Largest single settlement credit (₹1,00,000)
+#define CREDIT_BONUS_MIN_PAISE 10000 // Credits of ₹100+ earn the 2% top-up bonus
+#define CREDIT_OK 0                 // Per-line settlement results
+#define CREDIT_UNKNOWN_USER 1
+#define CREDIT_BAD_AMOUNT 2         // Not a positive amount with at most 2 decimals
+#define CREDIT_BAD_FORMAT 3         // Not user_id,amount
+#define CREDIT_HEADER 4             // Column header line (skipped)
+#define CREDIT_ALREADY_APPLIED -2   // credit_batch_apply() failures (-1 = unreadable)
+#define CREDIT_JOURNAL_FAILED -3
+
+// Multi-nozzle queue scheduler
+#define NOZZLE_MAX 8                // Nozzles per kiosk
+#define NOZZLE_QUEUE_MAX PROFILE(1024, 32) // Waiting orders per lane (more are turned away)
+#define NOZZLE_HANDOVER_S 15.0      // Per order: place bottle, start, take it away
+#define NOZZLE_AGING 0.5            // Seconds of job size forgiven per second waited
+#define NOZZLE_SIM_MAX PROFILE(100000, 2000) // Customers per simulated policy
+#define NOZZLE_FIFO 0               // First come, first served
+#define NOZZLE_SJF 1                // Shortest dispense first, with aging
+#define NOZZLE_BULK_LANE 2          // SJF, at most one bulk order dispensing at a time
+
+// Tamper-evident transaction log (Merkle batches, hash-chained)
+#define AUDIT_BATCH PROFILE(256, 32) // Records per Merkle batch
+#define AUDIT_EARLY_SEALS PROFILE(1024, 64) // Partial batches sealed by time before sealing waits for full ones
+#define AUDIT_MAX_BATCHES ((MAX_TRANSACTIONS + AUDIT_BATCH - 1) / AUDIT_BATCH + AUDIT_EARLY_SEALS)
+#define AUDIT_MAX_DEPTH 16          // Merkle levels in a proof (2^16 > any batch)
+#define AUDIT_LEAF_LEN 54           // Encoded record (fits one SHA-256 block)
+#define AUDIT_SEAL_MS 1000          // Seal a partial batch after this long
+
+// Refunds (compensating entries for failed dispenses)
+#define TXN_INDEX_SLOTS (2 * MAX_TRANSACTIONS) // Open-addressing slots per transaction index
+#define REFUND_RESERVE PROFILE(64, 8) // transactions[] slots kept for refund entries
+#define TXN_SALE_SLOTS (MAX_TRANSACTIONS - REFUND_RESERVE) // History that sales (and flash replay) may fill
+#define REFUND_WINDOW_S (24 * 3600) // Only sales this recent can be reported or refunded
+#define REFUND_OK 0                 // refund_transaction() results
+#define REFUND_UNKNOWN 1            // Not in transaction history
+#define REFUND_NOT_A_SALE 2         // Is itself a refund entry
+#define REFUND_DUPLICATE 3          // Sale was already refunded
+#define REFUND_NO_ACCOUNT 4         // Customer or group wallet no longer registered
+#define REFUND_HISTORY_FULL 5       // No room to record the compensating entry
+#define REFUND_TOO_OLD 6            // Sold more than REFUND_WINDOW_S ago
+#define REFUND_NOT_REPORTED 7       // No failed dispense was reported for the sale
+
+// Replica sync (Merkle anti-entropy between a kiosk and the central store)
+#define SYNC_LEAVES PROFILE(4096, 64) // User-ID hash ranges (tree leaves, power of two)
+#define SYNC_CHUNK PROFILE(256, 16) // Records per socket read/write
+#define SYNC_MSG_NODES 1            // Node indexes -> their hashes (one tree level)
+#define SYNC_MSG_DIGESTS 2          // Leaf indexes -> (ID, digest, version) of their users there
+#define SYNC_MSG_RECORDS 3          // Newer records + wanted IDs -> the wanted records
+#define SYNC_MSG_DONE 4             // -> their root after applying
+#define SYNC_UNSEEN 0               // sync_state: not (yet) reported by the peer
+#define SYNC_SEEN 1                 // Peer has it: same, or the peer's copy wins
+#define SYNC_PUSH 2                 // Ours is newer or has unsynced wallet changes: send it
+#define SYNC_MAX_PAISE 100000000LL  // Largest wallet amount or change a record may carry (₹10 lakh)
+#define SYNC_REC_STUDENT 0x01       // SyncRecord flags
+#define SYNC_REC_WEEKLY 0x02
+#define SYNC_REC_MONTHLY 0x04
+#define SYNC_REC_PIN 0x08
+
+// Kiosk cache of central user records (leases + pushed invalidations)
+#define LEASE_SETS PROFILE(1024, 16) // Cache sets (power of two)
+#define LEASE_WAYS 4                // Records per set (least recently used is evicted)
+#define LEASE_TERM_MS 5000          // How long the store vouches for a record it sent
+#define LEASE_MAX_KIOSKS 64         // Kiosks per store (lease holders are a bitmask)
+#define LEASE_MSG_GET 1             // Kiosk -> store: record + lease for a user
+#define LEASE_MSG_DEBIT 2           // Kiosk -> store: wallet write-through (negative = credit)
+#define LEASE_MSG_REPLY 3           // Store -> kiosk: status (+ record and lease if found)
+#define LEASE_MSG_INVALIDATE 4      // Store -> kiosk: drop your copy, it changed
+
+// Parallel report scans (worker threads pull cache-sized morsels of a table)
+#define SCAN_MORSEL_BYTES PROFILE(65536, 8192) // Table bytes per morsel (stays in L2 while scanned)
+#define SCAN_MAX_THREADS PROFILE(64, 4) // Workers per scan, caller included
+#define SCAN_PARTIAL_BYTES 512      // Room for one worker's partial aggregate
+#define SCAN_METHODS 6              // Payment methods in sales reports (flash_methods order)
+
+// Analytics history (round-robin archives of per-interval changes in stats)
+#define HISTORY_ARCHIVES 3          // Per minute, per hour, per day
+#define HISTORY_MINUTE_ROWS PROFILE(1440, 60) // A day of minutes (an hour on embedded)
+#define HISTORY_HOUR_ROWS PROFILE(744, 168) // 31 days of hours (a week on embedded)
+#define HISTORY_DAY_ROWS PROFILE(1830, 366) // 5 years of days (a year on embedded)
+#define HISTORY_ROWS (HISTORY_MINUTE_ROWS + HISTORY_HOUR_ROWS + HISTORY_DAY_ROWS)
+#define HISTORY_MAGIC 0x57415448u   // "WATH"
+
+// Sales cube (kiosk/region/all x day/all x method/all, maintained on every commit)
+#define CUBE_SLOTS PROFILE(131072, 2048) // Cell hash table size (kept at most 7/8 full; oldest day evicted when it is)
+#define CUBE_REGIONS 256            // Region IDs from the fleet list (0 = unassigned)
+#define CUBE_METHODS 6              // Cash, Digital, UPI, QR, Group, Pass
+#define CUBE_KIOSK 0                // Location levels, finest first
+#define CUBE_REGION 1
+#define CUBE_ALL 2
+#define CUBE_ANY -1                 // Day or method rolled up
+
+// Cohort retention (registration week x weeks since registration)
+#define COHORT_WEEKS PROFILE(104, 26) // Registration weeks kept (two years / six months)
+#define COHORT_OFFSETS PROFILE(26, 13) // Weeks after registration tracked (at most 32)
+
+// Memory accounting (bytes of each subsystem's tables in use, by tag)
+#define MEM_USERS 0                 // User records + tap profiles
+#define MEM_TRANSACTIONS 1          // Transaction history and flash log state
+#define MEM_INDEXES 2               // User ID, phone, card and transaction ID indexes
+#define MEM_SKETCHES 3              // Aggregates: telemetry, sync tree, history, cube, cohorts
+#define MEM_CACHES 4                // PIN sessions, QR replay cache, lease cache
+#define MEM_BUFFERS 5               // Receipt queue, import rows, mapped files, scan partials
+#define MEM_SERVICES 6              // Gateway, kiosk registry, groups, nozzles, audit
+#define MEM_TAGS 7
+
+// Operators (tenants) hosted in one process; the prices above are the
+// first operator's unless a tenants file replaces them
+#define MAX_TENANTS PROFILE(16, 4)  // Operators per process
+#define TENANT_NAME_LEN 32
+#define TENANT_KEY_SHIFT 56         // Phone index keys carry the operator above the number
+
+// Payment request status
+#define PAY_PENDING 0
+#define PAY_APPROVED 1
+#define PAY_DECLINED 2
+#define PAY_TIMEOUT 3
+
 // =================== DATA STRUCTURES ===================
 
 /**
@@ -34,7 +331,7 @@
  * Contains personal info, financial data, and pass status
  */
 typedef struct {
-    int user_id;                    // Unique identifier for user
+    long long user_id;              // Unique identifier for user (Snowflake ID)
     char name[50];                  // User's full name
     char phone[15];                 // Contact number
     double wallet_balance;          // Current digital wallet balance
@@ -45,21 +342,43 @@ typedef struct {
     int has_monthly_pass;           // Boolean: has active monthly pass
     time_t pass_expiry;             // When current pass expires
     int is_student;                 // Boolean: eligible for student discount
+    int group_id;                   // Shared family/group wallet (0 = none)
+    int has_pin;                    // Boolean: PIN required for wallet spending
+    int pin_failures;               // Wrong PINs in a row
+    time_t pin_locked_until;        // Lockout end after too many wrong PINs
+    uint8_t pin_salt[16];           // Per-user random salt
+    uint8_t pin_hash[32];           // scrypt(PIN, salt)
+    uint32_t version;               // Bumped on every account change (replica sync)
+    int tenant;                     // Operator the account belongs to (index into tenants[])
 } User;
 
+// Compact transaction records on the embedded profile: a single sale never
+// needs more than float's 7 significant digits, and 32-bit seconds last until 2106
+#ifdef WATER_ATM_EMBEDDED
+typedef float txn_value_t;
+typedef uint32_t txn_time_t;
+#define TXN_METHOD_LEN 8
+#else
+typedef double txn_value_t;
+typedef time_t txn_time_t;
+#define TXN_METHOD_LEN 20
+#endif
+
 /**
  * Transaction Structure - Records each purchase
  * Maintains complete transaction history for analytics
  */
 typedef struct {
-    int transaction_id;             // Unique transaction identifier
-    int user_id;                    // Which user made this transaction
-    double amount;                  // Final amount paid
-    double liters;                  // Quantity of water purchased
-    char payment_method[20];        // "Cash" or "Digital"
-    double fee_charged;             // Digital payment fee (if any)
-    double discount_applied;        // Total discount given
-    time_t timestamp;               // When transaction occurred
+    long long transaction_id;       // Unique transaction identifier (Snowflake ID)
+    long long user_id;              // Which user made this transaction
+    txn_value_t amount;             // Final amount paid (negative for refunds)
+    txn_value_t liters;             // Quantity of water purchased
+    char payment_method[TXN_METHOD_LEN]; // "Cash", "Digital", "UPI", "QR", "Group" or "Refund"
+    int points_redeemed;            // Loyalty points spent on the discount
+    txn_value_t fee_charged;        // Digital payment fee (if any)
+    txn_value_t discount_applied;   // Total discount given
+    txn_time_t timestamp;           // When transaction occurred
+    long long reverses;             // Refunds: ID of the sale they undo (0 = a sale)
 } Transaction;
 
 /**
@@ -74,643 +393,10278 @@ typedef struct {
     int digital_transactions;       // Count of digital payments
     int bulk_purchases;             // Count of bulk orders (≥10L)
     int pass_holders;               // Count of users with active passes
+    int refunds;                    // Sales reversed after a failed dispense
+    double total_refunded;          // Amount paid back by those refunds
 } Analytics;
 
-// =================== GLOBAL VARIABLES ===================
-User users[MAX_USERS];              // Array to store all registered users
-Transaction transactions[MAX_TRANSACTIONS]; // Transaction history
-Analytics stats = {0};             // System statistics (initialized to zero)
-int user_count = 0;                 // Current number of registered users
-int transaction_count = 0;          // Current number of transactions
+/**
+ * Receipt Spooler Structure - Bounded queue between sales and the printer
+ * Sales only copy text into the ring; the spooler thread does the slow I/O
+ */
+typedef struct {
+    char queue[RECEIPT_QUEUE_SIZE][RECEIPT_MAX_LEN]; // Rendered receipts (ring buffer)
+    int head;                       // Next receipt to print
+    int count;                      // Receipts waiting
+    int running;                    // Boolean: spooler thread active
+    int paper_out;                  // Boolean: printer reported out of paper/offline
+    int printed;                    // Receipts printed successfully
+    int dropped;                    // Receipts dropped because the queue was full
+    int retries;                    // Failed print attempts that were retried
+    char device[256];               // Printer device, file or pty path
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+} ReceiptSpooler;
 
-// =================== FUNCTION DECLARATIONS ===================
-void display_menu();               // Show main menu options
-void register_user();              // Register new user in system
-void top_up_wallet();              // Add money to user's digital wallet
-void purchase_water();             // Main water purchase flow
-void purchase_pass();              // Buy weekly/monthly pass
-void view_user_profile();          // Display user information
-void admin_analytics();            // Show system analytics
-double calculate_discount(User* user, double liters, char* payment_method);
-double calculate_bulk_discount(double liters);
-double calculate_loyalty_discount(User* user);
-int is_pass_valid(User* user);     // Check if user's pass is still active
-void update_loyalty_points(User* user, double amount);
-void save_transaction(int user_id, double amount, double liters, char* method, double fee, double discount);
-User* find_user(int user_id);      // Find user by ID
-void display_pricing_info();       // Show pricing and discount information
+/**
+ * Payment Request Structure - One UPI charge waiting for the gateway
+ */
+typedef struct {
+    int in_use;                     // Boolean: slot holds a request
+    int status;                     // PAY_PENDING/APPROVED/DECLINED/TIMEOUT
+    long long request_id;           // Idempotency key (shared by hedged duplicates)
+    long long user_id;              // Paying user
+    double amount;                  // Amount to charge
+    long long submitted_ms;         // When the request was submitted
+    long long deadline_ms;          // When it times out
+    long long hedge_ms;             // When to send a hedged duplicate
+    int attempts;                   // Copies sent (original + hedges)
+    int sent_on;                    // Pool connection of the latest copy
+    char reference[24];             // Gateway transaction reference
+} PaymentRequest;
 
-// =================== MAIN PROGRAM FLOW ===================
 /**
- * Main function - Entry point of the program
- * Displays welcome message and runs main menu loop
+ * Payment Client Structure - Connection pool, in-flight table and counters
  */
-int main() {
-    int choice;
-    
-    // Display system welcome message
-    printf("=== WATER ATM MANAGEMENT SYSTEM ===\n");
-    printf("Smart Solution for Digital Payment Optimization\n\n");
-    
-    // Main program loop - continues until user chooses to exit
-    while (1) {
-        display_menu();             // Show available options
-        printf("Enter your choice: ");
-        scanf("%d", &choice);
-        
-        // Process user's menu choice
-        switch (choice) {
-            case 1:
-                register_user();    // Add new user to system
-                break;
-            case 2:
-                top_up_wallet();    // Add money to wallet
-                break;
-            case 3:
-                purchase_water();   // Main purchase functionality
-                break;
-            case 4:
-                purchase_pass();    // Buy fee-waiver pass
-                break;
-            case 5:
-                view_user_profile(); // Show user details
-                break;
-            case 6:
-                display_pricing_info(); // Show pricing guide
-                break;
-            case 7:
-                admin_analytics();  // Show business analytics
-                break;
-            case 8:
-                printf("Thank you for using Water ATM System!\n");
-                exit(0);            // Clean program exit
-            default:
-                printf("Invalid choice! Please try again.\n");
-        }
-        
-        // Pause for user to read output before clearing screen
-        printf("\nPress Enter to continue...");
-        getchar();
-        getchar();
-        system("clear || cls");     // Clear screen (works on Linux/Windows)
-    }
-    
-    return 0;
-}
+typedef struct {
+    char host[64];                  // Gateway address
+    int port;
+    int fds[PAYMENT_POOL_SIZE];     // Pool connections (-1 = reconnect on next send)
+    char rbuf[PAYMENT_POOL_SIZE][PAYMENT_RBUF_SIZE]; // Partial response lines
+    int rlen[PAYMENT_POOL_SIZE];
+    PaymentRequest slots[PAYMENT_MAX_INFLIGHT];      // In-flight requests (slot = handle)
+    int next_slot;                  // Where to start looking for a free slot
+    int timeout_ms;
+    int hedge_after_ms;
+    int running;                    // Boolean: event loop active
+    int wake_pipe[2];               // Wakes the event loop on shutdown
+    long long voids[PAYMENT_VOID_SLOTS]; // Timed-out request IDs not yet confirmed cancelled (0 = free)
+    long long void_retry_ms;        // When to resend unconfirmed cancels
+    int inflight, peak_inflight;    // Current and peak outstanding payments
+    int submitted, approved, declined, timeouts, hedges, reconnects;
+    int reversals, voids_lost;      // Late charges refunded; cancels dropped (table full)
+    pthread_mutex_t lock;
+    pthread_cond_t done;            // Signalled when any request finishes
+    pthread_t thread;
+} PaymentClient;
 
-// =================== USER INTERFACE FUNCTIONS ===================
+/**
+ * Mock Gateway Structure - Settings and idempotency table of the bundled gateway
+ */
+typedef struct {
+    int listen_fd;
+    int latency_ms;                 // Mean answer latency
+    double failure_rate;            // Fraction of charges declined
+    long long seen_ids[MOCK_IDEMPOTENCY_SLOTS]; // Request IDs already decided
+    char seen_ok[MOCK_IDEMPOTENCY_SLOTS];       // Their outcome
+    int seen_count;
+    int duplicates;                 // Hedged duplicates answered from the table
+    int reversals;                  // Charges refunded by CANCEL
+    int port;                       // Listening port (0 = not started)
+    pthread_mutex_t lock;
+} MockGateway;
 
 /**
- * Display Main Menu
- * Shows all available system functions to user
+ * Telemetry Block Structure - Compressed readings of one sensor
+ * Holds a summary for block skipping plus the encoder state for appends
  */
-void display_menu() {
-    printf("\n=== MAIN MENU ===\n");
-    printf("1. Register New User\n");
-    printf("2. Top-up Wallet\n");
-    printf("3. Purchase Water\n");
-    printf("4. Purchase Weekly/Monthly Pass\n");
-    printf("5. View User Profile\n");
-    printf("6. View Pricing & Discount Info\n");
-    printf("7. Admin Analytics\n");
-    printf("8. Exit\n");
-    printf("==================\n");
-}
+typedef struct {
+    int series;                     // SENSOR_* this block belongs to
+    int count;                      // Readings in block (0 = free)
+    long long start_ms, end_ms;     // Time range covered
+    double first_value;             // First reading (stored raw)
+    double min, max, sum;           // Summary for downsampling without decoding
+    long long prev_ts, prev_delta;  // Timestamp encoder state
+    uint64_t prev_bits;             // Value encoder state
+    int prev_leading, prev_trailing; // Current XOR window (-1 = none yet)
+    int bit_len;                    // Bits used in `bits`
+    uint64_t bits[TELEMETRY_BLOCK_WORDS];
+} TelemetryBlock;
 
-// =================== USER MANAGEMENT FUNCTIONS ===================
+/**
+ * Telemetry Store Structure - Ring of compressed blocks for all sensors
+ */
+typedef struct {
+    TelemetryBlock blocks[TELEMETRY_MAX_BLOCKS];
+    int open_block[TELEMETRY_SERIES]; // Block each sensor is appending to (-1 = none)
+    int next_block;                 // Next block to allocate (also the oldest)
+    long long points;               // Readings currently stored
+    long long bytes;                // Bytes currently stored (bit streams plus block headers)
+    pthread_mutex_t lock;
+} TelemetryStore;
 
 /**
- * Register New User
- * Collects user information and creates account
- * Initializes all user fields with default values
+ * Reconciliation Window Structure - Liters expected vs metered in one window
  */
-void register_user() {
-    // Check if system has reached maximum user capacity
-    if (user_count >= MAX_USERS) {
-        printf("Maximum user limit reached!\n");
-        return;
-    }
-    
-    // Get pointer to next available user slot
-    User* new_user = &users[user_count];
-    new_user->user_id = user_count + 1;    // Assign unique ID
-    
-    printf("\n=== USER REGISTRATION ===\n");
-    
-    // Collect user information
-    printf("Enter name: ");
-    scanf(" %[^\n]", new_user->name);      // Read full name including spaces
-    
-    printf("Enter phone number: ");
-    scanf("%s", new_user->phone);
-    
-    printf("Are you a student? (1 for Yes, 0 for No): ");
-    scanf("%d", &new_user->is_student);
-    
-    // Initialize financial and usage data
-    new_user->wallet_balance = 0.0;        // Start with empty wallet
-    new_user->total_spent = 0.0;           // No purchase history
-    new_user->transaction_count = 0;       // No transactions yet
-    new_user->loyalty_points = 0;          // No loyalty points
-    new_user->has_weekly_pass = 0;         // No active passes
-    new_user->has_monthly_pass = 0;
-    new_user->pass_expiry = 0;             // No expiry date
-    
-    user_count++;                          // Increment total user count
-    
-    // Confirm successful registration
-    printf("\nRegistration successful!\n");
-    printf("Your User ID: %d\n", new_user->user_id);
-    if (new_user->is_student) {
-        printf("Student discount: 10%% off on all purchases!\n");
-    }
-}
+typedef struct {
+    long long start_ms;             // Window start (-1 = unused)
+    double expected;                // Liters sales say should have flowed
+    double metered;                 // Liters the flow meter measured
+} ReconWindow;
 
 /**
- * Top-up Wallet
- * Allows users to add money to their digital wallet
- * Includes bonus system for large top-ups
+ * Kiosk Reconciler Structure - Streaming join state for one kiosk
  */
-void top_up_wallet() {
-    int user_id;
-    double amount;
-    
-    printf("\n=== WALLET TOP-UP ===\n");
-    printf("Enter User ID: ");
-    scanf("%d", &user_id);
-    
-    // Find the user in system
-    User* user = find_user(user_id);
-    if (!user) {
-        printf("User not found!\n");
-        return;
-    }
-    
-    // Display current balance and get top-up amount
-    printf("Current wallet balance: ₹%.2f\n", user->wallet_balance);
-    printf("Enter amount to add: ₹");
-    scanf("%lf", &amount);
-    
-    // Validate amount
-    if (amount <= 0) {
-        printf("Invalid amount!\n");
-        return;
-    }
-    
-    // Add money to wallet
-    user->wallet_balance += amount;
-    printf("Wallet topped up successfully!\n");
-    printf("New balance: ₹%.2f\n", user->wallet_balance);
-    
-    // Bonus system: Give 2% bonus for top-ups ≥ ₹100
-    if (amount >= 100) {
-        double bonus = amount * 0.02;      // Calculate 2% bonus
-        user->wallet_balance += bonus;     // Add bonus to wallet
-        printf("Bonus added: ₹%.2f (2%% bonus for top-up ≥ ₹100)\n", bonus);
-        printf("Final balance: ₹%.2f\n", user->wallet_balance);
-    }
-}
+typedef struct {
+    int in_use;                     // Boolean: slot claimed
+    int kiosk_id;
+    ReconWindow open[RECON_OPEN_WINDOWS]; // Windows not yet behind the watermark
+    long long next_close_ms;        // Start of the oldest open window (-1 = no meter yet)
+    double horizon_expected[RECON_HORIZON_WINDOWS]; // Recently closed windows
+    double horizon_metered[RECON_HORIZON_WINDOWS];
+    int horizon_pos;
+    long long last_flow_ms;         // Latest flow reading (drives the watermark)
+    double last_flow_lpm;
+    double total_sold, total_metered; // Lifetime liters
+    double drift_liters;            // Metered - sold over the horizon
+    int drifting;                   // Boolean: currently outside tolerance
+    int alerts;                     // Times drift alert was raised
+    int late_events;                // Events that arrived after their window closed
+    int windows_closed;
+} KioskReconciler;
 
-// =================== CORE BUSINESS LOGIC ===================
+/**
+ * Reconciler Structure - Fixed table of kiosk join states
+ */
+typedef struct {
+    KioskReconciler kiosks[RECON_MAX_KIOSKS];
+    int active_kiosks;              // Kiosks with a flow meter reporting
+    int unmetered_sales;            // Sales from kiosks without a flow meter
+    pthread_mutex_t lock;
+} Reconciler;
 
 /**
- * Purchase Water - Main Business Function
- * Handles the complete water purchase process including:
- * - User validation
- * - Payment method selection
- * - Discount calculation
- * - Fee optimization
- * - Transaction recording
+ * Tap Profile Structure - Pre-resolved state for one card holder
+ * Refreshed whenever the user's wallet, pass or loyalty status changes
  */
-void purchase_water() {
-    int user_id;
-    double liters;
-    int payment_choice;
-    
-    printf("\n=== WATER PURCHASE ===\n");
-    printf("Enter User ID: ");
-    scanf("%d", &user_id);
-    
-    // Validate user exists
-    User* user = find_user(user_id);
-    if (!user) {
-        printf("User not found!\n");
-        return;
-    }
-    
-    // Get quantity needed
-    printf("Enter liters of water needed: ");
-    scanf("%lf", &liters);
-    
-    if (liters <= 0) {
-        printf("Invalid quantity!\n");
-        return;
-    }
-    
-    // Calculate base cost (before fees/discounts)
-    double base_cost = liters * WATER_PRICE_PER_LITER;
-    
-    // Payment method selection
-    printf("\n=== PAYMENT OPTIONS ===\n");
-    printf("1. Cash (No extra fee)\n");
-    printf("2. Digital Payment (Wallet/UPI)\n");
-    printf("Choose payment method: ");
-    scanf("%d", &payment_choice);
-    
-    // Initialize transaction variables
-    char payment_method[20];
-    double fee = 0.0;              // Digital payment fee
-    double discount = 0.0;         // Total discount applied
-    double final_amount = base_cost;
-    
-    // Process payment method choice
+typedef struct {
+    User* user;                     // Card holder
+    double* wallet;                 // Wallet debited by taps
+    time_t pass_valid_until;        // Pass expiry if a pass is active, else 0
+    int eligibility;                // TAP_ELIG_* bits
+} TapProfile;
+
+/**
+ * Card Entry Structure - One slot of the card UID hash index
+ */
+typedef struct {
+    uint64_t uid;                   // Card UID (0 = empty slot)
+    int user_index;                 // Index into users[] and tap_profiles[]
+} CardEntry;
+
+/**
+ * Tap Statistics Structure - Tap outcomes and authorization latency
+ */
+typedef struct {
+    int authorized, declined, unknown;
+    int timed;                      // Taps that reached a purchase decision (counted in total_ns)
+    long long total_ns, max_ns;     // Authorization time of those taps
+} TapStats;
+
+/**
+ * HMAC Key Structure - SHA-256 midstates after the inner and outer key blocks
+ */
+typedef struct {
+    uint32_t inner[8];
+    uint32_t outer[8];
+} HmacKey;
+
+/**
+ * QR Token Structure - Parsed QR payment authorization
+ */
+typedef struct {
+    long long user_id;              // Paying user
+    long amount_paise;              // Maximum debit authorized (paise)
+    uint64_t nonce;                 // Single-use nonce
+    time_t expiry;                  // Token invalid after this time
+    char msg[QR_MAX_MESSAGE + 1];   // Signed text
+    int msg_len;
+    uint8_t sig[32];                // HMAC-SHA256 of msg
+} QrToken;
+
+/**
+ * Replay Cache Entry Structure - A nonce remembered until its token expires
+ */
+typedef struct {
+    uint64_t nonce;
+    time_t expiry;                  // Slot is free once this has passed
+} ReplayEntry;
+
+/**
+ * QR Request Structure - One caller waiting in the verification batcher
+ */
+typedef struct QrRequest {
+    QrToken* token;
+    int result;                     // QR_* code once done
+    int done;                       // Boolean: verified
+    struct QrRequest* next;
+} QrRequest;
+
+/**
+ * QR Batcher Structure - Forms multi-buffer batches from concurrent callers
+ */
+typedef struct {
+    QrRequest* pending;             // FIFO of waiting requests
+    int pending_count;
+    int leader_active;              // Boolean: a caller is verifying a batch
+    long long batches, verified;    // Batches run and tokens verified
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} QrBatcher;
+
+/**
+ * Kiosk Site Structure - One kiosk in the registry
+ */
+typedef struct {
+    int kiosk_id;
+    double lat, lon;                // Location
+    double tank_liters;             // Live tank level
+    int next_in_cell;               // Next site in the same grid cell (-1 = end)
+} KioskSite;
+
+/**
+ * Grid Cell Structure - One occupied lat/lon grid cell
+ */
+typedef struct {
+    int used;                       // Boolean: slot holds a cell
+    int cx, cy;                     // Cell coordinates (lon, lat in cell units)
+    int head;                       // First site in the cell (-1 = none)
+    int count;                      // Sites in the cell
+    double max_level;               // Highest tank level in the cell
+} GridCell;
+
+// Every site adds at most one cell, so the table stays at most half full
+_Static_assert(GRID_SLOTS >= 2 * MAX_KIOSK_SITES && (GRID_SLOTS & (GRID_SLOTS - 1)) == 0,
+               "grid table must be a power of two at least twice MAX_KIOSK_SITES");
+
+/**
+ * Nearby Kiosk Structure - One nearest-kiosk search result
+ */
+typedef struct {
+    int site;                       // Index into kiosk_sites[]
+    double distance_km;
+} NearbyKiosk;
+
+/**
+ * Wallet Stripe Structure - One sub-balance of a group wallet
+ * Padded to a cache line so concurrent debits on different stripes don't collide
+ */
+typedef struct {
+    _Alignas(64) _Atomic long long paise;
+} WalletStripe;
+
+/**
+ * Group Wallet Structure - Balance shared by several users
+ */
+typedef struct {
+    WalletStripe stripes[GROUP_STRIPES]; // Balance = sum of stripes
+    int group_id;                   // Unique identifier for group (1-based)
+    char name[50];                  // Family/hostel name
+    int members;                    // Users linked to this group
+    int tenant;                     // Operator whose customers share it
+    long long rebalances;           // Times stripes were consolidated
+    pthread_mutex_t rebalance_lock; // Only taken when no stripe covers a debit
+} GroupWallet;
+
+/**
+ * Phone Index Entry - Phone number (as a number) -> user
+ */
+typedef struct {
+    uint64_t key;                   // phone_key() of the number (0 = empty slot)
+    int user;                       // Index into users[]
+} PhoneEntry;
+
+/**
+ * Import Row - One parsed roster line (fields point into the mapped file)
+ */
+typedef struct {
+    uint32_t line;                  // Line number in the file
+    uint32_t name_off;              // Name field offset
+    uint32_t phone_off;             // Phone field offset
+    uint8_t name_len;
+    uint8_t phone_len;
+    uint8_t flags;                  // IMPORT_ROW_STUDENT | IMPORT_ROW_QUOTED
+    uint8_t status;                 // IMPORT_* result
+    uint64_t phone_key;             // Dedupe key
+    long long user_id;              // Assigned ID (IMPORT_OK rows)
+} ImportRow;
+
+/**
+ * Session Structure - One logged-in customer
+ */
+typedef struct {
+    uint64_t token;                 // 0 = free; low bits are the slot index
+    long long user_id;
+    long long created_ms;           // Login time (monotonic)
+    long long last_used_ms;         // Last check (monotonic)
+} Session;
+
+/**
+ * Session Cache Structure - Fixed table of live sessions
+ */
+typedef struct {
+    Session slots[SESSION_SLOTS];
+    int next;                       // Clock hand for eviction
+    long long logins, hits, expired, rejected, failures, lockouts;
+    pthread_mutex_t lock;
+} SessionCache;
+
+/**
+ * Credit Total - One user's share of a settlement batch
+ */
+typedef struct {
+    long long credit_paise;         // Sum of the user's credit lines
+    long long bonus_paise;          // Sum of the per-line bonuses
+} CreditTotal;
+
+/**
+ * Credit Batch Result - Summary of one settlement file
+ */
+typedef struct {
+    int counts[CREDIT_HEADER + 1];  // Lines per CREDIT_* result
+    int users;                      // Distinct users credited
+    long long credit_paise;         // Total credited (excluding bonus)
+    long long bonus_paise;          // Total bonus
+    char digest[65];                // SHA-256 of the file (hex) - the batch identity
+} CreditBatchResult;
+
+/**
+ * Nozzle Order - A paid purchase waiting for (or using) a nozzle
+ */
+typedef struct {
+    long long ticket;               // Order number
+    double liters;
+    double arrival_s;               // When it joined the queue
+    double service_s;               // Estimated nozzle time (dispense + handover)
+    double key;                     // Heap order (smallest first)
+} NozzleOrder;
+
+/**
+ * Nozzle Scheduler - Queues and nozzle state for one kiosk
+ * Bulk orders get their own lane only under NOZZLE_BULK_LANE
+ */
+typedef struct {
+    int policy;                     // NOZZLE_FIFO | NOZZLE_SJF | NOZZLE_BULK_LANE
+    int nozzles;                    // 0 = scheduler off
+    double now;                     // Scheduler clock (s)
+    double free_at[NOZZLE_MAX];     // When each nozzle is next free (s)
+    NozzleOrder small[NOZZLE_QUEUE_MAX]; // Min-heaps by key
+    NozzleOrder bulk[NOZZLE_QUEUE_MAX];
+    int small_count, bulk_count;
+    int bulk_nozzle;                // Nozzle dispensing a bulk order (-1 = none or finished)
+    long long next_ticket;
+    int turned_away;                // Arrivals that found their lane full
+} NozzleScheduler;
+
+typedef void (*NozzleStartFn)(const NozzleOrder* order, int nozzle, double start_s, void* ctx);
+
+/**
+ * Audit Batch - One sealed Merkle batch of transactions[]
+ */
+typedef struct {
+    int first;                      // transactions[] index of the first record
+    int count;                      // Records in the batch
+    uint8_t root[32];               // Merkle root of the records
+    uint8_t head[32];               // Chain head: H(previous head, root, position)
+    long long sealed_ms;            // Wall clock when sealed
+} AuditBatch;
+
+/**
+ * Audit Log - Sealer thread state and the batch chain
+ * Sales only publish their count; the sealer thread hashes behind them
+ */
+typedef struct {
+    atomic_int recorded;            // transactions[] records published by sales
+    int sealed;                     // Records covered by sealed batches (or sealed before a restart)
+    int batch_count;
+    int base;                       // Batches in the audit file before audit_batches[0]
+    uint8_t genesis[32];            // Head before the first batch (resumed from the audit file)
+    int running;                    // Boolean: sealer thread active
+    int fd;                         // Optional append-only file of batch heads (-1 = none)
+    pthread_t thread;
+    pthread_mutex_t lock;           // Protects the batches and the fields above (held while hashing)
+    pthread_mutex_t wake_lock;      // Protects wake_pending and running (never held while hashing)
+    pthread_cond_t wake;            // A batch is full (or shutting down)
+    int wake_pending;               // Boolean: a batch filled since the sealer last looked
+} AuditLog;
+
+/**
+ * Audit Proof - Path from one record to its batch root
+ */
+typedef struct {
+    int batch;                      // audit_batches[] index
+    int index;                      // Record's position within the batch
+    uint8_t leaf[32];               // Leaf hash of the record as it is now
+    int depth;                      // Sibling hashes used
+    uint8_t siblings[AUDIT_MAX_DEPTH][32];
+    uint8_t sibling_left[AUDIT_MAX_DEPTH]; // Boolean: sibling is the left child
+} AuditProof;
+
+/**
+ * Sync Message Header - Frames every replica sync message
+ */
+typedef struct {
+    uint32_t type;                  // SYNC_MSG_*
+    uint32_t count;                 // Entries that follow
+} SyncHeader;
+
+/**
+ * Sync Entry - One user's summary inside a differing range
+ */
+typedef struct {
+    int64_t user_id;
+    uint64_t digest;                // Same digest the leaf is built from
+    uint32_t version;
+    uint32_t reserved;
+} SyncEntry;
+
+/**
+ * Sync Record - One account on the wire (fixed layout, validated on receipt)
+ * Wallet and loyalty changes travel as deltas so both sides' changes survive
+ */
+typedef struct {
+    int64_t user_id;
+    int64_t wallet_paise;           // Balance as the sender holds it
+    int64_t wallet_delta_paise;     // Kiosk: wallet change since its last sync (store: 0)
+    int64_t total_spent_paise;
+    int64_t pass_expiry;
+    int64_t push_id;                // Kiosk: names this delta, so a resent one isn't applied twice
+    int32_t loyalty_points;
+    int32_t points_delta;           // Kiosk: loyalty change since its last sync (store: 0)
+    int32_t transaction_count;
+    int32_t group_id;
+    int32_t tenant;
+    uint32_t version;
+    uint8_t pin_salt[16];
+    uint8_t pin_hash[32];
+    char name[50];
+    char phone[15];
+    uint8_t flags;                  // SYNC_REC_*
+} SyncRecord;
+
+/**
+ * Sync Base - Per-user delta bookkeeping, parallel to users[]
+ * Kiosk: the balances it last agreed with the store, and the ID of a push
+ * not yet answered. Store: the last push applied and the delta it carried.
+ */
+typedef struct {
+    int64_t wallet_paise;
+    int64_t push_id;
+    int32_t loyalty_points;
+} SyncBase;
+
+/**
+ * Sync Stats - Cost of one replica sync, seen from the side that ran it
+ */
+typedef struct {
+    int round_trips;
+    long long bytes_sent;
+    long long bytes_received;
+    int ranges_differing;           // Leaves whose hashes disagreed
+    int entries_compared;           // Users in those ranges on the other side
+    int records_sent;               // Newer here (or missing there)
+    int records_received;           // Newer there (or missing here)
+    int records_rejected;           // Failed validation (not stored)
+} SyncStats;
+
+/**
+ * Lease Message - Kiosk <-> central store (a User record follows a found reply)
+ */
+typedef struct {
+    uint32_t type;                  // LEASE_MSG_*
+    int32_t status;                 // Replies: 1 done, 0 unknown user or insufficient balance
+    int64_t user_id;
+    int64_t amount_paise;           // Debits (negative = credit)
+    int64_t lease_ms;               // Replies: lease term granted with the record
+    int64_t changed_ns;             // Invalidations: when the store changed the record
+} LeaseMessage;
+
+/**
+ * Lease Entry - One cached user record
+ */
+typedef struct {
+    User user;                      // Copy as the store last sent it
+    long long expires_ns;           // Lease end on this kiosk's clock (0 = empty)
+    long long used;                 // Access stamp for LRU
+    int invalidated;                // Store said it changed (kept to classify the next miss)
+} LeaseEntry;
+
+/**
+ * Lease Stats - What a kiosk's cache saved, and how stale it could get
+ */
+typedef struct {
+    long long lookups, hits;
+    long long cold_misses;          // Never cached, or evicted
+    long long expired_misses;       // Lease ran out
+    long long invalidated_misses;   // Dropped by a pushed invalidation
+    long long evictions;
+    long long writes;               // Write-throughs to the store
+    long long round_trips;
+    long long invalidations;        // Pushes received
+    long long stale_ns_total, stale_ns_max; // Store change -> push applied here
+    long long hit_ns, miss_ns;      // Time spent in hits / in round trips
+    SyncStats wire;                 // Socket byte counts
+} LeaseStats;
+
+/**
+ * Lease Cache - This kiosk's view of the central store
+ */
+typedef struct {
+    int fd;                         // Connection to the store (-1 = none)
+    LeaseEntry sets[LEASE_SETS][LEASE_WAYS];
+    long long clock;                // LRU stamps
+    LeaseStats stats;
+} LeaseCache;
+
+/**
+ * Lease Holder - Store side: which kiosks may still serve a user from cache
+ */
+typedef struct {
+    uint64_t kiosks;                // Bit per kiosk connection
+    long long until_ns;             // Latest lease granted on this user
+} LeaseHolder;
+
+/**
+ * Scan Partial - One worker's aggregate, on its own cache lines
+ */
+typedef struct {
+    _Alignas(64) unsigned char bytes[SCAN_PARTIAL_BYTES];
+} ScanPartial;
+
+typedef void (*ScanMorselFn)(int first, int end, void* partial); // Fold rows [first, end) into partial
+typedef void (*ScanMergeFn)(void* total, const void* partial); // Add one worker's partial to the total
+
+/**
+ * Scan Job - A table being scanned; workers claim morsels from next
+ */
+typedef struct {
+    int rows;                       // Rows in the table
+    int morsel_rows;                // Rows per morsel
+    _Atomic int next;               // First row of the next unclaimed morsel
+    ScanMorselFn scan;
+} ScanJob;
+
+/**
+ * Scan Worker - One thread of a scan and what it did
+ */
+typedef struct {
+    ScanJob* job;
+    ScanPartial* partial;
+    int morsels;                    // Morsels this worker claimed
+} ScanWorker;
+
+/**
+ * Sales Scan - Totals over transactions[] (paise and centiliters, so any
+ * split into morsels sums to exactly the same figures)
+ */
+typedef struct {
+    long long sales[SCAN_METHODS];  // Records per payment method
+    long long amount_paise[SCAN_METHODS];
+    long long centiliters[SCAN_METHODS];
+    long long hour_sales[24];       // Sales (not refunds) by local hour of day
+    long long utc_offset;           // Seconds added to timestamps for the local hour
+} SalesScan;
+
+/**
+ * User Scan - Totals over users[]
+ */
+typedef struct {
+    long long users;
+    long long wallet_paise;         // Prepaid balances still owed to customers
+    long long spent_paise;          // Lifetime spending
+    long long points;               // Loyalty points outstanding
+    long long active_passes;        // Pass not yet expired
+    long long students, with_pin, never_bought;
+    long long now;                  // Pass expiry reference time
+} UserScan;
+
+/**
+ * History Point - How much stats moved during one interval
+ */
+typedef struct {
+    long long start;                // Interval start, Unix seconds (0 = never written)
+    Analytics delta;                // Change in every counter over the interval
+} HistoryPoint;
+
+/**
+ * History Archive - One resolution, a ring inside history_points[]
+ */
+typedef struct {
+    const char* name;
+    int step;                       // Seconds per point
+    int rows;                       // Points kept
+    int first;                      // Offset of its ring in history_points[]
+} HistoryArchive;
+
+/**
+ * History File Header - Geometry the file was created with
+ */
+typedef struct {
+    uint32_t magic;                 // HISTORY_MAGIC
+    uint32_t point_size;            // sizeof(HistoryPoint)
+    int32_t rows[HISTORY_ARCHIVES];
+    int32_t steps[HISTORY_ARCHIVES];
+} HistoryHeader;
+
+/**
+ * History Store - Where stats was last recorded and the backing file
+ */
+typedef struct {
+    int fd;                         // Fixed-size file (-1 = RAM only)
+    Analytics recorded;             // stats as of the last history_record()
+    long long utc_offset;           // Seconds east of UTC (hours and days are local)
+    long long writes, write_failures;
+    pthread_mutex_t lock;
+} HistoryStore;
+
+_Static_assert(sizeof(SalesScan) <= SCAN_PARTIAL_BYTES, "sales scan partial must fit a worker slot");
+_Static_assert(sizeof(UserScan) <= SCAN_PARTIAL_BYTES, "user scan partial must fit a worker slot");
+
+/**
+ * Cube Cell - Totals for one (location, day, method) combination
+ */
+typedef struct {
+    uint64_t key;                   // cube_key() (0 = empty slot)
+    long long sales;                // Sales less refunds
+    long long refunds;
+    long long revenue_paise;        // Before fees and discounts
+    long long fee_paise, discount_paise;
+    long long centiliters;
+} CubeCell;
+
+/**
+ * Cube Row - One member of a slice and its totals
+ */
+typedef struct {
+    int member;                     // Region, kiosk, day or method index
+    CubeCell totals;
+} CubeRow;
+
+/**
+ * Sales Cube - Cell table bookkeeping and which locations have sales
+ */
+typedef struct {
+    int cells;                      // Slots in use
+    long long dropped;              // Cell updates refused because the table was full
+    int first_day;                  // Oldest day still kept per day (older ones were evicted)
+    int evicted_days;
+    CubeCell evicted;               // Fleet totals of the evicted days, so days still add up
+    uint8_t kiosk_seen[1 << ID_KIOSK_BITS];
+    uint8_t region_seen[CUBE_REGIONS];
+    pthread_mutex_t lock;
+} SalesCube;
+
+/**
+ * Cohort - Users who registered in one week, and how many bought in each
+ * week after it ([0] others, [1] students)
+ */
+typedef struct {
+    int week;                       // Monday-based local week number (0 = unused)
+    int registered[2];
+    int active[COHORT_OFFSETS][2];  // Distinct buyers in week +n
+} Cohort;
+
+_Static_assert(COHORT_OFFSETS <= 32, "cohort weeks seen are a 32-bit mask per user");
+
+/**
+ * Memory Tag - Use of one subsystem's tables (own cache line: counted from
+ * several threads)
+ */
+typedef struct {
+    _Alignas(64) _Atomic long long live; // Bytes of entries in use
+    _Atomic long long peak;         // Highest live so far
+    _Atomic long long claims;       // Entries taken (a recycled slot counts again)
+    _Atomic long long releases;     // Entries given back
+} MemTag;
+
+/**
+ * Tenant - One operator hosted in this process: its prices, its share of
+ * the user and transaction tables, and its own analytics (own cache lines,
+ * so operators' sales don't contend)
+ */
+typedef struct {
+    _Alignas(64) char name[TENANT_NAME_LEN];
+    double price_per_liter;         // Base price per liter
+    double digital_fee;             // Fee charged for digital payments
+    int min_bulk_liters;            // Minimum liters for bulk discount
+    double loyalty_threshold;       // Minimum spent to qualify for loyalty discount
+    double weekly_pass_cost;
+    double monthly_pass_cost;
+    int max_users;                  // Quota of users[] (reserved: other operators can't use it)
+    int max_transactions;           // Quota of transactions[]
+    int users;                      // Registered so far
+    int transactions;               // Kept in RAM history so far
+    Analytics stats;                // This operator's part of the process-wide stats
+} Tenant;
+
+_Static_assert(MAX_TENANTS <= 256, "operator index must fit above the phone number in index keys");
+
+/**
+ * Flash Page Header - First record slot of every erase block
+ */
+typedef struct {
+    uint32_t magic;                 // FLASH_PAGE_MAGIC
+    uint32_t sequence;              // Pages opened since the log was created
+    uint8_t reserved[22];
+    uint16_t crc;                   // CRC-16 of the fields above
+} FlashPageHeader;
+
+/**
+ * Flash Record - One sale, packed (timestamp comes from the Snowflake ID)
+ */
+typedef struct {
+    int64_t transaction_id;         // Snowflake ID
+    int64_t user_id;                // Customer (link records: the reversed sale's ID)
+    int32_t amount_paise;           // Final amount paid
+    int32_t discount_paise;         // Total discount given
+    int32_t centiliters;            // Quantity dispensed
+    uint8_t method;                 // Payment method code | 0x80 if the digital fee was charged
+    uint8_t points_redeemed;        // Loyalty points spent, in hundreds
+    uint16_t crc;                   // CRC-16 of the fields above
+} FlashRecord;
+
+_Static_assert(sizeof(FlashPageHeader) == FLASH_RECORD_SIZE, "page header must fill one slot");
+_Static_assert(sizeof(FlashRecord) == FLASH_RECORD_SIZE, "flash record must stay 32 bytes");
+
+/**
+ * Flash Log Structure - Append position in the page ring
+ */
+typedef struct {
+    int fd;                         // Log file/partition (-1 = no log)
+    uint32_t sequence;              // Sequence of the page being filled
+    int page;                       // Its position in the ring
+    int slot;                       // Next free record slot in it
+    long long appended;             // Records written since startup
+    long long recovered;            // Valid records found at startup
+    long long erases;               // Pages erased since startup
+    int failures;                   // Writes that did not reach the log
+    int bad_times;                  // Restored sales dated before the ID epoch or in the future
+    pthread_mutex_t lock;
+} FlashLog;
+
+/**
+ * Telemetry Bucket Structure - One downsampled interval
+ */
+typedef struct {
+    long long start_ms;             // Bucket start time
+    double min, max, sum;           // Aggregates over the bucket
+    int count;                      // Readings in bucket
+} TelemetryBucket;
+
+// =================== GLOBAL VARIABLES ===================
+User users[MAX_USERS];              // Array to store all registered users
+Transaction transactions[MAX_TRANSACTIONS]; // Transaction history
+Analytics stats = {0};             // System statistics (initialized to zero)
+int user_count = 0;                 // Current number of registered users
+int transaction_count = 0;          // Current number of transactions
+int kiosk_id = DEFAULT_KIOSK_ID;    // This kiosk's ID (embedded in generated IDs)
+ReceiptSpooler spooler = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER};
+PaymentClient payments = {.fds = {-1, -1, -1, -1}, .lock = PTHREAD_MUTEX_INITIALIZER, .done = PTHREAD_COND_INITIALIZER};
+MockGateway mock_gateway = {.listen_fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+TelemetryStore telemetry = {.open_block = {-1, -1, -1}, .lock = PTHREAD_MUTEX_INITIALIZER};
+Reconciler reconciler = {.lock = PTHREAD_MUTEX_INITIALIZER};
+CardEntry card_index[CARD_INDEX_SLOTS]; // Card UID -> user hash index
+int card_count = 0;                 // Cards linked
+TapProfile tap_profiles[MAX_USERS]; // Pre-resolved tap state, parallel to users[]
+TapStats tap_stats = {0};
+HmacKey qr_key;                     // QR token signing key (midstates)
+int qr_key_ready = 0;
+ReplayEntry replay_cache[QR_REPLAY_SLOTS]; // Used QR nonces
+pthread_mutex_t qr_replay_lock = PTHREAD_MUTEX_INITIALIZER;
+QrBatcher qr_batcher = {.lock = PTHREAD_MUTEX_INITIALIZER, .done = PTHREAD_COND_INITIALIZER};
+KioskSite kiosk_sites[MAX_KIOSK_SITES]; // Kiosk registry
+int site_count = 0;
+int local_site = -1;                // This kiosk's registry entry (-1 = not listed)
+GridCell kiosk_grid[GRID_SLOTS];    // Spatial index over kiosk_sites[]
+GroupWallet group_wallets[MAX_GROUPS]; // Shared family/hostel wallets
+int group_count = 0;
+FlashLog flash_log = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+SessionCache sessions = {.lock = PTHREAD_MUTEX_INITIALIZER};
+uint64_t kiosk_session = 0;         // Session of the customer at this kiosk's screen
+// scrypt working memory: static like every other table (no heap on the
+// controller) and shared by all PIN hashes under kdf_lock. Its size is the
+// hash's memory cost, so shrinking it (-DPIN_KDF_N) weakens stored PINs and
+// changes their hashes; kiosks sharing users must use the same value.
+uint32_t kdf_scratch[32 * PIN_KDF_R * PIN_KDF_N];
+int user_id_index[USER_INDEX_SLOTS]; // User ID -> users[] index + 1 (0 = empty)
+PhoneEntry phone_index[USER_INDEX_SLOTS]; // Phone -> user (dedupe for imports)
+ImportRow import_rows[IMPORT_ROUND_ROWS]; // Parsed rows of the current import round
+CreditTotal credit_totals[MAX_USERS]; // Per-user sums of the settlement batch being applied
+int credit_users[MAX_USERS];        // Users in that batch (users[] indexes, first-seen order)
+NozzleScheduler kiosk_nozzles;      // This kiosk's nozzles (WATER_ATM_NOZZLES; off if unset)
+NozzleScheduler nozzle_plan;        // Scratch copy for wait estimates and simulations
+long long nozzle_sim_waits[2][NOZZLE_SIM_MAX]; // Simulated waits in ms (all orders, small orders)
+AuditBatch audit_batches[AUDIT_MAX_BATCHES]; // Sealed Merkle batches, oldest first
+AuditLog audit = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .wake_lock = PTHREAD_MUTEX_INITIALIZER,
+                  .wake = PTHREAD_COND_INITIALIZER};
+uint8_t audit_nodes[2 * AUDIT_BATCH][32]; // Merkle tree of the batch being sealed or proved
+int txn_id_index[TXN_INDEX_SLOTS];  // Transaction ID -> transactions[] index + 1 (0 = empty)
+int refund_index[TXN_INDEX_SLOTS];  // Refunded sale ID -> its refund's transactions[] index + 1
+uint32_t failed_dispenses[(MAX_TRANSACTIONS + 31) / 32]; // Bit per transactions[] index: dispense reported failed
+pthread_mutex_t refund_lock = PTHREAD_MUTEX_INITIALIZER; // One reversal at a time
+_Atomic uint64_t sync_leaves[SYNC_LEAVES]; // XOR of the user digests in each ID-hash range
+uint64_t sync_tree[2 * SYNC_LEAVES]; // Merkle tree over sync_leaves (root at 1, leaves from SYNC_LEAVES)
+uint64_t sync_digests[MAX_USERS];   // Each user's digest as last folded into its leaf
+uint8_t sync_state[MAX_USERS];      // Per-user outcome while comparing a sync's ranges
+long long sync_wanted[MAX_USERS];   // IDs to fetch from the peer (or asked for by it)
+SyncBase sync_base[MAX_USERS];      // Delta bookkeeping per user (see SyncBase)
+LeaseCache lease_cache = {.fd = -1}; // Kiosk side: leased copies of central user records
+LeaseHolder lease_holders[MAX_USERS]; // Store side: outstanding leases, parallel to users[]
+int lease_term_ms = LEASE_TERM_MS;  // Store side: term granted with each record
+ScanPartial scan_partials[SCAN_MAX_THREADS]; // Per-worker aggregates of the running scan
+pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER; // One parallel scan at a time
+HistoryPoint history_points[HISTORY_ROWS]; // Every archive's ring, finest first
+const HistoryArchive history_archives[HISTORY_ARCHIVES] = {
+    {"minute", 60, HISTORY_MINUTE_ROWS, 0},
+    {"hour", 3600, HISTORY_HOUR_ROWS, HISTORY_MINUTE_ROWS},
+    {"day", 86400, HISTORY_DAY_ROWS, HISTORY_MINUTE_ROWS + HISTORY_HOUR_ROWS},
+};
+HistoryStore history = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+uint8_t kiosk_regions[1 << ID_KIOSK_BITS]; // Kiosk ID -> region from the fleet list (0 = unassigned)
+CubeCell cube_cells[CUBE_SLOTS];    // Pre-aggregated sales at every level
+SalesCube cube = {.lock = PTHREAD_MUTEX_INITIALIZER};
+Cohort cohorts[COHORT_WEEKS];       // Ring of registration weeks
+_Atomic uint32_t cohort_seen[MAX_USERS]; // Weeks since registration each user bought in, parallel to users[]
+pthread_mutex_t cohort_lock = PTHREAD_MUTEX_INITIALIZER;
+MemTag mem_tags[MEM_TAGS];          // Live/peak bytes and claim counts per subsystem
+const char* const mem_tag_names[MEM_TAGS] = {"Users", "Transactions", "Indexes", "Sketches",
+                                              "Caches", "Buffers", "Services"};
+Tenant tenants[MAX_TENANTS] = {{.name = "Default", .price_per_liter = WATER_PRICE_PER_LITER,
+                                .digital_fee = DIGITAL_FEE, .min_bulk_liters = MIN_BULK_LITERS,
+                                .loyalty_threshold = LOYALTY_THRESHOLD, .weekly_pass_cost = WEEKLY_PASS_COST,
+                                .monthly_pass_cost = MONTHLY_PASS_COST, .max_users = MAX_USERS,
+                                .max_transactions = TXN_SALE_SLOTS}};
+int tenant_count = 1;               // Operators configured
+int active_tenant = 0;              // Operator this kiosk terminal serves (menu operations)
+#ifdef WATER_ATM_EMBEDDED
+static char stdout_buffer[256];     // Static stdio buffers: no heap once running
+static char stdin_buffer[256];
+#endif
+
+// =================== FUNCTION DECLARATIONS ===================
+void display_menu();               // Show main menu options
+void register_user();              // Register new user in system
+void top_up_wallet();              // Add money to user's digital wallet
+void purchase_water();             // Main water purchase flow
+int process_purchase(User* user, double liters, int payment_choice, const char* payment_token, int show_output);
+void purchase_pass();              // Buy weekly/monthly pass
+int activate_pass(User* user, int pass_type, int show_output); // Charge and switch on a pass
+double credit_wallet(User* user, double amount); // Top-up incl. bonus, returns bonus
+void view_user_profile();          // Display user information
+void admin_analytics();            // Show system analytics
+double calculate_discount(User* user, double liters, char* payment_method);
+double calculate_bulk_discount(double liters);
+double calculate_loyalty_discount(User* user);
+int is_pass_valid(User* user);     // Check if user's pass is still active
+void update_loyalty_points(User* user, double amount);
+long long save_transaction(User* user, double amount, double liters, char* method, double fee,
+                           double discount, int points_redeemed, long long reverses);
+void index_transaction(int index); // Add transactions[index] to the ID (and refund) index
+void index_transactions();         // Rebuild both transaction indexes
+Transaction* find_transaction(long long transaction_id); // O(1) lookup by ID
+Transaction* find_refund(long long transaction_id); // Refund entry of a sale, or NULL
+User* find_user(long long user_id); // Find user by ID
+int user_in_table(const User* user); // Record lives in users[] (safe to index side tables)
+User* find_user_by_phone(const char* phone); // Find user by phone number
+void index_user(User* user);       // Add user to the ID and phone indexes
+uint64_t phone_key(const char* phone, size_t len); // Phone as a number (0 = not digits)
+long long wall_clock_ms();         // Current Unix time in milliseconds
+long long generate_id();           // Next unique, time-sortable ID for this kiosk
+long long generate_id_block(int count); // Reserve `count` IDs at once, returns the first
+long long id_block_nth(long long first, int n); // n-th ID of a reserved block
+time_t id_timestamp(long long id); // Creation time encoded in a generated ID
+int id_kiosk(long long id);         // Kiosk that generated an ID
+void receipt_spooler_start(const char* device); // Start printer thread
+void receipt_spooler_stop();       // Flush pending receipts and stop printer thread
+void receipt_append(char* receipt, int* len, const char* format, ...); // Add a line (truncates at RECEIPT_MAX_LEN)
+int spool_receipt(const char* text); // Queue receipt for printing (never blocks)
+int payment_client_start(const char* host, int port); // Connect pool to a UPI gateway
+int payment_client_ensure();       // Connect to configured gateway or bundled mock
+void payment_client_stop();        // Close pool and stop event loop
+int payment_submit(long long user_id, double amount); // Start UPI charge, returns handle
+int payment_wait(int handle, char* reference); // Wait for charge result
+int mock_gateway_start(int latency_ms, double failure_rate); // Local test gateway
+void payment_gateway_benchmark();  // Report UPI throughput and in-flight capacity
+void telemetry_append(int series, long long ts_ms, double value); // Store sensor reading
+int telemetry_scan(int series, long long from_ms, long long to_ms,
+                   void (*visit)(long long ts_ms, double value, void* ctx), void* ctx);
+int telemetry_downsample(int series, long long from_ms, long long to_ms, long long bucket_ms,
+                         TelemetryBucket* buckets, int max_buckets);
+double telemetry_simulate(long long start_ms, int seconds, int hz, unsigned int seed);
+void telemetry_benchmark();        // Report compression ratio and scan speed
+void reconcile_sale(int kiosk, long long ts_ms, double liters); // Sold liters into the join
+void reconcile_flow(int kiosk, long long ts_ms, double flow_lpm); // Flow reading into the join
+void reconcile_simulate();         // Leak/theft detection demo on simulated kiosks
+void reconcile_report();           // Per-kiosk sold vs metered summary
+CardEntry* find_card(uint64_t uid); // Card UID hash lookup
+int link_card(uint64_t uid, User* user); // Map card UID to user
+void link_card_menu();             // Link card from the menu
+void tap_profile_refresh(User* user); // Re-resolve tap profile after account change
+int tap_dispense(uint64_t uid, double liters, int show_output); // Card tap sale
+void tap_mode();                   // Read taps from the card reader stream
+void tap_benchmark();              // Measure tap authorization latency
+void sha256(const uint8_t* data, size_t len, uint8_t out[32]);
+void hmac_sha256_init(HmacKey* key, const uint8_t* secret, size_t secret_len);
+void hmac_sha256(const HmacKey* key, const uint8_t* msg, size_t len, uint8_t out[32]);
+void hmac_sha256_x8(const HmacKey* key, const uint8_t* msgs[8], const int lens[8], uint8_t out[8][32]);
+int qr_token_create(long long user_id, double amount, time_t expiry, char* out, size_t out_size);
+int qr_token_parse(const char* text, QrToken* token);
+void qr_verify_batch(QrToken* tokens, int count, int* results); // Multi-buffer verification
+int qr_verify(const char* text, QrToken* token); // Verify via the shared batcher
+int qr_redeem(const QrToken* token); // Spend a verified token's nonce
+const char* qr_result_text(int result);
+void qr_benchmark();               // Report QR tokens verified per second per core
+int kiosk_site_add(int kiosk, double lat, double lon, double tank_liters); // Register site
+void kiosk_site_set_level(int index, double tank_liters); // Live tank level update
+void kiosk_site_record_sale(double liters); // Lower this kiosk's tank level
+int kiosk_sites_load(const char* path); // Load fleet list
+int kiosk_nearest(double lat, double lon, double min_liters, int k, double max_km, NearbyKiosk* best);
+int grid_cells_used();
+void find_nearest_kiosk();         // Nearest kiosk with stock (menu)
+void nearest_benchmark();          // Time stock-filtered k-nearest queries
+GroupWallet* find_group(int group_id); // Find group wallet by ID
+int group_wallet_create(const char* name);
+double group_wallet_balance(GroupWallet* group);
+void group_wallet_credit(GroupWallet* group, double amount);
+int group_wallet_debit(GroupWallet* group, double amount); // Lock-free on the fast path
+void group_wallet_menu();          // Create/join/top up group wallets
+void group_wallet_benchmark();     // Concurrent debits: striped vs locked
+int flash_log_open(const char* path); // Resume the flash log and replay history
+void flash_log_append(long long transaction_id, long long user_id, double amount, double liters,
+                      const char* method, double fee, double discount, int points_redeemed, long long reverses);
+void footprint_report();           // Static RAM per table + heap check + use per subsystem
+void workload_generate(int ops, unsigned int seed); // Synthetic kiosk traffic to stdout
+int workload_replay(const char* path); // Replay a workload without prompts
+void pin_kdf(const char* pin, const uint8_t salt[16], uint8_t out[32]); // scrypt
+int pin_valid_format(const char* pin);
+void set_pin(User* user, const char* pin);
+int pin_check(User* user, const char* pin); // PIN_OK, PIN_WRONG or PIN_LOCKED
+uint64_t session_open(long long user_id); // Start session, returns token
+int session_check(uint64_t token, long long user_id); // O(1) token check
+void session_close(uint64_t token);
+int authorize_user(User* user);    // PIN once per kiosk session
+int operator_authorize();          // Operator PIN (WATER_ATM_OPERATOR_PIN) for operator actions
+int prompt_new_pin(User* user);    // Ask for and set a new PIN
+void read_pin(char* pin, int size); // Read a PIN without echoing it
+void change_pin();                 // Set/change PIN (menu)
+void pin_benchmark();              // PIN hash vs session check cost
+int import_roster(const char* path, int threads, int counts[IMPORT_HEADER + 1]); // Bulk CSV registration
+void import_roster_menu();         // Import a roster from the menu
+void import_roster_run(const char* path); // Import and print the summary
+void import_benchmark(int rows);   // Import a synthetic roster
+int credit_batch_apply(const char* path, const char* journal_path, CreditBatchResult* result); // Settlement file
+void credit_batch_run(const char* path); // Apply a settlement file and print the summary
+void credit_batch_menu();          // Apply a settlement file from the menu
+void credit_benchmark(int lines);  // Apply a synthetic settlement file
+void nozzle_init(NozzleScheduler* s, int nozzles, int policy); // Empty queues, idle nozzles
+int nozzle_enqueue(NozzleScheduler* s, double liters, double arrival_s); // Returns ticket (0 = turned away)
+void nozzle_advance(NozzleScheduler* s, double until, NozzleStartFn on_start, void* ctx); // Run the clock
+void nozzle_assign(double liters, int show_output); // Queue a paid purchase at this kiosk's nozzles
+void nozzle_simulate(int nozzles, double arrivals_per_hour); // Compare policies on one arrival stream
+void audit_notify();                // Publish new records to the sealer (hot path)
+void audit_start(const char* path); // Start the sealer thread (path: optional head file)
+void audit_stop();                  // Seal what is pending and stop the thread
+int audit_prove(long long transaction_id, AuditProof* proof); // Inclusion proof for one record
+int audit_verify_proof(const AuditProof* proof); // Proof leads to the stored root and current head
+int audit_verify_all();             // First tampered batch, or -1 if all records match
+void audit_proof_menu();            // Show and check a proof for a transaction
+void audit_benchmark();             // Hot-path cost, sealing rate, proof cost, tamper check
+const uint8_t* audit_head();        // Latest chain head
+void hex_string(const uint8_t* data, int len, char* out); // Bytes as lowercase hex
+int report_failed_dispense(long long transaction_id); // Mark a recent sale as not dispensed
+int refund_transaction(long long transaction_id, long long* refund_id, int show_output); // Reverse a sale
+const char* refund_result_text(int result);
+void refund_menu();                 // Refund a failed dispense
+void refund_benchmark();            // ID index vs scan, cost of a reversal
+void user_changed(User* user);      // Account changed: new version, sync digest, tap profile
+void sync_track(User* user);        // Fold a user's current digest into the sync tree
+int sync_serve(int fd, SyncStats* stats); // Answer one sync (central store side)
+int sync_pull(int fd, SyncStats* stats); // Reconcile with the peer on fd (kiosk side)
+void sync_simulate(int user_total, int changes); // Kiosk and central store as two processes
+User* lease_find_user(long long user_id); // Cached lookup (round trip to the store on a miss)
+int lease_debit(long long user_id, double amount); // Wallet write-through to the store
+void lease_store_serve(const int* fds, int kiosks); // Central store: answer kiosks until they hang up
+void lease_report(const LeaseStats* stats); // Hit rate, misses by cause, staleness
+void lease_simulate(int kiosks, int ops, int lease_ms); // Kiosks and a store as separate processes
+int scan_run(int rows, size_t row_bytes, ScanMorselFn scan, size_t partial_size,
+             ScanMergeFn merge, void* total, int threads); // Parallel scan, returns workers used
+void scan_sales(SalesScan* total, int threads); // Totals over the whole transaction history
+void scan_users(UserScan* total, int threads); // Totals over every registered user
+void scan_report(int threads);      // Full-history section of admin analytics
+void scan_benchmark(int max_threads); // Scan throughput by thread count
+int history_open(const char* path); // Load or create the fixed-size history file
+void history_record(long long now); // Add the change in stats since the last call to each archive
+int history_query(int archive, long long from, long long to, HistoryPoint* out, int max); // Points in [from, to]
+void history_menu();                // Revenue and digital share over time
+void history_benchmark(int days);   // Years of sales on a simulated clock
+void cube_record(int kiosk, long long when, const char* method, int sign, double revenue,
+                 double fee, double discount, double liters); // Add a sale (sign 1) or refund (-1)
+void cube_load_history();           // Add the transactions replayed at startup
+int cube_get(int level, int where, int day, int method, CubeCell* out); // One cell, O(1)
+int cube_drill_down(int level, int where, int day, int method, CubeRow* rows, int max); // Next level down
+int cube_by_method(int level, int where, int day, CubeRow* rows); // Methods of one location
+int cube_by_day(int level, int where, int method, int first_day, int last_day, CubeRow* rows, int max);
+int cube_day(long long when);       // Local day number of a Unix time
+void cube_menu();                   // Dashboard slices
+void cube_benchmark(int sales);     // Synthetic fleet: maintenance and query cost
+int cohort_week(long long when);    // Monday-based local week number
+void cohort_join(User* user);       // Count a new user in their registration week
+void cohort_activity(User* user, long long when); // A purchase: mark the user active that week
+int cohort_retention(int filter, int cohort_count, int offsets, double* out, int* weeks, int* registered);
+void cohort_menu();                 // Retention matrix by registration week
+void cohort_benchmark(int user_total); // Synthetic cohorts: update and render cost
+void mem_claim(int tag, size_t bytes); // Count an entry of a subsystem's table as in use
+void mem_release(int tag, size_t bytes); // ... and as given back
+void mem_report();                  // Reserved/live/peak bytes per subsystem
+int tenants_load(const char* path); // Operators with their prices and table quotas
+User* tenant_user(long long user_id); // Find user of the active operator
+void tenant_report();               // Per-operator users, history and revenue
+void tenant_menu();                 // Switch the operator this terminal serves
+void display_pricing_info();       // Show pricing and discount information
+
+// =================== MAIN PROGRAM FLOW ===================
+/**
+ * Main function - Entry point of the program
+ * Displays welcome message and runs main menu loop
+ * Command-line options --bench-gateway, --bench-telemetry, --simulate-reconcile,
+ * --bench-tap, --bench-qr, --bench-nearest, --bench-group, --bench-pin,
+ * --bench-import [rows], --bench-credit [lines], --bench-audit, --bench-refund,
+ * --bench-scan [max threads], --bench-history [days], --bench-cube [sales],
+ * --bench-cohort [users] and
+ * --simulate-nozzles [nozzles] [customers/hour] and
+ * --simulate-sync [users] [changes] and
+ * --simulate-lease [kiosks] [ops] [lease ms] run benchmarks and simulations instead;
+ * --qr-token <user_id> <amount> issues a signed QR payment token;
+ * --import-roster <file> registers a CSV roster and --credit-batch <file>
+ * applies a wallet settlement file before the menu starts;
+ * --footprint reports the static RAM used by this build profile;
+ * --gen-workload <ops> [seed] writes a synthetic workload and --replay <file>
+ * runs one non-interactively (used to train profile-guided builds)
+ */
+int main(int argc, char* argv[]) {
+    int choice;
+    
+#ifdef WATER_ATM_EMBEDDED
+    setvbuf(stdout, stdout_buffer, _IOLBF, sizeof(stdout_buffer));
+    setvbuf(stdin, stdin_buffer, _IOFBF, sizeof(stdin_buffer));
+#endif
+    
+    // Kiosk ID comes from the environment so several kiosks never mint the same IDs
+    char* kiosk_env = getenv("WATER_ATM_KIOSK_ID");
+    if (kiosk_env) {
+        // An out-of-range ID would wrap onto another kiosk's IDs: refuse to start instead
+        char* end;
+        long id = strtol(kiosk_env, &end, 10);
+        if (end == kiosk_env || *end != '\0' || id < 0 || id >= (1 << ID_KIOSK_BITS)) {
+            printf("WATER_ATM_KIOSK_ID must be 0-%d (got \"%s\")\n", (1 << ID_KIOSK_BITS) - 1, kiosk_env);
+            return 1;
+        }
+        kiosk_id = (int)id;
+    }
+    
+    // Operators hosted by this process, and which one this terminal starts serving
+    char* tenants_env = getenv("WATER_ATM_TENANTS");
+    if (tenants_env && !tenants_load(tenants_env)) {
+        printf("Tenants file %s not loaded - single operator\n", tenants_env);
+    }
+    char* tenant_env = getenv("WATER_ATM_TENANT");
+    if (tenant_env && atoi(tenant_env) >= 1 && atoi(tenant_env) <= tenant_count) {
+        active_tenant = atoi(tenant_env) - 1;
+    }
+    
+    // Printer is optional: receipts are always shown on screen
+    char* printer_env = getenv("WATER_ATM_PRINTER");
+    if (printer_env) {
+        receipt_spooler_start(printer_env);
+    }
+    
+    // Fleet list for nearest-kiosk search (includes this kiosk's tank level)
+    char* sites_env = getenv("WATER_ATM_KIOSK_SITES");
+    if (sites_env) {
+        kiosk_sites_load(sites_env);
+    }
+    
+    // Kiosks with several nozzles queue paid orders across them
+    char* nozzles_env = getenv("WATER_ATM_NOZZLES");
+    if (nozzles_env && atoi(nozzles_env) > 0) {
+        char* policy_env = getenv("WATER_ATM_NOZZLE_POLICY");
+        int policy = !policy_env ? NOZZLE_SJF : strcmp(policy_env, "fifo") == 0 ? NOZZLE_FIFO :
+                     strcmp(policy_env, "bulk") == 0 ? NOZZLE_BULK_LANE : NOZZLE_SJF;
+        nozzle_init(&kiosk_nozzles, atoi(nozzles_env), policy);
+    }
+    
+    // Append-only sales log on flash; history survives a power cut
+    char* flash_env = getenv("WATER_ATM_FLASH_LOG");
+    if (flash_env && !flash_log_open(flash_env)) {
+        printf("Flash log %s unavailable - sales kept in RAM only\n", flash_env);
+    }
+    cube_load_history();
+    
+    // Per-minute/hour/day history of the analytics counters (fixed-size file)
+    char* history_env = getenv("WATER_ATM_HISTORY");
+    if (history_env && !history_open(history_env)) {
+        printf("History file %s unavailable - trends kept in RAM only\n", history_env);
+    }
+    
+    // Roster to register before the kiosk opens (the menu runs afterwards)
+    if (argc > 2 && strcmp(argv[1], "--import-roster") == 0) {
+        import_roster_run(argv[2]);
+    }
+    if (argc > 2 && strcmp(argv[1], "--credit-batch") == 0) {
+        credit_batch_run(argv[2]);
+    }
+    
+    // Non-interactive modes
+    if (argc > 2 && strcmp(argv[1], "--gen-workload") == 0) {
+        workload_generate(atoi(argv[2]), argc > 3 ? (unsigned int)atoi(argv[3]) : 1);
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[1], "--replay") == 0) {
+        return workload_replay(argv[2]) < 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--footprint") == 0) {
+        footprint_report();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-gateway") == 0) {
+        payment_gateway_benchmark();
+        payment_client_stop();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-telemetry") == 0) {
+        telemetry_benchmark();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--simulate-reconcile") == 0) {
+        reconcile_simulate();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-tap") == 0) {
+        tap_benchmark();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-qr") == 0) {
+        qr_benchmark();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-nearest") == 0) {
+        nearest_benchmark();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-group") == 0) {
+        group_wallet_benchmark();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-pin") == 0) {
+        pin_benchmark();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-import") == 0) {
+        import_benchmark(argc > 2 ? atoi(argv[2]) : 1000000);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-credit") == 0) {
+        credit_benchmark(argc > 2 ? atoi(argv[2]) : 1000000);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-audit") == 0) {
+        audit_benchmark();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-refund") == 0) {
+        refund_benchmark();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-scan") == 0) {
+        scan_benchmark(argc > 2 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN));
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-history") == 0) {
+        history_benchmark(argc > 2 ? atoi(argv[2]) : 730);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-cube") == 0) {
+        cube_benchmark(argc > 2 ? atoi(argv[2]) : 1000000);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-cohort") == 0) {
+        cohort_benchmark(argc > 2 ? atoi(argv[2]) : MAX_USERS);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--simulate-sync") == 0) {
+        sync_simulate(argc > 2 ? atoi(argv[2]) : 50000, argc > 3 ? atoi(argv[3]) : 100);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--simulate-lease") == 0) {
+        lease_simulate(argc > 2 ? atoi(argv[2]) : 4, argc > 3 ? atoi(argv[3]) : 20000,
+                       argc > 4 ? atoi(argv[4]) : LEASE_TERM_MS);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--simulate-nozzles") == 0) {
+        nozzle_simulate(argc > 2 ? atoi(argv[2]) : 3, argc > 3 ? atof(argv[3]) : 230);
+        return 0;
+    }
+    if (argc > 3 && strcmp(argv[1], "--qr-token") == 0) {
+        char token[160];
+        if (!qr_token_create(atoll(argv[2]), atof(argv[3]), time(NULL) + QR_TOKEN_TTL_S, token, sizeof(token))) {
+            printf("Set WATER_ATM_QR_KEY to issue QR tokens\n");
+            return 1;
+        }
+        printf("%s\n", token);
+        return 0;
+    }
+    
+    // Seal sales into the tamper-evident audit chain (history replayed from flash first)
+    audit_start(getenv("WATER_ATM_AUDIT_LOG"));
+    
+    // Display system welcome message
+    printf("=== WATER ATM MANAGEMENT SYSTEM ===\n");
+    printf("Smart Solution for Digital Payment Optimization\n\n");
+    
+    // Main program loop - continues until user chooses to exit
+    while (1) {
+        display_menu();             // Show available options
+        printf("Enter your choice: ");
+        scanf("%d", &choice);
+        
+        // Process user's menu choice
+        switch (choice) {
+            case 1:
+                register_user();    // Add new user to system
+                break;
+            case 2:
+                top_up_wallet();    // Add money to wallet
+                break;
+            case 3:
+                purchase_water();   // Main purchase functionality
+                break;
+            case 4:
+                purchase_pass();    // Buy fee-waiver pass
+                break;
+            case 5:
+                view_user_profile(); // Show user details
+                break;
+            case 6:
+                display_pricing_info(); // Show pricing guide
+                break;
+            case 7:
+                admin_analytics();  // Show business analytics
+                break;
+            case 9:
+                link_card_menu();   // Link RFID/NFC card to user
+                break;
+            case 10:
+                tap_mode();         // Card tap fast path
+                break;
+            case 11:
+                find_nearest_kiosk(); // Nearest kiosk with enough water
+                break;
+            case 12:
+                group_wallet_menu(); // Shared family/hostel wallets
+                break;
+            case 13:
+                change_pin();       // Set/change wallet PIN
+                break;
+            case 14:
+                import_roster_menu(); // Bulk registration from a CSV roster
+                break;
+            case 15:
+                credit_batch_menu(); // Bulk wallet credits from a settlement file
+                break;
+            case 16:
+                audit_proof_menu(); // Inclusion proof for one transaction
+                break;
+            case 17:
+                refund_menu();      // Reverse a sale whose water never came out
+                break;
+            case 18:
+                history_menu();     // Revenue and digital share per minute/hour/day
+                break;
+            case 19:
+                cube_menu();        // Sales by region, kiosk, method and day
+                break;
+            case 20:
+                cohort_menu();      // Are customers still buying weeks after registering?
+                break;
+            case 21:
+                tenant_menu();      // Serve another operator's customers
+                break;
+            case 8:
+                printf("Thank you for using Water ATM System!\n");
+                receipt_spooler_stop(); // Print anything still queued
+                payment_client_stop();
+                audit_stop();       // Seal the last partial batch
+                exit(0);            // Clean program exit
+            default:
+                printf("Invalid choice! Please try again.\n");
+        }
+        
+        // Pause for user to read output before clearing screen
+        printf("\nPress Enter to continue...");
+        getchar();
+        getchar();
+        system("clear || cls");     // Clear screen (works on Linux/Windows)
+    }
+    
+    return 0;
+}
+
+// =================== USER INTERFACE FUNCTIONS ===================
+
+/**
+ * Display Main Menu
+ * Shows all available system functions to user
+ */
+void display_menu() {
+    printf("\n=== MAIN MENU ===\n");
+    printf("1. Register New User\n");
+    printf("2. Top-up Wallet\n");
+    printf("3. Purchase Water\n");
+    printf("4. Purchase Weekly/Monthly Pass\n");
+    printf("5. View User Profile\n");
+    printf("6. View Pricing & Discount Info\n");
+    printf("7. Admin Analytics\n");
+    printf("9. Link RFID/NFC Card\n");
+    printf("10. Tap-to-Dispense Mode\n");
+    printf("11. Find Nearest Kiosk with Water\n");
+    printf("12. Group Wallets\n");
+    printf("13. Set/Change PIN\n");
+    printf("14. Bulk Import Roster (CSV)\n");
+    printf("15. Bulk Wallet Credit (settlement file)\n");
+    printf("16. Transaction Audit Proof\n");
+    printf("17. Refund Failed Dispense\n");
+    printf("18. Sales Trends\n");
+    printf("19. Sales Dashboard (region/kiosk/method/day)\n");
+    printf("20. Cohort Retention\n");
+    printf("21. Switch Operator\n");
+    printf("8. Exit\n");
+    printf("==================\n");
+}
+
+// =================== USER MANAGEMENT FUNCTIONS ===================
+
+/**
+ * Register New User
+ * Collects user information and creates account
+ * Initializes all user fields with default values
+ */
+void register_user() {
+    // Check if system (or this operator's share of it) has reached maximum user capacity
+    if (user_count >= MAX_USERS || tenants[active_tenant].users >= tenants[active_tenant].max_users) {
+        printf("Maximum user limit reached!\n");
+        return;
+    }
+    
+    // Get pointer to next available user slot
+    User* new_user = &users[user_count];
+    new_user->user_id = generate_id();     // Assign unique ID
+    new_user->tenant = active_tenant;      // Customer of the operator this kiosk serves
+    
+    printf("\n=== USER REGISTRATION ===\n");
+    
+    // Collect user information
+    printf("Enter name: ");
+    scanf(" %[^\n]", new_user->name);      // Read full name including spaces
+    
+    printf("Enter phone number: ");
+    scanf("%s", new_user->phone);
+    
+    printf("Are you a student? (1 for Yes, 0 for No): ");
+    scanf("%d", &new_user->is_student);
+    
+    // PIN protects the wallet (hashed, never stored)
+    new_user->has_pin = 0;
+    new_user->pin_failures = 0;
+    new_user->pin_locked_until = 0;
+    if (!prompt_new_pin(new_user)) {
+        printf("No PIN set - set one from the menu to protect your wallet\n");
+    }
+    
+    // Initialize financial and usage data
+    new_user->wallet_balance = 0.0;        // Start with empty wallet
+    new_user->total_spent = 0.0;           // No purchase history
+    new_user->transaction_count = 0;       // No transactions yet
+    new_user->loyalty_points = 0;          // No loyalty points
+    new_user->has_weekly_pass = 0;         // No active passes
+    new_user->has_monthly_pass = 0;
+    new_user->pass_expiry = 0;             // No expiry date
+    new_user->group_id = 0;                // Not in a group wallet
+    
+    user_count++;                          // Increment total user count
+    index_user(new_user);                  // Findable by ID and phone
+    
+    // Confirm successful registration
+    printf("\nRegistration successful!\n");
+    printf("Your User ID: %lld\n", new_user->user_id);
+    if (new_user->is_student) {
+        printf("Student discount: 10%% off on all purchases!\n");
+    }
+}
+
+/**
+ * Top-up Wallet
+ * Allows users to add money to their digital wallet
+ * Includes bonus system for large top-ups
+ */
+void top_up_wallet() {
+    long long user_id;
+    double amount;
+    
+    printf("\n=== WALLET TOP-UP ===\n");
+    printf("Enter User ID: ");
+    scanf("%lld", &user_id);
+    
+    // Find the user in system
+    User* user = tenant_user(user_id);
+    if (!user) {
+        printf("User not found!\n");
+        return;
+    }
+    
+    // Display current balance and get top-up amount
+    printf("Current wallet balance: ₹%.2f\n", user->wallet_balance);
+    printf("Enter amount to add: ₹");
+    scanf("%lf", &amount);
+    
+    // Validate amount
+    if (amount <= 0) {
+        printf("Invalid amount!\n");
+        return;
+    }
+    
+    // Add money to wallet
+    double bonus = credit_wallet(user, amount);
+    printf("Wallet topped up successfully!\n");
+    printf("New balance: ₹%.2f\n", user->wallet_balance - bonus);
+    
+    if (bonus > 0) {
+        printf("Bonus added: ₹%.2f (2%% bonus for top-up ≥ ₹100)\n", bonus);
+        printf("Final balance: ₹%.2f\n", user->wallet_balance);
+    }
+}
+
+/**
+ * Credit Wallet
+ * Adds a top-up to the wallet; returns the bonus that came with it
+ */
+double credit_wallet(User* user, double amount) {
+    user->wallet_balance += amount;
+    
+    // Bonus system: Give 2% bonus for top-ups ≥ ₹100
+    double bonus = amount >= 100 ? amount * 0.02 : 0.0;
+    user->wallet_balance += bonus;
+    user_changed(user);                    // Keep card tap state and sync current
+    return bonus;
+}
+
+// =================== CORE BUSINESS LOGIC ===================
+
+/**
+ * Purchase Water - Main Business Function
+ * Collects user ID, quantity and payment method at the counter and hands
+ * them to process_purchase()
+ */
+void purchase_water() {
+    long long user_id;
+    double liters;
+    int payment_choice;
+    
+    printf("\n=== WATER PURCHASE ===\n");
+    printf("Enter User ID: ");
+    scanf("%lld", &user_id);
+    
+    // Validate user exists
+    User* user = tenant_user(user_id);
+    if (!user) {
+        printf("User not found!\n");
+        return;
+    }
+    
+    // Get quantity needed
+    printf("Enter liters of water needed: ");
+    scanf("%lf", &liters);
+    
+    if (liters <= 0) {
+        printf("Invalid quantity!\n");
+        return;
+    }
+    
+    // Payment method selection
+    printf("\n=== PAYMENT OPTIONS ===\n");
+    printf("1. Cash (No extra fee)\n");
+    printf("2. Digital Payment (Wallet)\n");
+    printf("3. Digital Payment (UPI)\n");
+    printf("4. Digital Payment (QR code from app)\n");
+    if (user->group_id) {
+        printf("5. Digital Payment (Group wallet: %s)\n", find_group(user->group_id)->name);
+    }
+    printf("Choose payment method: ");
+    scanf("%d", &payment_choice);
+    
+    // Spending stored value needs the account's PIN (once per kiosk session)
+    if ((payment_choice == 2 || payment_choice == 5) && !authorize_user(user)) {
+        return;
+    }
+    
+    // QR payments: the customer shows a signed token from the app
+    char qr_text[160] = "";
+    if (payment_choice == 4) {
+        printf("Scan QR token: ");
+        scanf("%159s", qr_text);
+    }
+    
+    if (process_purchase(user, liters, payment_choice, qr_text, 1) && kiosk_nozzles.nozzles > 0) {
+        nozzle_assign(liters, 1);       // Multi-nozzle kiosk: which nozzle, and when
+    }
+}
+
+/**
+ * Process Purchase - Core Sale Logic
+ * Handles the complete water purchase once the customer is identified:
+ * - Discount calculation
+ * - Fee optimization
+ * - Payment (cash, wallet, UPI, QR token or group wallet)
+ * - Transaction recording
+ * payment_token carries the scanned QR token for QR payments (else NULL).
+ * Messages and the on-screen receipt are shown only if show_output is set;
+ * the receipt always goes to the printer spooler.
+ * Returns 1 if the sale completed, 0 if it was refused
+ */
+int process_purchase(User* user, double liters, int payment_choice, const char* payment_token, int show_output) {
+    long long user_id = user->user_id;
+    int points_before = user->loyalty_points; // Discounts may redeem points (given back if refused)
+    Tenant* tenant = &tenants[user->tenant]; // The account's operator sets the prices
+    
+    // Calculate base cost (before fees/discounts)
+    double base_cost = liters * tenant->price_per_liter;
+    
+    // Initialize transaction variables
+    char payment_method[20];
+    double fee = 0.0;              // Digital payment fee
+    double discount = 0.0;         // Total discount applied
+    double final_amount = base_cost;
+    
+    // Process payment method choice
     if (payment_choice == 1) {
         // ===== CASH PAYMENT PROCESSING =====
         strcpy(payment_method, "Cash");
         discount = calculate_discount(user, liters, payment_method);
         final_amount = base_cost - discount;
         stats.cash_transactions++;
+        tenant->stats.cash_transactions++;
+        
+    } else if (payment_choice >= 2 && payment_choice <= 5) {
+        // ===== DIGITAL PAYMENT PROCESSING =====
+        strcpy(payment_method, payment_choice == 3 ? "UPI" : payment_choice == 4 ? "QR" :
+                               payment_choice == 5 ? "Group" : "Digital");
+        
+        // SMART FEE OPTIMIZATION LOGIC
+        // Check if user has valid pass (no fee if pass active)
+        if (is_pass_valid(user)) {
+            if (show_output) printf("Pass holder - No digital payment fee!\n");
+            fee = 0.0;
+        } else {
+            // Calculate available discounts
+            discount = calculate_discount(user, liters, payment_method);
+            
+            // Fee optimization strategies:
+            if (liters >= tenant->min_bulk_liters) {
+                // Strategy 1: Bulk purchase - waive fee
+                if (show_output) printf("Bulk purchase - Digital fee waived!\n");
+                fee = 0.0;
+            } else if (discount >= tenant->digital_fee) {
+                // Strategy 2: Discount covers fee
+                if (show_output) printf("Discount covers digital fee!\n");
+                fee = 0.0;
+            } else {
+                // Strategy 3: Reduce fee by available discount
+                fee = tenant->digital_fee - discount;
+                if (fee < 0) fee = 0;
+            }
+        }
+        
+        final_amount = base_cost - discount + fee;
+        
+        if (payment_choice == 3) {
+            // Charge through the UPI gateway (the client keeps other payments moving meanwhile)
+            char reference[24];
+            int handle = payment_client_ensure() ? payment_submit(user_id, final_amount) : -1;
+            if (handle < 0) {
+                if (show_output) printf("UPI gateway busy or unavailable! Please use wallet or cash.\n");
+                user->loyalty_points = points_before;   // Refused sale: no points redeemed
+                return 0;
+            }
+            if (show_output) printf("Waiting for UPI approval...\n");
+            int status = payment_wait(handle, reference);
+            if (status != PAY_APPROVED) {
+                if (show_output) {
+                    if (status == PAY_DECLINED) printf("UPI payment declined!\n");
+                    else printf("UPI payment timed out! Any charge will be cancelled and refunded.\n");
+                }
+                user->loyalty_points = points_before;
+                return 0;
+            }
+            if (show_output) printf("UPI reference: %s\n", reference);
+        } else if (payment_choice == 5) {
+            // Shared group wallet (striped, so other members' kiosks aren't held up)
+            GroupWallet* group = find_group(user->group_id);
+            if (!group || !group_wallet_debit(group, final_amount)) {
+                if (show_output) {
+                    printf(group ? "Insufficient group wallet balance!\n" : "Not a member of a group wallet!\n");
+                }
+                user->loyalty_points = points_before;
+                return 0;
+            }
+        } else {
+            QrToken token;
+            if (payment_choice == 4) {
+                // QR token from the customer's app authorizes the wallet debit
+                int result = payment_token ? qr_verify(payment_token, &token) : QR_MALFORMED;
+                if (result == QR_OK && token.user_id != user_id) result = QR_BAD_SIGNATURE;
+                if (result == QR_OK && final_amount * 100 > token.amount_paise + 0.5) {
+                    if (show_output) printf("QR token covers only ₹%.2f!\n", token.amount_paise / 100.0);
+                    user->loyalty_points = points_before;
+                    return 0;
+                }
+                if (result != QR_OK) {
+                    if (show_output) printf("QR token %s!\n", qr_result_text(result));
+                    user->loyalty_points = points_before;
+                    return 0;
+                }
+            }
+            
+            // Validate sufficient wallet balance
+            if (user->wallet_balance < final_amount) {
+                if (show_output) {
+                    printf("Insufficient wallet balance!\n");
+                    printf("Required: ₹%.2f, Available: ₹%.2f\n", final_amount, user->wallet_balance);
+                }
+                user->loyalty_points = points_before;
+                return 0;
+            }
+            
+            // Spend the QR nonce only now that the sale is going ahead
+            if (payment_choice == 4) {
+                int result = qr_redeem(&token);
+                if (result != QR_OK) {
+                    if (show_output) printf("QR token %s!\n", qr_result_text(result));
+                    user->loyalty_points = points_before;
+                    return 0;
+                }
+            }
+            
+            // Deduct amount from wallet
+            user->wallet_balance -= final_amount;
+        }
+        stats.digital_transactions++;
+        tenant->stats.digital_transactions++;
+        
+    } else {
+        if (show_output) printf("Invalid payment method!\n");
+        return 0;
+    }
+    
+    // ===== UPDATE USER STATISTICS =====
+    int points_redeemed = points_before - user->loyalty_points;
+    user->total_spent += base_cost;        // Track lifetime spending
+    user->transaction_count++;             // Increment transaction count
+    update_loyalty_points(user, base_cost); // Award loyalty points
+    
+    // Track bulk purchases for analytics
+    if (liters >= tenant->min_bulk_liters) {
+        stats.bulk_purchases++;
+        tenant->stats.bulk_purchases++;
+    }
+    
+    // ===== RECORD TRANSACTION =====
+    long long transaction_id = save_transaction(user, final_amount, liters, payment_method, fee, discount,
+                                             points_redeemed, 0);
+    
+    // ===== UPDATE GLOBAL STATISTICS =====
+    stats.total_revenue += base_cost;
+    stats.total_fees_collected += fee;
+    stats.total_discounts_given += discount;
+    tenant->stats.total_revenue += base_cost;
+    tenant->stats.total_fees_collected += fee;
+    tenant->stats.total_discounts_given += discount;
+    history_record(time(NULL));            // Per-minute/hour/day trends
+    cube_record(kiosk_id, time(NULL), payment_method, 1, base_cost, fee, discount, liters);
+    cohort_activity(user, time(NULL));     // Retention by registration week
+    user_changed(user);                    // Keep card tap state and sync current
+    kiosk_site_record_sale(liters);        // Tank level for nearest-kiosk search
+    
+    // ===== DISPLAY PURCHASE RECEIPT =====
+    // Render once, show on screen, and hand a copy to the printer spooler
+    char receipt[RECEIPT_MAX_LEN];
+    int len = 0;
+    receipt_append(receipt, &len, "\n=== PURCHASE RECEIPT ===\n");
+    receipt_append(receipt, &len, "Transaction ID: %lld\n", transaction_id);
+    receipt_append(receipt, &len, "User: %s (ID: %lld)\n", user->name, user->user_id);
+    receipt_append(receipt, &len, "Water quantity: %.2f liters\n", liters);
+    receipt_append(receipt, &len, "Base cost: ₹%.2f\n", base_cost);
+    if (discount > 0) {
+        receipt_append(receipt, &len, "Discount applied: -₹%.2f\n", discount);
+    }
+    if (fee > 0) {
+        receipt_append(receipt, &len, "Digital payment fee: +₹%.2f\n", fee);
+    }
+    receipt_append(receipt, &len, "Final amount: ₹%.2f\n", final_amount);
+    receipt_append(receipt, &len, "Payment method: %s\n", payment_method);
+    if (payment_choice == 2 || payment_choice == 4) {
+        receipt_append(receipt, &len, "Remaining wallet balance: ₹%.2f\n", user->wallet_balance);
+    } else if (payment_choice == 5) {
+        receipt_append(receipt, &len, "Remaining group balance: ₹%.2f\n",
+                       group_wallet_balance(find_group(user->group_id)));
+    }
+    receipt_append(receipt, &len, "Loyalty points earned: +%d\n", (int)(base_cost));
+    receipt_append(receipt, &len, "Total loyalty points: %d\n", user->loyalty_points);
+    receipt_append(receipt, &len, "========================\n");
+    
+    if (show_output) printf("%s", receipt);
+    spool_receipt(receipt);
+    return 1;
+}
+
+/**
+ * Purchase Pass System
+ * Allows users to buy weekly/monthly passes to avoid digital fees
+ * This is a key strategy for frequent digital payment users
+ */
+void purchase_pass() {
+    long long user_id;
+    int pass_type;
+    
+    printf("\n=== PURCHASE PASS ===\n");
+    printf("Enter User ID: ");
+    scanf("%lld", &user_id);
+    
+    User* user = tenant_user(user_id);
+    if (!user) {
+        printf("User not found!\n");
+        return;
+    }
+    if (!authorize_user(user)) {
+        return;
+    }
+    
+    // Display pass options
+    printf("\n=== PASS OPTIONS ===\n");
+    printf("1. Weekly Pass - ₹%.2f (No digital fees for 7 days)\n", tenants[user->tenant].weekly_pass_cost);
+    printf("2. Monthly Pass - ₹%.2f (No digital fees for 30 days)\n", tenants[user->tenant].monthly_pass_cost);
+    printf("Choose pass type: ");
+    scanf("%d", &pass_type);
+    
+    activate_pass(user, pass_type, 1);
+}
+
+/**
+ * Activate Pass
+ * Charges the pass (personal wallet first, then the group wallet) and
+ * switches it on. Messages are shown only if show_output is set.
+ * Returns 1 if the pass was bought, 0 if it was refused
+ */
+int activate_pass(User* user, int pass_type, int show_output) {
+    Tenant* tenant = &tenants[user->tenant];
+    double pass_cost;
+    int pass_days;
+    
+    // Set pass parameters based on selection
+    if (pass_type == 1) {
+        pass_cost = tenant->weekly_pass_cost;
+        pass_days = 7;
+    } else if (pass_type == 2) {
+        pass_cost = tenant->monthly_pass_cost;
+        pass_days = 30;
+    } else {
+        if (show_output) printf("Invalid pass type!\n");
+        return 0;
+    }
+    
+    // Check wallet balance
+    if (user->wallet_balance < pass_cost) {
+        if (show_output) {
+            printf("Insufficient wallet balance!\n");
+            printf("Required: ₹%.2f, Available: ₹%.2f\n", pass_cost, user->wallet_balance);
+        }
+        return 0;
+    }
+    
+    // Process pass purchase
+    user->wallet_balance -= pass_cost;
+    
+    // Activate appropriate pass
+    if (pass_type == 1) {
+        user->has_weekly_pass = 1;
+    } else {
+        user->has_monthly_pass = 1;
+    }
+    
+    // Set expiry time (current time + pass duration)
+    user->pass_expiry = time(NULL) + (pass_days * 24 * 60 * 60);
+    stats.pass_holders++;
+    tenant->stats.pass_holders++;
+    history_record(time(NULL));
+    cube_record(kiosk_id, time(NULL), "Pass", 1, pass_cost, 0.0, 0.0, 0.0);
+    user_changed(user);                    // Keep card tap state and sync current
+    
+    // Confirm purchase
+    if (show_output) {
+        printf("Pass purchased successfully!\n");
+        printf("Cost: ₹%.2f\n", pass_cost);
+        printf("Valid for: %d days\n", pass_days);
+        printf("Remaining wallet balance: ₹%.2f\n", user->wallet_balance);
+        printf("Benefit: No digital payment fees during pass validity!\n");
+    }
+    return 1;
+}
+
+// =================== INFORMATION DISPLAY FUNCTIONS ===================
+
+/**
+ * View User Profile
+ * Displays comprehensive user information and provides usage insights
+ */
+void view_user_profile() {
+    long long user_id;
+    
+    printf("\n=== USER PROFILE ===\n");
+    printf("Enter User ID: ");
+    scanf("%lld", &user_id);
+    
+    User* user = tenant_user(user_id);
+    if (!user) {
+        printf("User not found!\n");
+        return;
+    }
+    
+    // Display basic user information
+    printf("\n=== PROFILE DETAILS ===\n");
+    printf("Name: %s\n", user->name);
+    printf("User ID: %lld\n", user->user_id);
+    printf("Phone: %s\n", user->phone);
+    printf("Student: %s\n", user->is_student ? "Yes" : "No");
+    printf("Wallet Balance: ₹%.2f\n", user->wallet_balance);
+    printf("Total Spent: ₹%.2f\n", user->total_spent);
+    printf("Transactions: %d\n", user->transaction_count);
+    printf("Loyalty Points: %d\n", user->loyalty_points);
+    
+    // Display pass status
+    if (is_pass_valid(user)) {
+        time_t now = time(NULL);
+        int days_left = (user->pass_expiry - now) / (24 * 60 * 60);
+        printf("Active Pass: %s (%d days remaining)\n", 
+               user->has_monthly_pass ? "Monthly" : "Weekly", days_left);
+    } else {
+        printf("Active Pass: None\n");
+    }
+    
+    // Provide cost optimization suggestion
+    const Tenant* tenant = &tenants[user->tenant];
+    double potential_monthly_fees = user->transaction_count * tenant->digital_fee;
+    printf("\nPotential monthly digital fees: ₹%.2f\n", potential_monthly_fees);
+    if (potential_monthly_fees > tenant->monthly_pass_cost) {
+        printf("💡 Tip: Monthly pass could save you ₹%.2f!\n", 
+               potential_monthly_fees - tenant->monthly_pass_cost);
+    }
+}
+
+/**
+ * Display Pricing Information
+ * Shows complete pricing structure and cost optimization strategies
+ */
+void display_pricing_info() {
+    const Tenant* tenant = &tenants[active_tenant];
+    printf("\n=== PRICING & DISCOUNTS ===\n");
+    if (tenant_count > 1) printf("Operator: %s\n", tenant->name);
+    printf("Base Price: ₹%.2f per liter\n", tenant->price_per_liter);
+    printf("Digital Payment Fee: ₹%.2f (when applicable)\n", tenant->digital_fee);
+    
+    // Show fee avoidance strategies
+    printf("\n=== WAYS TO AVOID DIGITAL FEES ===\n");
+    printf("1. Weekly Pass (₹%.2f) - No fees for 7 days\n", tenant->weekly_pass_cost);
+    printf("2. Monthly Pass (₹%.2f) - No fees for 30 days\n", tenant->monthly_pass_cost);
+    printf("3. Bulk Purchase - Buy ≥%d liters (fee waived)\n", tenant->min_bulk_liters);
+    printf("4. Student Discount - 10%% off (may cover fee)\n");
+    printf("5. Loyalty Discount - Spend ≥₹%.2f total (5%% off)\n", tenant->loyalty_threshold);
+    
+    printf("\n=== WALLET BONUSES ===\n");
+    printf("• Top-up ≥₹100: Get 2%% bonus credit\n");
+    
+    printf("\n=== LOYALTY PROGRAM ===\n");
+    printf("• Earn 1 point per ₹1 spent\n");
+    printf("• 100 points = ₹5 discount on next purchase\n");
+    
+    // Show cost comparison example
+    printf("\n=== COST COMPARISON EXAMPLE ===\n");
+    printf("Daily 5L purchase for 30 days:\n");
+    printf("• Cash: ₹%.2f\n", 30 * 5 * tenant->price_per_liter);
+    printf("• Digital (no pass): ₹%.2f\n", 30 * (5 * tenant->price_per_liter + tenant->digital_fee));
+    printf("• Digital (monthly pass): ₹%.2f\n", tenant->monthly_pass_cost + 30 * 5 * tenant->price_per_liter);
+    printf("• Savings with pass: ₹%.2f\n", 30 * tenant->digital_fee - tenant->monthly_pass_cost);
+}
+
+/**
+ * Admin Analytics
+ * Displays comprehensive system analytics and business insights
+ */
+void admin_analytics() {
+    printf("\n=== ADMIN ANALYTICS ===\n");
+    
+    // User and transaction statistics
+    printf("Total Users: %d\n", user_count);
+    printf("Total Transactions: %d\n", transaction_count);
+    printf("Cash Transactions: %d (%.1f%%)\n", stats.cash_transactions, 
+           transaction_count > 0 ? (stats.cash_transactions * 100.0 / transaction_count) : 0);
+    printf("Digital Transactions: %d (%.1f%%)\n", stats.digital_transactions,
+           transaction_count > 0 ? (stats.digital_transactions * 100.0 / transaction_count) : 0);
+    printf("Bulk Purchases: %d\n", stats.bulk_purchases);
+    printf("Pass Holders: %d\n", stats.pass_holders);
+    if (stats.refunds > 0) {
+        printf("Refunds: %d (₹%.2f returned for failed dispenses)\n", stats.refunds, stats.total_refunded);
+    }
+    
+    // Financial summary
+    printf("\n=== FINANCIAL SUMMARY ===\n");
+    printf("Total Revenue: ₹%.2f\n", stats.total_revenue);
+    printf("Fees Collected: ₹%.2f\n", stats.total_fees_collected);
+    printf("Discounts Given: ₹%.2f\n", stats.total_discounts_given);
+    printf("Net Revenue: ₹%.2f\n", stats.total_revenue + stats.total_fees_collected - stats.total_discounts_given);
+    
+    // Business recommendations based on data
+    printf("\n=== RECOMMENDATIONS ===\n");
+    if (stats.digital_transactions < stats.cash_transactions) {
+        printf("• Consider promoting passes to increase digital adoption\n");
+        printf("• Bulk purchase incentives are working well\n");
+    }
+    if (stats.pass_holders < user_count * 0.3) {
+        printf("• Low pass adoption - consider promotional pricing\n");
+    }
+    
+    // Totals recomputed from the full history (parallel scan)
+    if (user_count > 0 || transaction_count > 0) {
+        scan_report((int)sysconf(_SC_NPROCESSORS_ONLN));
+    }
+    
+    // Receipt printer health
+    pthread_mutex_lock(&spooler.lock);
+    if (spooler.running) {
+        printf("\n=== RECEIPT PRINTER ===\n");
+        printf("Device: %s (%s)\n", spooler.device, spooler.paper_out ? "OUT OF PAPER/OFFLINE" : "OK");
+        printf("Printed: %d, Pending: %d, Dropped: %d, Retries: %d\n",
+               spooler.printed, spooler.count, spooler.dropped, spooler.retries);
+    }
+    pthread_mutex_unlock(&spooler.lock);
+    
+    // UPI gateway health
+    if (payments.running) {
+        pthread_mutex_lock(&payments.lock);
+        printf("\n=== UPI GATEWAY ===\n");
+        int unconfirmed = 0;
+        for (int v = 0; v < PAYMENT_VOID_SLOTS; v++) unconfirmed += payments.voids[v] != 0;
+        printf("In flight: %d (peak %d), Approved: %d, Declined: %d, Timeouts: %d, Hedges: %d\n",
+               payments.inflight, payments.peak_inflight, payments.approved,
+               payments.declined, payments.timeouts, payments.hedges);
+        printf("Timed-out charges refunded: %d, Cancels unconfirmed: %d, Needing manual check: %d\n",
+               payments.reversals, unconfirmed, payments.voids_lost);
+        pthread_mutex_unlock(&payments.lock);
+    }
+    
+    // Sensor telemetry storage
+    if (telemetry.points > 0) {
+        printf("\n=== SENSOR TELEMETRY ===\n");
+        printf("Readings stored: %lld (%lld bytes, %.2f bytes/reading)\n",
+               telemetry.points, telemetry.bytes, telemetry.bytes / (double)telemetry.points);
+    }
+    
+    // Sold vs dispensed volume
+    if (reconciler.active_kiosks > 0) {
+        printf("\n=== DISPENSE RECONCILIATION ===\n");
+        reconcile_report();
+    }
+    
+    // PIN logins and kiosk sessions
+    if (sessions.logins > 0 || sessions.failures > 0) {
+        pthread_mutex_lock(&sessions.lock);
+        printf("\n=== PIN SESSIONS ===\n");
+        printf("Logins: %lld, Session reuses: %lld, Expired: %lld, Wrong PINs: %lld, Lockouts: %lld\n",
+               sessions.logins, sessions.hits, sessions.expired, sessions.failures, sessions.lockouts);
+        pthread_mutex_unlock(&sessions.lock);
+    }
+    
+    // Tamper-evident audit chain
+    if (audit.batch_count > 0 || transaction_count > 0) {
+        char head_hex[65];
+        pthread_mutex_lock(&audit.lock);
+        hex_string(audit_head(), 32, head_hex);
+        printf("\n=== TRANSACTION AUDIT ===\n");
+        printf("Sealed: %d records in %d batches, pending: %d\n", audit.sealed, audit.batch_count,
+               transaction_count - audit.sealed);
+        printf("Chain head: %.16s...\n", head_hex);
+        pthread_mutex_unlock(&audit.lock);
+        int tampered = audit_verify_all();
+        if (tampered >= 0) printf("WARNING: batch %d no longer matches its sealed root!\n", tampered);
+    }
+    
+    // Flash sales log
+    if (flash_log.fd >= 0) {
+        pthread_mutex_lock(&flash_log.lock);
+        printf("\n=== FLASH LOG ===\n");
+        printf("Recovered: %lld, Appended: %lld, Page erases: %lld, Write failures: %d\n",
+               flash_log.recovered, flash_log.appended, flash_log.erases, flash_log.failures);
+        if (flash_log.bad_times > 0) printf("Restored sales with implausible times: %d\n", flash_log.bad_times);
+        pthread_mutex_unlock(&flash_log.lock);
+    }
+    
+    // Per-operator takings (the totals above are the whole process)
+    if (tenant_count > 1) {
+        tenant_report();
+    }
+    
+    // How full each subsystem's tables are
+    mem_report();
+}
+
+// =================== CALCULATION FUNCTIONS ===================
+
+/**
+ * Calculate Total Discount
+ * Combines all applicable discounts for a user's purchase
+ * This is where the smart optimization happens
+ */
+double calculate_discount(User* user, double liters, char* payment_method) {
+    const Tenant* tenant = &tenants[user->tenant];
+    double discount = 0.0;
+    
+    // Student discount: 10% off base cost
+    if (user->is_student) {
+        discount += (liters * tenant->price_per_liter) * 0.10;
+    }
+    
+    // Bulk purchase discount: Fixed amount based on quantity
+    if (liters >= tenant->min_bulk_liters) {
+        discount += calculate_bulk_discount(liters);
+    }
+    
+    // Loyalty discount: Percentage of total lifetime spending
+    if (user->total_spent >= tenant->loyalty_threshold) {
+        discount += calculate_loyalty_discount(user);
+    }
+    
+    // Loyalty points redemption: 100 points = ₹5
+    if (user->loyalty_points >= 100) {
+        discount += 5.0;
+        user->loyalty_points -= 100;    // Deduct redeemed points
+    }
+    
+    return discount;
+}
+
+/**
+ * Calculate Bulk Purchase Discount
+ * Tiered discount system based on quantity
+ */
+double calculate_bulk_discount(double liters) {
+    if (liters >= 20) return 4.0;      // ₹4 discount for 20L+
+    if (liters >= 15) return 3.0;      // ₹3 discount for 15L+
+    if (liters >= 10) return 2.0;      // ₹2 discount for 10L+
+    return 0.0;
+}
+
+/**
+ * Calculate Loyalty Discount
+ * Returns 5% of user's total lifetime spending as discount
+ */
+double calculate_loyalty_discount(User* user) {
+    return (user->total_spent * 0.05);
+}
+
+// =================== UTILITY FUNCTIONS ===================
+
+/**
+ * Check Pass Validity
+ * Determines if user's pass is currently active
+ */
+int is_pass_valid(User* user) {
+    // Check if user has a pass and it hasn't expired
+    if ((user->has_weekly_pass || user->has_monthly_pass) && 
+        time(NULL) < user->pass_expiry) {
+        return 1;   // Pass is valid
+    }
+    return 0;       // No valid pass
+}
+
+/**
+ * Update Loyalty Points
+ * Awards points based on amount spent (1 point per rupee)
+ */
+void update_loyalty_points(User* user, double amount) {
+    user->loyalty_points += (int)amount;
+}
+
+/**
+ * Save Transaction Record
+ * Stores transaction details in system history; returns the transaction ID.
+ * Refund entries pass the ID of the sale they reverse (0 for a sale).
+ */
+long long save_transaction(User* user, double amount, double liters, char* method, double fee,
+                           double discount, int points_redeemed, long long reverses) {
+    long long transaction_id = generate_id();
+    Tenant* tenant = &tenants[user->tenant];
+    
+    // Durable copy first: the flash log keeps going after RAM history is full
+    flash_log_append(transaction_id, user->user_id, amount, liters, method, fee, discount, points_redeemed, reverses);
+    
+    // Create new transaction record (if history and the operator's share of it have room;
+    // refunds may also use the slots reserved for them)
+    if (reverses ? transaction_count < MAX_TRANSACTIONS
+                 : transaction_count < TXN_SALE_SLOTS && tenant->transactions < tenant->max_transactions) {
+        Transaction* txn = &transactions[transaction_count];
+        txn->transaction_id = transaction_id;
+        txn->user_id = user->user_id;
+        txn->amount = amount;
+        txn->liters = liters;
+        snprintf(txn->payment_method, sizeof(txn->payment_method), "%s", method);
+        txn->points_redeemed = points_redeemed;
+        txn->fee_charged = fee;
+        txn->discount_applied = discount;
+        txn->timestamp = time(NULL);    // Current timestamp
+        txn->reverses = reverses;
+        
+        index_transaction(transaction_count);
+        transaction_count++;            // Increment transaction counter
+        tenant->transactions++;
+        mem_claim(MEM_TRANSACTIONS, sizeof(*txn));
+        audit_notify();                 // Sealer thread hashes it later
+    }
+    
+    // Check the liters sold against what the flow meter sees leave the tank
+    // (a refund takes its liters back out of the window the sale went into)
+    reconcile_sale(kiosk_id, reverses ? (long long)id_timestamp(reverses) * 1000 : wall_clock_ms(), liters);
+    return transaction_id;
+}
+
+/**
+ * Index Slot for a 64-bit key (any table size: multiply-shift range reduction)
+ */
+static size_t hash_slot(uint64_t key, size_t slots) {
+    uint64_t h = key * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(((h >> 32) * (uint64_t)slots) >> 32);
+}
+
+static size_t index_slot(uint64_t key) {
+    return hash_slot(key, USER_INDEX_SLOTS);
+}
+
+/**
+ * Index Transaction
+ * Adds transactions[index] to the ID index; a refund entry is also indexed
+ * under the sale it reverses, so a second refund of that sale is caught
+ */
+void index_transaction(int index) {
+    const Transaction* txn = &transactions[index];
+    size_t slot = hash_slot((uint64_t)txn->transaction_id, TXN_INDEX_SLOTS);
+    while (txn_id_index[slot] != 0) slot = slot + 1 == TXN_INDEX_SLOTS ? 0 : slot + 1;
+    txn_id_index[slot] = index + 1;
+    mem_claim(MEM_INDEXES, sizeof(txn_id_index[0]));
+    
+    if (txn->reverses == 0) return;
+    slot = hash_slot((uint64_t)txn->reverses, TXN_INDEX_SLOTS);
+    while (refund_index[slot] != 0) slot = slot + 1 == TXN_INDEX_SLOTS ? 0 : slot + 1;
+    refund_index[slot] = index + 1;
+    mem_claim(MEM_INDEXES, sizeof(refund_index[0]));
+}
+
+/**
+ * Rebuild Transaction Indexes
+ * After history is replaced wholesale (flash replay). Refunds replayed from
+ * old "WAT1" flash pages learn their customer from the sale they reverse.
+ */
+void index_transactions() {
+    for (int i = 0; i < TXN_INDEX_SLOTS; i++) {
+        if (txn_id_index[i]) mem_release(MEM_INDEXES, sizeof(txn_id_index[0]));
+        if (refund_index[i]) mem_release(MEM_INDEXES, sizeof(refund_index[0]));
+    }
+    memset(txn_id_index, 0, sizeof(txn_id_index));
+    memset(refund_index, 0, sizeof(refund_index));
+    for (int i = 0; i < transaction_count; i++) {
+        index_transaction(i);
+    }
+    for (int i = 0; i < transaction_count; i++) {
+        Transaction* sale = transactions[i].reverses ? find_transaction(transactions[i].reverses) : NULL;
+        if (sale && transactions[i].user_id == 0) transactions[i].user_id = sale->user_id;
+    }
+}
+
+/**
+ * Find Transaction by ID
+ * Looks the ID up in the transaction index; NULL if it isn't in history
+ */
+Transaction* find_transaction(long long transaction_id) {
+    for (size_t slot = hash_slot((uint64_t)transaction_id, TXN_INDEX_SLOTS); txn_id_index[slot] != 0;
+         slot = slot + 1 == TXN_INDEX_SLOTS ? 0 : slot + 1) {
+        Transaction* txn = &transactions[txn_id_index[slot] - 1];
+        if (txn->transaction_id == transaction_id) return txn;
+    }
+    return NULL;
+}
+
+/**
+ * Find Refund of a sale
+ * Returns the compensating entry that reversed the sale, or NULL
+ */
+Transaction* find_refund(long long transaction_id) {
+    for (size_t slot = hash_slot((uint64_t)transaction_id, TXN_INDEX_SLOTS); refund_index[slot] != 0;
+         slot = slot + 1 == TXN_INDEX_SLOTS ? 0 : slot + 1) {
+        Transaction* txn = &transactions[refund_index[slot] - 1];
+        if (txn->reverses == transaction_id) return txn;
+    }
+    return NULL;
+}
+
+/**
+ * Phone Key
+ * A phone number's digits as one number, tagged with its length so leading
+ * zeros still count. Returns 0 if the number isn't 6-14 digits (optional '+')
+ */
+uint64_t phone_key(const char* phone, size_t len) {
+    if (len > 0 && phone[0] == '+') {
+        phone++;
+        len--;
+    }
+    if (len < 6 || len > 14) return 0;
+    uint64_t value = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (phone[i] < '0' || phone[i] > '9') return 0;
+        value = value * 10 + (uint64_t)(phone[i] - '0');
+    }
+    return value << 4 | len;
+}
+
+/**
+ * Index User
+ * Adds a user to the ID index and (if the phone is a valid number not
+ * yet indexed for the user's operator) to the phone index
+ */
+void index_user(User* user) {
+    int index = (int)(user - users);
+    sync_track(user);
+    cohort_join(user);
+    size_t slot = index_slot((uint64_t)user->user_id);
+    while (user_id_index[slot] != 0) slot = slot + 1 == USER_INDEX_SLOTS ? 0 : slot + 1;
+    user_id_index[slot] = index + 1;
+    tenants[user->tenant].users++;
+    mem_claim(MEM_USERS, sizeof(User) + sizeof(TapProfile));
+    mem_claim(MEM_INDEXES, sizeof(user_id_index[0]));
+    
+    uint64_t key = phone_key(user->phone, strlen(user->phone));
+    if (key == 0) return;
+    key |= (uint64_t)user->tenant << TENANT_KEY_SHIFT; // A number is unique per operator
+    slot = index_slot(key);
+    while (phone_index[slot].key != 0) {
+        if (phone_index[slot].key == key) return;   // First registration keeps the number
+        slot = slot + 1 == USER_INDEX_SLOTS ? 0 : slot + 1;
+    }
+    phone_index[slot].key = key;
+    phone_index[slot].user = index;
+    mem_claim(MEM_INDEXES, sizeof(phone_index[0]));
+}
+
+/**
+ * Find User by ID
+ * Looks the ID up in the user index; returns pointer to user or NULL if not found
+ */
+User* find_user(long long user_id) {
+    for (size_t slot = index_slot((uint64_t)user_id); user_id_index[slot] != 0;
+         slot = slot + 1 == USER_INDEX_SLOTS ? 0 : slot + 1) {
+        User* user = &users[user_id_index[slot] - 1];
+        if (user->user_id == user_id) {
+            return user;                // Return pointer to found user
+        }
+    }
+    return NULL;                        // User not found
+}
+
+/**
+ * Is this a record in users[]? Per-user side tables (tap profiles, sync
+ * digests) are indexed by user - users, so anything else must not reach them
+ */
+int user_in_table(const User* user) {
+    uintptr_t at = (uintptr_t)user, first = (uintptr_t)users;
+    return at >= first && at < (uintptr_t)(users + MAX_USERS) && (at - first) % sizeof(User) == 0;
+}
+
+/**
+ * Find User of the Active Operator
+ * Like find_user(), but another operator's customers are not found: what
+ * the kiosk menus use, so one operator's terminal never sees another's accounts
+ */
+User* tenant_user(long long user_id) {
+    User* user = find_user(user_id);
+    return user && user->tenant == active_tenant ? user : NULL;
+}
+
+/**
+ * Find User by Phone
+ * Returns the active operator's first user registered with this number, or NULL
+ */
+User* find_user_by_phone(const char* phone) {
+    uint64_t key = phone_key(phone, strlen(phone));
+    if (key == 0) return NULL;
+    key |= (uint64_t)active_tenant << TENANT_KEY_SHIFT;
+    for (size_t slot = index_slot(key); phone_index[slot].key != 0;
+         slot = slot + 1 == USER_INDEX_SLOTS ? 0 : slot + 1) {
+        if (phone_index[slot].key == key) return &users[phone_index[slot].user];
+    }
+    return NULL;
+}
+
+// =================== ID GENERATION ===================
+
+/*
+ * Snowflake-style IDs: [41-bit ms since ID_EPOCH_MS][10-bit kiosk][4-bit thread][8-bit sequence]
+ * Each thread owns its own sequence, so generating an ID never takes a lock
+ * and never touches memory shared with another thread. IDs from one thread are
+ * strictly increasing; IDs from one kiosk sort by creation millisecond, so they
+ * double as time-range keys for indexes. Threads beyond the first 15 share the
+ * last slot through a lock-free compare-and-swap instead of reusing a slot.
+ */
+#define ID_SHARED_SLOT ((1 << ID_THREAD_BITS) - 1)   // Slot shared by overflow threads
+static atomic_int id_thread_slots = 0;               // Hands out per-thread slot numbers
+static _Atomic long long id_shared_state = 0;        // Shared slot: (ms << ID_SEQUENCE_BITS) | sequence
+static _Thread_local int id_thread_slot = -1;         // This thread's slot (-1 = unassigned)
+static _Thread_local long long id_last_ms = -1;       // Millisecond of this thread's last ID
+static _Thread_local int id_sequence = 0;             // Sequence within id_last_ms
+
+/**
+ * Current Wall-Clock Time in Milliseconds (Unix epoch)
+ */
+long long wall_clock_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Current monotonic time in milliseconds (for deadlines and latency)
+ */
+static long long monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Current monotonic time in nanoseconds (for fine-grained latency)
+ */
+static long long monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Current Time in Milliseconds since the ID epoch
+ */
+static long long id_now_ms() {
+    return wall_clock_ms() - ID_EPOCH_MS;
+}
+
+/**
+ * Generate ID
+ * Returns the next unique, time-sortable ID for this kiosk and thread
+ */
+long long generate_id() {
+    // First call on this thread: claim a thread slot (the only shared write)
+    if (id_thread_slot < 0) {
+        id_thread_slot = atomic_fetch_add(&id_thread_slots, 1);
+        if (id_thread_slot > ID_SHARED_SLOT) id_thread_slot = ID_SHARED_SLOT;
+    }
+    
+    long long now = id_now_ms();
+    if (id_thread_slot == ID_SHARED_SLOT) {
+        // Shared slot: advance (ms, sequence) atomically; a full sequence carries into the next ms
+        long long old = atomic_load(&id_shared_state), next;
+        do {
+            next = now > (old >> ID_SEQUENCE_BITS) ? now << ID_SEQUENCE_BITS : old + 1;
+        } while (!atomic_compare_exchange_weak(&id_shared_state, &old, next));
+        now = next >> ID_SEQUENCE_BITS;
+        id_sequence = (int)(next & ((1 << ID_SEQUENCE_BITS) - 1));
+        return (now << (ID_KIOSK_BITS + ID_THREAD_BITS + ID_SEQUENCE_BITS)) |
+               ((long long)kiosk_id << (ID_THREAD_BITS + ID_SEQUENCE_BITS)) |
+               ((long long)ID_SHARED_SLOT << ID_SEQUENCE_BITS) |
+               id_sequence;
+    }
+    
+    if (now < id_last_ms) {
+        now = id_last_ms;                   // Clock stepped back: stay monotonic
+    }
+    
+    if (now == id_last_ms) {
+        id_sequence++;
+        if (id_sequence >= (1 << ID_SEQUENCE_BITS)) {
+            // Sequence exhausted for this millisecond: borrow the next one
+            now = id_last_ms + 1;
+            id_sequence = 0;
+        }
+    } else {
+        id_sequence = 0;
+    }
+    id_last_ms = now;
+    
+    return (now << (ID_KIOSK_BITS + ID_THREAD_BITS + ID_SEQUENCE_BITS)) |
+           ((long long)kiosk_id << (ID_THREAD_BITS + ID_SEQUENCE_BITS)) |
+           ((long long)id_thread_slot << ID_SEQUENCE_BITS) |
+           id_sequence;
+}
+
+/**
+ * Generate ID Block
+ * Reserves `count` IDs for this thread in one step (bulk imports): the
+ * block continues this thread's (millisecond, sequence) counter. A block
+ * longer than the rest of this millisecond runs into later ones, so this
+ * waits until the clock has reached the block's last millisecond: no ID is
+ * dated after the moment it is handed out (at 256 IDs per millisecond a
+ * 100,000-ID block waits about 0.4 s). id_block_nth() gives the n-th ID.
+ */
+long long generate_id_block(int count) {
+    long long first = generate_id();        // Claims the slot and syncs with the clock
+    if (count <= 1) return first;
+    
+    long long last_ms;
+    if (id_thread_slot == ID_SHARED_SLOT) {
+        // Shared slot state is (ms << ID_SEQUENCE_BITS) | sequence: adding carries into ms.
+        // Another thread may have taken IDs since generate_id(), so re-reserve past it.
+        long long start = atomic_fetch_add(&id_shared_state, count) + 1;
+        first = (start >> ID_SEQUENCE_BITS << (ID_KIOSK_BITS + ID_THREAD_BITS + ID_SEQUENCE_BITS)) |
+                ((long long)kiosk_id << (ID_THREAD_BITS + ID_SEQUENCE_BITS)) |
+                ((long long)ID_SHARED_SLOT << ID_SEQUENCE_BITS) |
+                (start & ((1 << ID_SEQUENCE_BITS) - 1));
+        last_ms = (start + count - 1) >> ID_SEQUENCE_BITS;
+    } else {
+        long long position = (id_last_ms << ID_SEQUENCE_BITS) + id_sequence + count - 1;
+        id_last_ms = position >> ID_SEQUENCE_BITS;
+        id_sequence = (int)(position & ((1 << ID_SEQUENCE_BITS) - 1));
+        last_ms = id_last_ms;
+    }
+    
+    // Let the clock catch up with the block instead of issuing future-dated IDs
+    while (id_now_ms() < last_ms) {
+        struct timespec pause = {0, 1000000L};
+        nanosleep(&pause, NULL);
+    }
+    return first;
+}
+
+/**
+ * n-th ID of a block from generate_id_block()
+ */
+long long id_block_nth(long long first, int n) {
+    const int ms_shift = ID_KIOSK_BITS + ID_THREAD_BITS + ID_SEQUENCE_BITS;
+    long long origin = first & (((1LL << (ID_KIOSK_BITS + ID_THREAD_BITS)) - 1) << ID_SEQUENCE_BITS);
+    long long position = ((first >> ms_shift) << ID_SEQUENCE_BITS) + (first & ((1 << ID_SEQUENCE_BITS) - 1)) + n;
+    return (position >> ID_SEQUENCE_BITS << ms_shift) | origin | (position & ((1 << ID_SEQUENCE_BITS) - 1));
+}
+
+/**
+ * ID Timestamp
+ * Recovers the creation time (seconds) encoded in a generated ID
+ */
+time_t id_timestamp(long long id) {
+    long long ms = (id >> (ID_KIOSK_BITS + ID_THREAD_BITS + ID_SEQUENCE_BITS)) + ID_EPOCH_MS;
+    return (time_t)(ms / 1000);
+}
+
+/**
+ * ID Kiosk
+ * Recovers the kiosk ID encoded in a generated ID
+ */
+int id_kiosk(long long id) {
+    return (int)((id >> (ID_THREAD_BITS + ID_SEQUENCE_BITS)) & ((1 << ID_KIOSK_BITS) - 1));
+}
+
+// =================== RECEIPT SPOOLER ===================
+
+/**
+ * Append to Receipt
+ * Formats onto the end of a RECEIPT_MAX_LEN buffer; once it is full the
+ * rest is cut off (len never runs past the buffer)
+ */
+void receipt_append(char* receipt, int* len, const char* format, ...) {
+    if (*len >= RECEIPT_MAX_LEN - 1) return;
+    va_list args;
+    va_start(args, format);
+    int added = vsnprintf(receipt + *len, RECEIPT_MAX_LEN - *len, format, args);
+    va_end(args);
+    if (added > 0) *len = *len + added < RECEIPT_MAX_LEN - 1 ? *len + added : RECEIPT_MAX_LEN - 1;
+}
+
+/**
+ * Spool Receipt
+ * Copies a rendered receipt into the printer queue and returns immediately.
+ * If the queue is full (printer jammed for a long time) the receipt is
+ * dropped and counted - the customer already has it on screen.
+ * Returns 1 if queued, 0 if dropped or no printer is configured.
+ */
+int spool_receipt(const char* text) {
+    pthread_mutex_lock(&spooler.lock);
+    if (!spooler.running) {
+        pthread_mutex_unlock(&spooler.lock);
+        return 0;
+    }
+    if (spooler.count >= RECEIPT_QUEUE_SIZE) {
+        spooler.dropped++;
+        pthread_mutex_unlock(&spooler.lock);
+        return 0;
+    }
+    int slot = (spooler.head + spooler.count) % RECEIPT_QUEUE_SIZE;
+    strncpy(spooler.queue[slot], text, RECEIPT_MAX_LEN - 1);
+    spooler.queue[slot][RECEIPT_MAX_LEN - 1] = '\0';
+    spooler.count++;
+    mem_claim(MEM_BUFFERS, RECEIPT_MAX_LEN);
+    pthread_cond_signal(&spooler.wake);
+    pthread_mutex_unlock(&spooler.lock);
+    return 1;
+}
+
+/**
+ * Printer Reports Paper Out
+ * Thermal printers on a file/pty stand-in signal "out of paper" through a
+ * "<device>.paperout" marker file; real devices report it as ENOSPC/EIO.
+ */
+static int printer_paper_out(const char* device) {
+    char marker[300];
+    snprintf(marker, sizeof(marker), "%s.paperout", device);
+    return access(marker, F_OK) == 0;
+}
+
+/**
+ * Send Receipt to Printer
+ * Returns 1 when the whole receipt reached the device, 0 to retry later
+ */
+static int printer_write(const char* device, const char* text) {
+    if (printer_paper_out(device)) return 0;
+    
+    int fd = open(device, O_WRONLY | O_APPEND | O_CREAT | O_NOCTTY, 0644);
+    if (fd < 0) return 0;                   // Printer unplugged or offline
+    
+    size_t len = strlen(text);
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, text + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;                          // ENOSPC/EIO: out of paper or jammed
+        }
+        done += n;
+    }
+    close(fd);
+    return done == len;
+}
+
+/**
+ * Sleep for a number of milliseconds
+ */
+static void sleep_ms(int ms) {
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * Receipt Spooler Thread
+ * Prints queued receipts in order. A failed print keeps the receipt at the
+ * head of the queue and retries with exponential backoff, so a printer that
+ * runs out of paper resumes with the right receipt once it is refilled.
+ */
+static void* receipt_spooler_main(void* arg) {
+    (void)arg;
+    char text[RECEIPT_MAX_LEN];
+    int backoff_ms = RECEIPT_RETRY_MS;
+    
+    pthread_mutex_lock(&spooler.lock);
+    while (1) {
+        while (spooler.count == 0 && spooler.running) {
+            pthread_cond_wait(&spooler.wake, &spooler.lock);
+        }
+        if (spooler.count == 0) break;      // Stopped and drained
+        
+        // Print outside the lock so sales can keep queueing
+        strcpy(text, spooler.queue[spooler.head]);
+        pthread_mutex_unlock(&spooler.lock);
+        int ok = printer_write(spooler.device, text);
+        pthread_mutex_lock(&spooler.lock);
+        
+        if (ok) {
+            spooler.head = (spooler.head + 1) % RECEIPT_QUEUE_SIZE;
+            spooler.count--;
+            spooler.printed++;
+            mem_release(MEM_BUFFERS, RECEIPT_MAX_LEN);
+            spooler.paper_out = 0;
+            backoff_ms = RECEIPT_RETRY_MS;
+        } else {
+            spooler.retries++;
+            spooler.paper_out = 1;
+            if (!spooler.running) break;    // Shutting down: give up on the rest
+            pthread_mutex_unlock(&spooler.lock);
+            sleep_ms(backoff_ms);
+            pthread_mutex_lock(&spooler.lock);
+            backoff_ms *= 2;
+            if (backoff_ms > RECEIPT_MAX_RETRY_MS) backoff_ms = RECEIPT_MAX_RETRY_MS;
+        }
+    }
+    pthread_mutex_unlock(&spooler.lock);
+    return NULL;
+}
+
+/**
+ * Start Receipt Spooler
+ * Launches the printer thread for a device path (printer, file or pty)
+ */
+void receipt_spooler_start(const char* device) {
+    strncpy(spooler.device, device, sizeof(spooler.device) - 1);
+    spooler.running = 1;
+    if (pthread_create(&spooler.thread, NULL, receipt_spooler_main, NULL) != 0) {
+        spooler.running = 0;
+        printf("Warning: receipt printer disabled (could not start spooler)\n");
+    }
+}
+
+/**
+ * Stop Receipt Spooler
+ * Lets the thread finish the queue; receipts that still fail are abandoned
+ */
+void receipt_spooler_stop() {
+    pthread_mutex_lock(&spooler.lock);
+    if (!spooler.running) {
+        pthread_mutex_unlock(&spooler.lock);
+        return;
+    }
+    spooler.running = 0;
+    pthread_cond_signal(&spooler.wake);
+    pthread_mutex_unlock(&spooler.lock);
+    pthread_join(spooler.thread, NULL);
+}
+
+// =================== PAYMENT GATEWAY CLIENT ===================
+
+/*
+ * UPI payments go to an external gateway that takes hundreds of milliseconds
+ * to seconds to answer. The client keeps a small pool of persistent
+ * connections and pipelines many requests on each one; a single event-loop
+ * thread matches responses to requests, enforces deadlines and sends one
+ * hedged duplicate (same idempotency key, different connection) when an
+ * answer is slow. Sockets are non-blocking and only the event loop
+ * reconnects, so nothing waits on the network while holding the client lock.
+ * A payment that times out may still be charged by the gateway, so the loop
+ * sends CANCEL for it until the gateway confirms it voided or refunded the
+ * charge. Wire format, one line each way:
+ *   PAY <request_id> <slot> <user_id> <amount>
+ *   RESULT <request_id> <slot> <OK|DECLINED> <reference>
+ *   CANCEL <request_id>
+ *   CANCELLED <request_id> <VOID|REVERSED>
+ */
+
+/**
+ * Open a non-blocking TCP connection to the gateway (host must be an IPv4
+ * address), waiting at most PAYMENT_CONNECT_MS. Never called with the lock held.
+ */
+static int gateway_connect(const char* host, int port) {
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) return -1;
+    
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        if (errno != EINPROGRESS || poll(&pfd, 1, PAYMENT_CONNECT_MS) != 1 ||
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0 || err != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // Small pipelined lines
+    return fd;
+}
+
+/**
+ * Write one line on a pool connection without blocking (caller holds the client lock)
+ * Returns 1 on success; a connection that cannot take the whole line is
+ * closed (a partial line would corrupt the stream) and left to the event loop
+ */
+static int gateway_write(int conn, const char* line, int len) {
+    if (payments.fds[conn] < 0) return 0;
+    if (send(payments.fds[conn], line, len, MSG_NOSIGNAL) != len) {
+        close(payments.fds[conn]);
+        payments.fds[conn] = -1;
+        payments.rlen[conn] = 0;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Send one request line on a pool connection (caller holds the client lock)
+ * Returns 1 on success
+ */
+static int gateway_send(int conn, PaymentRequest* req) {
+    char line[128];
+    int len = snprintf(line, sizeof(line), "PAY %lld %d %lld %.2f\n",
+                       req->request_id, (int)(req - payments.slots), req->user_id, req->amount);
+    if (!gateway_write(conn, line, len)) return 0;
+    req->sent_on = conn;
+    return 1;
+}
+
+/**
+ * Ask the gateway to void (or refund) a timed-out payment on any live
+ * connection (caller holds the client lock). Returns 1 if the line went out.
+ */
+static int gateway_cancel(long long request_id, int conn) {
+    char line[64];
+    int len = snprintf(line, sizeof(line), "CANCEL %lld\n", request_id);
+    for (int i = 0; i < PAYMENT_POOL_SIZE; i++) {
+        if (gateway_write((conn + i) % PAYMENT_POOL_SIZE, line, len)) return 1;
+    }
+    return 0;
+}
+
+/**
+ * Remember a timed-out payment until the gateway confirms its cancel
+ * (caller holds the client lock)
+ */
+static void payment_void(PaymentRequest* req) {
+    for (int v = 0; v < PAYMENT_VOID_SLOTS; v++) {
+        if (payments.voids[v] == 0) {
+            payments.voids[v] = req->request_id;
+            mem_claim(MEM_SERVICES, sizeof(payments.voids[v]));
+            gateway_cancel(req->request_id, req->sent_on);
+            return;
+        }
+    }
+    payments.voids_lost++;                  // Admin must reconcile this one by hand
+}
+
+/**
+ * Handle one response line from the gateway (caller holds the client lock)
+ * Stale answers (request already finished or its slot reused) are ignored
+ */
+static void gateway_handle_line(char* line) {
+    long long request_id;
+    int slot;
+    char outcome[16], reference[24];
+    if (sscanf(line, "CANCELLED %lld %15s", &request_id, outcome) == 2) {
+        for (int v = 0; v < PAYMENT_VOID_SLOTS; v++) {
+            if (payments.voids[v] != request_id) continue;
+            payments.voids[v] = 0;
+            mem_release(MEM_SERVICES, sizeof(payments.voids[v]));
+            if (strcmp(outcome, "REVERSED") == 0) payments.reversals++;
+        }
+        return;
+    }
+    if (sscanf(line, "RESULT %lld %d %15s %23s", &request_id, &slot, outcome, reference) != 4) return;
+    if (slot < 0 || slot >= PAYMENT_MAX_INFLIGHT) return;
+    
+    PaymentRequest* req = &payments.slots[slot];
+    if (!req->in_use || req->request_id != request_id || req->status != PAY_PENDING) return;
+    
+    req->status = strcmp(outcome, "OK") == 0 ? PAY_APPROVED : PAY_DECLINED;
+    strcpy(req->reference, reference);
+    if (req->status == PAY_APPROVED) payments.approved++; else payments.declined++;
+    payments.inflight--;
+    pthread_cond_broadcast(&payments.done);
+}
+
+/**
+ * Payment Event Loop
+ * Reads responses from every pool connection and fires hedges and timeouts
+ */
+static void* payment_loop_main(void* arg) {
+    (void)arg;
+    struct pollfd pfds[PAYMENT_POOL_SIZE + 1];
+    
+    pthread_mutex_lock(&payments.lock);
+    while (payments.running) {
+        // Reopen one dropped connection per tick, without holding the lock
+        for (int i = 0; i < PAYMENT_POOL_SIZE; i++) {
+            if (payments.fds[i] >= 0) continue;
+            pthread_mutex_unlock(&payments.lock);
+            int fd = gateway_connect(payments.host, payments.port);
+            pthread_mutex_lock(&payments.lock);
+            if (fd >= 0) {
+                payments.fds[i] = fd;
+                payments.rlen[i] = 0;
+                payments.reconnects++;
+            }
+            break;
+        }
+        
+        // Poll the wake pipe plus every open connection
+        pfds[0].fd = payments.wake_pipe[0];
+        pfds[0].events = POLLIN;
+        for (int i = 0; i < PAYMENT_POOL_SIZE; i++) {
+            pfds[i + 1].fd = payments.fds[i];  // Negative fds are skipped by poll()
+            pfds[i + 1].events = POLLIN;
+        }
+        pthread_mutex_unlock(&payments.lock);
+        poll(pfds, PAYMENT_POOL_SIZE + 1, PAYMENT_TICK_MS);
+        pthread_mutex_lock(&payments.lock);
+        
+        if (pfds[0].revents & POLLIN) {
+            char drain[64];
+            while (read(payments.wake_pipe[0], drain, sizeof(drain)) > 0) { }
+        }
+        
+        // Responses
+        for (int i = 0; i < PAYMENT_POOL_SIZE; i++) {
+            if (!(pfds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) || payments.fds[i] < 0) continue;
+            char* buf = payments.rbuf[i];
+            ssize_t n = read(payments.fds[i], buf + payments.rlen[i], PAYMENT_RBUF_SIZE - 1 - payments.rlen[i]);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+            if (n <= 0) {
+                close(payments.fds[i]);         // Gateway dropped us: hedges cover the requests
+                payments.fds[i] = -1;
+                payments.rlen[i] = 0;
+                continue;
+            }
+            payments.rlen[i] += n;
+            buf[payments.rlen[i]] = '\0';
+            
+            char* start = buf;
+            char* nl;
+            while ((nl = strchr(start, '\n')) != NULL) {
+                *nl = '\0';
+                gateway_handle_line(start);
+                start = nl + 1;
+            }
+            payments.rlen[i] -= (start - buf);
+            memmove(buf, start, payments.rlen[i]);
+        }
+        
+        // Deadlines and hedges
+        long long now = monotonic_ms();
+        for (int s = 0; s < PAYMENT_MAX_INFLIGHT; s++) {
+            PaymentRequest* req = &payments.slots[s];
+            if (!req->in_use || req->status != PAY_PENDING) continue;
+            if (now >= req->deadline_ms) {
+                // The gateway may still charge it: the sale is off, so cancel it there too
+                req->status = PAY_TIMEOUT;
+                payments.timeouts++;
+                payments.inflight--;
+                payment_void(req);
+                pthread_cond_broadcast(&payments.done);
+            } else if (now >= req->hedge_ms && req->attempts < PAYMENT_MAX_ATTEMPTS) {
+                // Slow answer: duplicate on the next connection, same idempotency key
+                int conn = (req->sent_on + 1) % PAYMENT_POOL_SIZE;
+                if (gateway_send(conn, req)) {
+                    payments.hedges++;
+                    req->attempts++;
+                }
+                req->hedge_ms = now + payments.hedge_after_ms;
+            }
+        }
+        
+        // Resend cancels the gateway has not confirmed yet
+        if (now >= payments.void_retry_ms) {
+            for (int v = 0; v < PAYMENT_VOID_SLOTS; v++) {
+                if (payments.voids[v] != 0) gateway_cancel(payments.voids[v], v);
+            }
+            payments.void_retry_ms = now + payments.hedge_after_ms;
+        }
+    }
+    pthread_mutex_unlock(&payments.lock);
+    return NULL;
+}
+
+/**
+ * Close every pool connection
+ */
+static void payment_client_close() {
+    for (int i = 0; i < PAYMENT_POOL_SIZE; i++) {
+        if (payments.fds[i] >= 0) close(payments.fds[i]);
+        payments.fds[i] = -1;
+        payments.rlen[i] = 0;
+    }
+}
+
+/**
+ * Start Payment Client
+ * Connects the pool to a gateway and starts the event-loop thread
+ * Returns 1 on success
+ */
+int payment_client_start(const char* host, int port) {
+    if (payments.running) return 1;
+    
+    strncpy(payments.host, host, sizeof(payments.host) - 1);
+    payments.port = port;
+    payments.timeout_ms = PAYMENT_TIMEOUT_MS;
+    payments.hedge_after_ms = PAYMENT_HEDGE_MS;
+    for (int i = 0; i < PAYMENT_POOL_SIZE; i++) {
+        payments.fds[i] = gateway_connect(host, port);
+        if (payments.fds[i] < 0) {
+            printf("Warning: payment gateway %s:%d unreachable\n", host, port);
+            payment_client_close();
+            return 0;
+        }
+    }
+    if (pipe(payments.wake_pipe) != 0) {
+        payment_client_close();
+        return 0;
+    }
+    fcntl(payments.wake_pipe[0], F_SETFL, O_NONBLOCK);
+    
+    payments.running = 1;
+    if (pthread_create(&payments.thread, NULL, payment_loop_main, NULL) != 0) {
+        payments.running = 0;
+        payment_client_close();
+        close(payments.wake_pipe[0]);
+        close(payments.wake_pipe[1]);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Stop Payment Client
+ * Pending requests and unconfirmed cancels are left to the gateway's
+ * idempotency handling
+ */
+void payment_client_stop() {
+    if (!payments.running) return;
+    pthread_mutex_lock(&payments.lock);
+    payments.running = 0;
+    pthread_mutex_unlock(&payments.lock);
+    if (write(payments.wake_pipe[1], "x", 1) < 0) { }
+    pthread_join(payments.thread, NULL);
+    payment_client_close();
+    close(payments.wake_pipe[0]);
+    close(payments.wake_pipe[1]);
+}
+
+/**
+ * Submit Payment
+ * Sends a charge request and returns immediately with a handle,
+ * or -1 if the kiosk already has PAYMENT_MAX_INFLIGHT requests outstanding
+ */
+int payment_submit(long long user_id, double amount) {
+    pthread_mutex_lock(&payments.lock);
+    int slot = -1;
+    for (int s = 0; s < PAYMENT_MAX_INFLIGHT; s++) {
+        int candidate = (payments.next_slot + s) % PAYMENT_MAX_INFLIGHT;
+        if (!payments.slots[candidate].in_use) {
+            slot = candidate;
+            break;
+        }
+    }
+    if (slot < 0 || !payments.running) {
+        pthread_mutex_unlock(&payments.lock);
+        return -1;
+    }
+    payments.next_slot = (slot + 1) % PAYMENT_MAX_INFLIGHT;
+    
+    PaymentRequest* req = &payments.slots[slot];
+    memset(req, 0, sizeof(*req));
+    req->in_use = 1;
+    mem_claim(MEM_SERVICES, sizeof(*req));
+    req->request_id = generate_id();         // Idempotency key shared by hedges
+    req->user_id = user_id;
+    req->amount = amount;
+    req->status = PAY_PENDING;
+    req->submitted_ms = monotonic_ms();
+    req->deadline_ms = req->submitted_ms + payments.timeout_ms;
+    req->hedge_ms = req->submitted_ms + payments.hedge_after_ms;
+    req->attempts = 1;
+    
+    // Round-robin across the pool; a dead connection falls through to the next
+    // (if none is up, the hedge timer resends once the event loop reconnects)
+    int conn = slot % PAYMENT_POOL_SIZE;
+    for (int i = 0; i < PAYMENT_POOL_SIZE && !gateway_send((conn + i) % PAYMENT_POOL_SIZE, req); i++) { }
+    
+    payments.submitted++;
+    payments.inflight++;
+    if (payments.inflight > payments.peak_inflight) {
+        payments.peak_inflight = payments.inflight;
+    }
+    pthread_mutex_unlock(&payments.lock);
+    return slot;
+}
+
+/**
+ * Wait for Payment
+ * Blocks until the request is approved, declined or timed out, frees the
+ * handle and returns the status. The gateway reference is copied out if given.
+ */
+int payment_wait(int handle, char* reference) {
+    pthread_mutex_lock(&payments.lock);
+    PaymentRequest* req = &payments.slots[handle];
+    while (req->status == PAY_PENDING) {
+        pthread_cond_wait(&payments.done, &payments.lock);
+    }
+    int status = req->status;
+    if (reference) strcpy(reference, req->reference);
+    req->in_use = 0;
+    mem_release(MEM_SERVICES, sizeof(*req));
+    pthread_mutex_unlock(&payments.lock);
+    return status;
+}
+
+// =================== MOCK PAYMENT GATEWAY ===================
+
+/*
+ * Bundled stand-in for a UPI gateway: answers each PAY line after a random
+ * latency around mock_gateway.latency_ms (with a slow tail), declines a
+ * configurable fraction, and remembers outcomes by request ID so hedged
+ * duplicates are never charged twice. CANCEL refunds an approved charge or,
+ * if the PAY has not arrived yet, records the ID as declined.
+ */
+
+/**
+ * Find (or claim) the idempotency table entry for a request ID
+ * (caller holds the mock gateway lock). Sets *is_new for a claimed entry.
+ */
+static unsigned int mock_gateway_entry(long long request_id, int* is_new) {
+    unsigned int h = (unsigned int)((request_id * 0x9E3779B97F4A7C15ULL) >> 52) % MOCK_IDEMPOTENCY_SLOTS;
+    while (mock_gateway.seen_ids[h] != 0 && mock_gateway.seen_ids[h] != request_id) {
+        h = (h + 1) % MOCK_IDEMPOTENCY_SLOTS;
+    }
+    *is_new = mock_gateway.seen_ids[h] == 0;
+    if (*is_new) {
+        // Table is reset when it gets too full
+        if (++mock_gateway.seen_count > MOCK_IDEMPOTENCY_SLOTS / 2) {
+            mem_release(MEM_SERVICES, (size_t)(mock_gateway.seen_count - 1) * (sizeof(long long) + 1));
+            memset(mock_gateway.seen_ids, 0, sizeof(mock_gateway.seen_ids));
+            mock_gateway.seen_count = 1;
+            h = (unsigned int)((request_id * 0x9E3779B97F4A7C15ULL) >> 52) % MOCK_IDEMPOTENCY_SLOTS;
+        }
+        mock_gateway.seen_ids[h] = request_id;
+        mem_claim(MEM_SERVICES, sizeof(long long) + 1); // ID and outcome
+    }
+    return h;
+}
+
+/**
+ * Decide (once per request ID) whether the mock gateway approves a charge
+ */
+static int mock_gateway_outcome(long long request_id, unsigned int* seed) {
+    pthread_mutex_lock(&mock_gateway.lock);
+    int is_new;
+    unsigned int h = mock_gateway_entry(request_id, &is_new);
+    if (is_new) {
+        mock_gateway.seen_ok[h] = (rand_r(seed) / (double)RAND_MAX) >= mock_gateway.failure_rate;
+    } else {
+        mock_gateway.duplicates++;
+    }
+    int ok = mock_gateway.seen_ok[h];
+    pthread_mutex_unlock(&mock_gateway.lock);
+    return ok;
+}
+
+/**
+ * Cancel a request at the mock gateway
+ * Returns 1 if an approved charge was refunded, 0 if there was nothing to refund
+ */
+static int mock_gateway_cancel(long long request_id) {
+    pthread_mutex_lock(&mock_gateway.lock);
+    int is_new;
+    unsigned int h = mock_gateway_entry(request_id, &is_new);
+    int reversed = !is_new && mock_gateway.seen_ok[h];
+    mock_gateway.seen_ok[h] = 0;            // Any later copy of the PAY is declined
+    if (reversed) mock_gateway.reversals++;
+    pthread_mutex_unlock(&mock_gateway.lock);
+    return reversed;
+}
+
+/**
+ * Mock Gateway Connection Thread
+ * Accepts pipelined requests and answers each when its latency has elapsed
+ */
+static void* mock_gateway_conn_main(void* arg) {
+    int fd = (int)(intptr_t)arg;
+    unsigned int seed = (unsigned int)fd * 2654435761u ^ (unsigned int)time(NULL);
+    struct { long long due_ms; char line[96]; } pending[MOCK_MAX_PENDING];
+    int pending_count = 0;
+    char buf[PAYMENT_RBUF_SIZE];
+    int len = 0;
+    
+    while (1) {
+        // Sleep until the next answer is due or a new request arrives
+        long long now = monotonic_ms();
+        int wait_ms = -1;
+        for (int i = 0; i < pending_count; i++) {
+            int left = (int)(pending[i].due_ms - now);
+            if (left < 0) left = 0;
+            if (wait_ms < 0 || left < wait_ms) wait_ms = left;
+        }
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, wait_ms) > 0) {
+            ssize_t n = read(fd, buf + len, sizeof(buf) - 1 - len);
+            if (n <= 0) break;
+            len += n;
+            buf[len] = '\0';
+            
+            char* start = buf;
+            char* nl;
+            while ((nl = strchr(start, '\n')) != NULL && pending_count < MOCK_MAX_PENDING) {
+                *nl = '\0';
+                long long request_id, user_id;
+                int slot;
+                double amount;
+                if (sscanf(start, "CANCEL %lld", &request_id) == 1) {
+                    char reply[64];
+                    int reply_len = snprintf(reply, sizeof(reply), "CANCELLED %lld %s\n", request_id,
+                                             mock_gateway_cancel(request_id) ? "REVERSED" : "VOID");
+                    if (write(fd, reply, reply_len) < 0) { }
+                } else if (sscanf(start, "PAY %lld %d %lld %lf", &request_id, &slot, &user_id, &amount) == 4) {
+                    int ok = mock_gateway_outcome(request_id, &seed);
+                    double jitter = 0.5 + rand_r(&seed) / (double)RAND_MAX;
+                    if (rand_r(&seed) % 100 < MOCK_SLOW_TAIL_PERCENT) jitter *= 5; // Straggler
+                    pending[pending_count].due_ms = monotonic_ms() + (long long)(mock_gateway.latency_ms * jitter);
+                    snprintf(pending[pending_count].line, sizeof(pending[0].line),
+                             "RESULT %lld %d %s UPI%lld\n", request_id, slot, ok ? "OK" : "DECLINED",
+                             request_id % 1000000000LL);
+                    pending_count++;
+                }
+                start = nl + 1;
+            }
+            len -= (start - buf);
+            memmove(buf, start, len);
+        }
+        
+        // Send every answer that is due (out of order is fine: slots match them up)
+        now = monotonic_ms();
+        for (int i = 0; i < pending_count; ) {
+            if (pending[i].due_ms <= now) {
+                if (write(fd, pending[i].line, strlen(pending[i].line)) < 0) { }
+                pending[i] = pending[--pending_count];
+            } else {
+                i++;
+            }
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+/**
+ * Mock Gateway Accept Thread
+ */
+static void* mock_gateway_accept_main(void* arg) {
+    (void)arg;
+    while (1) {
+        int fd = accept(mock_gateway.listen_fd, NULL, NULL);
+        if (fd < 0) break;
+        pthread_t conn_thread;
+        if (pthread_create(&conn_thread, NULL, mock_gateway_conn_main, (void*)(intptr_t)fd) == 0) {
+            pthread_detach(conn_thread);
+        } else {
+            close(fd);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Start Mock Gateway
+ * Listens on 127.0.0.1 (ephemeral port) and returns the port, or -1
+ * Only one mock runs per process: later calls return the same port
+ */
+int mock_gateway_start(int latency_ms, double failure_rate) {
+    if (mock_gateway.port > 0) return mock_gateway.port;   // Already listening
+    mock_gateway.latency_ms = latency_ms;
+    mock_gateway.failure_rate = failure_rate;
+    
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t addr_len = sizeof(addr);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0 ||
+        getsockname(fd, (struct sockaddr*)&addr, &addr_len) != 0) {
+        close(fd);
+        return -1;
+    }
+    mock_gateway.listen_fd = fd;
+    pthread_t accept_thread;
+    if (pthread_create(&accept_thread, NULL, mock_gateway_accept_main, NULL) != 0) {
+        close(fd);
+        return -1;
+    }
+    pthread_detach(accept_thread);
+    mock_gateway.port = ntohs(addr.sin_port);
+    return mock_gateway.port;
+}
+
+/**
+ * Connect Payment Client on First Use
+ * Uses WATER_ATM_UPI_GATEWAY (ip:port) or, if unset, the bundled mock gateway
+ * configured by WATER_ATM_MOCK_LATENCY_MS and WATER_ATM_MOCK_FAILURE_RATE
+ */
+int payment_client_ensure() {
+    if (payments.running) return 1;
+    
+    char* gateway_env = getenv("WATER_ATM_UPI_GATEWAY");
+    if (gateway_env) {
+        char host[64];
+        int port;
+        if (sscanf(gateway_env, "%63[^:]:%d", host, &port) != 2) {
+            printf("Invalid WATER_ATM_UPI_GATEWAY (expected ip:port)\n");
+            return 0;
+        }
+        return payment_client_start(host, port);
+    }
+    
+    char* latency_env = getenv("WATER_ATM_MOCK_LATENCY_MS");
+    char* failure_env = getenv("WATER_ATM_MOCK_FAILURE_RATE");
+    int port = mock_gateway_start(latency_env ? atoi(latency_env) : MOCK_DEFAULT_LATENCY_MS,
+                                  failure_env ? atof(failure_env) : MOCK_DEFAULT_FAILURE_RATE);
+    return port > 0 && payment_client_start("127.0.0.1", port);
+}
+
+// =================== PAYMENT GATEWAY BENCHMARK ===================
+
+static long long bench_latencies[PAYMENT_BENCH_MAX];   // Per-purchase latency (ms)
+static atomic_int bench_next = 0;                      // Next purchase to run
+static int bench_total = 0;
+
+/**
+ * Benchmark Worker - one customer at a time: submit, wait, repeat
+ */
+static void* payment_bench_worker(void* arg) {
+    (void)arg;
+    int i;
+    while ((i = atomic_fetch_add(&bench_next, 1)) < bench_total) {
+        long long start = monotonic_ms();
+        int handle;
+        while ((handle = payment_submit(i + 1, 10.0)) < 0) {
+            sleep_ms(1);                        // Kiosk at its in-flight limit
+        }
+        payment_wait(handle, NULL);
+        bench_latencies[i] = monotonic_ms() - start;
+    }
+    return NULL;
+}
+
+static int compare_long_long(const void* a, const void* b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Payment Gateway Benchmark
+ * Runs purchases against the mock gateway with increasing numbers of
+ * concurrent customers and reports throughput, latency and how many
+ * payments the kiosk kept in flight at once
+ */
+void payment_gateway_benchmark() {
+    if (!payment_client_ensure()) {
+        printf("Payment gateway unavailable\n");
+        return;
+    }
+    int concurrency_levels[] = {1, 16, 64, 256, PAYMENT_MAX_INFLIGHT * 2};
+    
+    printf("\n=== PAYMENT GATEWAY BENCHMARK ===\n");
+    printf("Pool: %d connections, in-flight limit: %d, mock latency: %d ms, failure rate: %.0f%%\n",
+           PAYMENT_POOL_SIZE, PAYMENT_MAX_INFLIGHT, mock_gateway.latency_ms, mock_gateway.failure_rate * 100);
+    printf("%-10s %-10s %-12s %-10s %-10s %-10s %-8s %-8s\n",
+           "Customers", "Payments", "Payments/s", "p50 (ms)", "p99 (ms)", "Peak", "Hedges", "Timeouts");
+    
+    for (size_t level = 0; level < sizeof(concurrency_levels) / sizeof(concurrency_levels[0]); level++) {
+        int customers = concurrency_levels[level];
+        if (customers > PAYMENT_MAX_INFLIGHT * 2) continue;
+        bench_total = customers * 8 < PAYMENT_BENCH_MAX ? customers * 8 : PAYMENT_BENCH_MAX;
+        atomic_store(&bench_next, 0);
+        
+        pthread_mutex_lock(&payments.lock);
+        payments.peak_inflight = payments.inflight;
+        int hedges_before = payments.hedges, timeouts_before = payments.timeouts;
+        pthread_mutex_unlock(&payments.lock);
+        
+        pthread_t workers[PAYMENT_MAX_INFLIGHT * 2];
+        long long start = monotonic_ms();
+        for (int w = 0; w < customers; w++) pthread_create(&workers[w], NULL, payment_bench_worker, NULL);
+        for (int w = 0; w < customers; w++) pthread_join(workers[w], NULL);
+        long long elapsed = monotonic_ms() - start;
+        
+        qsort(bench_latencies, bench_total, sizeof(long long), compare_long_long);
+        printf("%-10d %-10d %-12.0f %-10lld %-10lld %-10d %-8d %-8d\n",
+               customers, bench_total, bench_total * 1000.0 / (elapsed > 0 ? elapsed : 1),
+               bench_latencies[bench_total / 2], bench_latencies[bench_total * 99 / 100],
+               payments.peak_inflight, payments.hedges - hedges_before, payments.timeouts - timeouts_before);
+    }
+    printf("Approved: %d, Declined: %d, Reconnects: %d, Duplicate charges avoided: %d, Late charges refunded: %d\n",
+           payments.approved, payments.declined, payments.reconnects, mock_gateway.duplicates, payments.reversals);
+}
+
+// =================== TELEMETRY STORE ===================
+
+/*
+ * Sensor readings are stored Gorilla-style in fixed-size blocks: timestamps
+ * as delta-of-delta with variable-length prefixes, values as the XOR with the
+ * previous value, writing only the meaningful bits. A block keeps min/max/sum
+ * so range scans skip blocks by time and downsampling can use a whole block's
+ * summary without decoding it. Blocks are recycled oldest-first.
+ */
+
+/**
+ * Append the low `nbits` of `value` to a block's bit stream
+ */
+static void bits_write(TelemetryBlock* block, uint64_t value, int nbits) {
+    if (nbits == 0) return;
+    if (nbits < 64) value &= (1ULL << nbits) - 1;
+    int word = block->bit_len >> 6;
+    int used = block->bit_len & 63;
+    int room = 64 - used;
+    if (nbits <= room) {
+        block->bits[word] |= value << (room - nbits);
+    } else {
+        block->bits[word] |= value >> (nbits - room);
+        block->bits[word + 1] |= value << (64 - (nbits - room));
+    }
+    block->bit_len += nbits;
+}
+
+/**
+ * Read `nbits` from a block's bit stream at *pos, advancing *pos
+ */
+static uint64_t bits_read(const TelemetryBlock* block, int* pos, int nbits) {
+    if (nbits == 0) return 0;
+    int word = *pos >> 6;
+    int used = *pos & 63;
+    int room = 64 - used;
+    uint64_t value;
+    if (nbits <= room) {
+        value = block->bits[word] >> (room - nbits);
+    } else {
+        value = (block->bits[word] << (nbits - room)) | (block->bits[word + 1] >> (64 - (nbits - room)));
+    }
+    *pos += nbits;
+    return nbits < 64 ? value & ((1ULL << nbits) - 1) : value;
+}
+
+static uint64_t double_bits(double v) { uint64_t b; memcpy(&b, &v, sizeof(b)); return b; }
+static double bits_double(uint64_t b) { double v; memcpy(&v, &b, sizeof(v)); return v; }
+
+// Everything in a block except its bit stream (summary and encoder state)
+#define TELEMETRY_HEADER_BYTES ((long long)offsetof(TelemetryBlock, bits))
+
+/**
+ * Encode one value as XOR against the previous one
+ */
+static void telemetry_encode_value(TelemetryBlock* block, double value) {
+    uint64_t bits = double_bits(value);
+    uint64_t xor = bits ^ block->prev_bits;
+    block->prev_bits = bits;
+    
+    if (xor == 0) {
+        bits_write(block, 0, 1);                // Same value: one bit
+        return;
+    }
+    int leading = __builtin_clzll(xor);
+    int trailing = __builtin_ctzll(xor);
+    if (leading > 31) leading = 31;             // Leading count fits in 5 bits
+    
+    if (block->prev_leading >= 0 && leading >= block->prev_leading && trailing >= block->prev_trailing) {
+        // Fits inside the previous meaningful window: reuse it
+        int length = 64 - block->prev_leading - block->prev_trailing;
+        bits_write(block, 2, 2);                // '10'
+        bits_write(block, xor >> block->prev_trailing, length);
+    } else {
+        int length = 64 - leading - trailing;
+        bits_write(block, 3, 2);                // '11'
+        bits_write(block, leading, 5);
+        bits_write(block, length - 1, 6);       // 1..64 stored as 0..63
+        bits_write(block, xor >> trailing, length);
+        block->prev_leading = leading;
+        block->prev_trailing = trailing;
+    }
+}
+
+/**
+ * Encode one timestamp as the delta of the previous delta
+ */
+static void telemetry_encode_timestamp(TelemetryBlock* block, long long ts_ms) {
+    long long delta = ts_ms - block->prev_ts;
+    long long dod = delta - block->prev_delta;
+    block->prev_ts = ts_ms;
+    block->prev_delta = delta;
+    
+    if (dod == 0) {
+        bits_write(block, 0, 1);                            // '0'
+    } else if (dod >= -64 && dod <= 63) {
+        bits_write(block, 2, 2);  bits_write(block, dod, 7);     // '10'
+    } else if (dod >= -256 && dod <= 255) {
+        bits_write(block, 6, 3);  bits_write(block, dod, 9);     // '110'
+    } else if (dod >= -2048 && dod <= 2047) {
+        bits_write(block, 14, 4); bits_write(block, dod, 12);    // '1110'
+    } else {
+        bits_write(block, 15, 4); bits_write(block, dod, 32);    // '1111' (caller keeps it in 32 bits)
+    }
+}
+
+/**
+ * Sign-extend an n-bit two's complement field
+ */
+static long long sign_extend(uint64_t value, int nbits) {
+    uint64_t sign = 1ULL << (nbits - 1);
+    return (long long)((value ^ sign) - sign);
+}
+
+/**
+ * Allocate a fresh block for a series, recycling the oldest sealed block
+ * Caller holds the store lock
+ */
+static TelemetryBlock* telemetry_new_block(int series, long long ts_ms, double value) {
+    int index = -1;
+    for (int tries = 0; tries < TELEMETRY_MAX_BLOCKS; tries++) {
+        int candidate = telemetry.next_block;
+        telemetry.next_block = (telemetry.next_block + 1) % TELEMETRY_MAX_BLOCKS;
+        int is_open = 0;
+        for (int s = 0; s < TELEMETRY_SERIES; s++) {
+            if (telemetry.open_block[s] == candidate) is_open = 1;
+        }
+        if (!is_open) {
+            index = candidate;
+            break;
+        }
+    }
+    
+    TelemetryBlock* block = &telemetry.blocks[index];
+    if (block->count > 0) {
+        telemetry.points -= block->count;       // Oldest readings age out
+        telemetry.bytes -= TELEMETRY_HEADER_BYTES + (block->bit_len + 7) / 8;
+        mem_release(MEM_SKETCHES, sizeof(*block));
+    }
+    mem_claim(MEM_SKETCHES, sizeof(*block));
+    telemetry.bytes += TELEMETRY_HEADER_BYTES;
+    memset(block, 0, sizeof(*block));
+    block->series = series;
+    block->start_ms = block->end_ms = block->prev_ts = ts_ms;
+    block->first_value = value;
+    block->prev_bits = double_bits(value);
+    block->prev_leading = -1;
+    block->min = block->max = block->sum = value;
+    block->count = 1;
+    telemetry.open_block[series] = index;
+    return block;
+}
+
+/**
+ * Append Telemetry Reading
+ * Readings for a series must arrive in time order
+ */
+void telemetry_append(int series, long long ts_ms, double value) {
+    pthread_mutex_lock(&telemetry.lock);
+    int index = telemetry.open_block[series];
+    TelemetryBlock* block = index >= 0 ? &telemetry.blocks[index] : NULL;
+    
+    // Worst case per point is 36 timestamp bits + 77 value bits; a gap whose
+    // delta-of-delta does not fit the 32-bit field starts a new block instead
+    long long dod = block ? (ts_ms - block->prev_ts) - block->prev_delta : 0;
+    if (!block || block->bit_len + 113 > TELEMETRY_BLOCK_WORDS * 64 || ts_ms < block->end_ms ||
+        dod < INT32_MIN || dod > INT32_MAX) {
+        telemetry_new_block(series, ts_ms, value);
+    } else {
+        int before = block->bit_len;
+        telemetry_encode_timestamp(block, ts_ms);
+        telemetry_encode_value(block, value);
+        telemetry.bytes += (block->bit_len + 7) / 8 - (before + 7) / 8;
+        block->end_ms = ts_ms;
+        block->count++;
+        block->sum += value;
+        if (value < block->min) block->min = value;
+        if (value > block->max) block->max = value;
+    }
+    telemetry.points++;
+    pthread_mutex_unlock(&telemetry.lock);
+}
+
+/**
+ * Decode a block, calling visit() for each reading inside [from_ms, to_ms)
+ */
+static int telemetry_decode_block(const TelemetryBlock* block, long long from_ms, long long to_ms,
+                                  void (*visit)(long long, double, void*), void* ctx) {
+    int visited = 0;
+    long long ts = block->start_ms, delta = 0;
+    uint64_t bits = double_bits(block->first_value);
+    int leading = 0, trailing = 0;
+    int pos = 0;
+    
+    for (int i = 0; i < block->count; i++) {
+        if (i > 0) {
+            // Timestamp
+            long long dod;
+            if (bits_read(block, &pos, 1) == 0)      dod = 0;
+            else if (bits_read(block, &pos, 1) == 0) dod = sign_extend(bits_read(block, &pos, 7), 7);
+            else if (bits_read(block, &pos, 1) == 0) dod = sign_extend(bits_read(block, &pos, 9), 9);
+            else if (bits_read(block, &pos, 1) == 0) dod = sign_extend(bits_read(block, &pos, 12), 12);
+            else                                     dod = sign_extend(bits_read(block, &pos, 32), 32);
+            delta += dod;
+            ts += delta;
+            
+            // Value
+            if (bits_read(block, &pos, 1) == 1) {
+                if (bits_read(block, &pos, 1) == 1) {
+                    leading = (int)bits_read(block, &pos, 5);
+                    int length = (int)bits_read(block, &pos, 6) + 1;
+                    trailing = 64 - leading - length;
+                }
+                int length = 64 - leading - trailing;
+                bits ^= bits_read(block, &pos, length) << trailing;
+            }
+        }
+        if (ts >= to_ms) break;
+        if (ts >= from_ms) {
+            visit(ts, bits_double(bits), ctx);
+            visited++;
+        }
+    }
+    return visited;
+}
+
+/**
+ * Scan Telemetry Range
+ * Visits every reading of a series in [from_ms, to_ms) in time order and
+ * returns how many were visited. Blocks outside the range are never decoded.
+ */
+int telemetry_scan(int series, long long from_ms, long long to_ms,
+                   void (*visit)(long long ts_ms, double value, void* ctx), void* ctx) {
+    int visited = 0;
+    pthread_mutex_lock(&telemetry.lock);
+    // Blocks are allocated round-robin, so walking from next_block is oldest-first
+    for (int i = 0; i < TELEMETRY_MAX_BLOCKS; i++) {
+        const TelemetryBlock* block = &telemetry.blocks[(telemetry.next_block + i) % TELEMETRY_MAX_BLOCKS];
+        if (block->count == 0 || block->series != series) continue;
+        if (block->end_ms < from_ms || block->start_ms >= to_ms) continue;
+        visited += telemetry_decode_block(block, from_ms, to_ms, visit, ctx);
+    }
+    pthread_mutex_unlock(&telemetry.lock);
+    return visited;
+}
+
+/**
+ * Add one reading to the matching downsampling bucket
+ */
+typedef struct {
+    long long from_ms, bucket_ms;
+    TelemetryBucket* buckets;
+    int bucket_count;
+} DownsampleContext;
+
+static void downsample_visit(long long ts_ms, double value, void* arg) {
+    DownsampleContext* ctx = arg;
+    int b = (int)((ts_ms - ctx->from_ms) / ctx->bucket_ms);
+    if (b < 0 || b >= ctx->bucket_count) return;
+    TelemetryBucket* bucket = &ctx->buckets[b];
+    if (bucket->count == 0 || value < bucket->min) bucket->min = value;
+    if (bucket->count == 0 || value > bucket->max) bucket->max = value;
+    bucket->sum += value;
+    bucket->count++;
+}
+
+/**
+ * Downsample Telemetry
+ * Fills fixed-width buckets (min/max/sum/count) over [from_ms, to_ms) and
+ * returns the number of buckets (0 for an empty range or bucket_ms <= 0).
+ * A block that falls entirely inside one bucket and inside the range
+ * contributes its stored summary without being decoded.
+ */
+int telemetry_downsample(int series, long long from_ms, long long to_ms, long long bucket_ms,
+                         TelemetryBucket* buckets, int max_buckets) {
+    if (bucket_ms <= 0 || to_ms <= from_ms) return 0;
+    int bucket_count = (int)((to_ms - from_ms + bucket_ms - 1) / bucket_ms);
+    if (bucket_count > max_buckets) bucket_count = max_buckets;
+    for (int b = 0; b < bucket_count; b++) {
+        memset(&buckets[b], 0, sizeof(buckets[b]));
+        buckets[b].start_ms = from_ms + b * bucket_ms;
+    }
+    DownsampleContext ctx = {from_ms, bucket_ms, buckets, bucket_count};
+    
+    pthread_mutex_lock(&telemetry.lock);
+    for (int i = 0; i < TELEMETRY_MAX_BLOCKS; i++) {
+        const TelemetryBlock* block = &telemetry.blocks[(telemetry.next_block + i) % TELEMETRY_MAX_BLOCKS];
+        if (block->count == 0 || block->series != series) continue;
+        if (block->end_ms < from_ms || block->start_ms >= to_ms) continue;
+        
+        int first = (int)((block->start_ms - from_ms) / bucket_ms);
+        int last = (int)((block->end_ms - from_ms) / bucket_ms);
+        if (block->start_ms >= from_ms && block->end_ms < to_ms && first == last && first < bucket_count) {
+            TelemetryBucket* bucket = &buckets[first];
+            if (bucket->count == 0 || block->min < bucket->min) bucket->min = block->min;
+            if (bucket->count == 0 || block->max > bucket->max) bucket->max = block->max;
+            bucket->sum += block->sum;
+            bucket->count += block->count;
+        } else {
+            telemetry_decode_block(block, from_ms, to_ms, downsample_visit, &ctx);
+        }
+    }
+    pthread_mutex_unlock(&telemetry.lock);
+    return bucket_count;
+}
+
+// =================== SENSOR SIMULATOR ===================
+
+/**
+ * Simulate Kiosk Sensors
+ * Generates flow-meter, tank-level and pump-current readings at `hz` for
+ * `seconds`, starting at start_ms: the kiosk is mostly idle with a sale
+ * every minute or so. Readings are quantised to sensor resolution.
+ * Returns the liters dispensed.
+ */
+double telemetry_simulate(long long start_ms, int seconds, int hz, unsigned int seed) {
+    double tank = TANK_CAPACITY_LITERS;
+    double dispensed = 0.0;
+    double remaining = 0.0;                     // Liters left in the current dispense
+    long long step_ms = 1000 / hz;
+    
+    for (long long t = 0; t < (long long)seconds * hz; t++) {
+        long long ts = start_ms + t * step_ms + (rand_r(&seed) % 50 == 0 ? 1 : 0); // Clock jitter
+        
+        if (remaining <= 0 && rand_r(&seed) % (60 * hz) == 0) {
+            remaining = 1 + rand_r(&seed) % 20;  // New customer: 1-20 liters
+        }
+        double flow = 0.0, current = 0.0;
+        if (remaining > 0) {
+            flow = round((NOZZLE_FLOW_LPM + (rand_r(&seed) % 3 - 1) * 0.1) * 10) / 10;
+            current = PUMP_CURRENT_AMPS;
+            double step = flow / 60.0 / hz;
+            if (step > remaining) step = remaining;
+            remaining -= step;
+            tank -= step;
+            dispensed += step;
+        }
+        telemetry_append(SENSOR_FLOW_RATE, ts, flow);
+        telemetry_append(SENSOR_TANK_LEVEL, ts, round(tank * 10) / 10);
+        telemetry_append(SENSOR_PUMP_CURRENT, ts, current);
+    }
+    return dispensed;
+}
+
+// =================== TELEMETRY BENCHMARK ===================
+
+static void count_visit(long long ts_ms, double value, void* ctx) {
+    (void)ts_ms;
+    *(double*)ctx += value;
+}
+
+/**
+ * Telemetry Benchmark
+ * Simulates an hour of 10 Hz sensor data and reports compression and
+ * append, scan and downsampling speed
+ */
+void telemetry_benchmark() {
+    long long start_ms = wall_clock_ms();
+    int seconds = 3600, hz = 10;
+    
+    long long t0 = monotonic_ms();
+    telemetry_simulate(start_ms, seconds, hz, 42);
+    long long append_ms = monotonic_ms() - t0;
+    
+    double sum = 0.0;
+    t0 = monotonic_ms();
+    int scanned = 0;
+    for (int s = 0; s < TELEMETRY_SERIES; s++) {
+        scanned += telemetry_scan(s, start_ms, start_ms + seconds * 1000LL, count_visit, &sum);
+    }
+    long long scan_ms = monotonic_ms() - t0;
+    
+    TelemetryBucket buckets[60];
+    t0 = monotonic_ms();
+    telemetry_downsample(SENSOR_TANK_LEVEL, start_ms, start_ms + seconds * 1000LL, 60000, buckets, 60);
+    long long downsample_ms = monotonic_ms() - t0;
+    
+    printf("\n=== TELEMETRY BENCHMARK ===\n");
+    printf("Points stored: %lld (%d sensors, %d Hz, %d s)\n", telemetry.points, TELEMETRY_SERIES, hz, seconds);
+    printf("Compressed size: %lld bytes (%.2f bytes/point, raw 16 bytes/point)\n",
+           telemetry.bytes, telemetry.bytes / (double)telemetry.points);
+    printf("Append: %lld ms (%.0f points/s)\n", append_ms, telemetry.points * 1000.0 / (append_ms > 0 ? append_ms : 1));
+    printf("Full scan: %d points in %lld ms\n", scanned, scan_ms);
+    printf("Tank level per minute (60 buckets): %lld ms, last bucket avg %.1f L\n",
+           downsample_ms, buckets[59].count ? buckets[59].sum / buckets[59].count : 0.0);
+}
+
+// =================== DISPENSE RECONCILIATION ===================
+
+/*
+ * Streaming join of sold liters (from save_transaction) against metered
+ * liters (flow-meter readings), per kiosk, in tumbling event-time windows.
+ * Each sale is spread over the windows its dispense should take at the
+ * nominal nozzle flow rate. The flow meter reports continuously, so its
+ * latest timestamp minus an allowed lateness is the kiosk's watermark; once a
+ * window falls behind the watermark it is closed and its drift
+ * (metered - expected) joins a short horizon of recent windows. Sustained
+ * drift over the horizon raises an alert. State per kiosk is a fixed ring of
+ * open windows plus the horizon, so memory never grows with traffic.
+ */
+
+/**
+ * Find the reconciliation state for a kiosk, claiming a free slot if `claim`
+ * is set; NULL if not found or the table is full
+ * Caller holds the reconciler lock
+ */
+static KioskReconciler* reconciler_for(int kiosk, int claim) {
+    for (int i = 0; i < RECON_MAX_KIOSKS; i++) {
+        KioskReconciler* k = &reconciler.kiosks[(kiosk + i) % RECON_MAX_KIOSKS];
+        if (k->in_use && k->kiosk_id == kiosk) return k;
+        if (!k->in_use) {
+            if (!claim) return NULL;
+            memset(k, 0, sizeof(*k));
+            k->in_use = 1;
+            k->kiosk_id = kiosk;
+            k->next_close_ms = -1;              // Set by the first flow reading
+            reconciler.active_kiosks++;
+            return k;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Open window covering a timestamp, or NULL if it is already closed (late)
+ */
+static ReconWindow* recon_window(KioskReconciler* k, long long ts_ms) {
+    if (k->next_close_ms < 0 || ts_ms < k->next_close_ms) return NULL;
+    long long start = ts_ms - ts_ms % RECON_WINDOW_MS;
+    long long last_open = k->next_close_ms + (RECON_OPEN_WINDOWS - 1) * RECON_WINDOW_MS;
+    if (start > last_open) start = last_open;   // Too far ahead: fold into newest window
+    ReconWindow* w = &k->open[(start / RECON_WINDOW_MS) % RECON_OPEN_WINDOWS];
+    if (w->start_ms != start) {
+        w->start_ms = start;
+        w->expected = w->metered = 0.0;
+    }
+    return w;
+}
+
+/**
+ * Close every window behind the watermark and re-check the drift horizon
+ */
+static void recon_advance(KioskReconciler* k, long long watermark_ms) {
+    while (k->next_close_ms + RECON_WINDOW_MS <= watermark_ms) {
+        ReconWindow* w = &k->open[(k->next_close_ms / RECON_WINDOW_MS) % RECON_OPEN_WINDOWS];
+        double expected = 0.0, metered = 0.0;
+        if (w->start_ms == k->next_close_ms) {
+            expected = w->expected;
+            metered = w->metered;
+        }
+        w->start_ms = -1;                       // Slot free for a future window
+        k->next_close_ms += RECON_WINDOW_MS;
+        
+        // Slide the horizon
+        k->horizon_expected[k->horizon_pos] = expected;
+        k->horizon_metered[k->horizon_pos] = metered;
+        k->horizon_pos = (k->horizon_pos + 1) % RECON_HORIZON_WINDOWS;
+        k->windows_closed++;
+        
+        double sold = 0.0, flowed = 0.0;
+        for (int i = 0; i < RECON_HORIZON_WINDOWS; i++) {
+            sold += k->horizon_expected[i];
+            flowed += k->horizon_metered[i];
+        }
+        k->drift_liters = flowed - sold;
+        double tolerance = RECON_TOLERANCE_LITERS + sold * RECON_TOLERANCE_PERCENT / 100.0;
+        // Hysteresis: raise above the tolerance, clear only below half of it
+        int drifting = k->drifting ? fabs(k->drift_liters) > tolerance / 2
+                                   : fabs(k->drift_liters) > tolerance;
+        if (k->windows_closed < RECON_HORIZON_WINDOWS) drifting = 0; // Horizon not full yet
+        
+        if (drifting && !k->drifting) {
+            k->alerts++;
+            time_t at = (time_t)(k->next_close_ms / 1000);
+            char when[16];
+            strftime(when, sizeof(when), "%H:%M:%S", localtime(&at));
+            printf("[RECONCILE] %s kiosk %d: %s - metered %.1f L vs sold %.1f L over last %d min\n",
+                   when, k->kiosk_id,
+                   k->drift_liters > 0 ? "water leaving without sales (leak/theft?)"
+                                       : "customers short-dispensed (valve/meter fault?)",
+                   flowed, sold, RECON_HORIZON_WINDOWS * RECON_WINDOW_MS / 60000);
+        }
+        k->drifting = drifting;
+    }
+}
+
+/**
+ * Reconcile Sale
+ * Spreads the sold liters over the windows its dispense should occupy
+ */
+void reconcile_sale(int kiosk, long long ts_ms, double liters) {
+    pthread_mutex_lock(&reconciler.lock);
+    KioskReconciler* k = reconciler_for(kiosk, 0);
+    if (!k || k->next_close_ms < 0) {
+        // No flow meter reporting for this kiosk: nothing to reconcile against
+        reconciler.unmetered_sales++;
+        pthread_mutex_unlock(&reconciler.lock);
+        return;
+    }
+    k->total_sold += liters;
+    
+    // A refund (negative liters) takes back what its sale spread out
+    double sign = liters < 0 ? -1.0 : 1.0;
+    double remaining = fabs(liters);
+    long long t = ts_ms;
+    while (remaining > 1e-9) {
+        long long window_end = t - t % RECON_WINDOW_MS + RECON_WINDOW_MS;
+        double in_window = (window_end - t) / 60000.0 * NOZZLE_FLOW_LPM;
+        if (in_window > remaining) in_window = remaining;
+        ReconWindow* w = recon_window(k, t);
+        if (w) {
+            w->expected += sign * in_window;
+        } else {
+            // Late sale: its window already closed, charge it to the newest horizon entry
+            int newest = (k->horizon_pos + RECON_HORIZON_WINDOWS - 1) % RECON_HORIZON_WINDOWS;
+            k->horizon_expected[newest] += sign * in_window;
+            k->late_events++;
+        }
+        remaining -= in_window;
+        t = window_end;
+    }
+    pthread_mutex_unlock(&reconciler.lock);
+}
+
+/**
+ * Reconcile Flow Reading
+ * Integrates the flow rate since the previous reading into the metered
+ * liters of its window and advances the kiosk's watermark
+ */
+void reconcile_flow(int kiosk, long long ts_ms, double flow_lpm) {
+    pthread_mutex_lock(&reconciler.lock);
+    KioskReconciler* k = reconciler_for(kiosk, 1);
+    if (!k) {
+        pthread_mutex_unlock(&reconciler.lock);
+        return;
+    }
+    if (k->next_close_ms < 0) {
+        k->next_close_ms = ts_ms - ts_ms % RECON_WINDOW_MS;
+        for (int i = 0; i < RECON_OPEN_WINDOWS; i++) k->open[i].start_ms = -1;
+    }
+    
+    // Trapezoid-free integration: previous rate held until this reading
+    long long gap = ts_ms - k->last_flow_ms;
+    if (k->last_flow_ms > 0 && gap > 0 && gap <= RECON_MAX_GAP_MS) {
+        double liters = k->last_flow_lpm * gap / 60000.0;
+        ReconWindow* w = recon_window(k, ts_ms);
+        if (w) {
+            w->metered += liters;
+        } else {
+            k->late_events++;
+        }
+        k->total_metered += liters;
+    }
+    if (ts_ms > k->last_flow_ms) {
+        k->last_flow_ms = ts_ms;
+        k->last_flow_lpm = flow_lpm;
+        recon_advance(k, ts_ms - RECON_LATENESS_MS);
+    }
+    pthread_mutex_unlock(&reconciler.lock);
+}
+
+/**
+ * Simulate Reconciliation
+ * Runs several kiosks for an hour of 10 Hz flow readings with sales
+ * arriving a few seconds late. Kiosk 2 leaks, kiosk 3 has unpaid dispenses
+ * and kiosk 4 under-delivers by 15%; kiosk 1 is healthy.
+ */
+void reconcile_simulate() {
+    const int kiosks = 4, hz = 10, seconds = 3600;
+    long long start_ms = wall_clock_ms();
+    unsigned int seed = 2024;
+    double remaining[4] = {0}, dispense_scale[4] = {1.0, 1.0, 1.0, 0.85};
+    struct { long long due_ms; int kiosk; long long ts_ms; double liters; } delayed[64];
+    int delayed_count = 0;
+    
+    printf("\n=== DISPENSE RECONCILIATION SIMULATION ===\n");
+    printf("%d kiosks, %d Hz flow meters, %d min, %d s windows, %d s lateness\n",
+           kiosks, hz, seconds / 60, RECON_WINDOW_MS / 1000, RECON_LATENESS_MS / 1000);
+    
+    for (long long tick = 0; tick < (long long)seconds * hz; tick++) {
+        long long now = start_ms + tick * (1000 / hz);
+        
+        for (int k = 0; k < kiosks; k++) {
+            int kiosk = k + 1;
+            if (remaining[k] <= 0 && rand_r(&seed) % (60 * hz) == 0) {
+                double liters = 1 + rand_r(&seed) % 20;
+                remaining[k] = liters * dispense_scale[k];
+                if (delayed_count < 64) {
+                    // Sale record reaches the reconciler 0-3 s after dispensing starts
+                    delayed[delayed_count].due_ms = now + rand_r(&seed) % 3000;
+                    delayed[delayed_count].kiosk = kiosk;
+                    delayed[delayed_count].ts_ms = now;
+                    delayed[delayed_count].liters = liters;
+                    delayed_count++;
+                }
+            }
+            if (kiosk == 3 && remaining[k] <= 0 && rand_r(&seed) % (600 * hz) == 0) {
+                remaining[k] = 10;                  // Unpaid dispense: flow with no sale
+            }
+            
+            double flow = 0.0;
+            if (remaining[k] > 0) {
+                flow = round((NOZZLE_FLOW_LPM + (rand_r(&seed) % 3 - 1) * 0.1) * 10) / 10;
+                remaining[k] -= flow / 60.0 / hz;
+            } else if (kiosk == 2) {
+                flow = 1.0;                         // Slow leak while idle
+            }
+            reconcile_flow(kiosk, now, flow);
+        }
+        
+        for (int i = 0; i < delayed_count; ) {
+            if (delayed[i].due_ms <= now) {
+                reconcile_sale(delayed[i].kiosk, delayed[i].ts_ms, delayed[i].liters);
+                delayed[i] = delayed[--delayed_count];
+            } else {
+                i++;
+            }
+        }
+    }
+    reconcile_report();
+    printf("Reconciler state: %zu bytes for %d kiosks (fixed)\n", sizeof(reconciler), RECON_MAX_KIOSKS);
+}
+
+/**
+ * Reconciliation Report - per-kiosk totals and current drift
+ */
+void reconcile_report() {
+    pthread_mutex_lock(&reconciler.lock);
+    printf("%-7s %-10s %-12s %-14s %-8s %-6s %s\n",
+           "Kiosk", "Sold (L)", "Metered (L)", "Drift now (L)", "Alerts", "Late", "Status");
+    for (int i = 0; i < RECON_MAX_KIOSKS; i++) {
+        KioskReconciler* k = &reconciler.kiosks[i];
+        if (!k->in_use) continue;
+        printf("%-7d %-10.1f %-12.1f %-14.1f %-8d %-6d %s\n",
+               k->kiosk_id, k->total_sold, k->total_metered, k->drift_liters,
+               k->alerts, k->late_events, k->drifting ? "DRIFTING" : "OK");
+    }
+    pthread_mutex_unlock(&reconciler.lock);
+}
+
+// =================== RFID/NFC CARD TAP ===================
+
+/*
+ * Tap-to-dispense: a card UID resolves through an open-addressing hash index
+ * straight to a user, whose tap profile (pass validity, eligibility mask and
+ * wallet) is kept pre-computed and refreshed whenever the user's account
+ * changes. A tap therefore costs one hash probe plus the normal wallet sale,
+ * with no prompts and no search of the user table.
+ */
+
+/**
+ * Hash slot for a card UID (Fibonacci hashing)
+ */
+static int card_slot(uint64_t uid) {
+    return (int)((uid * 0x9E3779B97F4A7C15ULL) >> (64 - CARD_INDEX_BITS));
+}
+
+/**
+ * Find Card
+ * Returns the index entry for a card UID or NULL if the card is not linked
+ */
+CardEntry* find_card(uint64_t uid) {
+    int slot = card_slot(uid);
+    while (card_index[slot].uid != 0) {
+        if (card_index[slot].uid == uid) return &card_index[slot];
+        slot = (slot + 1) & (CARD_INDEX_SLOTS - 1);
+    }
+    return NULL;
+}
+
+/**
+ * Refresh Tap Profile
+ * Re-resolves a user's pass validity and eligibility after any account change
+ */
+void tap_profile_refresh(User* user) {
+    if (!user_in_table(user)) return;           // A scratch copy has no profile
+    TapProfile* profile = &tap_profiles[user - users];
+    profile->user = user;
+    profile->wallet = &user->wallet_balance;
+    profile->pass_valid_until = is_pass_valid(user) ? user->pass_expiry : 0;
+    profile->eligibility = 0;
+    if (user->is_student) profile->eligibility |= TAP_ELIG_STUDENT;
+    if (user->total_spent >= tenants[user->tenant].loyalty_threshold) profile->eligibility |= TAP_ELIG_LOYALTY;
+    if (user->loyalty_points >= 100) profile->eligibility |= TAP_ELIG_POINTS;
+    if (profile->pass_valid_until) profile->eligibility |= TAP_ELIG_PASS;
+}
+
+/**
+ * Link Card to User
+ * Maps a card UID to a user (relinking a card moves it to the new user)
+ * Returns 1 on success, 0 if the UID is invalid or the index is full
+ */
+int link_card(uint64_t uid, User* user) {
+    if (uid == 0) return 0;                     // 0 marks an empty slot
+    CardEntry* entry = find_card(uid);
+    if (!entry) {
+        if (card_count >= CARD_INDEX_SLOTS / 2) return 0; // Keep probes short
+        int slot = card_slot(uid);
+        while (card_index[slot].uid != 0) slot = (slot + 1) & (CARD_INDEX_SLOTS - 1);
+        entry = &card_index[slot];
+        entry->uid = uid;
+        card_count++;
+        mem_claim(MEM_INDEXES, sizeof(*entry));
+    }
+    entry->user_index = (int)(user - users);
+    tap_profile_refresh(user);
+    return 1;
+}
+
+/**
+ * Link Card (menu)
+ * Asks for a user ID and the card UID printed on / read from the card
+ */
+void link_card_menu() {
+    long long user_id;
+    char uid_text[32];
+    
+    printf("\n=== LINK RFID/NFC CARD ===\n");
+    printf("Enter User ID: ");
+    scanf("%lld", &user_id);
+    
+    User* user = tenant_user(user_id);
+    if (!user) {
+        printf("User not found!\n");
+        return;
+    }
+    
+    printf("Enter card UID (hex): ");
+    scanf("%31s", uid_text);
+    uint64_t uid = strtoull(uid_text, NULL, 16);
+    
+    if (!link_card(uid, user)) {
+        printf("Invalid card UID or card index full!\n");
+        return;
+    }
+    printf("Card %llX linked to %s. Tap to buy %.0f liters.\n",
+           (unsigned long long)uid, user->name, (double)TAP_DEFAULT_LITERS);
+}
+
+/**
+ * Tap to Dispense
+ * Authorizes and records a wallet sale for a tapped card. Accounts with a
+ * PIN need a live kiosk session (the PIN entered at the screen).
+ * Returns 1 if the sale completed
+ */
+int tap_dispense(uint64_t uid, double liters, int show_output) {
+    long long start_ns = monotonic_ns();
+    CardEntry* entry = find_card(uid);
+    if (!entry) {
+        tap_stats.unknown++;
+        if (show_output) printf("Card %llX not recognised\n", (unsigned long long)uid);
+        return 0;
+    }
+    TapProfile* profile = &tap_profiles[entry->user_index];
+    User* user = profile->user;
+    if (user->tenant != active_tenant) {        // Another operator's card
+        tap_stats.unknown++;
+        if (show_output) printf("Card %llX not recognised\n", (unsigned long long)uid);
+        return 0;
+    }
+    
+    // A card alone can't spend a PIN-protected wallet: its owner must have a session at the screen
+    if (user->has_pin && !session_check(kiosk_session, user->user_id)) {
+        tap_stats.declined++;
+        if (show_output) printf("%s: PIN-protected wallet - enter your PIN at the screen first\n", user->name);
+        return 0;
+    }
+    
+    // Pass holders skip the fee; everyone else must at least cover the base price
+    if (!(profile->eligibility & TAP_ELIG_PASS) && *profile->wallet <= 0) {
+        tap_stats.declined++;
+        if (show_output) printf("%s: wallet empty - please top up\n", user->name);
+        return 0;
+    }
+    
+    int ok = process_purchase(user, liters, 2, NULL, 0);
+    
+    long long elapsed_ns = monotonic_ns() - start_ns;
+    if (ok) tap_stats.authorized++; else tap_stats.declined++;
+    tap_stats.timed++;
+    tap_stats.total_ns += elapsed_ns;
+    if (elapsed_ns > tap_stats.max_ns) tap_stats.max_ns = elapsed_ns;
+    
+    if (show_output) {
+        if (ok) {
+            printf("%s: %.1f L authorized in %.3f ms, wallet ₹%.2f%s\n", user->name, liters,
+                   elapsed_ns / 1e6, *profile->wallet, (profile->eligibility & TAP_ELIG_PASS) ? " (pass)" : "");
+        } else {
+            printf("%s: declined (insufficient wallet balance ₹%.2f)\n", user->name, *profile->wallet);
+        }
+    }
+    if (ok && kiosk_nozzles.nozzles > 0) nozzle_assign(liters, show_output); // Tapped sales queue too
+    return ok;
+}
+
+/**
+ * Tap Mode
+ * Reads taps from the card reader stream (WATER_ATM_CARD_READER: device,
+ * FIFO or file; stdin if unset). Each line is "<uid-hex> [liters]"; a bare
+ * UID dispenses TAP_DEFAULT_LITERS. "q" or end of stream leaves tap mode.
+ */
+void tap_mode() {
+    char* reader_path = getenv("WATER_ATM_CARD_READER");
+    FILE* reader = reader_path ? fopen(reader_path, "r") : stdin;
+    if (!reader) {
+        printf("Cannot open card reader %s\n", reader_path);
+        return;
+    }
+    
+    printf("\n=== TAP-TO-DISPENSE ===\n");
+    printf("Tap card (UID [liters]), 'q' to finish%s\n", reader_path ? " - reading from card reader" : "");
+    
+    char line[64];
+    while (fgets(line, sizeof(line), reader)) {
+        char uid_text[32];
+        double liters = TAP_DEFAULT_LITERS;
+        if (line[0] == 'q') break;
+        if (sscanf(line, "%31s %lf", uid_text, &liters) < 1) continue;
+        if (liters <= 0) continue;
+        tap_dispense(strtoull(uid_text, NULL, 16), liters, 1);
+    }
+    if (reader != stdin) fclose(reader);
+    
+    if (tap_stats.timed > 0) {
+        printf("Taps authorized: %d, declined: %d, unknown cards: %d, avg %.3f ms, max %.3f ms\n",
+               tap_stats.authorized, tap_stats.declined, tap_stats.unknown,
+               tap_stats.total_ns / 1e6 / tap_stats.timed, tap_stats.max_ns / 1e6);
+    }
+}
+
+/**
+ * Tap Benchmark
+ * Registers synthetic card holders and measures end-to-end tap authorization
+ */
+void tap_benchmark() {
+    int holders = MAX_USERS / 2;
+    unsigned int seed = 99;
+    for (int i = 0; i < holders && user_count < MAX_USERS; i++) {
+        User* user = &users[user_count++];
+        memset(user, 0, sizeof(*user));
+        user->user_id = generate_id();
+        index_user(user);
+        snprintf(user->name, sizeof(user->name), "Card Holder %d", i + 1);
+        user->is_student = i % 3 == 0;
+        user->wallet_balance = 1000.0;
+        link_card(0x04000000000000ULL + (uint64_t)rand_r(&seed) * 7919 + i, user);
+    }
+    
+    int taps = TXN_SALE_SLOTS - transaction_count;
+    seed = 99;
+    uint64_t uids[MAX_USERS / 2];
+    for (int i = 0; i < holders; i++) uids[i] = 0x04000000000000ULL + (uint64_t)rand_r(&seed) * 7919 + i;
+    
+    long long start = monotonic_ns();
+    for (int i = 0; i < taps; i++) {
+        tap_dispense(uids[i % holders], TAP_DEFAULT_LITERS, 0);
+    }
+    long long elapsed = monotonic_ns() - start;
+    
+    printf("\n=== TAP-TO-DISPENSE BENCHMARK ===\n");
+    printf("Card holders: %d, taps: %d (authorized %d, declined %d)\n",
+           holders, taps, tap_stats.authorized, tap_stats.declined);
+    printf("Average tap: %.2f µs, worst tap: %.2f µs, throughput %.0f taps/s\n",
+           elapsed / 1000.0 / taps, tap_stats.max_ns / 1000.0, taps * 1e9 / elapsed);
+}
+
+// =================== SHA-256 / HMAC ===================
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256_init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/**
+ * SHA-256 compression of one 64-byte block into state h
+ */
+static void sha256_compress(uint32_t h[8], const uint8_t block[64]) {
+    uint32_t w[64];
+    for (int t = 0; t < 16; t++) {
+        w[t] = (uint32_t)block[4 * t] << 24 | (uint32_t)block[4 * t + 1] << 16 |
+               (uint32_t)block[4 * t + 2] << 8 | block[4 * t + 3];
+    }
+    for (int t = 16; t < 64; t++) {
+        uint32_t s0 = ROTR32(w[t - 15], 7) ^ ROTR32(w[t - 15], 18) ^ (w[t - 15] >> 3);
+        uint32_t s1 = ROTR32(w[t - 2], 17) ^ ROTR32(w[t - 2], 19) ^ (w[t - 2] >> 10);
+        w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+    for (int t = 0; t < 64; t++) {
+        uint32_t t1 = hh + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[t] + w[t];
+        uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        hh = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+}
+
+/**
+ * Finish a hash: absorb `data` (after `prefix_len` bytes already compressed
+ * into h), pad, and write the 32-byte digest
+ */
+static void sha256_finish(uint32_t h[8], size_t prefix_len, const uint8_t* data, size_t len, uint8_t out[32]) {
+    uint8_t block[64];
+    size_t total = prefix_len + len;
+    while (len >= 64) {
+        sha256_compress(h, data);
+        data += 64;
+        len -= 64;
+    }
+    memset(block, 0, sizeof(block));
+    memcpy(block, data, len);
+    block[len] = 0x80;
+    if (len >= 56) {
+        sha256_compress(h, block);
+        memset(block, 0, sizeof(block));
+    }
+    uint64_t bits = (uint64_t)total * 8;
+    for (int i = 0; i < 8; i++) block[63 - i] = (uint8_t)(bits >> (8 * i));
+    sha256_compress(h, block);
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = h[i] >> 24; out[4 * i + 1] = h[i] >> 16; out[4 * i + 2] = h[i] >> 8; out[4 * i + 3] = h[i];
+    }
+}
+
+/**
+ * SHA-256 of a buffer
+ */
+void sha256(const uint8_t* data, size_t len, uint8_t out[32]) {
+    uint32_t h[8];
+    memcpy(h, sha256_init, sizeof(h));
+    sha256_finish(h, 0, data, len, out);
+}
+
+/**
+ * Precompute HMAC inner/outer midstates for a key, so every HMAC afterwards
+ * skips the two key blocks
+ */
+void hmac_sha256_init(HmacKey* key, const uint8_t* secret, size_t secret_len) {
+    uint8_t k[64] = {0}, pad[64];
+    if (secret_len > 64) sha256(secret, secret_len, k); else memcpy(k, secret, secret_len);
+    
+    memcpy(key->inner, sha256_init, sizeof(key->inner));
+    for (int i = 0; i < 64; i++) pad[i] = k[i] ^ 0x36;
+    sha256_compress(key->inner, pad);
+    
+    memcpy(key->outer, sha256_init, sizeof(key->outer));
+    for (int i = 0; i < 64; i++) pad[i] = k[i] ^ 0x5c;
+    sha256_compress(key->outer, pad);
+}
+
+/**
+ * HMAC-SHA256 of a message with a prepared key (scalar, any length)
+ */
+void hmac_sha256(const HmacKey* key, const uint8_t* msg, size_t len, uint8_t out[32]) {
+    uint32_t h[8];
+    uint8_t inner[32];
+    memcpy(h, key->inner, sizeof(h));
+    sha256_finish(h, 64, msg, len, inner);
+    memcpy(h, key->outer, sizeof(h));
+    sha256_finish(h, 64, inner, 32, out);
+}
+
+/*
+ * Multi-buffer SHA-256: eight independent single-block compressions run in
+ * lockstep, one message per SIMD lane, using GCC vector extensions (AVX2 with
+ * -mavx2/-march=native, two SSE2 halves otherwise). QR token messages fit in
+ * one block after the HMAC key block, so an HMAC is two lane-compressions.
+ */
+typedef uint32_t u32x8 __attribute__((vector_size(32)));
+
+#define VROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/**
+ * Compress one 64-byte block per lane into 8 interleaved states
+ */
+static void sha256_compress_x8(u32x8 h[8], const uint8_t* blocks[8]) {
+    u32x8 w[64];
+    for (int t = 0; t < 16; t++) {
+        for (int l = 0; l < 8; l++) {
+            const uint8_t* p = blocks[l] + 4 * t;
+            w[t][l] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+        }
+    }
+    for (int t = 16; t < 64; t++) {
+        u32x8 s0 = VROTR(w[t - 15], 7) ^ VROTR(w[t - 15], 18) ^ (w[t - 15] >> 3);
+        u32x8 s1 = VROTR(w[t - 2], 17) ^ VROTR(w[t - 2], 19) ^ (w[t - 2] >> 10);
+        w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+    }
+    u32x8 a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+    for (int t = 0; t < 64; t++) {
+        u32x8 t1 = hh + (VROTR(e, 6) ^ VROTR(e, 11) ^ VROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[t] + w[t];
+        u32x8 t2 = (VROTR(a, 2) ^ VROTR(a, 13) ^ VROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        hh = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+}
+
+/**
+ * HMAC-SHA256 of eight short messages (each at most 55 bytes) at once
+ */
+void hmac_sha256_x8(const HmacKey* key, const uint8_t* msgs[8], const int lens[8], uint8_t out[8][32]) {
+    uint8_t blocks[8][64];
+    const uint8_t* ptrs[8];
+    u32x8 h[8];
+    
+    // Inner hash: key midstate + one padded message block per lane
+    for (int l = 0; l < 8; l++) {
+        memset(blocks[l], 0, 64);
+        memcpy(blocks[l], msgs[l], lens[l]);
+        blocks[l][lens[l]] = 0x80;
+        uint64_t bits = (uint64_t)(64 + lens[l]) * 8;
+        for (int i = 0; i < 8; i++) blocks[l][63 - i] = (uint8_t)(bits >> (8 * i));
+        ptrs[l] = blocks[l];
+    }
+    for (int i = 0; i < 8; i++) h[i] = (u32x8){0} + key->inner[i];
+    sha256_compress_x8(h, ptrs);
+    
+    // Outer hash: key midstate + padded inner digest per lane
+    for (int l = 0; l < 8; l++) {
+        memset(blocks[l], 0, 64);
+        for (int i = 0; i < 8; i++) {
+            blocks[l][4 * i] = h[i][l] >> 24; blocks[l][4 * i + 1] = h[i][l] >> 16;
+            blocks[l][4 * i + 2] = h[i][l] >> 8; blocks[l][4 * i + 3] = h[i][l];
+        }
+        blocks[l][32] = 0x80;
+        blocks[l][62] = (96 * 8) >> 8;          // 64-byte key block + 32-byte digest
+        blocks[l][63] = (96 * 8) & 0xff;
+    }
+    for (int i = 0; i < 8; i++) h[i] = (u32x8){0} + key->outer[i];
+    sha256_compress_x8(h, ptrs);
+    
+    for (int l = 0; l < 8; l++) {
+        for (int i = 0; i < 8; i++) {
+            out[l][4 * i] = h[i][l] >> 24; out[l][4 * i + 1] = h[i][l] >> 16;
+            out[l][4 * i + 2] = h[i][l] >> 8; out[l][4 * i + 3] = h[i][l];
+        }
+    }
+}
+
+// =================== QR PAYMENT TOKENS ===================
+
+/*
+ * A QR payment token authorizes a wallet debit of up to `amount` for one
+ * user until `expiry`:   <user_id>.<amount_paise>.<nonce_hex>.<expiry>.<hmac_hex>
+ * The HMAC-SHA256 covers everything before the last '.'. Verification is
+ * batched: concurrent callers join a batch and whoever arrives while no batch
+ * is running leads it, checking up to eight signatures in one multi-buffer
+ * pass. Used nonces are remembered in a bounded replay cache until expiry.
+ */
+
+/**
+ * Install a QR signing key
+ */
+static void qr_key_load(const char* secret) {
+    hmac_sha256_init(&qr_key, (const uint8_t*)secret, strlen(secret));
+    qr_key_ready = 1;
+}
+
+/**
+ * Load the QR signing key from WATER_ATM_QR_KEY
+ * Returns 0 if it is not set: there is no fallback key, QR payments fail closed
+ */
+static int qr_key_ensure() {
+    if (qr_key_ready) return 1;
+    char* env = getenv("WATER_ATM_QR_KEY");
+    if (!env || !env[0]) return 0;
+    qr_key_load(env);
+    return 1;
+}
+
+/**
+ * Create QR Token
+ * Signs a wallet debit authorization (what the mobile app backend would issue)
+ * Returns 0 (and an empty token) if no signing key is configured
+ */
+int qr_token_create(long long user_id, double amount, time_t expiry, char* out, size_t out_size) {
+    if (out_size > 0) out[0] = '\0';
+    if (!qr_key_ensure()) return 0;
+    static atomic_ullong nonce_counter = 0;
+    uint64_t nonce = (uint64_t)generate_id() ^ (atomic_fetch_add(&nonce_counter, 1) * 0x9E3779B97F4A7C15ULL);
+    
+    char msg[QR_MAX_MESSAGE + 1];
+    int len = snprintf(msg, sizeof(msg), "%lld.%ld.%016llx.%lld", user_id, lround(amount * 100),
+                       (unsigned long long)nonce, (long long)expiry);
+    uint8_t sig[32];
+    hmac_sha256(&qr_key, (const uint8_t*)msg, len, sig);
+    
+    int pos = snprintf(out, out_size, "%s.", msg);
+    for (int i = 0; i < 32 && pos + 2 < (int)out_size; i++) pos += snprintf(out + pos, out_size - pos, "%02x", sig[i]);
+    return 1;
+}
+
+/**
+ * Parse QR Token text into fields; returns 1 if well formed
+ */
+int qr_token_parse(const char* text, QrToken* token) {
+    memset(token, 0, sizeof(*token));
+    const char* last_dot = strrchr(text, '.');
+    if (!last_dot || last_dot - text > QR_MAX_MESSAGE || strlen(last_dot + 1) < 64) return 0;
+    
+    token->msg_len = (int)(last_dot - text);
+    memcpy(token->msg, text, token->msg_len);
+    token->msg[token->msg_len] = '\0';
+    
+    unsigned long long nonce;
+    long long expiry;
+    if (sscanf(token->msg, "%lld.%ld.%16llx.%lld", &token->user_id, &token->amount_paise, &nonce, &expiry) != 4) return 0;
+    token->nonce = nonce;
+    token->expiry = (time_t)expiry;
+    
+    for (int i = 0; i < 32; i++) {
+        unsigned int byte;
+        if (sscanf(last_dot + 1 + 2 * i, "%2x", &byte) != 1) return 0;
+        token->sig[i] = (uint8_t)byte;
+    }
+    return 1;
+}
+
+/**
+ * Constant-time comparison of two 32-byte MACs
+ */
+static int mac_equal(const uint8_t* a, const uint8_t* b) {
+    uint8_t diff = 0;
+    for (int i = 0; i < 32; i++) diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+/**
+ * Check a nonce against the replay cache and, if `commit` is set, record it
+ * Returns QR_OK if it was new, QR_REPLAYED if seen, QR_REPLAY_FULL if no
+ * slot could be freed (fail closed rather than forget a live nonce)
+ */
+static int replay_cache_insert(uint64_t nonce, time_t expiry, time_t now, int commit) {
+    int slot = (int)((nonce * 0x9E3779B97F4A7C15ULL) >> (64 - QR_REPLAY_BITS));
+    int free_slot = -1;
+    for (int probe = 0; probe < QR_REPLAY_MAX_PROBE; probe++) {
+        int s = (slot + probe) & (QR_REPLAY_SLOTS - 1);
+        if (replay_cache[s].expiry > now && replay_cache[s].nonce == nonce) return QR_REPLAYED;
+        if (free_slot < 0 && replay_cache[s].expiry <= now) free_slot = s; // Empty or expired
+    }
+    if (free_slot < 0) return QR_REPLAY_FULL;
+    if (!commit) return QR_OK;
+    if (replay_cache[free_slot].expiry != 0) mem_release(MEM_CACHES, sizeof(ReplayEntry)); // Expired nonce reused
+    mem_claim(MEM_CACHES, sizeof(ReplayEntry));
+    replay_cache[free_slot].nonce = nonce;
+    replay_cache[free_slot].expiry = expiry;
+    return QR_OK;
+}
+
+/**
+ * Verify Batch of QR Tokens
+ * Checks signatures eight at a time with multi-buffer HMAC, then expiry and
+ * replay. results[i] receives a QR_* code for tokens[i]. Nonces are only
+ * checked here: qr_redeem() spends one once the sale has passed its checks.
+ */
+void qr_verify_batch(QrToken* tokens, int count, int* results) {
+    if (!qr_key_ensure()) {
+        for (int i = 0; i < count; i++) results[i] = QR_NO_KEY;
+        return;
+    }
+    time_t now = time(NULL);
+    
+    for (int base = 0; base < count; base += 8) {
+        const uint8_t* msgs[8];
+        int lens[8];
+        uint8_t macs[8][32];
+        int lanes = count - base < 8 ? count - base : 8;
+        int batchable = 1;
+        for (int l = 0; l < 8; l++) {
+            QrToken* t = &tokens[base + (l < lanes ? l : 0)]; // Idle lanes repeat lane 0
+            msgs[l] = (const uint8_t*)t->msg;
+            lens[l] = t->msg_len;
+            if (t->msg_len > 55) batchable = 0;
+        }
+        if (batchable) {
+            hmac_sha256_x8(&qr_key, msgs, lens, macs);
+        } else {
+            for (int l = 0; l < lanes; l++) hmac_sha256(&qr_key, msgs[l], lens[l], macs[l]);
+        }
+        for (int l = 0; l < lanes; l++) {
+            results[base + l] = mac_equal(macs[l], tokens[base + l].sig) ? QR_OK : QR_BAD_SIGNATURE;
+        }
+    }
+    
+    pthread_mutex_lock(&qr_replay_lock);
+    for (int i = 0; i < count; i++) {
+        if (results[i] != QR_OK) continue;
+        if (tokens[i].expiry <= now) {
+            results[i] = QR_EXPIRED;
+        } else if (tokens[i].expiry > now + QR_MAX_LIFETIME_S) {
+            results[i] = QR_EXPIRED;               // Lifetime longer than the replay window
+        } else {
+            results[i] = replay_cache_insert(tokens[i].nonce, tokens[i].expiry, now, 0);
+        }
+    }
+    pthread_mutex_unlock(&qr_replay_lock);
+}
+
+/**
+ * Redeem QR Token
+ * Spends a verified token's nonce; call only once the sale is going ahead.
+ * Returns QR_OK, or QR_REPLAYED if a concurrent sale spent it first.
+ */
+int qr_redeem(const QrToken* token) {
+    pthread_mutex_lock(&qr_replay_lock);
+    int result = replay_cache_insert(token->nonce, token->expiry, time(NULL), 1);
+    pthread_mutex_unlock(&qr_replay_lock);
+    return result;
+}
+
+/**
+ * Verify QR Token
+ * Parses a token and verifies it as part of whatever batch is forming:
+ * the first caller to find no batch running leads one, waiting briefly for
+ * other kiosks' requests to join, and verifies up to eight together.
+ * Returns a QR_* code; *token receives the parsed fields.
+ */
+int qr_verify(const char* text, QrToken* token) {
+    if (!qr_key_ensure()) return QR_NO_KEY;
+    if (!qr_token_parse(text, token)) return QR_MALFORMED;
+    
+    QrRequest request = {token, 0, 0, NULL};
+    pthread_mutex_lock(&qr_batcher.lock);
+    // Append to the pending list
+    QrRequest** tail = &qr_batcher.pending;
+    while (*tail) tail = &(*tail)->next;
+    *tail = &request;
+    qr_batcher.pending_count++;
+    
+    while (!request.done) {
+        if (qr_batcher.leader_active) {
+            pthread_cond_wait(&qr_batcher.done, &qr_batcher.lock);
+            continue;
+        }
+        // Lead a batch: give concurrent requests a moment to join
+        qr_batcher.leader_active = 1;
+        if (qr_batcher.pending_count < 8) {
+            pthread_mutex_unlock(&qr_batcher.lock);
+            struct timespec pause = {0, QR_BATCH_WAIT_US * 1000L};
+            nanosleep(&pause, NULL);
+            pthread_mutex_lock(&qr_batcher.lock);
+        }
+        QrRequest* batch[8];
+        QrToken tokens[8];
+        int results[8], n = 0;
+        while (qr_batcher.pending && n < 8) {
+            batch[n] = qr_batcher.pending;
+            qr_batcher.pending = batch[n]->next;
+            tokens[n] = *batch[n]->token;
+            n++;
+        }
+        qr_batcher.pending_count -= n;
+        pthread_mutex_unlock(&qr_batcher.lock);
+        
+        qr_verify_batch(tokens, n, results);
+        
+        pthread_mutex_lock(&qr_batcher.lock);
+        for (int i = 0; i < n; i++) {
+            batch[i]->result = results[i];
+            batch[i]->done = 1;
+        }
+        qr_batcher.batches++;
+        qr_batcher.verified += n;
+        qr_batcher.leader_active = 0;
+        pthread_cond_broadcast(&qr_batcher.done);
+    }
+    pthread_mutex_unlock(&qr_batcher.lock);
+    return request.result;
+}
+
+/**
+ * Describe a QR_* result code
+ */
+const char* qr_result_text(int result) {
+    switch (result) {
+        case QR_OK: return "valid";
+        case QR_MALFORMED: return "malformed";
+        case QR_BAD_SIGNATURE: return "signature invalid";
+        case QR_EXPIRED: return "expired";
+        case QR_REPLAYED: return "already used";
+        case QR_NO_KEY: return "not accepted (no signing key configured)";
+        default: return "cannot be checked right now";
+    }
+}
+
+enum { QR_BENCH_TOKENS = PROFILE(65536, 1024) };
+static QrToken qr_bench_tokens[QR_BENCH_TOKENS]; // Benchmark tokens and verdicts
+static int qr_bench_results[QR_BENCH_TOKENS];
+
+/**
+ * QR Benchmark
+ * Reports HMAC verifications per second per core for scalar and
+ * multi-buffer (8-lane) signature checking
+ */
+void qr_benchmark() {
+    char text[160];
+    
+    if (!qr_key_ensure()) qr_key_load(QR_BENCH_KEY);   // Tokens here are minted and checked in-process
+    time_t expiry = time(NULL) + 120;
+    for (int i = 0; i < QR_BENCH_TOKENS; i++) {
+        qr_token_create(237630000000000000LL + i, 10.0 + i % 50, expiry, text, sizeof(text));
+        qr_token_parse(text, &qr_bench_tokens[i]);
+    }
+    
+    // Scalar HMAC
+    long long start = monotonic_ns();
+    int valid = 0;
+    for (int i = 0; i < QR_BENCH_TOKENS; i++) {
+        uint8_t mac[32];
+        hmac_sha256(&qr_key, (const uint8_t*)qr_bench_tokens[i].msg, qr_bench_tokens[i].msg_len, mac);
+        valid += mac_equal(mac, qr_bench_tokens[i].sig);
+    }
+    long long scalar_ns = monotonic_ns() - start;
+    
+    // Multi-buffer HMAC (signatures only)
+    start = monotonic_ns();
+    int valid_x8 = 0;
+    for (int i = 0; i < QR_BENCH_TOKENS; i += 8) {
+        const uint8_t* msgs[8];
+        int lens[8];
+        uint8_t macs[8][32];
+        for (int l = 0; l < 8; l++) {
+            msgs[l] = (const uint8_t*)qr_bench_tokens[i + l].msg;
+            lens[l] = qr_bench_tokens[i + l].msg_len;
+        }
+        hmac_sha256_x8(&qr_key, msgs, lens, macs);
+        for (int l = 0; l < 8; l++) valid_x8 += mac_equal(macs[l], qr_bench_tokens[i + l].sig);
+    }
+    long long x8_ns = monotonic_ns() - start;
+    
+    // Full batch verification: signatures + expiry + replay cache
+    for (int s = 0; s < QR_REPLAY_SLOTS; s++) {
+        if (replay_cache[s].expiry != 0) mem_release(MEM_CACHES, sizeof(ReplayEntry));
+    }
+    memset(replay_cache, 0, sizeof(replay_cache));
+    int full_count = QR_REPLAY_SLOTS / 2;      // Stay within the replay window's capacity
+    start = monotonic_ns();
+    qr_verify_batch(qr_bench_tokens, full_count, qr_bench_results);
+    int accepted = 0;
+    for (int i = 0; i < full_count; i++) {
+        accepted += qr_bench_results[i] == QR_OK && qr_redeem(&qr_bench_tokens[i]) == QR_OK;
+    }
+    long long full_ns = monotonic_ns() - start;
+    qr_verify_batch(qr_bench_tokens, 8, qr_bench_results);        // Same tokens again must be rejected
+    
+    printf("\n=== QR TOKEN VERIFICATION BENCHMARK (1 core) ===\n");
+    printf("Scalar HMAC-SHA256:       %9.0f tokens/s (%d/%d valid)\n", QR_BENCH_TOKENS * 1e9 / scalar_ns, valid, QR_BENCH_TOKENS);
+    printf("Multi-buffer x8 HMAC:     %9.0f tokens/s (%d/%d valid, %.1fx)\n",
+           QR_BENCH_TOKENS * 1e9 / x8_ns, valid_x8, QR_BENCH_TOKENS, (double)scalar_ns / x8_ns);
+    printf("Batch verify + replay:    %9.0f tokens/s (%d/%d accepted)\n", full_count * 1e9 / full_ns, accepted, full_count);
+    printf("Replay of used token:     %s\n", qr_result_text(qr_bench_results[0]));
+}
+
+// =================== KIOSK REGISTRY & SPATIAL INDEX ===================
+
+/*
+ * Every known kiosk site with its coordinates and live tank level, indexed
+ * by a uniform lat/lon grid. Grid cells live in an open-addressing hash table
+ * (only occupied cells cost memory) and each keeps the highest tank level of
+ * its kiosks, so "nearest kiosk with at least N liters" searches rings of
+ * cells outward, skips cells that cannot satisfy N without touching their
+ * kiosks, and stops once the next ring is farther than the k-th best hit.
+ * Tank-level changes update the cell maximum in place.
+ */
+
+/**
+ * Great-circle distance in kilometers
+ */
+static double distance_km(double lat1, double lon1, double lat2, double lon2) {
+    const double rad = M_PI / 180.0;
+    double dlat = (lat2 - lat1) * rad, dlon = (lon2 - lon1) * rad;
+    double a = sin(dlat / 2) * sin(dlat / 2) + cos(lat1 * rad) * cos(lat2 * rad) * sin(dlon / 2) * sin(dlon / 2);
+    return 2 * EARTH_RADIUS_KM * asin(sqrt(a));
+}
+
+/**
+ * Fast local distance in kilometers (equirectangular; within 0.1% of the
+ * great-circle distance over the search radius). cos_lat is cos(lat1).
+ */
+static double local_distance_km(double lat1, double lon1, double cos_lat, double lat2, double lon2) {
+    double x = (lon2 - lon1) * cos_lat, y = lat2 - lat1;
+    return EARTH_RADIUS_KM * M_PI / 180.0 * sqrt(x * x + y * y);
+}
+
+/**
+ * Grid cell containing a coordinate
+ */
+static void grid_cell_of(double lat, double lon, int* cx, int* cy) {
+    *cx = (int)floor(lon / GRID_CELL_DEG);
+    *cy = (int)floor(lat / GRID_CELL_DEG);
+}
+
+/**
+ * Find a grid cell; creates it if `create` is set. NULL if absent/full.
+ */
+static GridCell* grid_cell(int cx, int cy, int create) {
+    uint32_t h = ((uint32_t)cx * 73856093u) ^ ((uint32_t)cy * 19349663u);
+    int slot = (int)(h & (GRID_SLOTS - 1));
+    for (int probe = 0; probe < GRID_SLOTS; probe++) {
+        GridCell* cell = &kiosk_grid[slot];
+        if (cell->used && cell->cx == cx && cell->cy == cy) return cell;
+        if (!cell->used) {
+            if (!create) return NULL;
+            cell->used = 1;
+            cell->cx = cx;
+            cell->cy = cy;
+            cell->head = -1;
+            cell->max_level = 0.0;
+            return cell;
+        }
+        slot = (slot + 1) & (GRID_SLOTS - 1);
+    }
+    return NULL;
+}
+
+/**
+ * Register Kiosk Site
+ * Adds a kiosk to the registry and grid; returns its site index or -1
+ */
+int kiosk_site_add(int kiosk, double lat, double lon, double tank_liters) {
+    if (site_count >= MAX_KIOSK_SITES) return -1;
+    int cx, cy;
+    grid_cell_of(lat, lon, &cx, &cy);
+    GridCell* cell = grid_cell(cx, cy, 1);
+    if (!cell) return -1;
+    
+    int index = site_count++;
+    mem_claim(MEM_SERVICES, sizeof(KioskSite));
+    KioskSite* site = &kiosk_sites[index];
+    site->kiosk_id = kiosk;
+    site->lat = lat;
+    site->lon = lon;
+    site->tank_liters = tank_liters;
+    site->next_in_cell = cell->head;            // Push onto the cell's list
+    cell->head = index;
+    cell->count++;
+    if (tank_liters > cell->max_level) cell->max_level = tank_liters;
+    return index;
+}
+
+/**
+ * Update Kiosk Tank Level
+ * Keeps the cell's maximum level exact: raising is O(1), lowering the
+ * current maximum rescans that one cell
+ */
+void kiosk_site_set_level(int index, double tank_liters) {
+    if (index < 0 || index >= site_count) return;
+    KioskSite* site = &kiosk_sites[index];
+    double old_level = site->tank_liters;
+    site->tank_liters = tank_liters;
+    
+    int cx, cy;
+    grid_cell_of(site->lat, site->lon, &cx, &cy);
+    GridCell* cell = grid_cell(cx, cy, 0);
+    if (tank_liters >= cell->max_level) {
+        cell->max_level = tank_liters;
+    } else if (old_level >= cell->max_level) {
+        cell->max_level = 0.0;
+        for (int i = cell->head; i >= 0; i = kiosk_sites[i].next_in_cell) {
+            if (kiosk_sites[i].tank_liters > cell->max_level) cell->max_level = kiosk_sites[i].tank_liters;
+        }
+    }
+}
+
+/**
+ * Insert a candidate into the k-best list (sorted by distance)
+ */
+static void nearest_consider(NearbyKiosk* best, int* found, int k, int site, double km) {
+    if (*found == k && km >= best[k - 1].distance_km) return;
+    int pos = *found < k ? (*found)++ : k - 1;
+    while (pos > 0 && best[pos - 1].distance_km > km) {
+        best[pos] = best[pos - 1];
+        pos--;
+    }
+    best[pos].site = site;
+    best[pos].distance_km = km;
+}
+
+/**
+ * Nearest Kiosks with Stock
+ * Fills `best` with up to k kiosks holding at least min_liters, nearest
+ * first, within max_km. Returns how many were found.
+ */
+int kiosk_nearest(double lat, double lon, double min_liters, int k, double max_km, NearbyKiosk* best) {
+    int found = 0;
+    int cx, cy;
+    grid_cell_of(lat, lon, &cx, &cy);
+    
+    double cos_lat = cos(lat * M_PI / 180.0);
+    
+    // Smallest cell side in km near this latitude (longitude lines converge)
+    double cell_km = GRID_CELL_DEG * 111.32 * cos((fabs(lat) + GRID_CELL_DEG) * M_PI / 180.0);
+    int max_ring = (int)(max_km / cell_km) + 1;
+    
+    for (int ring = 0; ring <= max_ring; ring++) {
+        // Everything in this ring is at least (ring - 1) cells away
+        if (found == k && (ring - 1) * cell_km > best[k - 1].distance_km) break;
+        
+        for (int dy = -ring; dy <= ring; dy++) {
+            int step = (dy == -ring || dy == ring) ? 1 : 2 * ring; // Only the ring's border
+            for (int dx = -ring; dx <= ring; dx += step > 0 ? step : 1) {
+                GridCell* cell = grid_cell(cx + dx, cy + dy, 0);
+                if (!cell || cell->max_level < min_liters) continue; // Nothing here can serve N liters
+                for (int i = cell->head; i >= 0; i = kiosk_sites[i].next_in_cell) {
+                    KioskSite* site = &kiosk_sites[i];
+                    if (site->tank_liters < min_liters) continue;
+                    double km = local_distance_km(lat, lon, cos_lat, site->lat, site->lon);
+                    if (km <= max_km) nearest_consider(best, &found, k, i, km);
+                }
+            }
+        }
+    }
+    // Report exact great-circle distances for the winners
+    for (int i = 0; i < found; i++) {
+        KioskSite* site = &kiosk_sites[best[i].site];
+        best[i].distance_km = distance_km(lat, lon, site->lat, site->lon);
+    }
+    return found;
+}
+
+/**
+ * Load Kiosk Sites
+ * Reads "kiosk_id,lat,lon,tank_liters[,region]" lines (e.g. the fleet list
+ * from HQ). Returns the number of sites loaded
+ */
+int kiosk_sites_load(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) return 0;
+    char line[128];
+    int loaded = 0;
+    while (fgets(line, sizeof(line), file)) {
+        int kiosk, region = 0;
+        double lat, lon, level;
+        if (sscanf(line, "%d,%lf,%lf,%lf,%d", &kiosk, &lat, &lon, &level, &region) < 4) continue;
+        int index = kiosk_site_add(kiosk, lat, lon, level);
+        if (index < 0) break;
+        if (region > 0 && region < CUBE_REGIONS) kiosk_regions[kiosk & ((1 << ID_KIOSK_BITS) - 1)] = (uint8_t)region;
+        if (kiosk == kiosk_id) local_site = index;
+        loaded++;
+    }
+    fclose(file);
+    return loaded;
+}
+
+/**
+ * Record Sale at this Kiosk
+ * Lowers this kiosk's tank level in the registry after each dispense
+ */
+void kiosk_site_record_sale(double liters) {
+    if (local_site < 0) return;
+    double level = kiosk_sites[local_site].tank_liters - liters;
+    kiosk_site_set_level(local_site, level > 0 ? level : 0);
+}
+
+/**
+ * Find Nearest Kiosk (menu)
+ */
+void find_nearest_kiosk() {
+    double lat, lon, liters;
+    NearbyKiosk best[NEAREST_RESULTS];
+    
+    printf("\n=== NEAREST KIOSK WITH WATER ===\n");
+    if (site_count == 0) {
+        printf("No kiosk sites loaded (set WATER_ATM_KIOSK_SITES)\n");
+        return;
+    }
+    printf("Enter your latitude and longitude: ");
+    scanf("%lf %lf", &lat, &lon);
+    printf("Liters needed: ");
+    scanf("%lf", &liters);
+    
+    int found = kiosk_nearest(lat, lon, liters, NEAREST_RESULTS, NEAREST_MAX_KM, best);
+    if (found == 0) {
+        printf("No kiosk within %.0f km has %.1f liters available\n", NEAREST_MAX_KM, liters);
+        return;
+    }
+    for (int i = 0; i < found; i++) {
+        KioskSite* site = &kiosk_sites[best[i].site];
+        printf("%d. Kiosk %d - %.2f km away, %.0f liters available\n",
+               i + 1, site->kiosk_id, best[i].distance_km, site->tank_liters);
+    }
+}
+
+/**
+ * Nearest-Kiosk Benchmark
+ * Builds a synthetic fleet clustered around cities and times k-nearest
+ * queries filtered by stock, interleaved with tank-level updates
+ */
+void nearest_benchmark() {
+    const double cities[][2] = {
+        {18.52, 73.86}, {19.08, 72.88}, {28.61, 77.21}, {12.97, 77.59}, {13.08, 80.27},
+        {22.57, 88.36}, {17.39, 78.49}, {23.02, 72.57}, {26.91, 75.79}, {21.15, 79.09}
+    };
+    unsigned int seed = 7;
+    int fleet = MAX_KIOSK_SITES < 50000 ? MAX_KIOSK_SITES : 50000;
+    
+    long long start = monotonic_ns();
+    for (int i = 0; i < fleet; i++) {
+        const double* city = cities[i % 10];
+        double spread = 0.3 * (rand_r(&seed) / (double)RAND_MAX);  // Up to ~33 km from center
+        double angle = 2 * M_PI * (rand_r(&seed) / (double)RAND_MAX);
+        kiosk_site_add(i + 1, city[0] + spread * sin(angle), city[1] + spread * cos(angle),
+                       rand_r(&seed) % (int)TANK_CAPACITY_LITERS);
+    }
+    long long build_ns = monotonic_ns() - start;
+    
+    int queries = 100000, total_found = 0;
+    NearbyKiosk best[NEAREST_RESULTS];
+    start = monotonic_ns();
+    for (int q = 0; q < queries; q++) {
+        const double* city = cities[q % 10];
+        double lat = city[0] + (rand_r(&seed) / (double)RAND_MAX - 0.5) * 0.4;
+        double lon = city[1] + (rand_r(&seed) / (double)RAND_MAX - 0.5) * 0.4;
+        double need = (q % 4 == 0) ? 4500 : 20;    // Some queries want a nearly full tank
+        total_found += kiosk_nearest(lat, lon, need, NEAREST_RESULTS, NEAREST_MAX_KM, best);
+        
+        // A sale somewhere in the fleet
+        int site = rand_r(&seed) % site_count;
+        double level = kiosk_sites[site].tank_liters - 10;
+        kiosk_site_set_level(site, level > 0 ? level : TANK_CAPACITY_LITERS); // Empty tanks get refilled
+    }
+    long long query_ns = monotonic_ns() - start;
+    
+    printf("\n=== NEAREST KIOSK BENCHMARK ===\n");
+    printf("Fleet: %d kiosks in %d grid cells, built in %.1f ms\n", site_count, grid_cells_used(), build_ns / 1e6);
+    printf("%d queries (k=%d, stock-filtered) with a tank update each: %.2f µs per query+update\n",
+           queries, NEAREST_RESULTS, query_ns / 1000.0 / queries);
+    printf("Average results per query: %.2f\n", total_found / (double)queries);
+}
+
+/**
+ * Count occupied grid cells
+ */
+int grid_cells_used() {
+    int used = 0;
+    for (int i = 0; i < GRID_SLOTS; i++) used += kiosk_grid[i].used;
+    return used;
+}
+
+// =================== GROUP WALLETS ===================
+
+/*
+ * A group (family/hostel) wallet is split into cache-line-sized stripes,
+ * each an atomic balance in paise. A debit takes from the caller's home
+ * stripe with a compare-and-swap and falls over to the other stripes, so
+ * debits from different kiosk threads touch different cache lines and never
+ * take a lock. Only when no single stripe can cover a debit does the caller
+ * lock the group, sweep all stripes together, debit, and spread the rest
+ * evenly again (rebalancing). Credits are spread across all stripes.
+ */
+
+static atomic_int stripe_assigner = 0;                  // Hands out home stripes
+static _Thread_local int home_stripe = -1;              // This thread's home stripe
+
+/**
+ * Try to take `paise` from one stripe without going below zero
+ */
+static int stripe_take(WalletStripe* stripe, long long paise) {
+    long long balance = atomic_load(&stripe->paise);
+    while (balance >= paise) {
+        if (atomic_compare_exchange_weak(&stripe->paise, &balance, balance - paise)) return 1;
+    }
+    return 0;
+}
+
+/**
+ * Spread an amount over all stripes (remainder to the first stripe)
+ */
+static void stripes_spread(GroupWallet* group, long long paise) {
+    long long share = paise / GROUP_STRIPES;
+    atomic_fetch_add(&group->stripes[0].paise, paise - share * (GROUP_STRIPES - 1));
+    for (int s = 1; s < GROUP_STRIPES; s++) atomic_fetch_add(&group->stripes[s].paise, share);
+}
+
+/**
+ * Find Group Wallet by ID (IDs start at 1); NULL if unknown
+ */
+GroupWallet* find_group(int group_id) {
+    if (group_id < 1 || group_id > group_count) return NULL;
+    return &group_wallets[group_id - 1];
+}
+
+/**
+ * Create Group Wallet; returns the group ID or 0 if the table is full
+ */
+int group_wallet_create(const char* name) {
+    if (group_count >= MAX_GROUPS) return 0;
+    GroupWallet* group = &group_wallets[group_count];
+    memset(group, 0, sizeof(*group));
+    pthread_mutex_init(&group->rebalance_lock, NULL);
+    strncpy(group->name, name, sizeof(group->name) - 1);
+    group->group_id = ++group_count;
+    group->tenant = active_tenant;
+    mem_claim(MEM_SERVICES, sizeof(*group));
+    return group->group_id;
+}
+
+/**
+ * Group Wallet Balance
+ * Sum of all stripes (a snapshot while debits are in flight)
+ */
+double group_wallet_balance(GroupWallet* group) {
+    long long total = 0;
+    for (int s = 0; s < GROUP_STRIPES; s++) total += atomic_load(&group->stripes[s].paise);
+    return total / 100.0;
+}
+
+/**
+ * Credit Group Wallet
+ */
+void group_wallet_credit(GroupWallet* group, double amount) {
+    stripes_spread(group, llround(amount * 100));
+}
+
+/**
+ * Debit Group Wallet
+ * Returns 1 if the amount was taken, 0 if the group balance is insufficient
+ */
+int group_wallet_debit(GroupWallet* group, double amount) {
+    long long paise = llround(amount * 100);
+    if (home_stripe < 0) home_stripe = atomic_fetch_add(&stripe_assigner, 1) % GROUP_STRIPES;
+    
+    // Fast path: home stripe, then the others
+    for (int i = 0; i < GROUP_STRIPES; i++) {
+        if (stripe_take(&group->stripes[(home_stripe + i) % GROUP_STRIPES], paise)) return 1;
+    }
+    
+    // Slow path: no stripe covers it alone - consolidate, debit, spread again
+    pthread_mutex_lock(&group->rebalance_lock);
+    long long total = 0;
+    for (int s = 0; s < GROUP_STRIPES; s++) total += atomic_exchange(&group->stripes[s].paise, 0);
+    int ok = total >= paise;
+    if (ok) total -= paise;
+    stripes_spread(group, total);
+    group->rebalances++;
+    pthread_mutex_unlock(&group->rebalance_lock);
+    return ok;
+}
+
+/**
+ * Group Wallet Menu
+ * Create groups, add members and top up the shared balance
+ */
+void group_wallet_menu() {
+    int option, group_id;
+    char name[50];
+    double amount;
+    
+    printf("\n=== GROUP WALLETS ===\n");
+    printf("1. Create Group\n");
+    printf("2. Add Member\n");
+    printf("3. Top-up Group Wallet\n");
+    printf("4. View Group\n");
+    printf("Choose option: ");
+    scanf("%d", &option);
+    
+    if (option == 1) {
+        printf("Group name: ");
+        scanf(" %49[^\n]", name);
+        group_id = group_wallet_create(name);
+        if (!group_id) {
+            printf("Maximum group limit reached!\n");
+            return;
+        }
+        printf("Group created! Group ID: %d\n", group_id);
+        return;
+    }
+    
+    printf("Enter Group ID: ");
+    scanf("%d", &group_id);
+    GroupWallet* group = find_group(group_id);
+    if (!group || group->tenant != active_tenant) {
+        printf("Group not found!\n");
+        return;
+    }
+    
+    if (option == 2) {
+        long long user_id;
+        printf("Enter User ID: ");
+        scanf("%lld", &user_id);
+        User* user = tenant_user(user_id);
+        if (!user) {
+            printf("User not found!\n");
+            return;
+        }
+        if (user->group_id == group_id) {
+            printf("%s is already a member of %s\n", user->name, group->name);
+            return;
+        }
+        // A user belongs to one group: moving leaves the old one
+        GroupWallet* old_group = find_group(user->group_id);
+        if (old_group) {
+            old_group->members--;
+            printf("%s left %s\n", user->name, old_group->name);
+        }
+        user->group_id = group_id;
+        group->members++;
+        user_changed(user);
+        printf("%s can now pay from %s's wallet\n", user->name, group->name);
+    } else if (option == 3) {
+        printf("Enter amount to add: ₹");
+        scanf("%lf", &amount);
+        if (amount <= 0) {
+            printf("Invalid amount!\n");
+            return;
+        }
+        // Same bonus rule as personal wallets
+        double bonus = amount >= 100 ? amount * 0.02 : 0.0;
+        group_wallet_credit(group, amount + bonus);
+        if (bonus > 0) printf("Bonus added: ₹%.2f (2%% bonus for top-up ≥ ₹100)\n", bonus);
+        printf("Group balance: ₹%.2f\n", group_wallet_balance(group));
+    } else if (option == 4) {
+        printf("Group: %s (ID: %d)\n", group->name, group->group_id);
+        printf("Members: %d\n", group->members);
+        printf("Balance: ₹%.2f\n", group_wallet_balance(group));
+        printf("Rebalances: %lld\n", group->rebalances);
+    } else {
+        printf("Invalid option!\n");
+    }
+}
+
+// =================== GROUP WALLET BENCHMARK ===================
+
+static GroupWallet* bench_group;
+static pthread_mutex_t bench_group_lock = PTHREAD_MUTEX_INITIALIZER;
+static double bench_locked_balance;
+static atomic_int bench_group_ok;
+
+/**
+ * Striped debits: many small purchases from one group
+ */
+static void* group_bench_striped(void* arg) {
+    int debits = *(int*)arg, ok = 0;
+    for (int i = 0; i < debits; i++) ok += group_wallet_debit(bench_group, 0.05);
+    atomic_fetch_add(&bench_group_ok, ok);
+    return NULL;
+}
+
+/**
+ * Baseline: one balance behind one mutex
+ */
+static void* group_bench_locked(void* arg) {
+    int debits = *(int*)arg, ok = 0;
+    for (int i = 0; i < debits; i++) {
+        pthread_mutex_lock(&bench_group_lock);
+        if (bench_locked_balance >= 0.05) {
+            bench_locked_balance -= 0.05;
+            ok++;
+        }
+        pthread_mutex_unlock(&bench_group_lock);
+    }
+    atomic_fetch_add(&bench_group_ok, ok);
+    return NULL;
+}
+
+/**
+ * Group Wallet Benchmark
+ * Concurrent debits on one group wallet: striped vs single locked balance
+ */
+void group_wallet_benchmark() {
+    int thread_counts[] = {1, 2, 4, 8};
+    int debits = 1000000;
+    
+    printf("\n=== GROUP WALLET BENCHMARK (%d stripes) ===\n", GROUP_STRIPES);
+    printf("%-8s %-18s %-18s %-10s\n", "Threads", "Striped debits/s", "Locked debits/s", "Rebalances");
+    for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+        int threads = thread_counts[t], per_thread = debits / threads;
+        pthread_t workers[8];
+        
+        bench_group = find_group(group_wallet_create("Benchmark Hostel"));
+        group_wallet_credit(bench_group, debits * 0.05);
+        atomic_store(&bench_group_ok, 0);
+        long long start = monotonic_ns();
+        for (int i = 0; i < threads; i++) pthread_create(&workers[i], NULL, group_bench_striped, &per_thread);
+        for (int i = 0; i < threads; i++) pthread_join(workers[i], NULL);
+        long long striped_ns = monotonic_ns() - start;
+        int striped_ok = atomic_load(&bench_group_ok);
+        
+        bench_locked_balance = debits * 0.05;
+        atomic_store(&bench_group_ok, 0);
+        start = monotonic_ns();
+        for (int i = 0; i < threads; i++) pthread_create(&workers[i], NULL, group_bench_locked, &per_thread);
+        for (int i = 0; i < threads; i++) pthread_join(workers[i], NULL);
+        long long locked_ns = monotonic_ns() - start;
+        
+        printf("%-8d %-18.0f %-18.0f %-10lld", threads, striped_ok * 1e9 / striped_ns,
+               atomic_load(&bench_group_ok) * 1e9 / locked_ns, bench_group->rebalances);
+        printf(" (left ₹%.2f)\n", group_wallet_balance(bench_group));
+    }
+}
+
+// =================== FLASH TRANSACTION LOG ===================
+
+/*
+ * Every sale is appended as a packed 32-byte record to a ring of erase
+ * blocks (pages). Records are written once and never updated in place; a
+ * page is erased (filled with 0xFF, as NOR/NAND flash reads after erase)
+ * only when the ring comes round to it again, so every block wears evenly.
+ * Page N of the ring always holds sequence numbers congruent to N, and each
+ * record carries a CRC, so a power cut mid-write loses at most the record
+ * being written: at startup the newest page is found from the headers and
+ * appending resumes after its last good record.
+ */
+
+static const char* flash_methods[] = {"Cash", "Digital", "UPI", "QR", "Group", "Refund"};
+#define FLASH_METHOD_REFUND 5
+#define FLASH_METHOD_LINK 6         // Written just before a refund: its ID and the sale it reverses
+
+/**
+ * CRC-16/CCITT (bitwise - records are 30 bytes, no table needed)
+ */
+static uint16_t crc16(const uint8_t* data, size_t len) {
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (int bit = 0; bit < 8; bit++) crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+static int flash_header_valid(const FlashPageHeader* header) {
+    return (header->magic == FLASH_PAGE_MAGIC || header->magic == FLASH_PAGE_MAGIC_V1) &&
+           header->crc == crc16((const uint8_t*)header, offsetof(FlashPageHeader, crc));
+}
+
+static int flash_record_valid(const FlashRecord* record) {
+    return record->crc == crc16((const uint8_t*)record, offsetof(FlashRecord, crc));
+}
+
+/**
+ * Read one page; never-written parts of the file read as erased
+ */
+static void flash_read_page(int page, uint8_t buf[FLASH_PAGE_SIZE]) {
+    memset(buf, 0xFF, FLASH_PAGE_SIZE);
+    if (pread(flash_log.fd, buf, FLASH_PAGE_SIZE, (off_t)page * FLASH_PAGE_SIZE) < 0) return;
+}
+
+/**
+ * Erase the next page of the ring and stamp its header
+ */
+static int flash_open_page(uint32_t sequence) {
+    uint8_t buf[FLASH_PAGE_SIZE];
+    memset(buf, 0xFF, sizeof(buf));
+    FlashPageHeader* header = (FlashPageHeader*)buf;
+    memset(header, 0, sizeof(*header));
+    header->magic = FLASH_PAGE_MAGIC;
+    header->sequence = sequence;
+    header->crc = crc16(buf, offsetof(FlashPageHeader, crc));
+    
+    int page = sequence % FLASH_LOG_PAGES;
+    if (pwrite(flash_log.fd, buf, FLASH_PAGE_SIZE, (off_t)page * FLASH_PAGE_SIZE) != FLASH_PAGE_SIZE) return 0;
+    flash_log.sequence = sequence;
+    flash_log.page = page;
+    flash_log.slot = 0;
+    flash_log.erases++;
+    return 1;
+}
+
+/**
+ * Unpack a log record into the transaction history
+ * `reverses` is the sale a refund undoes (from its link record). A refund
+ * on a "WAT1" page carries that sale's ID in user_id; its customer is
+ * filled in from the sale once history is indexed.
+ */
+static void flash_record_restore(const FlashRecord* record, int legacy, long long reverses, Transaction* txn) {
+    int method = record->method & 0x7F;
+    int refund = method == FLASH_METHOD_REFUND;
+    int sign = refund ? -1 : 1;
+    txn->transaction_id = record->transaction_id;
+    txn->user_id = refund && legacy ? 0 : record->user_id;
+    txn->reverses = !refund ? 0 : legacy ? record->user_id : reverses;
+    txn->amount = record->amount_paise / 100.0;
+    txn->liters = record->centiliters / 100.0;
+    txn->points_redeemed = sign * record->points_redeemed * 100;
+    txn->fee_charged = record->method & 0x80 ? sign * DIGITAL_FEE : 0.0;
+    txn->discount_applied = record->discount_paise / 100.0;
+    txn->timestamp = (txn_time_t)id_timestamp(record->transaction_id); // Sale saved within a second of its ID
+    snprintf(txn->payment_method, sizeof(txn->payment_method), "%s",
+             method < (int)(sizeof(flash_methods) / sizeof(flash_methods[0])) ? flash_methods[method] : "?");
+}
+
+/**
+ * Reverse transactions[from, to) in place (for rotating the replay ring)
+ */
+static void transactions_reverse(int from, int to) {
+    for (to--; from < to; from++, to--) {
+        Transaction swap = transactions[from];
+        transactions[from] = transactions[to];
+        transactions[to] = swap;
+    }
+}
+
+/**
+ * Open Flash Log
+ * Finds where appending resumes and replays the newest records into the
+ * transaction history, as many as the quota of the operator this terminal
+ * serves (the refund reserve and other operators' quotas stay free). Every
+ * replayed sale is charged to that operator. Returns 1 if the log is usable.
+ */
+int flash_log_open(const char* path) {
+    int keep = tenants[active_tenant].max_transactions;   // Ring size of the replay
+    flash_log.fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (flash_log.fd < 0) return 0;
+    
+    // Newest page = highest valid sequence
+    uint8_t buf[FLASH_PAGE_SIZE];
+    int found = 0;
+    uint32_t newest = 0;
+    for (int page = 0; page < FLASH_LOG_PAGES; page++) {
+        flash_read_page(page, buf);
+        const FlashPageHeader* header = (const FlashPageHeader*)buf;
+        if (flash_header_valid(header) && header->sequence % FLASH_LOG_PAGES == (uint32_t)page &&
+            (!found || header->sequence > newest)) {
+            newest = header->sequence;
+            found = 1;
+        }
+    }
+    if (!found) return flash_open_page(0);
+    
+    // Replay oldest to newest into transactions[] used as a ring, then rotate
+    uint32_t oldest = newest >= FLASH_LOG_PAGES ? newest - FLASH_LOG_PAGES + 1 : 0;
+    long long restored = 0;
+    int resume_slot = 0, resume_legacy = 0;
+    for (uint32_t sequence = oldest; sequence <= newest; sequence++) {
+        flash_read_page(sequence % FLASH_LOG_PAGES, buf);
+        const FlashPageHeader* header = (const FlashPageHeader*)buf;
+        if (!flash_header_valid(header) || header->sequence != sequence) continue;
+        int legacy = header->magic == FLASH_PAGE_MAGIC_V1;
+        const FlashRecord* link = NULL;             // Link record just before a refund
+        int slot = 0;
+        for (; slot < FLASH_RECORDS_PER_PAGE; slot++) {
+            const FlashRecord* record = (const FlashRecord*)(buf + (slot + 1) * FLASH_RECORD_SIZE);
+            if (!flash_record_valid(record)) break;     // Erased, or torn by a power cut
+            if ((record->method & 0x7F) == FLASH_METHOD_LINK) {
+                link = record;
+                continue;
+            }
+            if ((record->method & 0x7F) == FLASH_METHOD_REFUND && !legacy &&
+                (!link || link->transaction_id != record->transaction_id)) {
+                continue;                               // Refund without its link record: can't be linked
+            }
+            flash_record_restore(record, legacy, link ? link->user_id : 0,
+                                 &transactions[restored++ % keep]);
+            link = NULL;
+        }
+        if (sequence == newest) {
+            resume_slot = slot;
+            resume_legacy = legacy;
+        }
+    }
+    if (restored > keep) {
+        int split = restored % keep;
+        transactions_reverse(0, split);
+        transactions_reverse(split, keep);
+        transactions_reverse(0, keep);
+    }
+    transaction_count = restored < keep ? (int)restored : keep;
+    mem_claim(MEM_TRANSACTIONS, (size_t)transaction_count * sizeof(Transaction));
+    for (int i = 0; i < transaction_count; i++) {
+        if (!transactions[i].reverses) tenants[active_tenant].transactions++;   // Refunds are outside the quotas
+    }
+    flash_log.recovered = restored;
+    
+    // Restart check: a restored time must fall between the ID epoch and now,
+    // like the original sale time did (a day of slack for kiosk clock drift)
+    time_t now = time(NULL);
+    for (int i = 0; i < transaction_count; i++) {
+        long long when = (long long)transactions[i].timestamp;
+        if (when < ID_EPOCH_MS / 1000 || when > (long long)now + 86400) flash_log.bad_times++;
+    }
+    if (flash_log.bad_times > 0) {
+        printf("Warning: %d restored sales have implausible times (kiosk clock or log damaged)\n",
+               flash_log.bad_times);
+    }
+    index_transactions();
+    
+    flash_log.sequence = newest;
+    flash_log.page = newest % FLASH_LOG_PAGES;
+    flash_log.slot = resume_slot;
+    if (resume_legacy) return flash_open_page(newest + 1);  // New records never go on a "WAT1" page
+    return 1;
+}
+
+/**
+ * Append Sale to Flash Log
+ * One 32-byte write (plus a page erase every FLASH_RECORDS_PER_PAGE sales).
+ * A refund is preceded by a link record naming the sale it reverses; both
+ * go to the same page in one write, so replay never sees a refund without it.
+ */
+void flash_log_append(long long transaction_id, long long user_id, double amount, double liters,
+                      const char* method, double fee, double discount, int points_redeemed, long long reverses) {
+    if (flash_log.fd < 0) return;
+    
+    FlashRecord records[2] = {{
+        .transaction_id = transaction_id,
+        .user_id = reverses,
+        .method = FLASH_METHOD_LINK,
+    }, {
+        .transaction_id = transaction_id,
+        .user_id = user_id,
+        .amount_paise = (int32_t)llround(amount * 100),
+        .discount_paise = (int32_t)llround(discount * 100),
+        .centiliters = (int32_t)llround(liters * 100),
+        .method = 0x7F,
+        .points_redeemed = (uint8_t)(abs(points_redeemed) / 100),
+    }};
+    FlashRecord* record = &records[1];
+    for (size_t i = 0; i < sizeof(flash_methods) / sizeof(flash_methods[0]); i++) {
+        if (strcmp(method, flash_methods[i]) == 0) record->method = (uint8_t)i;
+    }
+    if (fee != 0) record->method |= 0x80;
+    records[0].crc = crc16((const uint8_t*)&records[0], offsetof(FlashRecord, crc));
+    record->crc = crc16((const uint8_t*)record, offsetof(FlashRecord, crc));
+    const FlashRecord* first = reverses ? &records[0] : record;
+    int count = reverses ? 2 : 1;
+    
+    pthread_mutex_lock(&flash_log.lock);
+    if (flash_log.slot + count > FLASH_RECORDS_PER_PAGE && !flash_open_page(flash_log.sequence + 1)) {
+        flash_log.failures++;
+        pthread_mutex_unlock(&flash_log.lock);
+        return;
+    }
+    off_t offset = (off_t)flash_log.page * FLASH_PAGE_SIZE + (off_t)(flash_log.slot + 1) * FLASH_RECORD_SIZE;
+    ssize_t bytes = (ssize_t)(count * sizeof(FlashRecord));
+    if (pwrite(flash_log.fd, first, bytes, offset) == bytes) {
+        fdatasync(flash_log.fd);            // A sale is durable once it is reported
+        flash_log.slot += count;
+        flash_log.appended++;
+    } else {
+        flash_log.failures++;
+    }
+    pthread_mutex_unlock(&flash_log.lock);
+}
+
+// =================== STATIC FOOTPRINT ===================
+
+#ifdef __linux__
+extern char __data_start[], _end[];     // Linker-provided bounds of .data + .bss
+#endif
+
+/**
+ * Heap bytes in use (glibc only; -1 where it cannot be measured)
+ */
+static long long heap_in_use() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+    return (long long)(info.uordblks + info.hblkhd);
+#else
+    return -1;
+#endif
+}
+
+/**
+ * Static tables of this build, each under the subsystem it belongs to
+ */
+static const struct { const char* name; size_t bytes; int tag; } footprint_tables[] = {
+    {"Users + tap profiles", sizeof(users) + sizeof(tap_profiles), MEM_USERS},
+    {"Transaction history", sizeof(transactions), MEM_TRANSACTIONS},
+    {"Receipt spooler", sizeof(spooler), MEM_BUFFERS},
+    {"UPI gateway client", sizeof(payments), MEM_SERVICES},
+    {"Mock UPI gateway", sizeof(mock_gateway), MEM_SERVICES},
+    {"Sensor telemetry", sizeof(telemetry), MEM_SKETCHES},
+    {"Dispense reconciler", sizeof(reconciler), MEM_SKETCHES},
+    {"Card index", sizeof(card_index), MEM_INDEXES},
+    {"QR replay cache", sizeof(replay_cache) + sizeof(qr_batcher), MEM_CACHES},
+    {"Kiosk registry + grid", sizeof(kiosk_sites) + sizeof(kiosk_grid), MEM_SERVICES},
+    {"Group wallets", sizeof(group_wallets), MEM_SERVICES},
+    {"Flash log state", sizeof(flash_log), MEM_TRANSACTIONS},
+    {"PIN sessions + scrypt", sizeof(sessions) + sizeof(kdf_scratch), MEM_CACHES},
+    {"User ID + phone indexes", sizeof(user_id_index) + sizeof(phone_index), MEM_INDEXES},
+    {"Roster import rows", sizeof(import_rows), MEM_BUFFERS},
+    {"Credit batch totals", sizeof(credit_totals) + sizeof(credit_users), MEM_BUFFERS},
+    {"Nozzle queues + plan", sizeof(kiosk_nozzles) + sizeof(nozzle_plan), MEM_SERVICES},
+    {"Audit batches + tree", sizeof(audit_batches) + sizeof(audit_nodes), MEM_SERVICES},
+    {"Transaction ID indexes", sizeof(txn_id_index) + sizeof(refund_index) + sizeof(failed_dispenses), MEM_INDEXES},
+    {"Replica sync tree", sizeof(sync_leaves) + sizeof(sync_tree) + sizeof(sync_digests) +
+                          sizeof(sync_state) + sizeof(sync_wanted) + sizeof(sync_base), MEM_SKETCHES},
+    {"Lease cache + holders", sizeof(lease_cache) + sizeof(lease_holders), MEM_CACHES},
+    {"Report scan partials", sizeof(scan_partials), MEM_BUFFERS},
+    {"Analytics history", sizeof(history_points) + sizeof(history), MEM_SKETCHES},
+    {"Sales cube", sizeof(cube_cells) + sizeof(cube) + sizeof(kiosk_regions), MEM_SKETCHES},
+    {"Cohort retention", sizeof(cohorts) + sizeof(cohort_seen), MEM_SKETCHES},
+    {"Memory accounting", sizeof(mem_tags), MEM_SERVICES},
+    {"Operators", sizeof(tenants), MEM_SERVICES},
+    {"Benchmark buffers", sizeof(bench_latencies) + sizeof(qr_bench_tokens) + sizeof(qr_bench_results) +
+                          sizeof(nozzle_sim_waits), MEM_BUFFERS},
+};
+
+/**
+ * Footprint Report
+ * Static RAM of every fixed table in this build, the whole image from the
+ * linker, a check that steady-state sales never touch the heap, and how
+ * much of each subsystem's tables is in use after them
+ */
+void footprint_report() {
+    size_t total = 0;
+    
+#ifdef WATER_ATM_EMBEDDED
+    printf("\n=== STATIC RAM FOOTPRINT (embedded profile) ===\n");
+#else
+    printf("\n=== STATIC RAM FOOTPRINT (full profile) ===\n");
+#endif
+    printf("Capacities: %d users, %d transactions, %d kiosk sites, %d groups\n",
+           MAX_USERS, MAX_TRANSACTIONS, MAX_KIOSK_SITES, MAX_GROUPS);
+    printf("Record sizes: user %zu B, transaction %zu B, flash record %zu B\n",
+           sizeof(User), sizeof(Transaction), sizeof(FlashRecord));
+    for (size_t i = 0; i < sizeof(footprint_tables) / sizeof(footprint_tables[0]); i++) {
+        printf("%-24s %10zu bytes\n", footprint_tables[i].name, footprint_tables[i].bytes);
+        total += footprint_tables[i].bytes;
+    }
+    printf("%-24s %10zu bytes\n", "Tables total", total);
+#ifdef __linux__
+    printf("%-24s %10zu bytes\n", "Image .data + .bss", (size_t)(_end - __data_start));
+#endif
+    
+    // Steady state: a burst of sales through the normal path
+    users[user_count] = (User){.user_id = generate_id(), .name = "Footprint Check", .wallet_balance = 1e6};
+    User* user = &users[user_count++];
+    index_user(user);
+    audit_start(NULL);                          // Sealer runs as on a kiosk (its stack is mapped now)
+    if (!qr_key_ensure()) qr_key_load(QR_BENCH_KEY);   // The QR sales below are minted in-process
+    long long heap_before = heap_in_use();
+    char token[160];
+    for (int i = 0; i < 1000; i++) {
+        double liters = 1.0 + i % 20;
+        int method = i % 4 == 3 ? 4 : i % 2 ? 1 : 2;   // Every fourth sale pays by QR
+        if (method == 4) {
+            const Tenant* tenant = &tenants[user->tenant];
+            qr_token_create(user->user_id, liters * tenant->price_per_liter + tenant->digital_fee,
+                            time(NULL) + QR_TOKEN_TTL_S, token, sizeof(token));
+        }
+        process_purchase(user, liters, method, method == 4 ? token : NULL, 0);
+    }
+    long long heap_after = heap_in_use();
+    audit_stop();                               // Seals the last partial batch
+    if (heap_before < 0) {
+        printf("Heap after init: not measurable on this C library\n");
+    } else {
+        printf("Heap growth over 1000 sales: %lld bytes\n", heap_after - heap_before);
+    }
+    mem_report();
+}
+
+// =================== WORKLOAD REPLAY ===================
+
+/*
+ * A workload is a text file with one kiosk operation per line, replayed
+ * through the same code paths the menus use but without prompts, screen
+ * clears or printing. It drives profile-guided builds (make release) and
+ * lets a recorded day of kiosk traffic be replayed for timing. Users are
+ * referred to by their order of registration within the workload:
+ *
+ *   register <is_student>
+ *   topup <user> <amount>
+ *   buy <user> <liters> <payment 1=cash 2=wallet 4=QR>
+ *   pass <user> <1=weekly 2=monthly>
+ *   card <user>
+ *   tap <user> <liters>
+ *
+ * Blank lines and lines starting with '#' are skipped.
+ */
+
+/**
+ * Card UID used by the workload for a user
+ */
+static uint64_t workload_card_uid(int user) {
+    return 0x04A0000000000000ULL + (uint64_t)user * 7919;
+}
+
+/**
+ * Generate Workload
+ * Writes a synthetic day of kiosk traffic to stdout: mostly purchases,
+ * with registrations, top-ups, passes and card taps mixed in
+ */
+void workload_generate(int ops, unsigned int seed) {
+    int users = 0, max_users = MAX_USERS / 2;
+    
+    printf("# Water ATM workload: %d operations, seed %u\n", ops, seed);
+    for (int i = 0; i < ops; i++) {
+        int roll = rand_r(&seed) % 100;
+        int user = users > 0 ? rand_r(&seed) % users : 0;
+        double liters = roll % 10 == 0 ? 10 + rand_r(&seed) % 30 : 1 + rand_r(&seed) % 8;
+        
+        if (users == 0 || (roll < 5 && users < max_users)) {
+            printf("register %d\n", rand_r(&seed) % 4 == 0);
+            if (users % 3 == 0) printf("card %d\n", users);
+            users++;
+        } else if (roll < 17) {
+            printf("topup %d %d\n", user, 50 + 50 * (rand_r(&seed) % 5));
+        } else if (roll < 19) {
+            printf("pass %d %d\n", user, 1 + rand_r(&seed) % 2);
+        } else if (roll < 34) {
+            printf("tap %d %.0f\n", user - user % 3, liters);
+        } else {
+            int payment = roll < 64 ? 1 : roll < 94 ? 2 : 4;
+            printf("buy %d %.0f %d\n", user, liters, payment);
+        }
+    }
+}
+
+/**
+ * Replay Workload
+ * Runs every operation in the file and reports throughput.
+ * Returns the number of operations replayed, or -1 if the file can't be read
+ */
+int workload_replay(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        printf("Cannot open workload %s\n", path);
+        return -1;
+    }
+    
+    enum { OP_REGISTER, OP_TOPUP, OP_BUY, OP_PASS, OP_CARD, OP_TAP, OP_KINDS };
+    static const char* names[OP_KINDS] = {"register", "topup", "buy", "pass", "card", "tap"};
+    int counts[OP_KINDS] = {0}, refused = 0, malformed = 0, ops = 0;
+    int first_user = user_count;
+    char line[128], op[16], token[160];
+    if (!qr_key_ensure()) qr_key_load(QR_BENCH_KEY);   // Offline run: its QR tokens never leave the process
+    
+    long long start = monotonic_ns();
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] == '#' || line[0] == '\n') continue;
+        int user_index = 0;
+        double a = 0, b = 0;
+        int fields = sscanf(line, "%15s %d %lf %lf", op, &user_index, &a, &b);
+        int kind = 0;
+        while (kind < OP_KINDS && (fields < 2 || strcmp(op, names[kind]) != 0)) kind++;
+        
+        User* user = first_user + user_index < user_count ? &users[first_user + user_index] : NULL;
+        int ok = 1;
+        if (kind == OP_REGISTER) {
+            if (user_count >= MAX_USERS) {
+                ok = 0;
+            } else {
+                User* created = &users[user_count++];
+                memset(created, 0, sizeof(*created));
+                created->user_id = generate_id();
+                snprintf(created->name, sizeof(created->name), "Replay User %d", user_count - first_user);
+                snprintf(created->phone, sizeof(created->phone), "9%09d", user_count - first_user);
+                created->is_student = user_index;
+                index_user(created);
+                tap_profile_refresh(created);
+            }
+        } else if (kind == OP_KINDS || !user) {
+            malformed++;
+            continue;
+        } else if (kind == OP_TOPUP) {
+            credit_wallet(user, a);
+        } else if (kind == OP_BUY) {
+            if (b == 4) qr_token_create(user->user_id, a * tenants[user->tenant].price_per_liter, time(NULL) + QR_TOKEN_TTL_S, token, sizeof(token));
+            ok = process_purchase(user, a, (int)b, b == 4 ? token : NULL, 0);
+        } else if (kind == OP_PASS) {
+            ok = activate_pass(user, (int)a, 0);
+        } else if (kind == OP_CARD) {
+            ok = link_card(workload_card_uid(user_index), user);
+        } else if (kind == OP_TAP) {
+            ok = tap_dispense(workload_card_uid(user_index), a, 0);
+        }
+        counts[kind]++;
+        refused += !ok;
+        ops++;
+    }
+    long long elapsed_ns = monotonic_ns() - start;
+    fclose(file);
+    
+    printf("\n=== WORKLOAD REPLAY ===\n");
+    printf("Operations: %d (", ops);
+    for (int k = 0; k < OP_KINDS; k++) printf("%s%s %d", k ? ", " : "", names[k], counts[k]);
+    printf(")\n");
+    printf("Refused: %d, Malformed: %d\n", refused, malformed);
+    printf("Elapsed: %.1f ms (%.0f operations/s)\n", elapsed_ns / 1e6, ops * 1e9 / (elapsed_ns > 0 ? elapsed_ns : 1));
+    printf("Revenue: ₹%.2f from %d transactions\n", stats.total_revenue, transaction_count);
+    return ops;
+}
+
+// =================== PIN AUTHENTICATION & SESSIONS ===================
+
+/*
+ * PINs are stored as scrypt(PIN, per-user salt): each guess costs
+ * 128 * r * N bytes of memory and tens of milliseconds, so a stolen user
+ * table can't be brute-forced cheaply even though PINs are short. The hash
+ * runs once per kiosk session. A successful login opens a session token in
+ * a small fixed table; the token's low bits are its slot, so repeat
+ * operations check it with one array lookup. Sessions end when idle for
+ * SESSION_IDLE_MS, at SESSION_MAX_MS, or when the slot is reused by the
+ * clock hand because the table is full.
+ */
+
+static pthread_mutex_t kdf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Fill a buffer with random bytes (/dev/urandom, hashed clock as fallback)
+ */
+static void random_bytes(uint8_t* out, size_t len) {
+    static atomic_llong fallback_counter = 0;
+    int fd = open("/dev/urandom", O_RDONLY);
+    size_t done = 0;
+    while (fd >= 0 && done < len) {
+        ssize_t n = read(fd, out + done, len - done);
+        if (n <= 0) break;
+        done += n;
+    }
+    if (fd >= 0) close(fd);
+    while (done < len) {
+        long long seed[3] = {monotonic_ns(), wall_clock_ms(), atomic_fetch_add(&fallback_counter, 1)};
+        uint8_t digest[32];
+        sha256((const uint8_t*)seed, sizeof(seed), digest);
+        for (int i = 0; i < 32 && done < len; i++) out[done++] = digest[i];
+    }
+}
+
+/**
+ * PBKDF2-HMAC-SHA256 with one iteration (the form scrypt uses)
+ */
+static void pbkdf2_sha256_1(const HmacKey* key, const uint8_t* salt, size_t salt_len, uint8_t* out, size_t out_len) {
+    static uint8_t msg[128 * PIN_KDF_R + 4];  // Salt || block index (only used under kdf_lock)
+    memcpy(msg, salt, salt_len);
+    for (uint32_t block = 1; out_len > 0; block++) {
+        uint8_t digest[32];
+        msg[salt_len] = block >> 24; msg[salt_len + 1] = block >> 16;
+        msg[salt_len + 2] = block >> 8; msg[salt_len + 3] = block;
+        hmac_sha256(key, msg, salt_len + 4, digest);
+        size_t n = out_len < 32 ? out_len : 32;
+        memcpy(out, digest, n);
+        out += n;
+        out_len -= n;
+    }
+}
+
+/**
+ * Salsa20/8 core, in place on 16 words
+ */
+static void salsa20_8(uint32_t b[16]) {
+    uint32_t x[16];
+    memcpy(x, b, sizeof(x));
+    for (int i = 0; i < 8; i += 2) {
+#define R(a, n) (((a) << (n)) | ((a) >> (32 - (n))))
+        x[4] ^= R(x[0] + x[12], 7);   x[8] ^= R(x[4] + x[0], 9);
+        x[12] ^= R(x[8] + x[4], 13);  x[0] ^= R(x[12] + x[8], 18);
+        x[9] ^= R(x[5] + x[1], 7);    x[13] ^= R(x[9] + x[5], 9);
+        x[1] ^= R(x[13] + x[9], 13);  x[5] ^= R(x[1] + x[13], 18);
+        x[14] ^= R(x[10] + x[6], 7);  x[2] ^= R(x[14] + x[10], 9);
+        x[6] ^= R(x[2] + x[14], 13);  x[10] ^= R(x[6] + x[2], 18);
+        x[3] ^= R(x[15] + x[11], 7);  x[7] ^= R(x[3] + x[15], 9);
+        x[11] ^= R(x[7] + x[3], 13);  x[15] ^= R(x[11] + x[7], 18);
+        x[1] ^= R(x[0] + x[3], 7);    x[2] ^= R(x[1] + x[0], 9);
+        x[3] ^= R(x[2] + x[1], 13);   x[0] ^= R(x[3] + x[2], 18);
+        x[6] ^= R(x[5] + x[4], 7);    x[7] ^= R(x[6] + x[5], 9);
+        x[4] ^= R(x[7] + x[6], 13);   x[5] ^= R(x[4] + x[7], 18);
+        x[11] ^= R(x[10] + x[9], 7);  x[8] ^= R(x[11] + x[10], 9);
+        x[9] ^= R(x[8] + x[11], 13);  x[10] ^= R(x[9] + x[8], 18);
+        x[12] ^= R(x[15] + x[14], 7); x[13] ^= R(x[12] + x[15], 9);
+        x[14] ^= R(x[13] + x[12], 13); x[15] ^= R(x[14] + x[13], 18);
+#undef R
+    }
+    for (int i = 0; i < 16; i++) b[i] += x[i];
+}
+
+/**
+ * scrypt BlockMix: 2r 64-byte chunks through Salsa20/8, output interleaved
+ */
+static void scrypt_blockmix(const uint32_t* in, uint32_t* out) {
+    uint32_t x[16];
+    memcpy(x, &in[(2 * PIN_KDF_R - 1) * 16], sizeof(x));
+    for (int i = 0; i < 2 * PIN_KDF_R; i++) {
+        for (int j = 0; j < 16; j++) x[j] ^= in[i * 16 + j];
+        salsa20_8(x);
+        memcpy(&out[((i & 1) * PIN_KDF_R + i / 2) * 16], x, sizeof(x));
+    }
+}
+
+/**
+ * PIN KDF: scrypt(PIN, salt, N = PIN_KDF_N, r = PIN_KDF_R, p = 1) -> 32 bytes
+ */
+void pin_kdf(const char* pin, const uint8_t salt[16], uint8_t out[32]) {
+    enum { WORDS = 32 * PIN_KDF_R };
+    uint8_t block[128 * PIN_KDF_R];
+    uint32_t x[WORDS], y[WORDS];
+    HmacKey key;
+    
+    pthread_mutex_lock(&kdf_lock);
+    hmac_sha256_init(&key, (const uint8_t*)pin, strlen(pin));
+    pbkdf2_sha256_1(&key, salt, 16, block, sizeof(block));
+    for (int i = 0; i < WORDS; i++) {
+        x[i] = block[4 * i] | block[4 * i + 1] << 8 | block[4 * i + 2] << 16 | (uint32_t)block[4 * i + 3] << 24;
+    }
+    
+    // ROMix: fill V sequentially, then read it back in data-dependent order
+    for (int i = 0; i < PIN_KDF_N; i++) {
+        memcpy(&kdf_scratch[i * WORDS], x, sizeof(x));
+        scrypt_blockmix(x, y);
+        memcpy(x, y, sizeof(x));
+    }
+    for (int i = 0; i < PIN_KDF_N; i++) {
+        uint32_t j = x[(2 * PIN_KDF_R - 1) * 16] & (PIN_KDF_N - 1);
+        for (int w = 0; w < WORDS; w++) x[w] ^= kdf_scratch[j * WORDS + w];
+        scrypt_blockmix(x, y);
+        memcpy(x, y, sizeof(x));
+    }
+    
+    for (int i = 0; i < WORDS; i++) {
+        block[4 * i] = x[i]; block[4 * i + 1] = x[i] >> 8; block[4 * i + 2] = x[i] >> 16; block[4 * i + 3] = x[i] >> 24;
+    }
+    pbkdf2_sha256_1(&key, block, sizeof(block), out, 32);
+    pthread_mutex_unlock(&kdf_lock);
+}
+
+/**
+ * PIN format check: PIN_MIN_DIGITS to PIN_MAX_DIGITS digits
+ */
+int pin_valid_format(const char* pin) {
+    size_t len = strlen(pin);
+    if (len < PIN_MIN_DIGITS || len > PIN_MAX_DIGITS) return 0;
+    for (size_t i = 0; i < len; i++) {
+        if (pin[i] < '0' || pin[i] > '9') return 0;
+    }
+    return 1;
+}
+
+/**
+ * Set PIN
+ * Stores scrypt(PIN) with a fresh salt and ends the user's open sessions
+ */
+void set_pin(User* user, const char* pin) {
+    random_bytes(user->pin_salt, sizeof(user->pin_salt));
+    pin_kdf(pin, user->pin_salt, user->pin_hash);
+    user->has_pin = 1;
+    user->pin_failures = 0;
+    user_changed(user);
+    
+    pthread_mutex_lock(&sessions.lock);
+    for (int i = 0; i < SESSION_SLOTS; i++) {
+        if (sessions.slots[i].user_id == user->user_id) sessions.slots[i].token = 0;
+    }
+    pthread_mutex_unlock(&sessions.lock);
+}
+
+/**
+ * Check PIN (runs the KDF)
+ * Returns PIN_OK, PIN_WRONG or PIN_LOCKED
+ */
+int pin_check(User* user, const char* pin) {
+    if (user->pin_locked_until > time(NULL)) return PIN_LOCKED;
+    
+    uint8_t hash[32];
+    pin_kdf(pin, user->pin_salt, hash);
+    if (mac_equal(hash, user->pin_hash)) {
+        user->pin_failures = 0;
+        return PIN_OK;
+    }
+    if (++user->pin_failures >= PIN_MAX_FAILURES) {
+        user->pin_failures = 0;
+        user->pin_locked_until = time(NULL) + PIN_LOCKOUT_S;
+        pthread_mutex_lock(&sessions.lock);
+        sessions.lockouts++;
+        pthread_mutex_unlock(&sessions.lock);
+        return PIN_LOCKED;
+    }
+    return PIN_WRONG;
+}
+
+/**
+ * Open Session
+ * Takes a free or expired slot, else evicts the slot under the clock hand.
+ * Returns the session token
+ */
+uint64_t session_open(long long user_id) {
+    uint64_t random;
+    random_bytes((uint8_t*)&random, sizeof(random));
+    long long now = monotonic_ms();
+    
+    pthread_mutex_lock(&sessions.lock);
+    int slot = sessions.next;
+    for (int i = 0; i < SESSION_SLOTS; i++) {
+        Session* candidate = &sessions.slots[(sessions.next + i) & (SESSION_SLOTS - 1)];
+        if (candidate->token == 0 || now - candidate->last_used_ms > SESSION_IDLE_MS) {
+            slot = (sessions.next + i) & (SESSION_SLOTS - 1);
+            break;
+        }
+    }
+    sessions.next = (slot + 1) & (SESSION_SLOTS - 1);
+    
+    Session* session = &sessions.slots[slot];
+    if (session->token != 0) mem_release(MEM_CACHES, sizeof(*session)); // Expired or evicted
+    mem_claim(MEM_CACHES, sizeof(*session));
+    session->token = (random & ~(uint64_t)(SESSION_SLOTS - 1)) | (uint64_t)slot;
+    if (session->token == 0) session->token = SESSION_SLOTS;  // 0 marks a free slot
+    session->user_id = user_id;
+    session->created_ms = now;
+    session->last_used_ms = now;
+    sessions.logins++;
+    uint64_t token = session->token;
+    pthread_mutex_unlock(&sessions.lock);
+    return token;
+}
+
+/**
+ * Check Session - O(1): the token names its own slot
+ * Returns 1 if the token is live for this user (and extends its idle time)
+ */
+int session_check(uint64_t token, long long user_id) {
+    if (token == 0) return 0;
+    long long now = monotonic_ms();
+    
+    pthread_mutex_lock(&sessions.lock);
+    Session* session = &sessions.slots[token & (SESSION_SLOTS - 1)];
+    int ok = session->token == token && session->user_id == user_id;
+    if (ok && (now - session->last_used_ms > SESSION_IDLE_MS || now - session->created_ms > SESSION_MAX_MS)) {
+        session->token = 0;
+        sessions.expired++;
+        mem_release(MEM_CACHES, sizeof(*session));
+        ok = 0;
+    } else if (ok) {
+        session->last_used_ms = now;
+        sessions.hits++;
+    } else {
+        sessions.rejected++;
+    }
+    pthread_mutex_unlock(&sessions.lock);
+    return ok;
+}
+
+/**
+ * Close Session
+ */
+void session_close(uint64_t token) {
+    pthread_mutex_lock(&sessions.lock);
+    Session* session = &sessions.slots[token & (SESSION_SLOTS - 1)];
+    if (token != 0 && session->token == token) {
+        session->token = 0;
+        mem_release(MEM_CACHES, sizeof(*session));
+    }
+    pthread_mutex_unlock(&sessions.lock);
+}
+
+/**
+ * Authorize Wallet Spending at the Kiosk
+ * Users with a PIN enter it once; the kiosk then holds a session token so
+ * further purchases by the same customer skip the PIN (and the KDF).
+ * Returns 1 if the customer may spend from this account
+ */
+int authorize_user(User* user) {
+    if (!user->has_pin) return 1;
+    if (session_check(kiosk_session, user->user_id)) return 1;
+    
+    // New customer at the screen: the previous customer's session ends
+    session_close(kiosk_session);
+    kiosk_session = 0;
+    
+    char pin[16];
+    printf("Enter PIN: ");
+    read_pin(pin, sizeof(pin));
+    int result = pin_check(user, pin);
+    memset(pin, 0, sizeof(pin));
+    if (result == PIN_LOCKED) {
+        printf("Too many wrong PINs - account locked for %d minutes\n", PIN_LOCKOUT_S / 60);
+        return 0;
+    }
+    if (result == PIN_WRONG) {
+        pthread_mutex_lock(&sessions.lock);
+        sessions.failures++;
+        pthread_mutex_unlock(&sessions.lock);
+        printf("Wrong PIN!\n");
+        return 0;
+    }
+    kiosk_session = session_open(user->user_id);
+    return 1;
+}
+
+/**
+ * Authorize an Operator Action
+ * Asks for the kiosk's operator PIN (WATER_ATM_OPERATOR_PIN); without one
+ * configured, operator actions stay locked. Too many wrong PINs lock them
+ * for PIN_LOCKOUT_S, like a wallet. Returns 1 if authorized
+ */
+int operator_authorize() {
+    static int failures;
+    static time_t locked_until;
+    char* expected = getenv("WATER_ATM_OPERATOR_PIN");
+    if (!expected || !pin_valid_format(expected)) {
+        printf("Operator actions are disabled (set a %d-%d digit WATER_ATM_OPERATOR_PIN)\n",
+               PIN_MIN_DIGITS, PIN_MAX_DIGITS);
+        return 0;
+    }
+    if (locked_until > time(NULL)) {
+        printf("Operator PIN locked - try again later\n");
+        return 0;
+    }
+    
+    char pin[16];
+    uint8_t entered[32], wanted[32];
+    printf("Operator PIN: ");
+    read_pin(pin, sizeof(pin));
+    sha256((const uint8_t*)pin, strlen(pin), entered);
+    sha256((const uint8_t*)expected, strlen(expected), wanted);
+    memset(pin, 0, sizeof(pin));
+    if (mac_equal(entered, wanted)) {
+        failures = 0;
+        return 1;
+    }
+    if (++failures >= PIN_MAX_FAILURES) {
+        failures = 0;
+        locked_until = time(NULL) + PIN_LOCKOUT_S;
+        printf("Too many wrong PINs - operator actions locked for %d minutes\n", PIN_LOCKOUT_S / 60);
+        return 0;
+    }
+    printf("Wrong PIN!\n");
+    return 0;
+}
+
+/**
+ * Read PIN
+ * Reads one word from stdin with terminal echo off (echo is left alone
+ * when stdin is not a terminal, e.g. a piped workload)
+ */
+void read_pin(char* pin, int size) {
+    char format[16];
+    snprintf(format, sizeof(format), "%%%ds", size - 1);
+    
+    struct termios saved, quiet;
+    int is_tty = isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &saved) == 0;
+    if (is_tty) {
+        quiet = saved;
+        quiet.c_lflag &= ~(tcflag_t)ECHO;
+        tcsetattr(STDIN_FILENO, TCSANOW, &quiet);
+    }
+    fflush(stdout);
+    if (scanf(format, pin) != 1) pin[0] = '\0';
+    if (is_tty) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+        printf("\n");                   // The Enter key was not echoed either
+    }
+}
+
+/**
+ * Ask for a new PIN (up to three tries); returns 1 if one was set
+ */
+int prompt_new_pin(User* user) {
+    char pin[16];
+    for (int tries = 0; tries < 3; tries++) {
+        printf("Set a %d-%d digit PIN: ", PIN_MIN_DIGITS, PIN_MAX_DIGITS);
+        read_pin(pin, sizeof(pin));
+        if (pin_valid_format(pin)) {
+            set_pin(user, pin);
+            memset(pin, 0, sizeof(pin));
+            return 1;
+        }
+        printf("PIN must be %d-%d digits\n", PIN_MIN_DIGITS, PIN_MAX_DIGITS);
+    }
+    return 0;
+}
+
+/**
+ * Change PIN Menu
+ * The current PIN is required if one is set
+ */
+void change_pin() {
+    long long user_id;
+    
+    printf("\n=== SET/CHANGE PIN ===\n");
+    printf("Enter User ID: ");
+    scanf("%lld", &user_id);
+    
+    User* user = tenant_user(user_id);
+    if (!user) {
+        printf("User not found!\n");
+        return;
+    }
+    if (user->has_pin) {
+        char pin[16];
+        printf("Current PIN: ");
+        read_pin(pin, sizeof(pin));
+        int result = pin_check(user, pin);
+        memset(pin, 0, sizeof(pin));
+        if (result != PIN_OK) {
+            printf(result == PIN_LOCKED ? "Account locked - try again later\n" : "Wrong PIN!\n");
+            return;
+        }
+    }
+    if (prompt_new_pin(user)) {
+        session_close(kiosk_session);
+        kiosk_session = 0;
+        printf("PIN updated!\n");
+    }
+}
+
+/**
+ * PIN Benchmark
+ * Cost of one PIN hash vs one session check, and a kiosk session of
+ * one login plus repeat purchases
+ */
+void pin_benchmark() {
+    users[user_count] = (User){.user_id = generate_id(), .name = "PIN Check"};
+    User* user = &users[user_count++];  // A real slot: set_pin updates the sync tree and tap profile
+    index_user(user);
+    uint8_t salt[16] = {0};
+    uint8_t hash[32];
+    
+    long long start = monotonic_ns();
+    int hashes = 5;
+    for (int i = 0; i < hashes; i++) pin_kdf("482913", salt, hash);
+    double kdf_ms = (monotonic_ns() - start) / 1e6 / hashes;
+    
+    set_pin(user, "482913");
+    uint64_t token = session_open(user->user_id);
+    int checks = 1000000, ok = 0;
+    start = monotonic_ns();
+    for (int i = 0; i < checks; i++) ok += session_check(token, user->user_id);
+    double check_ns = (monotonic_ns() - start) / (double)checks;
+    session_close(token);
+    
+    printf("\n=== PIN / SESSION BENCHMARK ===\n");
+    printf("scrypt N=%d r=%d p=1: %zu KB memory per hash\n", PIN_KDF_N, PIN_KDF_R, sizeof(kdf_scratch) / 1024);
+    printf("PIN hash (KDF):      %10.2f ms\n", kdf_ms);
+    printf("Session check:       %10.1f ns (%d/%d valid)\n", check_ns, ok, checks);
+    printf("10 purchases, PIN every time:  %8.1f ms\n", 10 * kdf_ms);
+    printf("10 purchases, one session:     %8.1f ms\n", kdf_ms + 9 * check_ns / 1e6);
+}
+
+// =================== BULK ROSTER IMPORT ===================
+
+/*
+ * Roster CSVs (name,phone,student) are memory-mapped and imported in
+ * rounds. In each round several threads parse adjacent slices of the file.
+ * A slice is classified 64 bytes at a time into a bitmask of structural
+ * characters (comma, newline, quote) with SSE2 compares, and the parser
+ * jumps from one set bit to the next instead of looking at every byte;
+ * lines containing quotes take a scalar path. Every non-blank line is at
+ * least 2 bytes, so a slice of 2 * k bytes never yields more than k rows and
+ * the fixed row table can't overflow. The calling thread then walks the
+ * rows in file order, in one pass: duplicates by phone (against existing
+ * users and earlier rows) are rejected, IDs come from one reserved block,
+ * and each user is written to the store and indexes. A report with one
+ * result per line is written next to the roster.
+ */
+
+#define IMPORT_ROW_STUDENT 0x01     // ImportRow.flags
+#define IMPORT_ROW_QUOTED 0x02      // Name was quoted (may contain "" escapes)
+
+typedef struct {
+    const char* base;               // Mapped file
+    size_t from, to;                // Slice [from, to), starts at a line start
+    uint32_t first_line;            // Line number of `from` (filled in after counting)
+    ImportRow* rows;                // Output slots for this slice
+    int row_count;
+    uint32_t lines;                 // Lines seen in the slice (incl. blank ones)
+} ImportSlice;
+
+static const char* import_status_names[] = {
+    "ok", "duplicate phone", "bad name", "bad phone", "bad student flag", "bad format", "user store full", "header"
+};
+
+/**
+ * Bitmask of ',' '\n' '"' in the 64 bytes at p (or fewer, at the end)
+ */
+static uint64_t csv_structural_mask(const char* p, size_t len) {
+    uint64_t mask = 0;
+#ifdef __SSE2__
+    if (len >= 64) {
+        const __m128i comma = _mm_set1_epi8(','), newline = _mm_set1_epi8('\n'), quote = _mm_set1_epi8('"');
+        for (int i = 0; i < 4; i++) {
+            __m128i bytes = _mm_loadu_si128((const __m128i*)(p + 16 * i));
+            __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, comma), _mm_cmpeq_epi8(bytes, newline)),
+                                        _mm_cmpeq_epi8(bytes, quote));
+            mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(hits) << (16 * i);
+        }
+        return mask;
+    }
+#endif
+    for (size_t i = 0; i < len && i < 64; i++) {
+        if (p[i] == ',' || p[i] == '\n' || p[i] == '"') mask |= 1ULL << i;
+    }
+    return mask;
+}
+
+/**
+ * Trim spaces (and a trailing '\r') from a field
+ */
+static void csv_trim(const char* base, size_t* from, size_t* to) {
+    while (*from < *to && base[*from] == ' ') (*from)++;
+    while (*to > *from && (base[*to - 1] == ' ' || base[*to - 1] == '\r')) (*to)--;
+}
+
+/**
+ * Validate a row's fields and fill in its ImportRow
+ */
+static void import_fill_row(const char* base, ImportRow* row, size_t name_from, size_t name_to,
+                            size_t phone_from, size_t phone_to, size_t flag_from, size_t flag_to, int quoted) {
+    row->status = IMPORT_OK;
+    row->flags = quoted ? IMPORT_ROW_QUOTED : 0;
+    if (!quoted) csv_trim(base, &name_from, &name_to);
+    csv_trim(base, &phone_from, &phone_to);
+    csv_trim(base, &flag_from, &flag_to);
+    row->name_off = (uint32_t)name_from;
+    row->name_len = name_to - name_from < 50 ? (uint8_t)(name_to - name_from) : 0;
+    row->phone_off = (uint32_t)phone_from;
+    // User.phone holds 14 characters plus the terminator; longer numbers are rejected
+    row->phone_len = phone_to - phone_from < sizeof(((User*)0)->phone) ? (uint8_t)(phone_to - phone_from) : 0;
+    row->phone_key = row->phone_len ? phone_key(base + phone_from, phone_to - phone_from) : 0;
+    
+    char flag = flag_to - flag_from == 1 ? base[flag_from] : '?';
+    if (row->phone_key == 0) {
+        // A first line whose phone column isn't a number is the column header
+        row->status = row->line == 1 && phone_to > phone_from && (base[phone_from] < '0' || base[phone_from] > '9') &&
+                      base[phone_from] != '+' ? IMPORT_HEADER : IMPORT_BAD_PHONE;
+    } else if (row->name_len == 0) {
+        row->status = IMPORT_BAD_NAME;
+    } else if (flag == '1' || flag == 'y' || flag == 'Y') {
+        row->flags |= IMPORT_ROW_STUDENT;
+    } else if (flag != '0' && flag != 'n' && flag != 'N') {
+        row->status = IMPORT_BAD_STUDENT;
+    }
+}
+
+/**
+ * Parse one line that contains quotes (scalar path)
+ */
+static void import_parse_quoted(const char* base, size_t from, size_t to, ImportRow* row) {
+    size_t bounds[6];
+    int field = 0, quoted_name = 0;
+    size_t p = from;
+    while (field < 3) {
+        while (p < to && base[p] == ' ') p++;
+        size_t start = p, end;
+        if (p < to && base[p] == '"') {
+            start = ++p;
+            while (p < to && !(base[p] == '"' && (p + 1 >= to || base[p + 1] != '"'))) p += base[p] == '"' ? 2 : 1;
+            end = p;
+            if (p < to) p++;                // Closing quote
+            while (p < to && base[p] != ',') p++;
+            if (field == 0) quoted_name = 1;
+        } else {
+            while (p < to && base[p] != ',') p++;
+            end = p;
+        }
+        bounds[2 * field] = start;
+        bounds[2 * field + 1] = end;
+        field++;
+        if (p >= to) break;
+        p++;                                // Comma
+    }
+    if (field != 3 || p < to) {
+        row->status = IMPORT_BAD_FORMAT;
+        return;
+    }
+    import_fill_row(base, row, bounds[0], bounds[1], bounds[2], bounds[3], bounds[4], bounds[5], quoted_name);
+}
+
+/**
+ * Parser Thread: one slice of the file into rows
+ */
+static void* import_parse_slice(void* arg) {
+    ImportSlice* slice = arg;
+    const char* base = slice->base;
+    size_t line_start = slice->from, commas[2];
+    int fields = 0, has_quote = 0;
+    uint32_t line = 0;
+    
+    for (size_t block = slice->from; block <= slice->to; block += 64) {
+        size_t len = block < slice->to ? slice->to - block : 0;
+        uint64_t mask = csv_structural_mask(base + block, len);
+        if (len < 64) mask |= 1ULL << len;  // End of slice acts as a final newline
+        while (mask) {
+            size_t pos = block + (size_t)__builtin_ctzll(mask);
+            mask &= mask - 1;
+            if (pos < slice->to && base[pos] == ',') {
+                if (fields < 2) commas[fields] = pos;
+                fields++;
+            } else if (pos < slice->to && base[pos] == '"') {
+                has_quote = 1;
+            } else {
+                // End of line (or of the slice)
+                int blank = pos == line_start || (pos == line_start + 1 && base[line_start] == '\r');
+                if (pos < slice->to || !blank) line++;
+                if (!blank) {
+                    ImportRow* row = &slice->rows[slice->row_count++];
+                    row->line = line;       // Made file-global after all slices are counted
+                    if (has_quote) {
+                        import_parse_quoted(base, line_start, pos, row);
+                    } else if (fields != 2) {
+                        row->status = IMPORT_BAD_FORMAT;
+                    } else {
+                        import_fill_row(base, row, line_start, commas[0], commas[0] + 1, commas[1],
+                                        commas[1] + 1, pos, 0);
+                    }
+                }
+                line_start = pos + 1;
+                fields = 0;
+                has_quote = 0;
+                if (pos >= slice->to) break;
+            }
+        }
+        if (len < 64) break;
+    }
+    slice->lines = line;
+    return NULL;
+}
+
+/**
+ * Copy a name field into a user record, undoing "" escapes of quoted names
+ */
+static void import_copy_name(char* out, const char* field, int len, int quoted) {
+    int n = 0;
+    for (int i = 0; i < len && n < 49; i++) {
+        out[n++] = field[i];
+        if (quoted && field[i] == '"' && i + 1 < len && field[i + 1] == '"') i++;
+    }
+    out[n] = '\0';
+}
+
+/**
+ * Buffered report writer (one static buffer, plain write())
+ * Shared by the roster import and the wallet credit batch
+ */
+static char report_buf[1 << 16];
+static size_t report_len = 0;
+
+static int report_flush(int fd) {
+    size_t done = 0;
+    while (fd >= 0 && done < report_len) {
+        ssize_t n = write(fd, report_buf + done, report_len - done);
+        if (n <= 0) break;
+        done += n;
+    }
+    int complete = done == report_len;
+    report_len = 0;
+    return complete;
+}
+
+static void import_report_line(int fd, uint32_t line, int status, long long user_id) {
+    if (report_len > sizeof(report_buf) - 96) report_flush(fd);
+    report_len += snprintf(report_buf + report_len, 96, status == IMPORT_OK ? "%u,%s,%lld\n" : "%u,%s,\n",
+                                  line, import_status_names[status], user_id);
+}
+
+/**
+ * Import Roster
+ * Registers every valid, new row of a name,phone,student CSV. Writes
+ * "<path>.report" with line,result,user_id for each row and fills in the
+ * per-result counts (indexed by IMPORT_*). Returns the number of users
+ * added, or -1 if the file can't be read.
+ */
+int import_roster(const char* path, int threads, int counts[IMPORT_HEADER + 1]) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size <= 0 || size > UINT32_MAX) {
+        close(fd);
+        return size == 0 ? 0 : -1;
+    }
+    const char* base = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return -1;
+    mem_claim(MEM_BUFFERS, (size_t)size);
+    madvise((void*)base, (size_t)size, MADV_SEQUENTIAL);
+    
+    char report_path[512];
+    snprintf(report_path, sizeof(report_path), "%s.report", path);
+    int report = open(report_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    report_len = 0;
+    
+    if (threads < 1) threads = 1;
+    if (threads > IMPORT_MAX_THREADS) threads = IMPORT_MAX_THREADS;
+    memset(counts, 0, sizeof(int) * (IMPORT_HEADER + 1));
+    int added = 0;
+    uint32_t line_base = 0;
+    size_t offset = 0;
+    
+    while (offset < (size_t)size) {
+        // Cut this round into slices that end at line ends
+        ImportSlice slices[IMPORT_MAX_THREADS];
+        size_t slice_bytes = 2 * (IMPORT_ROUND_ROWS / threads - 1);
+        int used = 0;
+        for (int t = 0; t < threads && offset < (size_t)size; t++, used++) {
+            size_t end = offset + slice_bytes < (size_t)size ? offset + slice_bytes : (size_t)size;
+            const char* newline = end < (size_t)size ? memchr(base + end, '\n', (size_t)size - end) : NULL;
+            if (end < (size_t)size) end = newline ? (size_t)(newline - base) + 1 : (size_t)size;
+            slices[t] = (ImportSlice){base, offset, end, 0, &import_rows[t * (IMPORT_ROUND_ROWS / threads)], 0, 0};
+            offset = end;
+        }
+        
+        // A slice whose thread can't be started is parsed here instead
+        pthread_t workers[IMPORT_MAX_THREADS];
+        int started[IMPORT_MAX_THREADS] = {0};
+        for (int t = 1; t < used; t++) {
+            started[t] = pthread_create(&workers[t], NULL, import_parse_slice, &slices[t]) == 0;
+        }
+        import_parse_slice(&slices[0]);
+        for (int t = 1; t < used; t++) {
+            if (started[t]) pthread_join(workers[t], NULL); else import_parse_slice(&slices[t]);
+        }
+        
+        // One pass in file order: dedupe, assign IDs, insert and index
+        int candidates = 0;
+        for (int t = 0; t < used; t++) {
+            for (int r = 0; r < slices[t].row_count; r++) candidates += slices[t].rows[r].status == IMPORT_OK;
+        }
+        // Only rows that can still fit need an ID (the rest are reported as full)
+        int room = MAX_USERS - user_count;
+        int tenant_room = tenants[active_tenant].max_users - tenants[active_tenant].users;
+        if (tenant_room < room) room = tenant_room;
+        if (candidates > room) candidates = room > 0 ? room : 0;
+        long long first_id = candidates > 0 ? generate_id_block(candidates) : 0;
+        int next_id = 0;
+        
+        for (int t = 0; t < used; t++) {
+            for (int r = 0; r < slices[t].row_count; r++) {
+                ImportRow* row = &slices[t].rows[r];
+                row->line += line_base;
+                if (row->status == IMPORT_OK) {
+                    uint64_t key = row->phone_key | (uint64_t)active_tenant << TENANT_KEY_SHIFT;
+                    size_t slot = index_slot(key);
+                    while (phone_index[slot].key != 0 && phone_index[slot].key != key) {
+                        slot = slot + 1 == USER_INDEX_SLOTS ? 0 : slot + 1;
+                    }
+                    if (phone_index[slot].key == key) {
+                        row->status = IMPORT_DUPLICATE;
+                    } else if (user_count >= MAX_USERS ||
+                               tenants[active_tenant].users >= tenants[active_tenant].max_users) {
+                        row->status = IMPORT_FULL;
+                    } else {
+                        User* user = &users[user_count];
+                        memset(user, 0, sizeof(*user));
+                        user->user_id = row->user_id = id_block_nth(first_id, next_id++);
+                        import_copy_name(user->name, base + row->name_off, row->name_len, row->flags & IMPORT_ROW_QUOTED);
+                        memcpy(user->phone, base + row->phone_off, row->phone_len);
+                        user->phone[row->phone_len] = '\0';
+                        user->is_student = row->flags & IMPORT_ROW_STUDENT;
+                        user->tenant = active_tenant;
+                        
+                        // Insert into both indexes (phone slot already found)
+                        phone_index[slot].key = key;
+                        phone_index[slot].user = user_count;
+                        size_t id_slot = index_slot((uint64_t)user->user_id);
+                        while (user_id_index[id_slot] != 0) id_slot = id_slot + 1 == USER_INDEX_SLOTS ? 0 : id_slot + 1;
+                        user_id_index[id_slot] = user_count + 1;
+                        user_count++;
+                        tenants[active_tenant].users++;
+                        mem_claim(MEM_USERS, sizeof(User) + sizeof(TapProfile));
+                        mem_claim(MEM_INDEXES, sizeof(user_id_index[0]) + sizeof(phone_index[0]));
+                        sync_track(user);
+                        cohort_join(user);
+                        tap_profile_refresh(user);
+                        added++;
+                    }
+                }
+                counts[row->status]++;
+                if (row->status != IMPORT_HEADER) import_report_line(report, row->line, row->status, row->user_id);
+            }
+            line_base += slices[t].lines;
+        }
+    }
+    
+    report_flush(report);
+    if (report >= 0) close(report);
+    munmap((void*)base, (size_t)size);
+    mem_release(MEM_BUFFERS, (size_t)size);
+    return added;
+}
+
+/**
+ * Import a roster and print the summary
+ */
+void import_roster_run(const char* path) {
+    int counts[IMPORT_HEADER + 1];
+    long long start = monotonic_ns();
+    int added = import_roster(path, (int)sysconf(_SC_NPROCESSORS_ONLN), counts);
+    double elapsed_ms = (monotonic_ns() - start) / 1e6;
+    if (added < 0) {
+        printf("Cannot read %s\n", path);
+        return;
+    }
+    
+    printf("Registered: %d users in %.1f ms\n", added, elapsed_ms);
+    for (int status = IMPORT_DUPLICATE; status < IMPORT_HEADER; status++) {
+        if (counts[status]) printf("Rejected (%s): %d\n", import_status_names[status], counts[status]);
+    }
+    printf("Per-line results: %s.report\n", path);
+    printf("Imported users set their PIN with menu option 13\n");
+}
+
+/**
+ * Import Roster Menu
+ */
+void import_roster_menu() {
+    char path[400];
+    
+    printf("\n=== BULK ROSTER IMPORT ===\n");
+    printf("CSV columns: name,phone,student (1/0)\n");
+    printf("Roster file: ");
+    scanf(" %399[^\n]", path);
+    import_roster_run(path);
+}
+
+/**
+ * Import Benchmark
+ * Writes a synthetic roster (2% repeated phones, a few bad rows) and imports it
+ */
+void import_benchmark(int rows) {
+    char path[] = "/tmp/water_atm_roster_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        printf("Cannot create roster file\n");
+        return;
+    }
+    
+    unsigned int seed = 2024;
+    report_len = 0;
+    size_t written = 0;
+    written += snprintf(report_buf, sizeof(report_buf), "name,phone,student\n");
+    report_len = written;
+    for (int i = 0; i < rows; i++) {
+        if (report_len > sizeof(report_buf) - 96) report_flush(fd);
+        long long phone = 9000000000LL + (rand_r(&seed) % 50 == 0 ? rand_r(&seed) % (i + 1) : i);
+        int bad = rand_r(&seed) % 1000 == 0;
+        report_len += snprintf(report_buf + report_len, 96,
+                                      i % 97 == 0 ? "\"Kumar, Student %d\",%lld,%d\n" : "Student %d,%lld,%d\n",
+                                      i + 1, bad ? 42 : phone, rand_r(&seed) % 5 != 0);
+    }
+    report_flush(fd);
+    off_t bytes = lseek(fd, 0, SEEK_END);
+    close(fd);
+    
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int counts[IMPORT_HEADER + 1];
+    long long start = monotonic_ns();
+    int added = import_roster(path, threads, counts);
+    double elapsed = (monotonic_ns() - start) / 1e9;
+    
+    printf("\n=== ROSTER IMPORT BENCHMARK (%d parser threads) ===\n", threads < IMPORT_MAX_THREADS ? threads : IMPORT_MAX_THREADS);
+    printf("Rows: %d (%.1f MB)\n", rows, bytes / 1e6);
+    printf("Registered: %d, duplicate phones: %d, bad rows: %d, store full: %d\n", added, counts[IMPORT_DUPLICATE],
+           counts[IMPORT_BAD_NAME] + counts[IMPORT_BAD_PHONE] + counts[IMPORT_BAD_STUDENT] + counts[IMPORT_BAD_FORMAT],
+           counts[IMPORT_FULL]);
+    printf("Elapsed: %.3f s (%.0f rows/s, %.0f MB/s) incl. per-line report\n", elapsed, rows / elapsed, bytes / 1e6 / elapsed);
+    User* sample = find_user_by_phone("9000000097");
+    if (sample) printf("Lookup by phone 9000000097: %s (ID %lld)\n", sample->name, sample->user_id);
+    
+    char report_path[64];
+    snprintf(report_path, sizeof(report_path), "%s.report", path);
+    unlink(report_path);
+    unlink(path);
+}
+
+// =================== BULK WALLET CREDITS ===================
+
+/*
+ * Employers and hostels pre-fund wallets with settlement files of
+ * "user_id,amount" lines. A batch is applied in one pass over the mapped
+ * file: each line is validated, its bonus worked out on its own (2% for
+ * credits of ₹100 or more, exactly as if it had been a separate top-up, so
+ * splitting or merging lines never changes what a user gets), and summed
+ * into the user's CreditTotal. All money is handled in paise.
+ *
+ * The per-user totals are then appended to a credit journal as one batch,
+ * ending in a commit line, and synced once. Only after that are balances
+ * changed; if the journal write fails nothing is credited. The batch is
+ * identified by the SHA-256 of the file, so a settlement that is already
+ * committed in the journal is refused rather than credited twice.
+ */
+
+static const char* credit_status_names[] = {"ok", "unknown user", "bad amount", "bad format", "header"};
+
+/**
+ * Parse "123.45" into paise (at most 2 decimals); -1 if invalid
+ */
+static long long parse_paise(const char* p, const char* end) {
+    long long paise = 0;
+    int digits = 0, decimals = -1;
+    for (; p < end; p++) {
+        if (*p >= '0' && *p <= '9') {
+            if (decimals >= 2 || paise > CREDIT_MAX_PAISE) return -1;
+            paise = paise * 10 + (*p - '0');
+            digits++;
+            if (decimals >= 0) decimals++;
+        } else if (*p == '.' && decimals < 0) {
+            decimals = 0;
+        } else {
+            return -1;
+        }
+    }
+    if (digits == 0) return -1;
+    for (int i = decimals < 0 ? 0 : decimals; i < 2; i++) paise *= 10;
+    return paise;
+}
+
+/**
+ * Journal Contains Batch
+ * Looks for "commit <digest>" in the journal (batches without it never committed)
+ */
+static int credit_journal_has(const char* journal_path, const char* digest) {
+    int fd = open(journal_path, O_RDONLY);
+    if (fd < 0) return 0;
+    off_t size = lseek(fd, 0, SEEK_END);
+    const char* base = size > 0 ? mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (base == MAP_FAILED) return 0;
+    mem_claim(MEM_BUFFERS, (size_t)size);
+    
+    int found = 0;
+    for (const char* line = base; !found && line < base + size;) {
+        const char* next = memchr(line, '\n', (size_t)(base + size - line));
+        if (!next) break;
+        found = next - line == 71 && memcmp(line, "commit ", 7) == 0 && memcmp(line + 7, digest, 64) == 0;
+        line = next + 1;
+    }
+    munmap((void*)base, (size_t)size);
+    mem_release(MEM_BUFFERS, (size_t)size);
+    return found;
+}
+
+/**
+ * Append Batch to Credit Journal
+ * One synced write of every user's totals; on failure the journal is cut
+ * back to where it was
+ */
+static int credit_journal_commit(const char* journal_path, const CreditBatchResult* result) {
+    int fd = open(journal_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) return 0;
+    off_t start = lseek(fd, 0, SEEK_END);
+    
+    int ok = 1;
+    report_len = snprintf(report_buf, sizeof(report_buf), "batch %s users %d credit %lld bonus %lld time %lld\n",
+                          result->digest, result->users, result->credit_paise, result->bonus_paise, (long long)time(NULL));
+    for (int i = 0; i < result->users; i++) {
+        if (report_len > sizeof(report_buf) - 64) ok &= report_flush(fd);
+        const CreditTotal* total = &credit_totals[credit_users[i]];
+        report_len += snprintf(report_buf + report_len, 64, "%lld,%lld,%lld\n",
+                               users[credit_users[i]].user_id, total->credit_paise, total->bonus_paise);
+    }
+    report_len += snprintf(report_buf + report_len, 80, "commit %s\n", result->digest);
+    ok &= report_flush(fd);
+    ok = ok && fdatasync(fd) == 0;
+    if (!ok && ftruncate(fd, start) == 0) fdatasync(fd);
+    close(fd);
+    return ok;
+}
+
+/**
+ * Apply Settlement File
+ * Validates every line, credits the valid ones as one journaled batch and
+ * writes "<path>.report" with line,result,credit,bonus for each line.
+ * Returns the number of users credited, -1 if the file can't be read, or
+ * CREDIT_ALREADY_APPLIED / CREDIT_JOURNAL_FAILED (nothing credited).
+ */
+int credit_batch_apply(const char* path, const char* journal_path, CreditBatchResult* result) {
+    memset(result, 0, sizeof(*result));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    off_t size = lseek(fd, 0, SEEK_END);
+    const char* base = size > 0 ? mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (base == MAP_FAILED) return size == 0 ? 0 : -1;
+    mem_claim(MEM_BUFFERS, (size_t)size);
+    madvise((void*)base, (size_t)size, MADV_SEQUENTIAL);
+    
+    uint8_t digest[32];
+    sha256((const uint8_t*)base, (size_t)size, digest);
+    for (int i = 0; i < 32; i++) snprintf(result->digest + 2 * i, 3, "%02x", digest[i]);
+    if (credit_journal_has(journal_path, result->digest)) {
+        munmap((void*)base, (size_t)size);
+        mem_release(MEM_BUFFERS, (size_t)size);
+        return CREDIT_ALREADY_APPLIED;
+    }
+    
+    char report_path[512];
+    snprintf(report_path, sizeof(report_path), "%s.report", path);
+    int report = open(report_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    report_len = 0;
+    
+    // Validate and sum per user
+    uint32_t line_no = 0;
+    for (const char* line = base; line < base + size;) {
+        const char* end = memchr(line, '\n', (size_t)(base + size - line));
+        const char* next = end ? end + 1 : base + size;
+        if (!end) end = base + size;
+        line_no++;
+        if (end > line && end[-1] == '\r') end--;
+        if (end == line) {
+            line = next;
+            continue;
+        }
+        
+        const char* comma = memchr(line, ',', (size_t)(end - line));
+        int status = CREDIT_OK;
+        long long paise = 0, bonus = 0;
+        User* user = NULL;
+        if (!comma || memchr(comma + 1, ',', (size_t)(end - comma - 1))) {
+            status = CREDIT_BAD_FORMAT;
+        } else {
+            const char* id_from = line, *id_to = comma, *amount_from = comma + 1, *amount_to = end;
+            while (id_from < id_to && *id_from == ' ') id_from++;
+            while (id_to > id_from && id_to[-1] == ' ') id_to--;
+            while (amount_from < amount_to && *amount_from == ' ') amount_from++;
+            while (amount_to > amount_from && amount_to[-1] == ' ') amount_to--;
+            
+            long long user_id = 0;
+            const char* p = id_from;
+            while (p < id_to && *p >= '0' && *p <= '9' && user_id < LLONG_MAX / 10) user_id = user_id * 10 + (*p++ - '0');
+            paise = parse_paise(amount_from, amount_to);
+            if (line_no == 1 && (id_from == id_to || *id_from < '0' || *id_from > '9')) {
+                status = CREDIT_HEADER;
+            } else if (p != id_to || id_from == id_to || !(user = tenant_user(user_id))) {
+                status = CREDIT_UNKNOWN_USER;
+            } else if (paise <= 0 || paise > CREDIT_MAX_PAISE) {
+                status = CREDIT_BAD_AMOUNT;
+            }
+        }
+        
+        if (status == CREDIT_OK) {
+            bonus = paise >= CREDIT_BONUS_MIN_PAISE ? (paise * 2 + 50) / 100 : 0;
+            CreditTotal* total = &credit_totals[user - users];
+            if (total->credit_paise == 0) credit_users[result->users++] = (int)(user - users);
+            total->credit_paise += paise;
+            total->bonus_paise += bonus;
+            result->credit_paise += paise;
+            result->bonus_paise += bonus;
+        }
+        result->counts[status]++;
+        if (status != CREDIT_HEADER) {
+            if (report_len > sizeof(report_buf) - 96) report_flush(report);
+            report_len += snprintf(report_buf + report_len, 96, status == CREDIT_OK ? "%u,%s,%lld.%02lld,%lld.%02lld\n" : "%u,%s,,\n",
+                                   line_no, credit_status_names[status], paise / 100, paise % 100, bonus / 100, bonus % 100);
+        }
+        line = next;
+    }
+    report_flush(report);
+    if (report >= 0) close(report);
+    munmap((void*)base, (size_t)size);
+    mem_release(MEM_BUFFERS, (size_t)size);
+    
+    // Durable first, then the balances; the totals are cleared either way
+    int committed = result->users == 0 || credit_journal_commit(journal_path, result);
+    for (int i = 0; i < result->users; i++) {
+        User* user = &users[credit_users[i]];
+        CreditTotal* total = &credit_totals[credit_users[i]];
+        if (committed) {
+            user->wallet_balance += (total->credit_paise + total->bonus_paise) / 100.0;
+            user_changed(user);
+        }
+        total->credit_paise = total->bonus_paise = 0;
+    }
+    if (!committed) {
+        unlink(report_path);                // Its "ok" lines were never credited
+        return CREDIT_JOURNAL_FAILED;
+    }
+    return result->users;
+}
+
+/**
+ * Credit Journal Path (WATER_ATM_CREDIT_JOURNAL, or a file in the working directory)
+ */
+static const char* credit_journal_path() {
+    char* journal = getenv("WATER_ATM_CREDIT_JOURNAL");
+    return journal ? journal : "wallet_credits.journal";
+}
+
+/**
+ * Apply a settlement file and print the summary
+ */
+void credit_batch_run(const char* path) {
+    CreditBatchResult result;
+    long long start = monotonic_ns();
+    int credited = credit_batch_apply(path, credit_journal_path(), &result);
+    double elapsed_ms = (monotonic_ns() - start) / 1e6;
+    
+    if (credited == -1) {
+        printf("Cannot read %s\n", path);
+        return;
+    }
+    if (credited == CREDIT_ALREADY_APPLIED) {
+        printf("Settlement %.12s... was already applied - nothing credited\n", result.digest);
+        return;
+    }
+    if (credited == CREDIT_JOURNAL_FAILED) {
+        printf("Credit journal %s could not be written - nothing credited\n", credit_journal_path());
+        return;
+    }
+    
+    printf("Credited: %d lines to %d users in %.1f ms\n", result.counts[CREDIT_OK], credited, elapsed_ms);
+    printf("Total: ₹%lld.%02lld + bonus ₹%lld.%02lld (2%% on each credit ≥ ₹100)\n",
+           result.credit_paise / 100, result.credit_paise % 100, result.bonus_paise / 100, result.bonus_paise % 100);
+    for (int status = CREDIT_UNKNOWN_USER; status < CREDIT_HEADER; status++) {
+        if (result.counts[status]) printf("Rejected (%s): %d\n", credit_status_names[status], result.counts[status]);
+    }
+    printf("Per-line results: %s.report\n", path);
+}
+
+/**
+ * Credit Batch Menu
+ */
+void credit_batch_menu() {
+    char path[400];
+    
+    printf("\n=== BULK WALLET CREDIT ===\n");
+    printf("Settlement lines: user_id,amount\n");
+    printf("Settlement file: ");
+    scanf(" %399[^\n]", path);
+    credit_batch_run(path);
+}
+
+/**
+ * Credit Benchmark
+ * Credits a synthetic settlement file to 50% of capacity worth of users
+ * and checks the balances add up
+ */
+void credit_benchmark(int lines) {
+    int holders = MAX_USERS / 2;
+    for (int i = 0; i < holders && user_count < MAX_USERS; i++) {
+        User* user = &users[user_count++];
+        memset(user, 0, sizeof(*user));
+        user->user_id = generate_id();
+        index_user(user);
+        snprintf(user->name, sizeof(user->name), "Employee %d", i + 1);
+    }
+    
+    char path[] = "/tmp/water_atm_settlement_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        printf("Cannot create settlement file\n");
+        return;
+    }
+    unsigned int seed = 7;
+    report_len = snprintf(report_buf, sizeof(report_buf), "user_id,amount\n");
+    for (int i = 0; i < lines; i++) {
+        if (report_len > sizeof(report_buf) - 64) report_flush(fd);
+        long long user_id = rand_r(&seed) % 1000 == 0 ? 42 : users[rand_r(&seed) % user_count].user_id;
+        int rupees = rand_r(&seed) % 4 == 0 ? 100 + rand_r(&seed) % 900 : 10 + rand_r(&seed) % 90;
+        report_len += snprintf(report_buf + report_len, 64, "%lld,%d.%02d\n", user_id, rupees, rand_r(&seed) % 100);
+    }
+    report_flush(fd);
+    off_t bytes = lseek(fd, 0, SEEK_END);
+    close(fd);
+    
+    char journal[64];
+    snprintf(journal, sizeof(journal), "%s.journal", path);
+    double before = 0, after = 0;
+    for (int i = 0; i < user_count; i++) before += users[i].wallet_balance;
+    
+    CreditBatchResult result;
+    long long start = monotonic_ns();
+    int credited = credit_batch_apply(path, journal, &result);
+    double elapsed = (monotonic_ns() - start) / 1e9;
+    for (int i = 0; i < user_count; i++) after += users[i].wallet_balance;
+    int again = credit_batch_apply(path, journal, &(CreditBatchResult){0});
+    
+    printf("\n=== BULK WALLET CREDIT BENCHMARK ===\n");
+    printf("Lines: %d (%.1f MB) for %d users\n", lines, bytes / 1e6, user_count);
+    printf("Credited: %d lines to %d users, unknown users: %d\n", result.counts[CREDIT_OK], credited,
+           result.counts[CREDIT_UNKNOWN_USER]);
+    printf("Elapsed: %.3f s (%.0f lines/s, %.0f MB/s) incl. report and synced journal\n",
+           elapsed, lines / elapsed, bytes / 1e6 / elapsed);
+    printf("Balances grew ₹%.2f = credits ₹%.2f + bonus ₹%.2f\n", after - before,
+           result.credit_paise / 100.0, result.bonus_paise / 100.0);
+    printf("Applying the same file again: %s\n", again == CREDIT_ALREADY_APPLIED ? "refused (already applied)" : "NOT refused");
+    
+    char report_path[64];
+    snprintf(report_path, sizeof(report_path), "%s.report", path);
+    unlink(report_path);
+    unlink(journal);
+    unlink(path);
+}
+
+// =================== NOZZLE SCHEDULER ===================
+
+/*
+ * Paid orders wait for one of the kiosk's nozzles. Each order's nozzle time
+ * is estimated from its liters at NOZZLE_FLOW_LPM plus a fixed handover.
+ * Shortest-job-first with aging ranks an order by
+ *     service - NOZZLE_AGING * (now - arrival)
+ * which orders the same way at every instant as
+ *     service + NOZZLE_AGING * arrival
+ * so that fixed value is the heap key and the heaps never need re-sorting.
+ * Every second of waiting is worth half a second of job size, so a 20 L
+ * order overtaken by 1 L buyers still reaches the front within minutes.
+ * Under NOZZLE_BULK_LANE orders of MIN_BULK_LITERS or more queue in their
+ * own lane, and only one of them dispenses at a time: any free nozzle can
+ * take the next bulk order, but several bulk orders can never hold all the
+ * nozzles while small buyers wait.
+ */
+
+static void order_heap_push(NozzleOrder* heap, int* count, const NozzleOrder* order) {
+    int i = (*count)++;
+    while (i > 0 && heap[(i - 1) / 2].key > order->key) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = *order;
+}
+
+static NozzleOrder order_heap_pop(NozzleOrder* heap, int* count) {
+    NozzleOrder top = heap[0], last = heap[--(*count)];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= *count) break;
+        if (child + 1 < *count && heap[child + 1].key < heap[child].key) child++;
+        if (heap[child].key >= last.key) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    if (*count > 0) heap[i] = last;
+    return top;
+}
+
+/**
+ * Lane the next free nozzle takes work from (NULL if nothing can start)
+ */
+static NozzleOrder* nozzle_lane(NozzleScheduler* s, int** count) {
+    int bulk_ready = s->bulk_count > 0 && (s->bulk_nozzle < 0 || s->free_at[s->bulk_nozzle] <= s->now);
+    if (bulk_ready && (s->small_count == 0 || s->bulk[0].key < s->small[0].key)) {
+        *count = &s->bulk_count;
+        return s->bulk;
+    }
+    *count = &s->small_count;
+    return s->small_count > 0 ? s->small : NULL;
+}
+
+/**
+ * Start an order on every idle nozzle while work can start
+ */
+static void nozzle_start_ready(NozzleScheduler* s, NozzleStartFn on_start, void* ctx) {
+    for (int n = 0; n < s->nozzles; n++) {
+        int* count;
+        NozzleOrder* lane;
+        if (s->free_at[n] > s->now) continue;
+        if (n == s->bulk_nozzle) s->bulk_nozzle = -1;  // Its bulk order has finished
+        if (!(lane = nozzle_lane(s, &count))) continue;
+        if (lane == s->bulk) s->bulk_nozzle = n;
+        NozzleOrder order = order_heap_pop(lane, count);
+        mem_release(MEM_SERVICES, sizeof(order));
+        s->free_at[n] = s->now + order.service_s;
+        if (on_start) on_start(&order, n, s->now, ctx);
+    }
+}
+
+void nozzle_init(NozzleScheduler* s, int nozzles, int policy) {
+    if (s->small_count + s->bulk_count > 0) mem_release(MEM_SERVICES, (s->small_count + s->bulk_count) * sizeof(NozzleOrder));
+    memset(s, 0, offsetof(NozzleScheduler, small));
+    s->nozzles = nozzles < NOZZLE_MAX ? nozzles : NOZZLE_MAX;
+    s->policy = policy;
+    s->small_count = s->bulk_count = 0;
+    s->bulk_nozzle = -1;
+    s->next_ticket = 1;
+    s->turned_away = 0;
+}
+
+/**
+ * Queue an order that arrives at arrival_s (call nozzle_advance up to it first)
+ */
+int nozzle_enqueue(NozzleScheduler* s, double liters, double arrival_s) {
+    NozzleOrder order = {
+        .ticket = s->next_ticket,
+        .liters = liters,
+        .arrival_s = arrival_s,
+        .service_s = liters / NOZZLE_FLOW_LPM * 60.0 + NOZZLE_HANDOVER_S,
+    };
+    order.key = s->policy == NOZZLE_FIFO ? arrival_s : order.service_s + NOZZLE_AGING * arrival_s;
+    
+    int bulk = s->policy == NOZZLE_BULK_LANE && s->nozzles > 1 && liters >= MIN_BULK_LITERS;
+    int* count = bulk ? &s->bulk_count : &s->small_count;
+    if (*count == NOZZLE_QUEUE_MAX) {
+        s->turned_away++;
+        return 0;
+    }
+    order_heap_push(bulk ? s->bulk : s->small, count, &order);
+    mem_claim(MEM_SERVICES, sizeof(order));
+    return (int)s->next_ticket++;
+}
+
+/**
+ * Advance the scheduler clock to `until` (INFINITY drains the queues),
+ * starting orders as nozzles free up; on_start is called for each
+ */
+void nozzle_advance(NozzleScheduler* s, double until, NozzleStartFn on_start, void* ctx) {
+    for (;;) {
+        nozzle_start_ready(s, on_start, ctx);
         
-    } else if (payment_choice == 2) {
-        // ===== DIGITAL PAYMENT PROCESSING =====
-        strcpy(payment_method, "Digital");
+        // Next time a nozzle frees up while work is waiting
+        double next = INFINITY;
+        for (int n = 0; s->small_count + s->bulk_count > 0 && n < s->nozzles; n++) {
+            if (s->free_at[n] > s->now && s->free_at[n] < next) next = s->free_at[n];
+        }
+        if (next > until || next == INFINITY) break;
+        s->now = next;
+    }
+    if (until != INFINITY && until > s->now) {
+        s->now = until;
+        nozzle_start_ready(s, on_start, ctx);
+    }
+}
+
+typedef struct {
+    long long ticket;
+    int nozzle;
+    double start_s;
+} NozzleWatch;
+
+static void nozzle_watch_start(const NozzleOrder* order, int nozzle, double start_s, void* ctx) {
+    NozzleWatch* watch = ctx;
+    if (order->ticket == watch->ticket) {
+        watch->nozzle = nozzle;
+        watch->start_s = start_s;
+    }
+}
+
+/**
+ * Nozzle Assignment (after a paid purchase, counter or card tap)
+ * Tells the customer which nozzle to use and roughly when
+ */
+void nozzle_assign(double liters, int show_output) {
+    NozzleScheduler* s = &kiosk_nozzles;
+    double now = monotonic_ms() / 1000.0;
+    
+    nozzle_advance(s, now, NULL, NULL);
+    NozzleWatch watch = {nozzle_enqueue(s, liters, now), -1, 0};
+    if (watch.ticket == 0) {
+        if (show_output) printf("All nozzle queues are full - please wait for staff\n");
+        return;
+    }
+    nozzle_advance(s, now, nozzle_watch_start, &watch);
+    if (watch.nozzle >= 0) {
+        if (show_output) printf("Please go to nozzle %d now\n", watch.nozzle + 1);
+        return;
+    }
+    if (!show_output) return;
+    
+    // Not started yet: play the queue forward on a copy (no later arrivals)
+    memcpy(&nozzle_plan, s, offsetof(NozzleScheduler, small));
+    memcpy(nozzle_plan.small, s->small, s->small_count * sizeof(NozzleOrder));
+    memcpy(nozzle_plan.bulk, s->bulk, s->bulk_count * sizeof(NozzleOrder));
+    nozzle_plan.small_count = s->small_count;
+    nozzle_plan.bulk_count = s->bulk_count;
+    mem_claim(MEM_SERVICES, (s->small_count + s->bulk_count) * sizeof(NozzleOrder)); // Drained below
+    nozzle_advance(&nozzle_plan, INFINITY, nozzle_watch_start, &watch);
+    printf("Ticket %lld: nozzle %d in about %.0f s (queue: %d)\n", watch.ticket, watch.nozzle + 1,
+           watch.start_s - now, s->small_count + s->bulk_count);
+}
+
+// =================== NOZZLE SIMULATOR ===================
+
+typedef struct {
+    int started, small_started;
+    double liters, last_finish_s;
+    double bulk_wait_s;
+    int bulk_started;
+} NozzleSimStats;
+
+static void nozzle_sim_start(const NozzleOrder* order, int nozzle, double start_s, void* ctx) {
+    NozzleSimStats* stats = ctx;
+    long long wait_ms = llround((start_s - order->arrival_s) * 1000);
+    nozzle_sim_waits[0][stats->started++] = wait_ms;
+    if (order->liters <= 2) nozzle_sim_waits[1][stats->small_started++] = wait_ms;
+    if (order->liters >= MIN_BULK_LITERS) {
+        stats->bulk_wait_s += wait_ms / 1000.0;
+        stats->bulk_started++;
+    }
+    stats->liters += order->liters;
+    if (start_s + order->service_s > stats->last_finish_s) stats->last_finish_s = start_s + order->service_s;
+    (void)nozzle;
+}
+
+/**
+ * Simulated order size: mostly 1-2 L bottles, some 5 L cans, a few 20 L jars
+ */
+static double nozzle_sim_liters(unsigned int* seed) {
+    int r = rand_r(seed) % 100;
+    return r < 65 ? 1 + rand_r(seed) % 2 : r < 92 ? 5 : 20;
+}
+
+/**
+ * Nozzle Simulator
+ * Poisson arrivals at the given rate, the same stream for every policy.
+ * A run that is over 100% busy has no steady state: its queue only stops
+ * growing when lanes fill and customers are turned away, so its waits
+ * measure NOZZLE_QUEUE_MAX rather than the policy and are not reported.
+ */
+void nozzle_simulate(int nozzles, double arrivals_per_hour) {
+    if (nozzles < 1 || nozzles > NOZZLE_MAX || !(arrivals_per_hour > 0)) {
+        printf("Nozzles must be 1-%d and customers/hour above 0\n", NOZZLE_MAX);
+        return;
+    }
+    static const char* policy_names[] = {"FIFO", "SJF + aging", "SJF + aging + bulk lane"};
+    struct { const char* name; int nozzles, policy; } runs[] = {
+        {"One at a time (today)", 1, NOZZLE_FIFO},
+        {policy_names[NOZZLE_FIFO], nozzles, NOZZLE_FIFO},
+        {policy_names[NOZZLE_SJF], nozzles, NOZZLE_SJF},
+        {policy_names[NOZZLE_BULK_LANE], nozzles, NOZZLE_BULK_LANE},
+    };
+    int customers = NOZZLE_SIM_MAX;
+    
+    printf("\n=== NOZZLE SCHEDULER SIMULATION ===\n");
+    printf("%d nozzles, %.0f customers/hour, %d customers, %.0f L/min + %.0f s handover per order\n",
+           nozzles, arrivals_per_hour, customers, NOZZLE_FLOW_LPM, NOZZLE_HANDOVER_S);
+    printf("%-24s %6s %9s %9s %12s %11s %9s %9s\n", "Policy", "Busy", "Mean (s)", "p95 (s)", "p95 <=2L (s)",
+           "Bulk avg(s)", "L/hour", "Refused");
+    
+    for (size_t r = 0; r < sizeof(runs) / sizeof(runs[0]); r++) {
+        nozzle_init(&nozzle_plan, runs[r].nozzles, runs[r].policy);
+        NozzleSimStats stats = {0};
+        unsigned int seed = 2024;
+        double t = 0, offered_s = 0;
+        for (int i = 0; i < customers; i++) {
+            t += -log((rand_r(&seed) + 1.0) / (RAND_MAX + 2.0)) * 3600.0 / arrivals_per_hour;
+            double liters = nozzle_sim_liters(&seed);
+            offered_s += liters / NOZZLE_FLOW_LPM * 60.0 + NOZZLE_HANDOVER_S;
+            nozzle_advance(&nozzle_plan, t, nozzle_sim_start, &stats);
+            nozzle_enqueue(&nozzle_plan, liters, t);
+            nozzle_advance(&nozzle_plan, t, nozzle_sim_start, &stats);
+        }
+        nozzle_advance(&nozzle_plan, INFINITY, nozzle_sim_start, &stats);
+        double busy = offered_s / (t * runs[r].nozzles);
         
-        // SMART FEE OPTIMIZATION LOGIC
-        // Check if user has valid pass (no fee if pass active)
-        if (is_pass_valid(user)) {
-            printf("Pass holder - No digital payment fee!\n");
-            fee = 0.0;
+        if (busy >= 1.0 || nozzle_plan.turned_away > 0 || stats.started == 0) {
+            printf("%-24s %5.0f%% %9s %9s %12s %11s %9.0f %9d\n", runs[r].name, busy * 100, "overload",
+                   "overload", "overload", "overload", stats.liters / (stats.last_finish_s / 3600.0),
+                   nozzle_plan.turned_away);
+            continue;
+        }
+        double mean = 0;
+        for (int i = 0; i < stats.started; i++) mean += nozzle_sim_waits[0][i];
+        mean /= stats.started > 0 ? stats.started * 1000.0 : 1;
+        qsort(nozzle_sim_waits[0], stats.started, sizeof(long long), compare_long_long);
+        qsort(nozzle_sim_waits[1], stats.small_started, sizeof(long long), compare_long_long);
+        printf("%-24s %5.0f%% %9.1f %9.1f %12.1f %11.1f %9.0f %9d\n", runs[r].name, busy * 100, mean,
+               nozzle_sim_waits[0][stats.started * 95 / 100] / 1000.0,
+               stats.small_started ? nozzle_sim_waits[1][stats.small_started * 95 / 100] / 1000.0 : 0,
+               stats.bulk_started ? stats.bulk_wait_s / stats.bulk_started : 0,
+               stats.liters / (stats.last_finish_s / 3600.0), nozzle_plan.turned_away);
+    }
+}
+
+// =================== TRANSACTION AUDIT LOG ===================
+
+/*
+ * Auditors need to see that transactions[] hasn't been edited after the
+ * fact. Sales don't hash anything: save_transaction() only publishes the new
+ * record count (one atomic store, plus a signal when a batch fills up). The
+ * sealer thread hashes each batch of AUDIT_BATCH records - eight leaves at a
+ * time with the multi-buffer SHA-256 - into a Merkle tree, and chains the
+ * root onto the previous batch:
+ *     leaf = H(0x00 || record)     node = H(0x01 || left || right)
+ *     head = H(0x02 || previous head || root || first ID || last ID || count)
+ * An odd node at the end of a level moves up unchanged. A partial batch is
+ * sealed after AUDIT_SEAL_MS so quiet kiosks still commit their sales, up to
+ * AUDIT_EARLY_SEALS of them; after that sealing waits for full batches, so
+ * audit_batches[] never needs more than one slot per full batch plus those.
+ *
+ * A proof for one record is its leaf plus one sibling per level. Rebuilding
+ * the root from the record as it is now and following the chain to the
+ * latest head shows whether it still matches what was sealed; editing any
+ * sealed record changes its leaf and breaks the proof. With
+ * WATER_ATM_AUDIT_LOG set every head is also appended to a file (synced),
+ * so a copy held by auditors can't be rewritten from the kiosk. After a
+ * restart the batches in that file are loaded back for the history replayed
+ * from flash instead of sealing it again.
+ */
+
+/**
+ * Record encoding that is hashed (fixed layout, amounts in paise)
+ */
+static void audit_encode(const Transaction* txn, uint8_t out[AUDIT_LEAF_LEN]) {
+    int64_t fields[2] = {txn->transaction_id, txn->user_id};
+    int32_t money[4] = {(int32_t)llround(txn->amount * 100), (int32_t)llround(txn->liters * 100),
+                        (int32_t)llround(txn->fee_charged * 100), (int32_t)llround(txn->discount_applied * 100)};
+    int64_t timestamp = (int64_t)txn->timestamp;
+    int64_t reverses = txn->reverses;
+    int32_t points = txn->points_redeemed;
+    
+    out[0] = 0x00;                          // Leaf domain
+    memcpy(out + 1, fields, sizeof(fields));
+    memcpy(out + 17, money, sizeof(money));
+    memcpy(out + 33, &timestamp, sizeof(timestamp));
+    out[41] = 0x7F;
+    for (size_t i = 0; i < sizeof(flash_methods) / sizeof(flash_methods[0]); i++) {
+        if (strcmp(txn->payment_method, flash_methods[i]) == 0) out[41] = (uint8_t)i;
+    }
+    memcpy(out + 42, &reverses, sizeof(reverses)); // Links a refund to its sale
+    memcpy(out + 50, &points, sizeof(points));
+}
+
+/**
+ * SHA-256 of eight equal-length messages (at most 119 bytes) at once
+ */
+static void sha256_x8(const uint8_t* msgs[8], size_t len, uint8_t out[8][32]) {
+    uint8_t blocks[8][128];
+    const uint8_t* ptrs[8];
+    u32x8 h[8];
+    int nblocks = len + 9 <= 64 ? 1 : 2;
+    
+    for (int l = 0; l < 8; l++) {
+        memset(blocks[l], 0, 64 * nblocks);
+        memcpy(blocks[l], msgs[l], len);
+        blocks[l][len] = 0x80;
+        uint64_t bits = (uint64_t)len * 8;
+        for (int i = 0; i < 8; i++) blocks[l][64 * nblocks - 1 - i] = (uint8_t)(bits >> (8 * i));
+    }
+    for (int i = 0; i < 8; i++) h[i] = (u32x8){0} + sha256_init[i];
+    for (int b = 0; b < nblocks; b++) {
+        for (int l = 0; l < 8; l++) ptrs[l] = blocks[l] + 64 * b;
+        sha256_compress_x8(h, ptrs);
+    }
+    for (int l = 0; l < 8; l++) {
+        for (int i = 0; i < 8; i++) {
+            out[l][4 * i] = h[i][l] >> 24; out[l][4 * i + 1] = h[i][l] >> 16;
+            out[l][4 * i + 2] = h[i][l] >> 8; out[l][4 * i + 3] = h[i][l];
+        }
+    }
+}
+
+/**
+ * Hash `count` equal-length messages, eight lanes at a time
+ * (a short final group repeats its last message in the spare lanes)
+ */
+static void sha256_many(const uint8_t* msgs[], int count, size_t len, uint8_t (*out)[32]) {
+    for (int i = 0; i < count; i += 8) {
+        const uint8_t* lanes[8];
+        uint8_t digests[8][32];
+        for (int l = 0; l < 8; l++) lanes[l] = msgs[i + l < count ? i + l : count - 1];
+        sha256_x8(lanes, len, digests);
+        memcpy(out[i], digests, (size_t)(count - i < 8 ? count - i : 8) * 32);
+    }
+}
+
+/**
+ * Build the Merkle tree of transactions[first, first + count) in
+ * audit_nodes (levels stored one after another); returns the root's index
+ */
+static int audit_build_tree(int first, int count, int level_start[AUDIT_MAX_DEPTH + 1], int level_size[AUDIT_MAX_DEPTH + 1]) {
+    static uint8_t leaves[AUDIT_BATCH][AUDIT_LEAF_LEN];
+    static uint8_t pairs[AUDIT_BATCH / 2 + 1][65];
+    const uint8_t* msgs[AUDIT_BATCH];
+    
+    for (int i = 0; i < count; i++) {
+        audit_encode(&transactions[first + i], leaves[i]);
+        msgs[i] = leaves[i];
+    }
+    sha256_many(msgs, count, AUDIT_LEAF_LEN, audit_nodes);
+    
+    int levels = 0, start = 0, size = count;
+    level_start[0] = 0;
+    level_size[0] = count;
+    while (size > 1) {
+        int parents = size / 2;
+        for (int i = 0; i < parents; i++) {
+            pairs[i][0] = 0x01;             // Node domain
+            memcpy(pairs[i] + 1, audit_nodes[start + 2 * i], 32);
+            memcpy(pairs[i] + 33, audit_nodes[start + 2 * i + 1], 32);
+            msgs[i] = pairs[i];
+        }
+        int next = start + size;
+        sha256_many(msgs, parents, 65, audit_nodes + next);
+        if (size % 2) memcpy(audit_nodes[next + parents], audit_nodes[start + size - 1], 32); // Odd node moves up
+        start = next;
+        size = parents + size % 2;
+        levels++;
+        level_start[levels] = start;
+        level_size[levels] = size;
+    }
+    return levels;
+}
+
+/**
+ * Chain head after a batch
+ */
+static void audit_chain(const uint8_t previous[32], const AuditBatch* batch, uint8_t out[32]) {
+    uint8_t msg[1 + 32 + 32 + 8 + 8 + 4];
+    int64_t first_id = transactions[batch->first].transaction_id;
+    int64_t last_id = transactions[batch->first + batch->count - 1].transaction_id;
+    int32_t count = batch->count;
+    msg[0] = 0x02;                          // Chain domain
+    memcpy(msg + 1, previous, 32);
+    memcpy(msg + 33, batch->root, 32);
+    memcpy(msg + 65, &first_id, 8);
+    memcpy(msg + 73, &last_id, 8);
+    memcpy(msg + 81, &count, 4);
+    sha256(msg, sizeof(msg), out);
+}
+
+const uint8_t* audit_head() {
+    return audit.batch_count > 0 ? audit_batches[audit.batch_count - 1].head : audit.genesis;
+}
+
+void hex_string(const uint8_t* data, int len, char* out) {
+    for (int i = 0; i < len; i++) snprintf(out + 2 * i, 3, "%02x", data[i]);
+}
+
+/**
+ * Seal one batch of up to AUDIT_BATCH published records (lock held)
+ * A partial batch is only sealed if every record still to come fits in
+ * full batches after it. Returns 1 if a batch was sealed.
+ */
+static int audit_seal(int available) {
+    int count = available - audit.sealed < AUDIT_BATCH ? available - audit.sealed : AUDIT_BATCH;
+    if (count <= 0 || audit.batch_count == AUDIT_MAX_BATCHES) return 0;
+    int rest = MAX_TRANSACTIONS - audit.sealed - count;
+    if (count < AUDIT_BATCH && audit.batch_count + 1 + (rest + AUDIT_BATCH - 1) / AUDIT_BATCH > AUDIT_MAX_BATCHES) return 0;
+    
+    int level_start[AUDIT_MAX_DEPTH + 1], level_size[AUDIT_MAX_DEPTH + 1];
+    int levels = audit_build_tree(audit.sealed, count, level_start, level_size);
+    AuditBatch* batch = &audit_batches[audit.batch_count];
+    batch->first = audit.sealed;
+    batch->count = count;
+    memcpy(batch->root, audit_nodes[level_start[levels]], 32);
+    audit_chain(audit_head(), batch, batch->head);
+    batch->sealed_ms = wall_clock_ms();
+    audit.batch_count++;
+    mem_claim(MEM_SERVICES, sizeof(*batch));
+    audit.sealed += count;
+    
+    if (audit.fd >= 0) {
+        char line[200], root_hex[65], head_hex[65];
+        hex_string(batch->root, 32, root_hex);
+        hex_string(batch->head, 32, head_hex);
+        int len = snprintf(line, sizeof(line), "%d %lld %d %s %s\n", audit.base + audit.batch_count - 1,
+                           transactions[batch->first].transaction_id, count, root_hex, head_hex);
+        if (write(audit.fd, line, len) == len) fdatasync(audit.fd);
+    }
+    return 1;
+}
+
+/**
+ * Publish new records to the sealer (called by every sale - hot path)
+ */
+void audit_notify() {
+    atomic_store_explicit(&audit.recorded, transaction_count, memory_order_release);
+    if (audit.running && transaction_count % AUDIT_BATCH == 0) {   // Another batch's worth
+        pthread_mutex_lock(&audit.wake_lock);
+        audit.wake_pending = 1;
+        pthread_cond_signal(&audit.wake);
+        pthread_mutex_unlock(&audit.wake_lock);
+    }
+}
+
+/**
+ * Sealer Thread
+ * Seals full batches as soon as they fill, and a partial batch once
+ * records have waited AUDIT_SEAL_MS
+ */
+static void* audit_sealer_main(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&audit.wake_lock);
+    while (audit.running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += AUDIT_SEAL_MS / 1000;
+        deadline.tv_nsec += (AUDIT_SEAL_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        int timed_out = 0;
+        while (!audit.wake_pending && audit.running && !timed_out) {
+            timed_out = pthread_cond_timedwait(&audit.wake, &audit.wake_lock, &deadline) == ETIMEDOUT;
+        }
+        audit.wake_pending = 0;
+        int stopping = !audit.running;
+        pthread_mutex_unlock(&audit.wake_lock);
+        
+        // Hash under the batch lock only, so a sale signalling a full batch never waits on it
+        pthread_mutex_lock(&audit.lock);
+        int available = atomic_load_explicit(&audit.recorded, memory_order_acquire);
+        while (available - audit.sealed >= AUDIT_BATCH && audit_seal(available));
+        if (timed_out || stopping) audit_seal(available);
+        pthread_mutex_unlock(&audit.lock);
+        pthread_mutex_lock(&audit.wake_lock);
+    }
+    pthread_mutex_unlock(&audit.wake_lock);
+    return NULL;
+}
+
+/**
+ * Restore Sealed Batches from the audit file
+ * Lines are "<batch> <first id> <count> <root> <head>". The latest run of
+ * batches whose records are still in transactions[] (replayed from flash)
+ * is loaded back, so those records aren't sealed a second time and stay
+ * provable; the chain continues from the file's last head either way.
+ */
+static void audit_restore(FILE* in) {
+    char line[256], root_hex[65], head_hex[65];
+    uint8_t previous[32] = {0};             // Head of the line before
+    int number, count, end = 0;
+    long long first_id;
+    
+    while (fgets(line, sizeof(line), in)) {
+        if (sscanf(line, "%d %lld %d %64s %64s", &number, &first_id, &count, root_hex, head_hex) != 5 ||
+            strlen(root_hex) != 64 || strlen(head_hex) != 64) {
+            continue;
+        }
+        AuditBatch batch = {0};
+        for (int i = 0; i < 32; i++) {
+            sscanf(root_hex + 2 * i, "%2hhx", &batch.root[i]);
+            sscanf(head_hex + 2 * i, "%2hhx", &batch.head[i]);
+        }
+        Transaction* txn = find_transaction(first_id);
+        batch.first = txn ? (int)(txn - transactions) : -1;
+        batch.count = count;
+        
+        int fits = batch.first >= 0 && count > 0 && count <= AUDIT_BATCH && batch.first + count <= transaction_count;
+        if (!fits || audit.batch_count == 0 || batch.first != end) {   // New run at this batch (or after it)
+            audit.batch_count = 0;
+            audit.base = fits ? number : number + 1;
+            memcpy(audit.genesis, fits ? previous : batch.head, 32);
+        }
+        if (fits) {
+            if (audit.batch_count == AUDIT_MAX_BATCHES) {   // Keep the newest batches
+                memcpy(audit.genesis, audit_batches[0].head, 32);
+                memmove(audit_batches, audit_batches + 1, (AUDIT_MAX_BATCHES - 1) * sizeof(AuditBatch));
+                audit.batch_count--;
+                audit.base++;
+            }
+            audit_batches[audit.batch_count++] = batch;
+            end = batch.first + count;
+        }
+        memcpy(previous, batch.head, 32);
+    }
+    audit.sealed = audit.batch_count > 0 ? end : 0;
+    if (audit.batch_count > 0) mem_claim(MEM_SERVICES, audit.batch_count * sizeof(AuditBatch));
+}
+
+/**
+ * Start Audit Sealer
+ * Records already in transactions[] (replayed from flash) are sealed first,
+ * except those the audit file shows were sealed before the restart.
+ * If path is given, batch heads are appended there and the chain continues
+ * from the last head it holds.
+ */
+void audit_start(const char* path) {
+    if (path) {
+        FILE* in = fopen(path, "r");
+        if (in) {
+            audit_restore(in);
+            fclose(in);
+        }
+        audit.fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    }
+    
+    atomic_store(&audit.recorded, transaction_count);
+    audit.running = 1;
+    if (pthread_create(&audit.thread, NULL, audit_sealer_main, NULL) != 0) {
+        audit.running = 0;
+        printf("Warning: transaction audit log disabled (could not start sealer)\n");
+    }
+}
+
+/**
+ * Stop Audit Sealer (seals whatever is still pending first)
+ */
+void audit_stop() {
+    if (!audit.running) return;
+    pthread_mutex_lock(&audit.wake_lock);
+    audit.running = 0;
+    pthread_cond_signal(&audit.wake);
+    pthread_mutex_unlock(&audit.wake_lock);
+    pthread_join(audit.thread, NULL);
+}
+
+/**
+ * Inclusion Proof for a transaction
+ * Seals the record's batch first if it is still pending.
+ * Returns 1 with the proof filled in, 0 if the transaction isn't in history.
+ */
+int audit_prove(long long transaction_id, AuditProof* proof) {
+    Transaction* txn = find_transaction(transaction_id);
+    if (!txn) return 0;
+    int index = (int)(txn - transactions);
+    
+    pthread_mutex_lock(&audit.lock);
+    int available = atomic_load_explicit(&audit.recorded, memory_order_acquire);
+    while (audit.sealed <= index && audit_seal(available));
+    
+    // Batches are in record order: binary search for the one holding `index`
+    int lo = 0, hi = audit.batch_count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (audit_batches[mid].first <= index) lo = mid; else hi = mid - 1;
+    }
+    if (audit.batch_count == 0 || index >= audit.sealed || index < audit_batches[lo].first) {
+        pthread_mutex_unlock(&audit.lock);
+        return 0;
+    }
+    
+    AuditBatch* batch = &audit_batches[lo];
+    int level_start[AUDIT_MAX_DEPTH + 1], level_size[AUDIT_MAX_DEPTH + 1];
+    int levels = audit_build_tree(batch->first, batch->count, level_start, level_size);
+    proof->batch = lo;
+    proof->index = index - batch->first;
+    memcpy(proof->leaf, audit_nodes[proof->index], 32);
+    proof->depth = 0;
+    
+    int pos = proof->index;
+    for (int level = 0; level < levels; level++) {
+        int sibling = pos ^ 1;
+        if (sibling < level_size[level]) {          // Odd last node has no sibling
+            memcpy(proof->siblings[proof->depth], audit_nodes[level_start[level] + sibling], 32);
+            proof->sibling_left[proof->depth] = sibling < pos;
+            proof->depth++;
+        }
+        pos /= 2;
+    }
+    pthread_mutex_unlock(&audit.lock);
+    return 1;
+}
+
+/**
+ * Check a proof: the path must rebuild the batch's sealed root, and the
+ * chain from that batch must still end at the current head
+ */
+int audit_verify_proof(const AuditProof* proof) {
+    uint8_t node[32], pair[65];
+    memcpy(node, proof->leaf, 32);
+    for (int i = 0; i < proof->depth; i++) {
+        pair[0] = 0x01;
+        memcpy(pair + 1, proof->sibling_left[i] ? proof->siblings[i] : node, 32);
+        memcpy(pair + 33, proof->sibling_left[i] ? node : proof->siblings[i], 32);
+        sha256(pair, sizeof(pair), node);
+    }
+    
+    pthread_mutex_lock(&audit.lock);
+    int ok = proof->batch < audit.batch_count && memcmp(node, audit_batches[proof->batch].root, 32) == 0;
+    uint8_t head[32];
+    memcpy(head, proof->batch > 0 ? audit_batches[proof->batch - 1].head : audit.genesis, 32);
+    for (int b = proof->batch; ok && b < audit.batch_count; b++) {
+        audit_chain(head, &audit_batches[b], head);
+        ok = memcmp(head, audit_batches[b].head, 32) == 0;
+    }
+    pthread_mutex_unlock(&audit.lock);
+    return ok;
+}
+
+/**
+ * Re-hash every sealed batch from transactions[] as it is now
+ * Returns the first batch whose records or chain no longer match, or -1
+ */
+int audit_verify_all() {
+    pthread_mutex_lock(&audit.lock);
+    uint8_t head[32];
+    memcpy(head, audit.genesis, 32);
+    int tampered = -1;
+    for (int b = 0; b < audit.batch_count && tampered < 0; b++) {
+        int level_start[AUDIT_MAX_DEPTH + 1], level_size[AUDIT_MAX_DEPTH + 1];
+        AuditBatch* batch = &audit_batches[b];
+        int levels = audit_build_tree(batch->first, batch->count, level_start, level_size);
+        audit_chain(head, batch, head);
+        if (memcmp(audit_nodes[level_start[levels]], batch->root, 32) != 0 || memcmp(head, batch->head, 32) != 0) {
+            tampered = b;
+        }
+    }
+    pthread_mutex_unlock(&audit.lock);
+    return tampered;
+}
+
+/**
+ * Audit Proof Menu
+ */
+void audit_proof_menu() {
+    long long transaction_id;
+    AuditProof proof;
+    char hex[65];
+    
+    printf("\n=== TRANSACTION AUDIT PROOF ===\n");
+    printf("Enter Transaction ID: ");
+    scanf("%lld", &transaction_id);
+    
+    if (!audit_prove(transaction_id, &proof)) {
+        printf("Transaction not found in history!\n");
+        return;
+    }
+    hex_string(proof.leaf, 32, hex);
+    printf("Batch %d, position %d of %d\n", proof.batch, proof.index, audit_batches[proof.batch].count);
+    printf("Leaf:  %s\n", hex);
+    for (int i = 0; i < proof.depth; i++) {
+        hex_string(proof.siblings[i], 32, hex);
+        printf("  %s %s\n", proof.sibling_left[i] ? "L" : "R", hex);
+    }
+    hex_string(audit_batches[proof.batch].root, 32, hex);
+    printf("Root:  %s\n", hex);
+    hex_string(audit_head(), 32, hex);
+    printf("Head:  %s\n", hex);
+    printf("Proof: %s\n", audit_verify_proof(&proof) ? "VALID - record unchanged since sealing" : "INVALID - record or chain altered");
+}
+
+/**
+ * Audit Benchmark
+ * Sale hot-path cost with and without the audit hook, sealing throughput,
+ * proof cost, and a tamper check
+ */
+void audit_benchmark() {
+    User* user = &users[user_count++];
+    memset(user, 0, sizeof(*user));
+    user->user_id = generate_id();
+    index_user(user);
+    
+    // Fill history with sales (sealer running), then measure the hook itself
+    audit_start(NULL);
+    long long start = monotonic_ns();
+    while (transaction_count < TXN_SALE_SLOTS) {
+        save_transaction(user, 10.0, 5.0, "Cash", 0.0, 0.0, 0, 0);
+    }
+    double sale_ns = (monotonic_ns() - start) / (double)TXN_SALE_SLOTS;
+    
+    int rounds = 1000000;
+    start = monotonic_ns();
+    for (int i = 0; i < rounds; i++) audit_notify();
+    double notify_ns = (monotonic_ns() - start) / (double)rounds;
+    audit_stop();
+    
+    // Sealing throughput: re-seal the full history from scratch
+    int batches = audit.batch_count;
+    if (batches > 0) mem_release(MEM_SERVICES, batches * sizeof(AuditBatch));
+    audit.batch_count = audit.sealed = 0;
+    start = monotonic_ns();
+    while (audit_seal(transaction_count));
+    double seal_ns = (monotonic_ns() - start) / (double)transaction_count;
+    
+    // Proofs for records spread across the history
+    AuditProof proof;
+    int proofs = 200, valid = 0;
+    start = monotonic_ns();
+    for (int i = 0; i < proofs; i++) {
+        audit_prove(transactions[(long long)i * transaction_count / proofs].transaction_id, &proof);
+        valid += audit_verify_proof(&proof);
+    }
+    double proof_us = (monotonic_ns() - start) / 1000.0 / proofs;
+    
+    // Tamper with one record and check it is caught
+    int victim = transaction_count / 2;
+    audit_prove(transactions[victim].transaction_id, &proof);
+    transactions[victim].amount -= 1;
+    AuditProof tampered_proof;
+    audit_prove(transactions[victim].transaction_id, &tampered_proof);
+    int detected_batch = audit_verify_all();
+    
+    printf("\n=== TRANSACTION AUDIT LOG BENCHMARK ===\n");
+    printf("Records: %d in %d batches of up to %d (sealed while selling: %d batches)\n",
+           transaction_count, audit.batch_count, AUDIT_BATCH, batches);
+    printf("Sale hot path: audit hook %.1f ns per sale (whole save_transaction %.0f ns)\n", notify_ns, sale_ns);
+    printf("Sealing: %.0f ns per record off the hot path (%.1fM records/s)\n", seal_ns, 1000.0 / seal_ns);
+    printf("Inclusion proof: %d levels, build + verify %.1f µs, valid %d/%d\n",
+           proof.depth, proof_us, valid, proofs);
+    printf("Tamper test: edited record %d -> proof %s, full check flags batch %d (expected %d)\n", victim,
+           audit_verify_proof(&tampered_proof) ? "still valid (NOT DETECTED)" : "rejected", detected_batch,
+           victim / AUDIT_BATCH);
+}
+
+// =================== REFUNDS ===================
+
+/*
+ * A sale whose water never came out (a valve jam after payment) is undone
+ * by a compensating entry: a "Refund" record carrying the sale's amount,
+ * liters, fee, discount and redeemed points negated, linked to the sale by
+ * its `reverses` ID. The sale itself is never edited, so sealed audit
+ * batches stay valid and history shows both records. The sale is found
+ * through the transaction ID index, and the refund index (sale ID -> its
+ * refund) stops a second refund of the same sale, both in O(1).
+ *
+ * Only a sale from the last REFUND_WINDOW_S whose failed dispense was
+ * reported can be refunded, and the refund itself takes the operator PIN.
+ * The last REFUND_RESERVE history slots are kept for refund entries, so
+ * refunds still work once sales have filled history.
+ *
+ * Money goes back as far as the kiosk can send it: group payments to the
+ * customer's group wallet, everything else (cash and UPI too) to their
+ * wallet. All checks run before anything changes, and the whole reversal
+ * holds refund_lock, so it happens completely or not at all.
+ */
+
+const char* refund_result_text(int result) {
+    switch (result) {
+        case REFUND_OK: return "refunded";
+        case REFUND_UNKNOWN: return "not found in transaction history";
+        case REFUND_NOT_A_SALE: return "is itself a refund";
+        case REFUND_DUPLICATE: return "already refunded";
+        case REFUND_NO_ACCOUNT: return "has no registered customer or group wallet to refund";
+        case REFUND_TOO_OLD: return "is too old to refund at the kiosk";
+        case REFUND_NOT_REPORTED: return "has no reported failed dispense";
+        default: return "can't be refunded: transaction history is full";
+    }
+}
+
+/**
+ * Checks shared by reporting and refunding a sale (refund_lock held)
+ */
+static int refund_eligible(const Transaction* sale, long long transaction_id) {
+    return !sale ? REFUND_UNKNOWN :
+           sale->reverses != 0 ? REFUND_NOT_A_SALE :
+           find_refund(transaction_id) ? REFUND_DUPLICATE :
+           (long long)sale->timestamp < (long long)time(NULL) - REFUND_WINDOW_S ? REFUND_TOO_OLD :
+           REFUND_OK;
+}
+
+static int dispense_reported(const Transaction* sale) {
+    int index = (int)(sale - transactions);
+    return (failed_dispenses[index / 32] >> (index % 32)) & 1;
+}
+
+/**
+ * Report Failed Dispense
+ * Marks a recent sale whose water never came out, so an operator can
+ * refund it. Returns REFUND_OK or why the sale can't be reported.
+ */
+int report_failed_dispense(long long transaction_id) {
+    pthread_mutex_lock(&refund_lock);
+    Transaction* sale = find_transaction(transaction_id);
+    int result = refund_eligible(sale, transaction_id);
+    if (result == REFUND_OK) {
+        int index = (int)(sale - transactions);
+        failed_dispenses[index / 32] |= 1u << (index % 32);
+    }
+    pthread_mutex_unlock(&refund_lock);
+    return result;
+}
+
+/**
+ * Refund Transaction
+ * Reverses a reported failed dispense (the caller has the operator's
+ * authorization): restores the wallet (or group wallet), loyalty points,
+ * total_spent, the customer's transaction count and stats, and records
+ * the linked compensating entry. Returns REFUND_OK with *refund_id set,
+ * or the reason it was refused (nothing is changed then).
+ */
+int refund_transaction(long long transaction_id, long long* refund_id, int show_output) {
+    pthread_mutex_lock(&refund_lock);
+    Transaction* sale = find_transaction(transaction_id);
+    User* user = sale ? find_user(sale->user_id) : NULL;
+    int group_paid = sale && strcmp(sale->payment_method, "Group") == 0;
+    GroupWallet* group = user && group_paid ? find_group(user->group_id) : NULL;
+    
+    int result = refund_eligible(sale, transaction_id);
+    if (result == REFUND_OK) {
+        result = !dispense_reported(sale) ? REFUND_NOT_REPORTED :
+                 !user || (group_paid && !group) ? REFUND_NO_ACCOUNT :
+                 transaction_count >= MAX_TRANSACTIONS ? REFUND_HISTORY_FULL :
+                 REFUND_OK;
+    }
+    if (result != REFUND_OK) {
+        pthread_mutex_unlock(&refund_lock);
+        return result;
+    }
+    
+    // Everything the sale added, taken back out
+    Tenant* tenant = &tenants[user->tenant];
+    double liters = sale->liters;
+    double amount = sale->amount;
+    double base_cost = liters * tenant->price_per_liter;
+    int points_back = sale->points_redeemed - (int)base_cost;
+    if (group) {
+        group_wallet_credit(group, amount);
+    } else {
+        user->wallet_balance += amount;
+    }
+    user->total_spent -= base_cost;
+    user->transaction_count--;
+    user->loyalty_points += points_back;
+    
+    if (strcmp(sale->payment_method, "Cash") == 0) {
+        stats.cash_transactions--;
+        tenant->stats.cash_transactions--;
+    } else {
+        stats.digital_transactions--;
+        tenant->stats.digital_transactions--;
+    }
+    if (liters >= tenant->min_bulk_liters) {
+        stats.bulk_purchases--;
+        tenant->stats.bulk_purchases--;
+    }
+    stats.total_revenue -= base_cost;
+    stats.total_fees_collected -= sale->fee_charged;
+    stats.total_discounts_given -= sale->discount_applied;
+    stats.refunds++;
+    stats.total_refunded += amount;
+    tenant->stats.total_revenue -= base_cost;
+    tenant->stats.total_fees_collected -= sale->fee_charged;
+    tenant->stats.total_discounts_given -= sale->discount_applied;
+    tenant->stats.refunds++;
+    tenant->stats.total_refunded += amount;
+    history_record(time(NULL));
+    cube_record(id_kiosk(transaction_id), sale->timestamp, sale->payment_method, -1, base_cost,
+                sale->fee_charged, sale->discount_applied, liters); // Counted against the sale's day
+    
+    *refund_id = save_transaction(user, -amount, -liters, "Refund", -sale->fee_charged,
+                                  -sale->discount_applied, -sale->points_redeemed, transaction_id);
+    pthread_mutex_unlock(&refund_lock);
+    
+    user_changed(user);                    // Keep card tap state and sync current
+    kiosk_site_record_sale(-liters);       // The water is still in the tank
+    
+    // Refund receipt: on screen and to the printer, like a sale
+    char receipt[RECEIPT_MAX_LEN];
+    int len = 0;
+    receipt_append(receipt, &len, "\n=== REFUND RECEIPT ===\n");
+    receipt_append(receipt, &len, "Refund ID: %lld\n", *refund_id);
+    receipt_append(receipt, &len, "Refunds transaction: %lld\n", transaction_id);
+    receipt_append(receipt, &len, "User: %s (ID: %lld)\n", user->name, user->user_id);
+    receipt_append(receipt, &len, "Water not dispensed: %.2f liters\n", liters);
+    receipt_append(receipt, &len, "Amount refunded: ₹%.2f\n", amount);
+    if (group) {
+        receipt_append(receipt, &len, "Refunded to group wallet: %s (balance ₹%.2f)\n",
+                       group->name, group_wallet_balance(group));
+    } else {
+        receipt_append(receipt, &len, "Refunded to wallet (balance ₹%.2f)\n",
+                       user->wallet_balance);
+    }
+    receipt_append(receipt, &len, "Loyalty points: %+d (total %d)\n",
+                   points_back, user->loyalty_points);
+    receipt_append(receipt, &len, "======================\n");
+    
+    if (show_output) printf("%s", receipt);
+    spool_receipt(receipt);
+    return REFUND_OK;
+}
+
+/**
+ * Refund Failed Dispense (menu)
+ * The customer reports the failed dispense (with their PIN if they have
+ * one); an operator then refunds it with the operator PIN
+ */
+void refund_menu() {
+    long long transaction_id, refund_id;
+    int choice;
+    
+    printf("\n=== REFUND FAILED DISPENSE ===\n");
+    printf("1. Report a failed dispense\n");
+    printf("2. Refund a reported dispense (operator)\n");
+    printf("Enter choice: ");
+    scanf("%d", &choice);
+    if (choice != 1 && choice != 2) {
+        printf("Invalid choice!\n");
+        return;
+    }
+    if (choice == 2 && !operator_authorize()) return;
+    
+    printf("Enter Transaction ID (from the receipt): ");
+    scanf("%lld", &transaction_id);
+    
+    // Another operator's sale is as good as unknown here
+    Transaction* sale = find_transaction(transaction_id);
+    User* customer = sale ? find_user(sale->user_id) : NULL;
+    if (!sale || (customer && customer->tenant != active_tenant)) {
+        printf("Transaction %lld %s!\n", transaction_id, refund_result_text(REFUND_UNKNOWN));
+        return;
+    }
+    if (choice == 1) {
+        if (customer && !authorize_user(customer)) return;
+        int result = report_failed_dispense(transaction_id);
+        if (result == REFUND_OK) {
+            printf("Failed dispense reported - an operator can now refund transaction %lld\n", transaction_id);
+        } else {
+            printf("Transaction %lld %s!\n", transaction_id, refund_result_text(result));
+        }
+        return;
+    }
+    int result = refund_transaction(transaction_id, &refund_id, 1);
+    if (result != REFUND_OK) {
+        printf("Transaction %lld %s!\n", transaction_id, refund_result_text(result));
+    }
+}
+
+/**
+ * Refund Benchmark
+ * Fills history with sales, then compares looking IDs up through the
+ * index with scanning for them, times refunds, and checks that refunding
+ * a run of sales puts the customer and stats back where they were
+ */
+void refund_benchmark() {
+    users[user_count] = (User){.user_id = generate_id(), .name = "Refund Check", .wallet_balance = 1e6};
+    User* user = &users[user_count++];
+    index_user(user);
+    
+    // Most of history first, then the sales that will be refunded
+    int refunds = MAX_TRANSACTIONS / 10;
+    while (transaction_count < MAX_TRANSACTIONS - 2 * refunds) {
+        process_purchase(user, 1.0 + transaction_count % 20, transaction_count % 2 ? 1 : 2, NULL, 0);
+    }
+    User before = *user;
+    Analytics stats_before = stats;
+    int first_refunded = transaction_count;
+    for (int i = 0; i < refunds; i++) {
+        process_purchase(user, 1.0 + i % 20, i % 2 ? 1 : 2, NULL, 0);
+    }
+    
+    // Lookups spread over the whole history
+    int lookups = 1000000, found = 0;
+    long long start = monotonic_ns();
+    for (int i = 0; i < lookups; i++) {
+        found += find_transaction(transactions[(long long)i * 7919 % transaction_count].transaction_id) != NULL;
+    }
+    double index_ns = (monotonic_ns() - start) / (double)lookups;
+    
+    int scans = 20000;
+    long long scanned = 0;
+    start = monotonic_ns();
+    for (int i = 0; i < scans; i++) {
+        long long id = transactions[(long long)i * 7919 % transaction_count].transaction_id;
+        for (int j = 0; j < transaction_count; j++) {
+            if (transactions[j].transaction_id == id) {
+                scanned += j;
+                break;
+            }
+        }
+    }
+    double scan_ns = (monotonic_ns() - start) / (double)scans;
+    
+    // Refund the last run of sales, then try each one again (cash comes back to the wallet)
+    long long refund_id;
+    int refunded = 0, refused = 0;
+    double cash_back = 0.0;
+    for (int i = 0; i < refunds; i++) {
+        if (strcmp(transactions[first_refunded + i].payment_method, "Cash") == 0) {
+            cash_back += transactions[first_refunded + i].amount;
+        }
+    }
+    for (int i = 0; i < refunds; i++) report_failed_dispense(transactions[first_refunded + i].transaction_id);
+    start = monotonic_ns();
+    for (int i = 0; i < refunds; i++) {
+        refunded += refund_transaction(transactions[first_refunded + i].transaction_id, &refund_id, 0) == REFUND_OK;
+    }
+    double refund_us = (monotonic_ns() - start) / 1000.0 / refunds;
+    for (int i = 0; i < refunds; i++) {
+        refused += refund_transaction(transactions[first_refunded + i].transaction_id, &refund_id, 0) == REFUND_DUPLICATE;
+    }
+    refused += refund_transaction(refund_id, &refund_id, 0) == REFUND_NOT_A_SALE;
+    
+    int restored = fabs(user->wallet_balance - before.wallet_balance - cash_back) < 0.005 &&
+                   fabs(user->total_spent - before.total_spent) < 0.005 &&
+                   user->loyalty_points == before.loyalty_points &&
+                   user->transaction_count == before.transaction_count &&
+                   fabs(stats.total_revenue - stats_before.total_revenue) < 0.005 &&
+                   fabs(stats.total_fees_collected - stats_before.total_fees_collected) < 0.005 &&
+                   fabs(stats.total_discounts_given - stats_before.total_discounts_given) < 0.005 &&
+                   stats.cash_transactions == stats_before.cash_transactions &&
+                   stats.digital_transactions == stats_before.digital_transactions &&
+                   stats.bulk_purchases == stats_before.bulk_purchases;
+    
+    printf("\n=== REFUND BENCHMARK ===\n");
+    printf("History: %d records\n", transaction_count);
+    printf("Lookup by ID: index %.0f ns (%d/%d found), linear scan %.0f ns (%.0f records read each, %.0fx slower)\n",
+           index_ns, found, lookups, scan_ns, scanned / (double)scans, scan_ns / index_ns);
+    printf("Refund (lookup, checks, compensating entry): %.2f µs\n", refund_us);
+    printf("Refunded %d/%d sales, refused %d/%d repeat refunds\n", refunded, refunds, refused, refunds + 1);
+    printf("Customer and stats after refunding every sale since the snapshot: %s\n",
+           restored ? "restored exactly" : "MISMATCH");
+}
+
+// =================== REPLICA SYNC ===================
+
+/*
+ * Each kiosk keeps a copy of users[], and so does the central store.
+ * Copying the whole table to find a few changed accounts costs a lot of
+ * bandwidth, so both sides keep a Merkle tree over user IDs instead. The ID
+ * space is cut into SYNC_LEAVES ranges of the hashed ID (Snowflake IDs
+ * cluster by registration time, their hash spreads them evenly), and each
+ * leaf is the XOR of the digests of the users in it. A digest covers
+ * wallet balance, loyalty points, pass expiry and version, so an account
+ * change updates its leaf in O(1) without rescanning the range.
+ *
+ * The kiosk walks the tree one level per round trip and asks only for the
+ * children of nodes that differed: log2(SYNC_LEAVES) + 1 round trips find
+ * the differing ranges. It then compares (ID, digest, version) for the
+ * users in those ranges and ships only the records that changed:
+ *     NODES    kiosk: node indexes           store: their hashes
+ *     DIGESTS  kiosk: leaf indexes           store: its entries in them
+ *     RECORDS  kiosk: newer records + IDs    store: the records asked for
+ *     DONE     kiosk: -                      store: its root
+ * Wallet balance and loyalty points are merged, not overwritten: the kiosk
+ * sends what changed since it last agreed with the store, the store adds
+ * that to its own copy, and the kiosk takes the merged record back, so a
+ * debit on one side and a credit on the other both survive. A push ID lets
+ * the store skip the part of a resent delta it already applied (it
+ * remembers one push per user). Other fields go to the higher version; on
+ * a tie the central store's copy wins. A user the other side has never
+ * seen is sent too.
+ *
+ * Records travel as SyncRecord, and every one is checked before it is
+ * stored: amounts in range, known flags, a real pass expiry, an existing
+ * operator and group. PIN lockout state stays with each replica, and an
+ * existing account keeps its phone number and operator.
+ */
+
+static uint8_t sync_marked[SYNC_LEAVES]; // Leaves being reconciled
+
+static uint64_t sync_hash(const void* data, size_t len) {
+    uint8_t digest[32];
+    uint64_t out;
+    sha256((const uint8_t*)data, len, digest);
+    memcpy(&out, digest, sizeof(out));
+    return out;
+}
+
+/**
+ * User Digest - the fields two replicas must agree on
+ */
+static uint64_t user_digest(const User* user) {
+    struct {
+        int64_t user_id;
+        int64_t wallet_paise;
+        int64_t pass_expiry;
+        int32_t loyalty_points;
+        uint32_t version;
+    } fields = {user->user_id, llround(user->wallet_balance * 100), (int64_t)user->pass_expiry,
+                user->loyalty_points, user->version};
+    return sync_hash(&fields, sizeof(fields));
+}
+
+/**
+ * Range of a user ID: IDs minted together differ only in a few low bits,
+ * so they are fully mixed (MurmurHash3 finalizer) before picking a leaf
+ */
+static size_t sync_leaf(long long user_id) {
+    uint64_t h = (uint64_t)user_id;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return hash_slot(h, SYNC_LEAVES);
+}
+
+/**
+ * Track User for Sync
+ * Swaps the user's previous digest for the current one in its leaf
+ */
+void sync_track(User* user) {
+    int index = (int)(user - users);
+    uint64_t digest = user_digest(user);
+    if (sync_digests[index] == 0) {             // First time: the user's rows in the sync tables
+        mem_claim(MEM_SKETCHES, sizeof(sync_digests[0]) + sizeof(sync_state[0]) + sizeof(sync_wanted[0]) +
+                                sizeof(sync_base[0]));
+    }
+    atomic_fetch_xor(&sync_leaves[sync_leaf(user->user_id)], sync_digests[index] ^ digest);
+    sync_digests[index] = digest;
+}
+
+/**
+ * User Changed
+ * Every account change goes through here: the version tells replicas which
+ * copy is newer, and the tap profile follows the account
+ */
+void user_changed(User* user) {
+    user->version++;
+    if (!user_in_table(user)) return;           // Scratch copy: no digest or profile to update
+    sync_track(user);
+    tap_profile_refresh(user);
+}
+
+/**
+ * Rebuild the inner nodes from the current leaves
+ */
+static void sync_tree_build() {
+    for (int i = 0; i < SYNC_LEAVES; i++) {
+        sync_tree[SYNC_LEAVES + i] = atomic_load(&sync_leaves[i]);
+    }
+    for (int i = SYNC_LEAVES - 1; i >= 1; i--) {
+        sync_tree[i] = sync_hash(&sync_tree[2 * i], 2 * sizeof(uint64_t));
+    }
+}
+
+static int sync_write(int fd, const void* data, size_t len, SyncStats* stats) {
+    const uint8_t* p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        len -= (size_t)n;
+        stats->bytes_sent += n;
+    }
+    return 1;
+}
+
+static int sync_read(int fd, void* data, size_t len, SyncStats* stats) {
+    uint8_t* p = data;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        len -= (size_t)n;
+        stats->bytes_received += n;
+    }
+    return 1;
+}
+
+/**
+ * Pack a user for the wire (with_delta: kiosk pushing its unsynced changes)
+ */
+static void sync_record_pack(User* user, int with_delta, SyncRecord* out) {
+    SyncBase* base = &sync_base[user - users];
+    memset(out, 0, sizeof(*out));
+    out->user_id = user->user_id;
+    out->wallet_paise = llround(user->wallet_balance * 100);
+    out->total_spent_paise = llround(user->total_spent * 100);
+    out->pass_expiry = (int64_t)user->pass_expiry;
+    out->loyalty_points = user->loyalty_points;
+    out->transaction_count = user->transaction_count;
+    out->group_id = user->group_id;
+    out->tenant = user->tenant;
+    out->version = user->version;
+    out->flags = (user->is_student ? SYNC_REC_STUDENT : 0) | (user->has_weekly_pass ? SYNC_REC_WEEKLY : 0) |
+                 (user->has_monthly_pass ? SYNC_REC_MONTHLY : 0) | (user->has_pin ? SYNC_REC_PIN : 0);
+    if (user->has_pin) {
+        memcpy(out->pin_salt, user->pin_salt, sizeof(out->pin_salt));
+        memcpy(out->pin_hash, user->pin_hash, sizeof(out->pin_hash));
+    }
+    memcpy(out->name, user->name, sizeof(out->name));
+    memcpy(out->phone, user->phone, sizeof(out->phone));
+    if (with_delta) {
+        out->wallet_delta_paise = out->wallet_paise - base->wallet_paise;
+        out->points_delta = user->loyalty_points - base->loyalty_points;
+        if (base->push_id == 0) base->push_id = generate_id(); // Kept until the store answers
+        out->push_id = base->push_id;
+    }
+}
+
+/**
+ * Validate a received record (terminates its strings)
+ */
+static int sync_record_valid(SyncRecord* record) {
+    record->name[sizeof(record->name) - 1] = '\0';
+    record->phone[sizeof(record->phone) - 1] = '\0';
+    static const uint8_t zero[32];
+    return record->user_id > 0 &&
+           llabs(record->wallet_paise) <= SYNC_MAX_PAISE && llabs(record->wallet_delta_paise) <= SYNC_MAX_PAISE &&
+           record->total_spent_paise >= 0 && record->total_spent_paise <= 100 * SYNC_MAX_PAISE &&
+           llabs((long long)record->points_delta) <= SYNC_MAX_PAISE && record->transaction_count >= 0 &&
+           record->pass_expiry >= 0 && record->pass_expiry <= (int64_t)time(NULL) + 366 * 86400LL &&
+           (record->flags & ~(SYNC_REC_STUDENT | SYNC_REC_WEEKLY | SYNC_REC_MONTHLY | SYNC_REC_PIN)) == 0 &&
+           (!(record->flags & SYNC_REC_PIN) || memcmp(record->pin_hash, zero, sizeof(record->pin_hash)) != 0) &&
+           record->tenant >= 0 && record->tenant < tenant_count &&
+           (record->phone[0] == '\0' || phone_key(record->phone, strlen(record->phone)) != 0);
+}
+
+/**
+ * Copy a record's profile fields (everything but balances, phone, operator
+ * and PIN lockout state); a group this replica doesn't have is left alone
+ */
+static void sync_apply_profile(User* local, const SyncRecord* record) {
+    memcpy(local->name, record->name, sizeof(local->name));
+    local->total_spent = record->total_spent_paise / 100.0;
+    local->transaction_count = record->transaction_count;
+    local->pass_expiry = (time_t)record->pass_expiry;
+    local->is_student = (record->flags & SYNC_REC_STUDENT) != 0;
+    local->has_weekly_pass = (record->flags & SYNC_REC_WEEKLY) != 0;
+    local->has_monthly_pass = (record->flags & SYNC_REC_MONTHLY) != 0;
+    local->has_pin = (record->flags & SYNC_REC_PIN) != 0;
+    memcpy(local->pin_salt, record->pin_salt, sizeof(local->pin_salt));
+    memcpy(local->pin_hash, record->pin_hash, sizeof(local->pin_hash));
+    
+    GroupWallet* group = record->group_id ? find_group(record->group_id) : NULL;
+    if (record->group_id != local->group_id && (group || record->group_id == 0)) {
+        GroupWallet* old_group = find_group(local->group_id);
+        if (old_group) old_group->members--;
+        if (group) group->members++;
+        local->group_id = record->group_id;
+    }
+}
+
+/**
+ * Add a user this replica has never seen
+ */
+static User* sync_add(const SyncRecord* record) {
+    const Tenant* tenant = &tenants[record->tenant];
+    if (user_count >= MAX_USERS || tenant->users >= tenant->max_users) return NULL; // Operator's quota too
+    User* local = &users[user_count++];
+    memset(local, 0, sizeof(*local));
+    sync_digests[local - users] = 0;
+    local->user_id = record->user_id;
+    local->tenant = record->tenant;
+    memcpy(local->phone, record->phone, sizeof(local->phone));
+    sync_apply_profile(local, record);
+    local->wallet_balance = record->wallet_paise / 100.0;
+    local->loyalty_points = record->loyalty_points;
+    local->version = record->version;
+    index_user(local);
+    return local;
+}
+
+/**
+ * Merge a kiosk's record (central store side)
+ * Adds the kiosk's wallet and loyalty changes to this copy - minus any part
+ * of the same push applied before - and takes its profile if it is newer
+ */
+static int sync_merge(const SyncRecord* record) {
+    User* local = find_user(record->user_id);
+    SyncBase* base;
+    if (!local) {
+        local = sync_add(record);
+        if (!local) return 0;
+        base = &sync_base[local - users];
+        base->push_id = record->push_id;
+        base->wallet_paise = record->wallet_delta_paise;
+        base->loyalty_points = record->points_delta;
+        tap_profile_refresh(local);
+        return 1;
+    }
+    
+    base = &sync_base[local - users];
+    long long wallet_delta = record->wallet_delta_paise;
+    int points_delta = record->points_delta;
+    if (record->push_id != 0 && record->push_id == base->push_id) {   // Resent: only what is new
+        wallet_delta -= base->wallet_paise;
+        points_delta -= base->loyalty_points;
+    }
+    base->push_id = record->push_id;
+    base->wallet_paise = record->wallet_delta_paise;
+    base->loyalty_points = record->points_delta;
+    
+    uint32_t version = local->version;
+    if (record->version > local->version) {
+        sync_apply_profile(local, record);
+        version = record->version;
+    }
+    local->wallet_balance += wallet_delta / 100.0;
+    local->loyalty_points += points_delta;
+    local->version = version;
+    if (wallet_delta != 0 || points_delta != 0) {
+        user_changed(local);                // Merged copy: newer than both
+    } else {
+        sync_track(local);
+        tap_profile_refresh(local);
+    }
+    return 1;
+}
+
+/**
+ * Take the store's record (kiosk side)
+ * The store's copy already includes whatever this kiosk pushed, so it
+ * replaces the balances here and becomes the new base
+ */
+static int sync_adopt(const SyncRecord* record) {
+    User* local = find_user(record->user_id);
+    if (!local && !(local = sync_add(record))) return 0;
+    sync_apply_profile(local, record);
+    local->wallet_balance = record->wallet_paise / 100.0;
+    local->loyalty_points = record->loyalty_points;
+    local->version = record->version;
+    sync_base[local - users] = (SyncBase){.wallet_paise = record->wallet_paise,
+                                          .loyalty_points = record->loyalty_points};
+    sync_track(local);
+    tap_profile_refresh(local);
+    return 1;
+}
+
+/**
+ * Wallet or loyalty changes this kiosk hasn't synced yet
+ */
+static int sync_pending(const User* user) {
+    const SyncBase* base = &sync_base[user - users];
+    return llround(user->wallet_balance * 100) != base->wallet_paise || user->loyalty_points != base->loyalty_points;
+}
+
+/**
+ * Send records framed as one RECORDS message: users[] entries whose
+ * sync_state is `state`, or (ids != NULL) the listed IDs found here
+ */
+static int sync_send_records(int fd, int state, const long long* ids, int id_count, SyncStats* stats) {
+    static SyncRecord chunk[SYNC_CHUNK];
+    SyncHeader header = {SYNC_MSG_RECORDS, 0};
+    int total = ids ? id_count : user_count;
+    for (int i = 0; i < total; i++) {
+        if (ids ? find_user(ids[i]) != NULL : sync_state[i] == state) header.count++;
+    }
+    if (!sync_write(fd, &header, sizeof(header), stats)) return 0;
+    
+    int n = 0;
+    for (int i = 0; i < total; i++) {
+        User* user = ids ? find_user(ids[i]) : sync_state[i] == state ? &users[i] : NULL;
+        if (!user) continue;
+        sync_record_pack(user, ids == NULL, &chunk[n++]);  // Pushes carry the kiosk's deltas
+        if (n == SYNC_CHUNK) {
+            if (!sync_write(fd, chunk, sizeof(chunk), stats)) return 0;
+            n = 0;
+        }
+    }
+    if (n > 0 && !sync_write(fd, chunk, n * sizeof(SyncRecord), stats)) return 0;
+    stats->records_sent += header.count;
+    return 1;
+}
+
+/**
+ * Receive the records of a RECORDS message (header already read) and store
+ * them: merged into this copy (store), or taken as they are (kiosk)
+ */
+static int sync_receive_records(int fd, const SyncHeader* header, int merge, SyncStats* stats) {
+    static SyncRecord chunk[SYNC_CHUNK];
+    if (header->type != SYNC_MSG_RECORDS) return 0;
+    for (uint32_t done = 0; done < header->count;) {
+        uint32_t n = header->count - done < SYNC_CHUNK ? header->count - done : SYNC_CHUNK;
+        if (!sync_read(fd, chunk, n * sizeof(SyncRecord), stats)) return 0;
+        for (uint32_t i = 0; i < n; i++) {
+            int stored = sync_record_valid(&chunk[i]) && (merge ? sync_merge(&chunk[i]) : sync_adopt(&chunk[i]));
+            if (!stored) stats->records_rejected++;
+        }
+        done += n;
+    }
+    stats->records_received += header->count;
+    return 1;
+}
+
+/**
+ * Serve Sync (central store side)
+ * Answers one kiosk's sync on a connected stream socket until it is done.
+ * Returns 1 if the session completed, 0 on a protocol or socket error.
+ */
+int sync_serve(int fd, SyncStats* stats) {
+    static uint32_t nodes[SYNC_LEAVES];
+    static uint64_t hashes[SYNC_LEAVES];
+    static SyncEntry entries[SYNC_CHUNK];
+    SyncHeader header;
+    memset(stats, 0, sizeof(*stats));
+    sync_tree_build();
+    
+    while (sync_read(fd, &header, sizeof(header), stats)) {
+        if (header.type == SYNC_MSG_DONE) {
+            sync_tree_build();
+            return sync_write(fd, &sync_tree[1], sizeof(sync_tree[1]), stats);
+        }
+        if (header.type == SYNC_MSG_RECORDS) {
+            // Newer records from the kiosk, then the IDs it wants from here
+            stats->round_trips++;
+            SyncHeader wanted;
+            if (!sync_receive_records(fd, &header, 1, stats) || !sync_read(fd, &wanted, sizeof(wanted), stats) ||
+                wanted.count > MAX_USERS || !sync_read(fd, sync_wanted, wanted.count * sizeof(long long), stats) ||
+                !sync_send_records(fd, 0, sync_wanted, (int)wanted.count, stats)) {
+                return 0;
+            }
+            continue;
+        }
+        if (header.count > SYNC_LEAVES || !sync_read(fd, nodes, header.count * sizeof(uint32_t), stats)) return 0;
+        stats->round_trips++;
+        if (header.type == SYNC_MSG_NODES) {
+            for (uint32_t i = 0; i < header.count; i++) {
+                hashes[i] = nodes[i] > 0 && nodes[i] < 2 * SYNC_LEAVES ? sync_tree[nodes[i]] : 0;
+            }
+            if (!sync_write(fd, hashes, header.count * sizeof(uint64_t), stats)) return 0;
+        } else if (header.type == SYNC_MSG_DIGESTS) {
+            memset(sync_marked, 0, sizeof(sync_marked));
+            for (uint32_t i = 0; i < header.count; i++) sync_marked[nodes[i] % SYNC_LEAVES] = 1;
+            stats->ranges_differing = (int)header.count;
+            
+            SyncHeader reply = {SYNC_MSG_DIGESTS, 0};
+            for (int i = 0; i < user_count; i++) reply.count += sync_marked[sync_leaf(users[i].user_id)];
+            if (!sync_write(fd, &reply, sizeof(reply), stats)) return 0;
+            int n = 0;
+            for (int i = 0; i < user_count; i++) {
+                if (!sync_marked[sync_leaf(users[i].user_id)]) continue;
+                entries[n++] = (SyncEntry){users[i].user_id, sync_digests[i], users[i].version, 0};
+                if (n == SYNC_CHUNK) {
+                    if (!sync_write(fd, entries, sizeof(entries), stats)) return 0;
+                    n = 0;
+                }
+            }
+            if (n > 0 && !sync_write(fd, entries, n * sizeof(SyncEntry), stats)) return 0;
+        } else {
+            return 0;
+        }
+    }
+    return 1;                           // Kiosk hung up between messages
+}
+
+/**
+ * Pull Sync (kiosk side)
+ * Reconciles users[] with the peer on a connected stream socket, in both
+ * directions. Returns 1 if both replicas match afterwards, 0 otherwise.
+ */
+int sync_pull(int fd, SyncStats* stats) {
+    static uint32_t nodes[SYNC_LEAVES];
+    static uint64_t hashes[SYNC_LEAVES];
+    static SyncEntry entries[SYNC_CHUNK];
+    memset(stats, 0, sizeof(*stats));
+    sync_tree_build();
+    
+    // Walk down one level per round trip, keeping only the nodes that differ
+    int count = 1, differing = 0;
+    nodes[0] = 1;
+    while (1) {
+        SyncHeader header = {SYNC_MSG_NODES, (uint32_t)count};
+        if (!sync_write(fd, &header, sizeof(header), stats) ||
+            !sync_write(fd, nodes, count * sizeof(uint32_t), stats) ||
+            !sync_read(fd, hashes, count * sizeof(uint64_t), stats)) {
+            return 0;
+        }
+        stats->round_trips++;
+        differing = 0;
+        for (int i = 0; i < count; i++) {
+            if (hashes[i] != sync_tree[nodes[i]]) nodes[differing++] = nodes[i];
+        }
+        if (differing == 0) return 1;   // Already in sync
+        if (nodes[0] >= SYNC_LEAVES) break;
+        for (int i = differing - 1; i >= 0; i--) {
+            nodes[2 * i + 1] = 2 * nodes[i] + 1;
+            nodes[2 * i] = 2 * nodes[i];
+        }
+        count = 2 * differing;
+    }
+    stats->ranges_differing = differing;
+    
+    // What the peer has in the differing ranges
+    memset(sync_marked, 0, sizeof(sync_marked));
+    for (int i = 0; i < differing; i++) {
+        nodes[i] -= SYNC_LEAVES;
+        sync_marked[nodes[i]] = 1;
+    }
+    SyncHeader header = {SYNC_MSG_DIGESTS, (uint32_t)differing};
+    if (!sync_write(fd, &header, sizeof(header), stats) ||
+        !sync_write(fd, nodes, differing * sizeof(uint32_t), stats) ||
+        !sync_read(fd, &header, sizeof(header), stats) || header.type != SYNC_MSG_DIGESTS) {
+        return 0;
+    }
+    stats->round_trips++;
+    
+    memset(sync_state, SYNC_UNSEEN, user_count);
+    int wanted = 0;
+    for (uint32_t done = 0; done < header.count;) {
+        uint32_t n = header.count - done < SYNC_CHUNK ? header.count - done : SYNC_CHUNK;
+        if (!sync_read(fd, entries, n * sizeof(SyncEntry), stats)) return 0;
+        for (uint32_t i = 0; i < n; i++) {
+            User* local = find_user(entries[i].user_id);
+            if (!local) {
+                if (wanted < MAX_USERS) sync_wanted[wanted++] = entries[i].user_id;
+                continue;
+            }
+            // Pushed records come back merged, so they are wanted too
+            int index = (int)(local - users);
+            sync_state[index] = sync_pending(local) || local->version > entries[i].version ? SYNC_PUSH : SYNC_SEEN;
+            if (sync_state[index] == SYNC_PUSH || entries[i].version != local->version ||
+                entries[i].digest != sync_digests[index]) {
+                if (wanted < MAX_USERS) sync_wanted[wanted++] = entries[i].user_id;
+            }
+        }
+        done += n;
+    }
+    stats->entries_compared = (int)header.count;
+    
+    // Users in those ranges the peer didn't report are new to it
+    for (int i = 0; i < user_count; i++) {
+        if (sync_state[i] == SYNC_UNSEEN && sync_marked[sync_leaf(users[i].user_id)]) {
+            sync_state[i] = SYNC_PUSH;
+            if (wanted < MAX_USERS) sync_wanted[wanted++] = users[i].user_id;
+        }
+    }
+    
+    // Ours that are newer, the IDs we want, then theirs
+    header = (SyncHeader){SYNC_MSG_RECORDS, (uint32_t)wanted};
+    if (!sync_send_records(fd, SYNC_PUSH, NULL, 0, stats) ||
+        !sync_write(fd, &header, sizeof(header), stats) ||
+        !sync_write(fd, sync_wanted, wanted * sizeof(long long), stats) ||
+        !sync_read(fd, &header, sizeof(header), stats) || !sync_receive_records(fd, &header, 0, stats)) {
+        return 0;
+    }
+    stats->round_trips++;
+    
+    uint64_t peer_root;
+    header = (SyncHeader){SYNC_MSG_DONE, 0};
+    if (!sync_write(fd, &header, sizeof(header), stats) || !sync_read(fd, &peer_root, sizeof(peer_root), stats)) {
+        return 0;
+    }
+    stats->round_trips++;
+    sync_tree_build();
+    return peer_root == sync_tree[1];
+}
+
+/**
+ * Change some users for the sync simulation: top-ups, sales and new users
+ */
+static void sync_simulate_changes(unsigned int seed, int first, int changes, int conflicts, int added) {
+    for (int i = 0; i < conflicts; i++) {
+        credit_wallet(&users[i], 10.0 + seed);
+    }
+    for (int i = 0; i < changes; i++) {
+        seed = seed * 1103515245u + 12345u;
+        User* user = &users[conflicts + (seed >> 8) % (unsigned int)(first - conflicts)];
+        if (i % 2) {
+            credit_wallet(user, 50.0);
+        } else {
+            process_purchase(user, 1.0 + i % 20, 2, NULL, 0);
+        }
+    }
+    for (int i = 0; i < added && user_count < MAX_USERS; i++) {
+        User* user = &users[user_count++];
+        memset(user, 0, sizeof(*user));
+        user->user_id = generate_id();
+        snprintf(user->name, sizeof(user->name), "Sync New %u-%d", seed % 100, i);
+        index_user(user);
+        credit_wallet(user, 100.0);
+    }
+}
+
+/**
+ * Sync Simulation
+ * Forks a central store from this kiosk after both hold the same roster,
+ * lets each side change some users on its own (a few on both), then syncs
+ * them over a socket pair and compares the cost with a full-table copy
+ */
+void sync_simulate(int user_total, int changes) {
+    int added = changes / 10 + 1, conflicts = changes / 10 + 1;
+    if (user_total > MAX_USERS - 2 * added) user_total = MAX_USERS - 2 * added;
+    if (changes > user_total / 2) changes = user_total / 2;
+    
+    // Shared starting roster
+    long long first_id = generate_id_block(user_total);
+    for (int i = 0; i < user_total; i++) {
+        User* user = &users[user_count++];
+        memset(user, 0, sizeof(*user));
+        user->user_id = id_block_nth(first_id, i);
+        snprintf(user->name, sizeof(user->name), "Sync User %d", i);
+        snprintf(user->phone, sizeof(user->phone), "8%09d", i);
+        user->wallet_balance = 50 + i % 200;
+        index_user(user);
+        tap_profile_refresh(user);
+        sync_base[i] = (SyncBase){.wallet_paise = llround(user->wallet_balance * 100)}; // Synced before
+    }
+    
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        printf("Sync simulation: socketpair failed (%s)\n", strerror(errno));
+        return;
+    }
+    fflush(stdout);
+    pid_t store = fork();
+    if (store < 0) {
+        printf("Sync simulation: fork failed (%s)\n", strerror(errno));
+        return;
+    }
+    if (store == 0) {
+        // Central store: its own ID space, its own changes, then serve the kiosk
+        close(fds[0]);
+        kiosk_id = (kiosk_id + 1) & ((1 << ID_KIOSK_BITS) - 1);
+        sync_simulate_changes(2, user_total, changes / 2, conflicts, added);
+        SyncStats store_stats;
+        _exit(sync_serve(fds[1], &store_stats) ? 0 : 1);
+    }
+    close(fds[1]);
+    sync_simulate_changes(1, user_total, changes - changes / 2, conflicts, added);
+    
+    SyncStats stats;
+    long long start = monotonic_ns();
+    int converged = sync_pull(fds[0], &stats);
+    double sync_ms = (monotonic_ns() - start) / 1e6;
+    close(fds[0]);
+    int status = 0;
+    waitpid(store, &status, 0);
+    
+    long long delta = stats.bytes_sent + stats.bytes_received;
+    long long full = 2LL * user_total * (long long)sizeof(User);
+    int merged = 0;                     // Kiosk credited ₹11 and the store ₹12: both must survive
+    for (int i = 0; i < conflicts; i++) {
+        merged += fabs(users[i].wallet_balance - (50 + i % 200 + 11.0 + 12.0)) < 0.005;
+    }
+    
+    printf("\n=== REPLICA SYNC SIMULATION (kiosk <-> central store, two processes) ===\n");
+    printf("Users: %d shared, changed %d (kiosk %d, store %d), %d changed on both, %d new on each side\n",
+           user_total, changes, changes - changes / 2, changes / 2, conflicts, added);
+    printf("Tree: %d ID-hash ranges, %d differed (%d entries compared)\n",
+           SYNC_LEAVES, stats.ranges_differing, stats.entries_compared);
+    printf("Round trips: %d, records sent %d, received %d\n",
+           stats.round_trips, stats.records_sent, stats.records_received);
+    printf("Bytes: %.1f KB exchanged vs %.1f MB for a full-table copy each way (%.0fx less)\n",
+           delta / 1024.0, full / 1048576.0, full / (double)delta);
+    printf("Wallets changed on both sides keeping both changes: %d/%d (records rejected: %d)\n", merged, conflicts,
+           stats.records_rejected);
+    printf("Sync time: %.1f ms, store exit %d, replicas %s\n", sync_ms,
+           WIFEXITED(status) ? WEXITSTATUS(status) : -1, converged ? "identical (roots match)" : "DIFFER");
+}
+
+// =================== KIOSK LEASE CACHE ===================
+
+/*
+ * With users kept in a central store, every lookup at a kiosk would be a
+ * network round trip. Kiosks therefore cache the records they fetch. The
+ * store hands out each record with a lease: a promise that it will tell the
+ * kiosk when the record changes, valid for lease_term_ms. While the lease
+ * runs the kiosk answers from its cache; once it ends the record is fetched
+ * again. The lease is timed on the kiosk from when the request was sent,
+ * so it never outlives the store's promise.
+ *
+ * Wallet writes go through to the store, which owns the record. The store
+ * applies them, answers with the new record, and pushes an invalidation to
+ * every other kiosk whose lease on that user is still running. Kiosks apply
+ * pushes before each lookup, so a cached read is stale only for as long as
+ * an invalidation is in flight. If a push is lost, the copy is stale for at
+ * most the lease term.
+ */
+
+/**
+ * Apply an invalidation from the store
+ */
+static void lease_invalidate(LeaseCache* cache, const LeaseMessage* msg) {
+    LeaseEntry* set = cache->sets[hash_slot((uint64_t)msg->user_id, LEASE_SETS)];
+    for (int way = 0; way < LEASE_WAYS; way++) {
+        if (set[way].expires_ns != 0 && set[way].user.user_id == msg->user_id) {
+            set[way].invalidated = 1;
+        }
+    }
+    long long stale_ns = monotonic_ns() - msg->changed_ns;
+    cache->stats.invalidations++;
+    cache->stats.stale_ns_total += stale_ns;
+    if (stale_ns > cache->stats.stale_ns_max) cache->stats.stale_ns_max = stale_ns;
+}
+
+/**
+ * Apply every invalidation that has already arrived (never waits)
+ */
+static void lease_drain(LeaseCache* cache) {
+    struct pollfd pfd = {.fd = cache->fd, .events = POLLIN};
+    LeaseMessage msg;
+    while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+        if (!sync_read(cache->fd, &msg, sizeof(msg), &cache->stats.wire) || msg.type != LEASE_MSG_INVALIDATE) return;
+        lease_invalidate(cache, &msg);
+    }
+}
+
+/**
+ * Keep a record the store just sent (its way in the set, or the LRU way)
+ */
+static User* lease_fill(LeaseCache* cache, const User* record, long long sent_ns, long long lease_ms) {
+    LeaseEntry* set = cache->sets[hash_slot((uint64_t)record->user_id, LEASE_SETS)];
+    LeaseEntry* entry = &set[0];
+    for (int way = 0; way < LEASE_WAYS; way++) {
+        if (set[way].expires_ns != 0 && set[way].user.user_id == record->user_id) {
+            entry = &set[way];
+            break;
+        }
+        if (set[way].used < entry->used) entry = &set[way];
+    }
+    if (entry->expires_ns != 0 && entry->user.user_id != record->user_id) cache->stats.evictions++;
+    if (entry->expires_ns != 0) mem_release(MEM_CACHES, sizeof(*entry));
+    mem_claim(MEM_CACHES, sizeof(*entry));
+    entry->user = *record;
+    entry->expires_ns = sent_ns + lease_ms * 1000000LL;
+    entry->used = ++cache->clock;
+    entry->invalidated = 0;
+    return &entry->user;
+}
+
+/**
+ * One request/reply with the store; pushes that arrive first are applied.
+ * Returns the cached record from a found reply, NULL otherwise.
+ */
+static User* lease_call(LeaseCache* cache, LeaseMessage* request) {
+    long long sent_ns = monotonic_ns();
+    if (!sync_write(cache->fd, request, sizeof(*request), &cache->stats.wire)) return NULL;
+    cache->stats.round_trips++;
+    
+    LeaseMessage reply;
+    User record;
+    while (sync_read(cache->fd, &reply, sizeof(reply), &cache->stats.wire)) {
+        if (reply.type == LEASE_MSG_INVALIDATE) {
+            lease_invalidate(cache, &reply);
+            continue;
+        }
+        User* user = NULL;
+        if (reply.status && sync_read(cache->fd, &record, sizeof(record), &cache->stats.wire)) {
+            user = lease_fill(cache, &record, sent_ns, reply.lease_ms);
+        }
+        cache->stats.miss_ns += monotonic_ns() - sent_ns;
+        return user;
+    }
+    return NULL;
+}
+
+/**
+ * Find User through the lease cache
+ * Answers from the cache while the record's lease runs and no invalidation
+ * came for it; otherwise fetches it from the store. NULL if unknown.
+ */
+User* lease_find_user(long long user_id) {
+    LeaseCache* cache = &lease_cache;
+    long long start_ns = monotonic_ns();
+    lease_drain(cache);
+    cache->stats.lookups++;
+    
+    LeaseEntry* set = cache->sets[hash_slot((uint64_t)user_id, LEASE_SETS)];
+    LeaseEntry* cached = NULL;
+    for (int way = 0; way < LEASE_WAYS && !cached; way++) {
+        if (set[way].expires_ns != 0 && set[way].user.user_id == user_id) cached = &set[way];
+    }
+    if (cached && !cached->invalidated && cached->expires_ns > start_ns) {
+        cached->used = ++cache->clock;
+        cache->stats.hits++;
+        cache->stats.hit_ns += monotonic_ns() - start_ns;
+        return &cached->user;
+    }
+    if (!cached) {
+        cache->stats.cold_misses++;
+    } else if (cached->invalidated) {
+        cache->stats.invalidated_misses++;
+    } else {
+        cache->stats.expired_misses++;
+    }
+    
+    LeaseMessage request = {.type = LEASE_MSG_GET, .user_id = user_id};
+    return lease_call(cache, &request);
+}
+
+/**
+ * Debit Wallet through the store (write-through; negative amounts credit)
+ * Returns 1 if the store applied it; the cache then holds the new record
+ */
+int lease_debit(long long user_id, double amount) {
+    LeaseCache* cache = &lease_cache;
+    lease_drain(cache);
+    cache->stats.writes++;
+    LeaseMessage request = {.type = LEASE_MSG_DEBIT, .user_id = user_id, .amount_paise = llround(amount * 100)};
+    return lease_call(cache, &request) != NULL;
+}
+
+/**
+ * Store side: answer one kiosk request (kiosk = connection index)
+ */
+static int lease_store_handle(const int* fds, int kiosks, int kiosk, const LeaseMessage* request, SyncStats* wire) {
+    User* user = find_user(request->user_id);
+    LeaseMessage reply = {.type = LEASE_MSG_REPLY, .user_id = request->user_id, .status = user != NULL};
+    long long now = monotonic_ns();
+    
+    if (user && request->type == LEASE_MSG_DEBIT) {
+        double amount = request->amount_paise / 100.0;
+        if (user->wallet_balance < amount) {
+            reply.status = 0;
         } else {
-            // Calculate available discounts
-            discount = calculate_discount(user, liters, payment_method);
+            user->wallet_balance -= amount;
+            user_changed(user);
             
-            // Fee optimization strategies:
-            if (liters >= MIN_BULK_LITERS) {
-                // Strategy 1: Bulk purchase - waive fee
-                printf("Bulk purchase - Digital fee waived!\n");
-                fee = 0.0;
-            } else if (discount >= DIGITAL_FEE) {
-                // Strategy 2: Discount covers fee
-                printf("Discount covers digital fee!\n");
-                fee = 0.0;
-            } else {
-                // Strategy 3: Reduce fee by available discount
-                fee = DIGITAL_FEE - discount;
-                if (fee < 0) fee = 0;
+            // Everyone else holding a running lease must drop their copy
+            LeaseHolder* holder = &lease_holders[user - users];
+            LeaseMessage push = {.type = LEASE_MSG_INVALIDATE, .user_id = user->user_id, .changed_ns = now};
+            for (int k = 0; k < kiosks && holder->until_ns > now; k++) {
+                if (k != kiosk && (holder->kiosks >> k & 1) && fds[k] >= 0) {
+                    sync_write(fds[k], &push, sizeof(push), wire);
+                }
             }
+            holder->kiosks = 0;
         }
-        
-        final_amount = base_cost - discount + fee;
-        
-        // Validate sufficient wallet balance
-        if (user->wallet_balance < final_amount) {
-            printf("Insufficient wallet balance!\n");
-            printf("Required: ₹%.2f, Available: ₹%.2f\n", final_amount, user->wallet_balance);
-            return;
+    } else if (request->type != LEASE_MSG_GET) {
+        reply.status = 0;
+    }
+    
+    if (reply.status) {
+        LeaseHolder* holder = &lease_holders[user - users];
+        if (holder->until_ns <= now) holder->kiosks = 0;
+        holder->kiosks |= 1ULL << kiosk;
+        if (now + lease_term_ms * 1000000LL > holder->until_ns) holder->until_ns = now + lease_term_ms * 1000000LL;
+        reply.lease_ms = lease_term_ms;
+    }
+    if (!sync_write(fds[kiosk], &reply, sizeof(reply), wire)) return 0;
+    return !reply.status || sync_write(fds[kiosk], user, sizeof(*user), wire);
+}
+
+/**
+ * Serve Kiosks (central store side)
+ * Answers lookups and wallet writes from up to LEASE_MAX_KIOSKS connected
+ * stream sockets until every kiosk has hung up
+ */
+void lease_store_serve(const int* fds, int kiosks) {
+    static int open_fds[LEASE_MAX_KIOSKS];
+    struct pollfd pfds[LEASE_MAX_KIOSKS];
+    SyncStats wire = {0};
+    signal(SIGPIPE, SIG_IGN);           // A kiosk hanging up mid-push must not stop the store
+    if (kiosks > LEASE_MAX_KIOSKS) kiosks = LEASE_MAX_KIOSKS;
+    for (int k = 0; k < kiosks; k++) {
+        open_fds[k] = fds[k];
+        pfds[k] = (struct pollfd){.fd = fds[k], .events = POLLIN};
+    }
+    
+    int open = kiosks;
+    while (open > 0 && poll(pfds, kiosks, -1) >= 0) {
+        for (int k = 0; k < kiosks; k++) {
+            if (pfds[k].fd < 0 || !(pfds[k].revents & (POLLIN | POLLHUP))) continue;
+            LeaseMessage request;
+            if (!sync_read(pfds[k].fd, &request, sizeof(request), &wire) ||
+                !lease_store_handle(open_fds, kiosks, k, &request, &wire)) {
+                close(pfds[k].fd);
+                pfds[k].fd = open_fds[k] = -1;
+                open--;
+            }
         }
-        
-        // Deduct amount from wallet
-        user->wallet_balance -= final_amount;
-        stats.digital_transactions++;
-        
+    }
+}
+
+/**
+ * Lease Cache Report
+ */
+void lease_report(const LeaseStats* stats) {
+    printf("Lookups: %lld, hit rate %.1f%% (misses: %lld cold/evicted, %lld lease expired, %lld invalidated)\n",
+           stats->lookups, stats->lookups ? stats->hits * 100.0 / stats->lookups : 0, stats->cold_misses,
+           stats->expired_misses, stats->invalidated_misses);
+    printf("Round trips: %lld for %lld lookups + %lld wallet writes (%.1f%% of uncached), %lld evictions\n",
+           stats->round_trips, stats->lookups, stats->writes,
+           stats->lookups + stats->writes ? stats->round_trips * 100.0 / (stats->lookups + stats->writes) : 0,
+           stats->evictions);
+    printf("Latency: hit %.2f µs, round trip %.1f µs\n",
+           stats->hits ? stats->hit_ns / 1000.0 / stats->hits : 0,
+           stats->round_trips ? stats->miss_ns / 1000.0 / stats->round_trips : 0);
+    printf("Staleness: %lld invalidations applied %.1f µs (mean) / %.1f µs (max) after the store's change; "
+           "%d ms at most if a push is lost\n", stats->invalidations,
+           stats->invalidations ? stats->stale_ns_total / 1000.0 / stats->invalidations : 0,
+           stats->stale_ns_max / 1000.0, lease_term_ms);
+}
+
+/**
+ * Lease Cache Simulation
+ * A central store and several kiosks, each its own process on a socket
+ * pair. Every kiosk mostly serves its own regulars (a quarter of them
+ * shared with the next kiosk) plus walk-ins from the whole roster: 70%
+ * lookups, 30% purchases that debit the wallet through the store.
+ */
+void lease_simulate(int kiosks, int ops, int lease_ms) {
+    if (kiosks < 1) kiosks = 1;
+    if (kiosks > LEASE_MAX_KIOSKS) kiosks = LEASE_MAX_KIOSKS;
+    if (lease_ms < 1) lease_ms = LEASE_TERM_MS;
+    int user_total = MAX_USERS < 20000 ? MAX_USERS : 20000;
+    int regulars = user_total / (2 * kiosks) < 400 ? user_total / (2 * kiosks) : 400;
+    lease_term_ms = lease_ms;
+    
+    long long first_id = generate_id_block(user_total);
+    for (int i = 0; i < user_total; i++) {
+        User* user = &users[user_count++];
+        memset(user, 0, sizeof(*user));
+        user->user_id = id_block_nth(first_id, i);
+        snprintf(user->name, sizeof(user->name), "Lease User %d", i);
+        user->wallet_balance = 1e6;
+        index_user(user);
+    }
+    
+    // One socket pair per kiosk, one pipe for the kiosks' results
+    int store_fds[LEASE_MAX_KIOSKS], kiosk_fds[LEASE_MAX_KIOSKS], results[2];
+    if (pipe(results) != 0) return;
+    for (int k = 0; k < kiosks; k++) {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) return;
+        store_fds[k] = pair[0];
+        kiosk_fds[k] = pair[1];
+    }
+    fflush(stdout);
+    
+    pid_t store = fork();
+    if (store == 0) {
+        for (int k = 0; k < kiosks; k++) close(kiosk_fds[k]);
+        close(results[0]);
+        close(results[1]);
+        lease_store_serve(store_fds, kiosks);
+        _exit(0);
+    }
+    for (int k = 0; k < kiosks; k++) close(store_fds[k]);
+    for (int k = 0; k < kiosks; k++) {
+        if (fork() == 0) {
+            for (int j = 0; j < kiosks; j++) {
+                close(store_fds[j]);
+                if (j != k) close(kiosk_fds[j]);
+            }
+            close(results[0]);
+            lease_cache.fd = kiosk_fds[k];
+            unsigned int seed = 7919u * (k + 1);
+            for (int i = 0; i < ops; i++) {
+                seed = seed * 1103515245u + 12345u;
+                unsigned int r = seed >> 8;
+                int customer = r % 100 < 80 ? (k * regulars * 3 / 4 + (int)(r / 100 % regulars)) % user_total
+                                            : (int)(r / 100 % user_total);
+                User* user = lease_find_user(users[customer].user_id);
+                if (user && r % 10 < 3) lease_debit(user->user_id, 10.0);
+            }
+            _Static_assert(sizeof(LeaseStats) <= PIPE_BUF, "kiosk results must be one atomic pipe write");
+            sync_write(results[1], &lease_cache.stats, sizeof(lease_cache.stats), &lease_cache.stats.wire);
+            _exit(0);
+        }
+    }
+    for (int k = 0; k < kiosks; k++) close(kiosk_fds[k]);
+    close(results[1]);
+    
+    // Collect per-kiosk results (each is one pipe write, so they don't interleave)
+    LeaseStats total = {0}, result;
+    SyncStats wire = {0};
+    for (int k = 0; k < kiosks && sync_read(results[0], &result, sizeof(result), &wire); k++) {
+        total.lookups += result.lookups;
+        total.hits += result.hits;
+        total.cold_misses += result.cold_misses;
+        total.expired_misses += result.expired_misses;
+        total.invalidated_misses += result.invalidated_misses;
+        total.evictions += result.evictions;
+        total.writes += result.writes;
+        total.round_trips += result.round_trips;
+        total.invalidations += result.invalidations;
+        total.stale_ns_total += result.stale_ns_total;
+        if (result.stale_ns_max > total.stale_ns_max) total.stale_ns_max = result.stale_ns_max;
+        total.hit_ns += result.hit_ns;
+        total.miss_ns += result.miss_ns;
+    }
+    close(results[0]);
+    while (wait(NULL) > 0) {}
+    
+    printf("\n=== KIOSK LEASE CACHE SIMULATION (%d kiosks + central store, separate processes) ===\n", kiosks);
+    printf("Users: %d, %d operations per kiosk (70%% lookups, 30%% wallet debits), lease %d ms, cache %d records\n",
+           user_total, ops, lease_ms, LEASE_SETS * LEASE_WAYS);
+    lease_report(&total);
+}
+
+// =================== PARALLEL REPORT SCANS ===================
+
+/*
+ * Reports that read a whole table (every sale, every user) split it into
+ * morsels of about SCAN_MORSEL_BYTES. Workers claim the next morsel with one
+ * atomic add, so a thread that gets ahead or is descheduled never leaves the
+ * others waiting on a fixed slice. Each worker folds its rows into its own
+ * partial aggregate on separate cache lines; the caller merges the partials
+ * once all workers are done. The calling thread works as worker 0.
+ *
+ * Aggregates are integers (paise, centiliters, counts), so the totals do not
+ * depend on how the morsels were shared out.
+ */
+
+/**
+ * Worker loop: claim morsels until the table is covered
+ */
+static void* scan_worker_main(void* arg) {
+    ScanWorker* worker = arg;
+    ScanJob* job = worker->job;
+    int first;
+    while ((first = atomic_fetch_add_explicit(&job->next, job->morsel_rows, memory_order_relaxed)) < job->rows) {
+        int end = job->rows - first > job->morsel_rows ? first + job->morsel_rows : job->rows;
+        job->scan(first, end, worker->partial);
+        worker->morsels++;
+    }
+    return NULL;
+}
+
+/**
+ * Run a Parallel Scan
+ * Calls scan on morsels of rows [0, rows) from up to threads workers and
+ * merges their partials into total (which the caller initializes). Returns
+ * the number of workers used, or -1 if partial_size is too large.
+ */
+int scan_run(int rows, size_t row_bytes, ScanMorselFn scan, size_t partial_size,
+             ScanMergeFn merge, void* total, int threads) {
+    if (partial_size > SCAN_PARTIAL_BYTES) return -1;
+    if (rows <= 0) return 0;
+    int morsel_rows = row_bytes < SCAN_MORSEL_BYTES ? (int)(SCAN_MORSEL_BYTES / row_bytes) : 1;
+    int morsels = (rows + morsel_rows - 1) / morsel_rows;
+    if (threads > SCAN_MAX_THREADS) threads = SCAN_MAX_THREADS;
+    if (threads > morsels) threads = morsels;
+    if (threads < 1) threads = 1;
+    
+    pthread_mutex_lock(&scan_lock);
+    ScanJob job = {.rows = rows, .morsel_rows = morsel_rows, .scan = scan};
+    ScanWorker workers[SCAN_MAX_THREADS];
+    pthread_t ids[SCAN_MAX_THREADS];
+    for (int t = 0; t < threads; t++) {
+        memcpy(scan_partials[t].bytes, total, partial_size); // Carries the caller's parameters (e.g. clock)
+        workers[t] = (ScanWorker){&job, &scan_partials[t], 0};
+    }
+    
+    int started = 1;
+    for (int t = 1; t < threads; t++) {
+        if (pthread_create(&ids[t], NULL, scan_worker_main, &workers[t]) != 0) break;
+        started++;
+    }
+    scan_worker_main(&workers[0]);
+    for (int t = 1; t < started; t++) pthread_join(ids[t], NULL);
+    
+    for (int t = 0; t < started; t++) merge(total, scan_partials[t].bytes);
+    pthread_mutex_unlock(&scan_lock);
+    return started;
+}
+
+/**
+ * Sales morsel: per-method totals and sales by hour
+ */
+static void scan_sales_morsel(int first, int end, void* partial) {
+    SalesScan* sum = partial;
+    for (int i = first; i < end; i++) {
+        const Transaction* txn = &transactions[i];
+        int method = 0;
+        while (method < SCAN_METHODS - 1 && strcmp(txn->payment_method, flash_methods[method]) != 0) method++;
+        sum->sales[method]++;
+        sum->amount_paise[method] += llround(txn->amount * 100);
+        sum->centiliters[method] += llround(txn->liters * 100);
+        if (txn->reverses == 0) sum->hour_sales[((long long)txn->timestamp + sum->utc_offset) / 3600 % 24]++;
+    }
+}
+
+/**
+ * Add one worker's sales totals to the result
+ */
+static void scan_sales_merge(void* total, const void* partial) {
+    SalesScan* sum = total;
+    const SalesScan* add = partial;
+    for (int m = 0; m < SCAN_METHODS; m++) {
+        sum->sales[m] += add->sales[m];
+        sum->amount_paise[m] += add->amount_paise[m];
+        sum->centiliters[m] += add->centiliters[m];
+    }
+    for (int h = 0; h < 24; h++) sum->hour_sales[h] += add->hour_sales[h];
+}
+
+void scan_sales(SalesScan* total, int threads) {
+    struct tm local;
+    time_t now = time(NULL);
+    localtime_r(&now, &local);
+    *total = (SalesScan){.utc_offset = local.tm_gmtoff};
+    scan_run(transaction_count, sizeof(Transaction), scan_sales_morsel, sizeof(SalesScan),
+             scan_sales_merge, total, threads);
+}
+
+/**
+ * User morsel: balances owed, spending, points and account flags
+ */
+static void scan_users_morsel(int first, int end, void* partial) {
+    UserScan* sum = partial;
+    for (int i = first; i < end; i++) {
+        const User* user = &users[i];
+        sum->users++;
+        sum->wallet_paise += llround(user->wallet_balance * 100);
+        sum->spent_paise += llround(user->total_spent * 100);
+        sum->points += user->loyalty_points;
+        sum->active_passes += (user->has_weekly_pass || user->has_monthly_pass) && user->pass_expiry > sum->now;
+        sum->students += user->is_student != 0;
+        sum->with_pin += user->has_pin != 0;
+        sum->never_bought += user->transaction_count == 0;
+    }
+}
+
+/**
+ * Add one worker's user totals to the result
+ */
+static void scan_users_merge(void* total, const void* partial) {
+    UserScan* sum = total;
+    const UserScan* add = partial;
+    sum->users += add->users;
+    sum->wallet_paise += add->wallet_paise;
+    sum->spent_paise += add->spent_paise;
+    sum->points += add->points;
+    sum->active_passes += add->active_passes;
+    sum->students += add->students;
+    sum->with_pin += add->with_pin;
+    sum->never_bought += add->never_bought;
+}
+
+void scan_users(UserScan* total, int threads) {
+    *total = (UserScan){.now = time(NULL)};
+    scan_run(user_count, sizeof(User), scan_users_morsel, sizeof(UserScan), scan_users_merge, total, threads);
+}
+
+/**
+ * Full History Report
+ * Recomputed from transactions[] and users[] rather than the running
+ * counters, so it also shows what the counters don't keep
+ */
+void scan_report(int threads) {
+    SalesScan sales;
+    UserScan people;
+    long long start = monotonic_ns();
+    scan_sales(&sales, threads);
+    scan_users(&people, threads);
+    double elapsed_ms = (monotonic_ns() - start) / 1e6;
+    
+    printf("\n=== FULL HISTORY SCAN ===\n");
+    for (int m = 0; m < SCAN_METHODS; m++) {
+        if (sales.sales[m] == 0) continue;
+        printf("%-8s %6lld records  ₹%10.2f  %9.1f L\n", flash_methods[m], sales.sales[m],
+               sales.amount_paise[m] / 100.0, sales.centiliters[m] / 100.0);
+    }
+    int busiest = 0;
+    for (int h = 1; h < 24; h++) {
+        if (sales.hour_sales[h] > sales.hour_sales[busiest]) busiest = h;
+    }
+    if (sales.hour_sales[busiest] > 0) {
+        printf("Busiest hour: %02d:00-%02d:00 (%lld sales)\n", busiest, (busiest + 1) % 24, sales.hour_sales[busiest]);
+    }
+    printf("Wallet balances owed: ₹%.2f across %lld users (%lld never bought)\n",
+           people.wallet_paise / 100.0, people.users, people.never_bought);
+    printf("Active passes: %lld, Students: %lld, PIN-protected: %lld, Points outstanding: %lld\n",
+           people.active_passes, people.students, people.with_pin, people.points);
+    printf("Scanned %d sales + %d users in %.2f ms\n", transaction_count, user_count, elapsed_ms);
+}
+
+void scan_benchmark(int max_threads) {
+    // Fill both tables to capacity (records are synthetic; nothing is indexed)
+    while (user_count < MAX_USERS) {
+        User* user = &users[user_count];
+        *user = (User){.user_id = generate_id(), .wallet_balance = user_count % 500 + 0.25,
+                       .total_spent = user_count % 3000, .loyalty_points = user_count % 300,
+                       .transaction_count = user_count % 7, .is_student = user_count % 4 == 0,
+                       .has_pin = user_count % 3 == 0, .has_weekly_pass = user_count % 5 == 0,
+                       .pass_expiry = time(NULL) + (user_count % 10 < 5 ? 3600 : -3600)};
+        snprintf(user->name, sizeof(user->name), "Scan User %d", user_count);
+        user_count++;
+    }
+    while (transaction_count < MAX_TRANSACTIONS) {
+        Transaction* txn = &transactions[transaction_count];
+        int method = transaction_count % (SCAN_METHODS - 1);
+        *txn = (Transaction){.transaction_id = generate_id(), .user_id = users[transaction_count % user_count].user_id,
+                             .amount = 2.0f * (1 + transaction_count % 20), .liters = 1 + transaction_count % 20,
+                             .timestamp = time(NULL) - transaction_count * 97LL};
+        snprintf(txn->payment_method, sizeof(txn->payment_method), "%s", flash_methods[method]);
+        transaction_count++;
+    }
+    if (max_threads < 1) max_threads = 1;
+    if (max_threads > SCAN_MAX_THREADS) max_threads = SCAN_MAX_THREADS;
+    
+    double user_mb = user_count * sizeof(User) / 1e6;
+    printf("\n=== PARALLEL SCAN BENCHMARK (%ld cores online) ===\n", sysconf(_SC_NPROCESSORS_ONLN));
+    printf("Users: %d (%.1f MB), Sales: %d (%.2f MB), morsels of %d KB\n", user_count, user_mb,
+           transaction_count, transaction_count * sizeof(Transaction) / 1e6, SCAN_MORSEL_BYTES / 1024);
+    printf("%8s %14s %12s %14s %10s\n", "Threads", "Users (ms)", "GB/s", "Sales (µs)", "Totals");
+    
+    UserScan reference_users;
+    SalesScan reference_sales;
+    scan_users(&reference_users, 1);
+    scan_sales(&reference_sales, 1);
+    double base_ms = 0;
+    for (int threads = 1; threads <= max_threads; threads = threads < max_threads && threads * 2 > max_threads ? max_threads : threads * 2) {
+        double best_users = 1e18, best_sales = 1e18;
+        int same = 1;
+        for (int run = 0; run < 5; run++) {
+            UserScan people;
+            SalesScan sales;
+            long long start = monotonic_ns();
+            scan_users(&people, threads);
+            long long middle = monotonic_ns();
+            scan_sales(&sales, threads);
+            long long end = monotonic_ns();
+            if ((middle - start) / 1e6 < best_users) best_users = (middle - start) / 1e6;
+            if ((end - middle) / 1e3 < best_sales) best_sales = (end - middle) / 1e3;
+            people.now = reference_users.now; // Totals only; the clock may have ticked
+            same &= memcmp(&people, &reference_users, sizeof(people)) == 0 &&
+                    memcmp(&sales, &reference_sales, sizeof(sales)) == 0;
+        }
+        if (threads == 1) base_ms = best_users;
+        printf("%8d %9.2f (%3.1fx) %12.2f %14.1f %10s\n", threads, best_users, base_ms / best_users,
+               user_mb / 1e3 / (best_users / 1e3), best_sales, same ? "match" : "MISMATCH");
+        if (threads == max_threads) break;
+    }
+    printf("Wallet balances owed: ₹%.2f, active passes: %lld\n",
+           reference_users.wallet_paise / 100.0, reference_users.active_passes);
+}
+
+// =================== ANALYTICS HISTORY ===================
+
+/*
+ * stats only holds lifetime totals. To see how revenue or the digital share
+ * moved, every change to stats is also added to the current point of three
+ * round-robin archives: per minute for a day, per hour for a month, per day
+ * for years. Points hold the change over their interval, not running totals,
+ * so a restart (which starts stats from zero) doesn't break the series.
+ *
+ * The point for time t sits at slot (t / step) % rows of its archive, so
+ * writing one costs O(1) per archive and a query reads exactly the slots of
+ * the intervals it returns. A slot still holding an older interval means
+ * nothing changed in the one asked for. With WATER_ATM_HISTORY set, each
+ * updated point is also written in place to a file whose size never changes:
+ * a header plus every archive's ring.
+ */
+
+/**
+ * into += now - before, field by field
+ */
+static void analytics_add_change(Analytics* into, const Analytics* now, const Analytics* before) {
+    into->total_revenue += now->total_revenue - before->total_revenue;
+    into->total_fees_collected += now->total_fees_collected - before->total_fees_collected;
+    into->total_discounts_given += now->total_discounts_given - before->total_discounts_given;
+    into->cash_transactions += now->cash_transactions - before->cash_transactions;
+    into->digital_transactions += now->digital_transactions - before->digital_transactions;
+    into->bulk_purchases += now->bulk_purchases - before->bulk_purchases;
+    into->pass_holders += now->pass_holders - before->pass_holders;
+    into->refunds += now->refunds - before->refunds;
+    into->total_refunded += now->total_refunded - before->total_refunded;
+}
+
+/**
+ * Start of the archive interval holding time t (hours and days are local)
+ */
+static long long history_interval(const HistoryArchive* archive, long long t) {
+    long long local = t + history.utc_offset;
+    return local - local % archive->step - history.utc_offset;
+}
+
+/**
+ * Slot in history_points[] for the interval starting at start
+ */
+static int history_slot(const HistoryArchive* archive, long long start) {
+    return archive->first + (int)((start + history.utc_offset) / archive->step % archive->rows);
+}
+
+/**
+ * Write one point back to the history file (in place)
+ */
+static void history_write(int slot) {
+    if (history.fd < 0) return;
+    off_t offset = (off_t)sizeof(HistoryHeader) + (off_t)slot * (off_t)sizeof(HistoryPoint);
+    if (pwrite(history.fd, &history_points[slot], sizeof(HistoryPoint), offset) == (ssize_t)sizeof(HistoryPoint)) {
+        history.writes++;
     } else {
-        printf("Invalid payment method!\n");
+        history.write_failures++;
+    }
+}
+
+/**
+ * Local offset from UTC, taken once so slots never move within a run
+ */
+static void history_clock_init() {
+    static int ready = 0;
+    if (ready) return;
+    struct tm local;
+    time_t now = time(NULL);
+    localtime_r(&now, &local);
+    history.utc_offset = local.tm_gmtoff;
+    ready = 1;
+}
+
+/**
+ * Open History File
+ * Loads the points if the file was made with this build's geometry,
+ * otherwise starts a new one at its fixed size. Returns 1 if usable.
+ */
+int history_open(const char* path) {
+    history_clock_init();
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return 0;
+    
+    HistoryHeader expected = {.magic = HISTORY_MAGIC, .point_size = sizeof(HistoryPoint)};
+    for (int a = 0; a < HISTORY_ARCHIVES; a++) {
+        expected.rows[a] = history_archives[a].rows;
+        expected.steps[a] = history_archives[a].step;
+    }
+    off_t file_size = (off_t)sizeof(HistoryHeader) + (off_t)sizeof(history_points);
+    
+    HistoryHeader found;
+    if (lseek(fd, 0, SEEK_END) == file_size && pread(fd, &found, sizeof(found), 0) == (ssize_t)sizeof(found) &&
+        memcmp(&found, &expected, sizeof(found)) == 0 &&
+        pread(fd, history_points, sizeof(history_points), sizeof(HistoryHeader)) == (ssize_t)sizeof(history_points)) {
+        for (int i = 0; i < HISTORY_ROWS; i++) {
+            if (history_points[i].start != 0) mem_claim(MEM_SKETCHES, sizeof(HistoryPoint));
+        }
+        history.fd = fd;
+        return 1;
+    }
+    
+    // New file, or another geometry: start over at the fixed size
+    memset(history_points, 0, sizeof(history_points));
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, file_size) != 0 ||
+        pwrite(fd, &expected, sizeof(expected), 0) != (ssize_t)sizeof(expected)) {
+        close(fd);
+        return 0;
+    }
+    history.fd = fd;
+    return 1;
+}
+
+/**
+ * Record Analytics History
+ * Adds whatever stats changed since the last call to the current point of
+ * every archive (called after each sale, pass and refund)
+ */
+void history_record(long long now) {
+    pthread_mutex_lock(&history.lock);
+    history_clock_init();
+    Analytics change = {0};
+    analytics_add_change(&change, &stats, &history.recorded);
+    history.recorded = stats;
+    
+    for (int a = 0; a < HISTORY_ARCHIVES; a++) {
+        const HistoryArchive* archive = &history_archives[a];
+        long long start = history_interval(archive, now);
+        int slot = history_slot(archive, start);
+        HistoryPoint* point = &history_points[slot];
+        if (point->start != start) {
+            if (point->start != 0) mem_release(MEM_SKETCHES, sizeof(*point)); // Oldest interval leaves the ring
+            mem_claim(MEM_SKETCHES, sizeof(*point));
+            *point = (HistoryPoint){.start = start};
+        }
+        analytics_add_change(&point->delta, &change, &(Analytics){0});
+        history_write(slot);
+    }
+    pthread_mutex_unlock(&history.lock);
+}
+
+/**
+ * Query History
+ * One point per interval of the archive between from and to (both Unix
+ * seconds), oldest first, at most max. Intervals without changes come back
+ * with zero deltas; intervals older than the archive keeps are skipped.
+ * Returns the number of points, or -1 for an unknown archive.
+ */
+int history_query(int archive_index, long long from, long long to, HistoryPoint* out, int max) {
+    if (archive_index < 0 || archive_index >= HISTORY_ARCHIVES) return -1;
+    const HistoryArchive* archive = &history_archives[archive_index];
+    
+    pthread_mutex_lock(&history.lock);
+    history_clock_init();
+    long long last = history_interval(archive, to);
+    long long first = history_interval(archive, from);
+    long long oldest = last - (long long)(archive->rows - 1) * archive->step;
+    if (first < oldest) first = oldest;
+    
+    int count = 0;
+    for (long long start = first; start <= last && count < max; start += archive->step) {
+        const HistoryPoint* point = &history_points[history_slot(archive, start)];
+        out[count++] = point->start == start ? *point : (HistoryPoint){.start = start};
+    }
+    pthread_mutex_unlock(&history.lock);
+    return count;
+}
+
+/**
+ * Sales Trends (menu)
+ * Latest points of one archive: sales, revenue, net and digital share
+ */
+void history_menu() {
+    int choice, count;
+    
+    printf("\n=== SALES TRENDS ===\n");
+    printf("Resolution (1: per minute, 2: per hour, 3: per day): ");
+    scanf("%d", &choice);
+    if (choice < 1 || choice > HISTORY_ARCHIVES) {
+        printf("Invalid resolution!\n");
         return;
     }
+    const HistoryArchive* archive = &history_archives[choice - 1];
+    printf("How many %ss (up to %d): ", archive->name, archive->rows);
+    scanf("%d", &count);
+    if (count < 1) count = 1;
+    if (count > archive->rows) count = archive->rows;
     
-    // ===== UPDATE USER STATISTICS =====
-    user->total_spent += base_cost;        // Track lifetime spending
-    user->transaction_count++;             // Increment transaction count
-    update_loyalty_points(user, base_cost); // Award loyalty points
+    long long now = time(NULL);
+    long long from = now - (long long)(count - 1) * archive->step;
+    printf("\n%-17s %7s %11s %11s %9s %8s\n", "Starting", "Sales", "Revenue", "Net", "Digital", "Refunds");
     
-    // Track bulk purchases for analytics
-    if (liters >= MIN_BULK_LITERS) {
-        stats.bulk_purchases++;
+    // Page through the range a few points at a time (no table-sized buffer)
+    HistoryPoint page[32];
+    int got;
+    while (from <= now && (got = history_query(choice - 1, from, now, page, 32)) > 0) {
+        for (int i = 0; i < got; i++) {
+            const Analytics* d = &page[i].delta;
+            char when[32];
+            time_t at = (time_t)page[i].start;
+            struct tm local;
+            localtime_r(&at, &local);
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M", &local);
+            int sales = d->cash_transactions + d->digital_transactions;
+            printf("%-17s %7d %11.2f %11.2f", when, sales, d->total_revenue,
+                   d->total_revenue + d->total_fees_collected - d->total_discounts_given);
+            if (sales > 0) {
+                printf(" %8.1f%% %8d\n", d->digital_transactions * 100.0 / sales, d->refunds);
+            } else {
+                printf(" %9s %8d\n", "-", d->refunds);
+            }
+        }
+        from = page[got - 1].start + archive->step;
     }
+    if (history.fd < 0) printf("(RAM only: set WATER_ATM_HISTORY to keep trends across restarts)\n");
+}
+
+void history_benchmark(int days) {
+    char path[] = "/tmp/water_atm_history_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0 || days < 1) return;
+    close(fd);
+    if (!history_open(path)) return;
     
-    // ===== RECORD TRANSACTION =====
-    save_transaction(user_id, final_amount, liters, payment_method, fee, discount);
+    // 300 sales a day on a simulated clock; the digital share grows from 20% to 80%
+    long long end = time(NULL);
+    long long start = end - (long long)days * 86400;
+    long long sales = (long long)days * 300;
+    long long began = monotonic_ns();
+    for (long long i = 0; i < sales; i++) {
+        long long t = start + i * 288;
+        if (i * 100 / sales * 6 / 10 + 20 > i % 100) {
+            stats.digital_transactions++;
+            stats.total_fees_collected += DIGITAL_FEE;
+        } else {
+            stats.cash_transactions++;
+        }
+        stats.total_revenue += 2.0 * (1 + i % 20);
+        history_record(t);
+    }
+    double record_ns = (monotonic_ns() - began) / (double)sales;
     
-    // ===== UPDATE GLOBAL STATISTICS =====
-    stats.total_revenue += base_cost;
-    stats.total_fees_collected += fee;
-    stats.total_discounts_given += discount;
+    // Trend queries at each resolution, paged like the menu does
+    HistoryPoint points[64];
+    printf("\n=== ANALYTICS HISTORY BENCHMARK ===\n");
+    printf("Simulated: %d days, %lld sales (%.2f µs per record incl. %d in-place writes)\n",
+           days, sales, record_ns / 1e3, HISTORY_ARCHIVES);
+    for (int a = 0; a < HISTORY_ARCHIVES; a++) {
+        int rounds = 200, got = 0;
+        began = monotonic_ns();
+        for (int r = 0; r < rounds; r++) {
+            got = 0;
+            for (long long from = start, n; (n = history_query(a, from, end, points, 64)) > 0; got += n) {
+                from = points[n - 1].start + history_archives[a].step;
+            }
+        }
+        double per_point = (monotonic_ns() - began) / (double)rounds / (got > 0 ? got : 1);
+        printf("Per %-6s: %5d points kept (%6.1f days), query %4d points at %.1f ns/point\n",
+               history_archives[a].name, history_archives[a].rows,
+               history_archives[a].rows * (double)history_archives[a].step / 86400, got, per_point);
+    }
     
-    // ===== DISPLAY PURCHASE RECEIPT =====
-    printf("\n=== PURCHASE RECEIPT ===\n");
-    printf("User: %s (ID: %d)\n", user->name, user->user_id);
-    printf("Water quantity: %.2f liters\n", liters);
-    printf("Base cost: ₹%.2f\n", base_cost);
-    if (discount > 0) {
-        printf("Discount applied: -₹%.2f\n", discount);
+    // Day points add back up to the totals, and the digital share moved as simulated
+    double revenue = 0;
+    long long digital[2] = {0, 0}, all[2] = {0, 0};
+    int got = 0;
+    for (long long from = start, n; (n = history_query(2, from, end, points, 64)) > 0; got += n) {
+        for (int i = 0; i < n; i++) {
+            const Analytics* d = &points[i].delta;
+            revenue += d->total_revenue;
+            if (got + i < 30) {
+                digital[0] += d->digital_transactions;
+                all[0] += d->cash_transactions + d->digital_transactions;
+            }
+            if (points[i].start > end - 31 * 86400LL) {
+                digital[1] += d->digital_transactions;
+                all[1] += d->cash_transactions + d->digital_transactions;
+            }
+        }
+        from = points[n - 1].start + 86400;
+    }
+    double share[2];
+    for (int side = 0; side < 2; side++) share[side] = all[side] > 0 ? digital[side] * 100.0 / all[side] : 0;
+    printf("Digital share: first 30 days %.1f%%, last 30 days %.1f%%\n", share[0], share[1]);
+    if (days < HISTORY_DAY_ROWS) {
+        printf("Day points sum to ₹%.2f of ₹%.2f revenue (%s)\n", revenue, stats.total_revenue,
+               fabs(revenue - stats.total_revenue) < 0.005 ? "match" : "MISMATCH");
+    } else {
+        printf("Day points kept sum to ₹%.2f (older days aged out)\n", revenue);
+    }
+    
+    // The file never grows, and a reopen sees the same points
+    off_t size = lseek(history.fd, 0, SEEK_END);
+    HistoryPoint last = history_points[history_slot(&history_archives[0], history_interval(&history_archives[0], end - 288))];
+    close(history.fd);
+    history.fd = -1;
+    memset(history_points, 0, sizeof(history_points));
+    int reopened = history_open(path);
+    HistoryPoint again = history_points[history_slot(&history_archives[0], history_interval(&history_archives[0], end - 288))];
+    printf("File: %lld bytes (fixed), %lld point writes, %lld failed; reopened %s\n", (long long)size,
+           history.writes, history.write_failures,
+           reopened && memcmp(&last, &again, sizeof(last)) == 0 ? "with identical points" : "WITH DIFFERENT POINTS");
+    close(history.fd);
+    history.fd = -1;
+    unlink(path);
+}
+
+// =================== SALES CUBE ===================
+
+/*
+ * Dashboards slice revenue, fees, discounts and liters by location, day and
+ * payment method. Instead of scanning transactions for every slice, each
+ * commit adds itself to every cell it belongs to, at each level:
+ *     location: kiosk, its region, all    (3)
+ *     day:      its local day, any day    (2)
+ *     method:   its method, any method    (2)
+ * That is 12 cells per sale, pass or refund, kept in one open-addressing
+ * table. Any roll-up is then one cell: revenue of region 3 on any day by
+ * UPI is cube_get(CUBE_REGION, 3, CUBE_ANY, UPI). A drill-down (all ->
+ * regions -> kiosks, or a day range, or the methods) reads one cell per row.
+ *
+ * Passes are a method of their own; refunds are added back with sign -1 to
+ * the sale's own kiosk, day and method, so slices show net figures.
+ */
+
+static const char* cube_methods[CUBE_METHODS] = {"Cash", "Digital", "UPI", "QR", "Group", "Pass"};
+
+/**
+ * Pack a cell's coordinates (CUBE_ANY day/method roll up)
+ */
+static uint64_t cube_key(int level, int where, int day, int method) {
+    return 1ULL << 63 | (uint64_t)level << 52 | (uint64_t)(where & 0xFFFF) << 36 |
+           (uint64_t)(uint32_t)day << 4 | (uint64_t)(method & 0xF);
+}
+
+static int cube_key_day(uint64_t key) {
+    return (int)(uint32_t)(key >> 4);
+}
+
+static void cube_add(CubeCell* cell, const CubeCell* change) {
+    cell->sales += change->sales;
+    cell->refunds += change->refunds;
+    cell->revenue_paise += change->revenue_paise;
+    cell->fee_paise += change->fee_paise;
+    cell->discount_paise += change->discount_paise;
+    cell->centiliters += change->centiliters;
+}
+
+/**
+ * Evict the oldest day
+ * Drops every per-day cell of the oldest day in the table; the any-day
+ * roll-ups stay. The survivors are re-placed so probing still finds them
+ * (starting after an empty slot, so no run wraps around unvisited).
+ * Returns 0 if there is no per-day cell older than keep_day.
+ */
+static int cube_evict_day(int keep_day) {
+    int oldest = INT_MAX;
+    for (size_t slot = 0; slot < CUBE_SLOTS; slot++) {
+        int day = cube_key_day(cube_cells[slot].key);
+        if (cube_cells[slot].key != 0 && day != CUBE_ANY && day < oldest) oldest = day;
+    }
+    if (oldest >= keep_day) return 0;
+    
+    size_t empty = 0;
+    for (size_t slot = 0; slot < CUBE_SLOTS; slot++) {
+        uint64_t key = cube_cells[slot].key;
+        if (key != 0 && cube_key_day(key) == oldest) {
+            if ((key >> 52 & 0x7FF) == CUBE_ALL && (key & 0xF) == (CUBE_ANY & 0xF)) cube_add(&cube.evicted, &cube_cells[slot]);
+            cube_cells[slot] = (CubeCell){0};
+            cube.cells--;
+            mem_release(MEM_SKETCHES, sizeof(CubeCell));
+        }
+        if (cube_cells[slot].key == 0) empty = slot;
+    }
+    for (size_t i = 1; i <= CUBE_SLOTS; i++) {
+        size_t slot = (empty + i) % CUBE_SLOTS;
+        if (cube_cells[slot].key == 0) continue;
+        CubeCell moved = cube_cells[slot];
+        cube_cells[slot] = (CubeCell){0};
+        size_t to = hash_slot(moved.key, CUBE_SLOTS);
+        while (cube_cells[to].key != 0) to = to + 1 == CUBE_SLOTS ? 0 : to + 1;
+        cube_cells[to] = moved;
+    }
+    cube.first_day = oldest + 1;
+    cube.evicted_days++;
+    return 1;
+}
+
+/**
+ * Find a cell (creating it if asked; a full table evicts its oldest day,
+ * unless that is keep_day, the day of the sale being added)
+ */
+static CubeCell* cube_cell(uint64_t key, int create, int keep_day) {
+    size_t slot = hash_slot(key, CUBE_SLOTS);
+    while (cube_cells[slot].key != 0) {
+        if (cube_cells[slot].key == key) return &cube_cells[slot];
+        slot = slot + 1 == CUBE_SLOTS ? 0 : slot + 1;
+    }
+    if (!create) return NULL;
+    if (cube.cells >= CUBE_SLOTS / 8 * 7) {
+        if (!cube_evict_day(keep_day)) {
+            cube.dropped++;
+            return NULL;
+        }
+        return cube_cell(key, create, keep_day);
+    }
+    cube.cells++;
+    mem_claim(MEM_SKETCHES, sizeof(CubeCell));
+    cube_cells[slot].key = key;
+    return &cube_cells[slot];
+}
+
+int cube_day(long long when) {
+    history_clock_init();                   // Same local days as the history archives
+    return (int)((when + history.utc_offset) / 86400);
+}
+
+/**
+ * Add to Sales Cube
+ * Updates the 12 cells a sale (sign 1) or a refund of it (sign -1) falls
+ * into. Methods outside the cube's list are ignored.
+ */
+void cube_record(int kiosk, long long when, const char* method, int sign, double revenue,
+                 double fee, double discount, double liters) {
+    int m = 0;
+    while (m < CUBE_METHODS && strcmp(method, cube_methods[m]) != 0) m++;
+    if (m == CUBE_METHODS) return;
+    kiosk &= (1 << ID_KIOSK_BITS) - 1;
+    int region = kiosk_regions[kiosk];
+    int day = cube_day(when);
+    
+    // Refund of a sale: same magnitudes as the sale (fields may arrive negative)
+    CubeCell change = {
+        .sales = sign,
+        .refunds = sign < 0,
+        .revenue_paise = sign * llabs(llround(revenue * 100)),
+        .fee_paise = sign * llabs(llround(fee * 100)),
+        .discount_paise = sign * llround(fabs(discount) * 100),
+        .centiliters = sign * llabs(llround(liters * 100)),
+    };
+    const int wheres[3] = {kiosk, region, 0};
+    
+    pthread_mutex_lock(&cube.lock);
+    cube.kiosk_seen[kiosk] = 1;
+    cube.region_seen[region] = 1;
+    for (int level = CUBE_KIOSK; level <= CUBE_ALL; level++) {
+        for (int d = 0; d < 2; d++) {
+            for (int k = 0; k < 2; k++) {
+                if (!d && day < cube.first_day) {
+                    // Refund of a sale on an evicted day: only the fleet total of those days
+                    if (level == CUBE_ALL && k) cube_add(&cube.evicted, &change);
+                    continue;
+                }
+                CubeCell* cell = cube_cell(cube_key(level, wheres[level], d ? CUBE_ANY : day, k ? CUBE_ANY : m), 1, day);
+                if (cell) cube_add(cell, &change);
+            }
+        }
+    }
+    pthread_mutex_unlock(&cube.lock);
+}
+
+/**
+ * Load the replayed history into the cube (startup)
+ * Passes aren't transactions, so only sales and refunds come back
+ */
+void cube_load_history() {
+    for (int i = 0; i < transaction_count; i++) {
+        const Transaction* txn = &transactions[i];
+        const Transaction* sale = txn->reverses ? find_transaction(txn->reverses) : txn;
+        if (!sale) continue;                // Refund of a sale older than the history
+        cube_record(id_kiosk(sale->transaction_id), sale->timestamp, sale->payment_method, txn->reverses ? -1 : 1,
+                    sale->liters * WATER_PRICE_PER_LITER, sale->fee_charged, sale->discount_applied, sale->liters);
+    }
+}
+
+/**
+ * Read one cell (all zeros if nothing was sold there); returns 1 if it exists
+ */
+int cube_get(int level, int where, int day, int method, CubeCell* out) {
+    pthread_mutex_lock(&cube.lock);
+    CubeCell* cell = cube_cell(cube_key(level, where, day, method), 0, 0);
+    *out = cell ? *cell : (CubeCell){0};
+    pthread_mutex_unlock(&cube.lock);
+    return cell != NULL;
+}
+
+/**
+ * Drill Down
+ * Rows one location level below (level, where): all -> regions, region ->
+ * its kiosks. Only locations with sales are listed. Returns the row count.
+ */
+int cube_drill_down(int level, int where, int day, int method, CubeRow* rows, int max) {
+    int count = 0;
+    if (level == CUBE_ALL) {
+        for (int region = 0; region < CUBE_REGIONS && count < max; region++) {
+            if (!cube.region_seen[region]) continue;
+            rows[count].member = region;
+            cube_get(CUBE_REGION, region, day, method, &rows[count++].totals);
+        }
+    } else if (level == CUBE_REGION) {
+        for (int kiosk = 0; kiosk < (1 << ID_KIOSK_BITS) && count < max; kiosk++) {
+            if (!cube.kiosk_seen[kiosk] || kiosk_regions[kiosk] != where) continue;
+            rows[count].member = kiosk;
+            cube_get(CUBE_KIOSK, kiosk, day, method, &rows[count++].totals);
+        }
+    }
+    return count;
+}
+
+/**
+ * One row per payment method of a location (rows holds CUBE_METHODS)
+ */
+int cube_by_method(int level, int where, int day, CubeRow* rows) {
+    for (int m = 0; m < CUBE_METHODS; m++) {
+        rows[m].member = m;
+        cube_get(level, where, day, m, &rows[m].totals);
     }
-    if (fee > 0) {
-        printf("Digital payment fee: +₹%.2f\n", fee);
+    return CUBE_METHODS;
+}
+
+/**
+ * One row per day in [first_day, last_day] for a location and method
+ */
+int cube_by_day(int level, int where, int method, int first_day, int last_day, CubeRow* rows, int max) {
+    int count = 0;
+    for (int day = first_day; day <= last_day && count < max; day++) {
+        rows[count].member = day;
+        cube_get(level, where, day, method, &rows[count++].totals);
     }
-    printf("Final amount: ₹%.2f\n", final_amount);
-    printf("Payment method: %s\n", payment_method);
-    if (payment_choice == 2) {
-        printf("Remaining wallet balance: ₹%.2f\n", user->wallet_balance);
+    return count;
+}
+
+/**
+ * Print slice rows (label by dimension: 'r' region, 'k' kiosk, 'm' method, 'd' day)
+ */
+static void cube_print(const CubeRow* rows, int count, char dimension) {
+    printf("%-12s %8s %12s %10s %10s %10s %8s\n", "", "Sales", "Revenue", "Fees", "Discounts", "Liters", "Refunds");
+    for (int i = 0; i < count; i++) {
+        const CubeCell* c = &rows[i].totals;
+        char label[24];
+        if (dimension == 'm') {
+            snprintf(label, sizeof(label), "%s", cube_methods[rows[i].member]);
+        } else if (dimension == 'd') {
+            time_t at = (time_t)rows[i].member * 86400 - history.utc_offset + 43200;
+            struct tm local;
+            localtime_r(&at, &local);
+            strftime(label, sizeof(label), "%Y-%m-%d", &local);
+        } else if (rows[i].member == 0 && dimension == 'r') {
+            snprintf(label, sizeof(label), "Unassigned");
+        } else {
+            snprintf(label, sizeof(label), "%s %d", dimension == 'r' ? "Region" : "Kiosk", rows[i].member);
+        }
+        printf("%-12s %8lld %12.2f %10.2f %10.2f %10.1f %8lld\n", label, c->sales, c->revenue_paise / 100.0,
+               c->fee_paise / 100.0, c->discount_paise / 100.0, c->centiliters / 100.0, c->refunds);
     }
-    printf("Loyalty points earned: +%d\n", (int)(base_cost));
-    printf("Total loyalty points: %d\n", user->loyalty_points);
-    printf("========================\n");
 }
 
 /**
- * Purchase Pass System
- * Allows users to buy weekly/monthly passes to avoid digital fees
- * This is a key strategy for frequent digital payment users
+ * Sales Dashboard (menu)
  */
-void purchase_pass() {
-    int user_id, pass_type;
+void cube_menu() {
+    int choice, today_only = 0, region = 0;
+    CubeRow rows[64];
+    int count = 0;
+    char dimension = 'r';
     
-    printf("\n=== PURCHASE PASS ===\n");
-    printf("Enter User ID: ");
-    scanf("%d", &user_id);
-    
-    User* user = find_user(user_id);
-    if (!user) {
-        printf("User not found!\n");
-        return;
+    printf("\n=== SALES DASHBOARD ===\n");
+    printf("1. By region\n2. Kiosks in a region\n3. By payment method\n4. Last 14 days\n");
+    printf("Choose: ");
+    scanf("%d", &choice);
+    if (choice >= 1 && choice <= 3) {
+        printf("Period (0: all time, 1: today): ");
+        scanf("%d", &today_only);
     }
-    
-    // Display pass options
-    printf("\n=== PASS OPTIONS ===\n");
-    printf("1. Weekly Pass - ₹%.2f (No digital fees for 7 days)\n", WEEKLY_PASS_COST);
-    printf("2. Monthly Pass - ₹%.2f (No digital fees for 30 days)\n", MONTHLY_PASS_COST);
-    printf("Choose pass type: ");
-    scanf("%d", &pass_type);
-    
-    double pass_cost;
-    int pass_days;
-    
-    // Set pass parameters based on selection
-    if (pass_type == 1) {
-        pass_cost = WEEKLY_PASS_COST;
-        pass_days = 7;
-    } else if (pass_type == 2) {
-        pass_cost = MONTHLY_PASS_COST;
-        pass_days = 30;
-    } else {
-        printf("Invalid pass type!\n");
-        return;
+    if (choice == 2) {
+        printf("Region (0 = unassigned): ");
+        scanf("%d", &region);
     }
+    int day = today_only ? cube_day(time(NULL)) : CUBE_ANY;
     
-    // Check wallet balance
-    if (user->wallet_balance < pass_cost) {
-        printf("Insufficient wallet balance!\n");
-        printf("Required: ₹%.2f, Available: ₹%.2f\n", pass_cost, user->wallet_balance);
+    long long start = monotonic_ns();
+    if (choice == 1) {
+        count = cube_drill_down(CUBE_ALL, 0, day, CUBE_ANY, rows, 64);
+    } else if (choice == 2) {
+        count = cube_drill_down(CUBE_REGION, region, day, CUBE_ANY, rows, 64);
+        dimension = 'k';
+    } else if (choice == 3) {
+        count = cube_by_method(CUBE_ALL, 0, day, rows);
+        dimension = 'm';
+    } else if (choice == 4) {
+        int today = cube_day(time(NULL));
+        count = cube_by_day(CUBE_ALL, 0, CUBE_ANY, today - 13, today, rows, 64);
+        dimension = 'd';
+    } else {
+        printf("Invalid choice!\n");
         return;
     }
+    double elapsed_us = (monotonic_ns() - start) / 1e3;
     
-    // Process pass purchase
-    user->wallet_balance -= pass_cost;
+    printf("\n");
+    cube_print(rows, count, dimension);
+    CubeCell total;
+    cube_get(CUBE_ALL, 0, choice == 4 ? CUBE_ANY : day, CUBE_ANY, &total);
+    printf("%-12s %8lld %12.2f\n", "Total", total.sales, total.revenue_paise / 100.0);
+    printf("Answered in %.1f µs (%d pre-aggregated cells in the cube)\n", elapsed_us, cube.cells);
+    if (cube.evicted_days > 0) printf("%d oldest days evicted from the per-day figures (all-time figures still include them)\n", cube.evicted_days);
+    if (cube.dropped > 0) printf("Warning: cube full, %lld cell updates dropped\n", cube.dropped);
+}
+
+void cube_benchmark(int sales) {
+    // Synthetic fleet: kiosks spread over regions, sales spread over days
+    int kiosks = PROFILE(64, 4), regions = PROFILE(8, 2), days = PROFILE(180, 20);
+    for (int k = 1; k <= kiosks; k++) kiosk_regions[k] = (uint8_t)(1 + k % regions);
+    long long first = time(NULL) - (long long)days * 86400;
+    unsigned int seed = 7;
     
-    // Activate appropriate pass
-    if (pass_type == 1) {
-        user->has_weekly_pass = 1;
-    } else {
-        user->has_monthly_pass = 1;
+    long long start = monotonic_ns();
+    for (int i = 0; i < sales; i++) {
+        int kiosk = 1 + rand_r(&seed) % kiosks;
+        int method = rand_r(&seed) % CUBE_METHODS;
+        double liters = 1 + rand_r(&seed) % 20;
+        double fee = method == 0 || method == 5 ? 0.0 : DIGITAL_FEE;
+        int refund = rand_r(&seed) % 100 == 0;
+        long long when = first + (long long)i * days * 86400 / sales;
+        cube_record(kiosk, when, cube_methods[method], 1, liters * WATER_PRICE_PER_LITER, fee, liters * 0.1, liters);
+        if (refund) cube_record(kiosk, when, cube_methods[method], -1, liters * WATER_PRICE_PER_LITER, fee, liters * 0.1, liters);
     }
+    double record_ns = (monotonic_ns() - start) / (double)sales;
     
-    // Set expiry time (current time + pass duration)
-    user->pass_expiry = time(NULL) + (pass_days * 24 * 60 * 60);
-    stats.pass_holders++;
+    // Slices a dashboard asks for
+    CubeRow rows[256];
+    int today = cube_day(time(NULL)), lookups = 20000, got = 0;
+    struct { const char* name; int kind; } slices[] = {
+        {"Grand total", 0}, {"All -> regions", 1}, {"Region -> kiosks", 2},
+        {"Region by method", 3}, {"Kiosk, last 30 days", 4},
+    };
+    printf("\n=== SALES CUBE BENCHMARK ===\n");
+    printf("Fleet: %d kiosks in %d regions, %d days; %d sales recorded at %.0f ns each (12 cells)\n",
+           kiosks, regions, days, sales, record_ns);
+    printf("Cells: %d of %d slots, %d oldest days evicted, %lld updates dropped\n", cube.cells, CUBE_SLOTS,
+           cube.evicted_days, cube.dropped);
+    for (size_t s = 0; s < sizeof(slices) / sizeof(slices[0]); s++) {
+        start = monotonic_ns();
+        for (int i = 0; i < lookups; i++) {
+            CubeCell total;
+            switch (slices[s].kind) {
+                case 0: got = cube_get(CUBE_ALL, 0, CUBE_ANY, CUBE_ANY, &total); break;
+                case 1: got = cube_drill_down(CUBE_ALL, 0, CUBE_ANY, CUBE_ANY, rows, 256); break;
+                case 2: got = cube_drill_down(CUBE_REGION, 1 + i % regions, CUBE_ANY, CUBE_ANY, rows, 256); break;
+                case 3: got = cube_by_method(CUBE_REGION, 1 + i % regions, today - i % days, rows); break;
+                default: got = cube_by_day(CUBE_KIOSK, 1 + i % kiosks, CUBE_ANY, today - 29, today, rows, 256); break;
+            }
+        }
+        printf("%-20s %4d rows in %7.2f µs\n", slices[s].name, got, (monotonic_ns() - start) / 1e3 / lookups);
+    }
     
-    // Confirm purchase
-    printf("Pass purchased successfully!\n");
-    printf("Cost: ₹%.2f\n", pass_cost);
-    printf("Valid for: %d days\n", pass_days);
-    printf("Remaining wallet balance: ₹%.2f\n", user->wallet_balance);
-    printf("Benefit: No digital payment fees during pass validity!\n");
+    // Every level adds up to the same totals
+    CubeCell all, part;
+    cube_get(CUBE_ALL, 0, CUBE_ANY, CUBE_ANY, &all);
+    long long by_region = 0, by_kiosk = 0, by_method = 0, by_day = cube.evicted.revenue_paise;
+    got = cube_drill_down(CUBE_ALL, 0, CUBE_ANY, CUBE_ANY, rows, 256);
+    for (int i = 0; i < got; i++) {
+        by_region += rows[i].totals.revenue_paise;
+        int in_region = cube_drill_down(CUBE_REGION, rows[i].member, CUBE_ANY, CUBE_ANY, rows + got, 256 - got);
+        for (int j = 0; j < in_region; j++) by_kiosk += rows[got + j].totals.revenue_paise;
+    }
+    for (int m = 0; m < CUBE_METHODS; m++) {
+        cube_get(CUBE_ALL, 0, CUBE_ANY, m, &part);
+        by_method += part.revenue_paise;
+    }
+    for (int day = cube_day(first); day <= today; day++) {
+        cube_get(CUBE_ALL, 0, day, CUBE_ANY, &part);
+        by_day += part.revenue_paise;
+    }
+    printf("Net revenue ₹%.2f from %lld sales (%lld refunded); regions, kiosks, methods and days %s\n",
+           all.revenue_paise / 100.0, all.sales, all.refunds,
+           by_region == all.revenue_paise && by_kiosk == all.revenue_paise && by_method == all.revenue_paise &&
+           by_day == all.revenue_paise ? "all add up to it" : "DO NOT ADD UP");
 }
 
-// =================== INFORMATION DISPLAY FUNCTIONS ===================
+// =================== COHORT RETENTION ===================
+
+/*
+ * Are customers who registered in a given week still buying n weeks later?
+ * Answering that from users[] and transactions[] means joining every sale
+ * to its customer's registration week. Instead each cohort (registration
+ * week) keeps counters: how many registered, and for every week after how
+ * many distinct customers bought. Each user carries a bitmask of the weeks
+ * since registration they already bought in, so a purchase costs one bit
+ * test and at most one increment. The registration week comes from the
+ * user ID's timestamp, so imported and synced users land in the right one.
+ *
+ * Counters are split by student flag. Cohorts older than COHORT_WEEKS fall
+ * out of the ring; refunds don't undo a week's activity (the customer did
+ * come back to buy).
+ */
+
+int cohort_week(long long when) {
+    return (cube_day(when) + 3) / 7;     // Day 0 (1970-01-01) was a Thursday
+}
 
 /**
- * View User Profile
- * Displays comprehensive user information and provides usage insights
+ * Cohort row for a registration week (reset if the ring has moved on), or
+ * NULL if that week is older than the ring keeps
  */
-void view_user_profile() {
-    int user_id;
-    
-    printf("\n=== USER PROFILE ===\n");
-    printf("Enter User ID: ");
-    scanf("%d", &user_id);
-    
-    User* user = find_user(user_id);
-    if (!user) {
-        printf("User not found!\n");
-        return;
-    }
-    
-    // Display basic user information
-    printf("\n=== PROFILE DETAILS ===\n");
-    printf("Name: %s\n", user->name);
-    printf("User ID: %d\n", user->user_id);
-    printf("Phone: %s\n", user->phone);
-    printf("Student: %s\n", user->is_student ? "Yes" : "No");
-    printf("Wallet Balance: ₹%.2f\n", user->wallet_balance);
-    printf("Total Spent: ₹%.2f\n", user->total_spent);
-    printf("Transactions: %d\n", user->transaction_count);
-    printf("Loyalty Points: %d\n", user->loyalty_points);
-    
-    // Display pass status
-    if (is_pass_valid(user)) {
-        time_t now = time(NULL);
-        int days_left = (user->pass_expiry - now) / (24 * 60 * 60);
-        printf("Active Pass: %s (%d days remaining)\n", 
-               user->has_monthly_pass ? "Monthly" : "Weekly", days_left);
-    } else {
-        printf("Active Pass: None\n");
-    }
+static Cohort* cohort_row(int week, int create) {
+    Cohort* cohort = &cohorts[week % COHORT_WEEKS];
+    if (cohort->week == week) return cohort;
+    if (!create || cohort->week > week) return NULL;
+    if (cohort->week != 0) mem_release(MEM_SKETCHES, sizeof(*cohort)); // Oldest week leaves the ring
+    mem_claim(MEM_SKETCHES, sizeof(*cohort));
+    memset(cohort, 0, sizeof(*cohort));
+    cohort->week = week;
+    return cohort;
+}
+
+void cohort_join(User* user) {
+    pthread_mutex_lock(&cohort_lock);
+    cohort_seen[user - users] = 0;
+    Cohort* cohort = cohort_row(cohort_week(id_timestamp(user->user_id)), 1);
+    if (cohort) cohort->registered[user->is_student != 0]++;
+    pthread_mutex_unlock(&cohort_lock);
+}
+
+void cohort_activity(User* user, long long when) {
+    int joined = cohort_week(id_timestamp(user->user_id));
+    int offset = cohort_week(when) - joined;
+    if (offset < 0 || offset >= COHORT_OFFSETS) return;
+    uint32_t bit = 1u << offset;
+    _Atomic uint32_t* seen = &cohort_seen[user - users];
+    if (atomic_load_explicit(seen, memory_order_relaxed) & bit) return; // Already counted this week
     
-    // Provide cost optimization suggestion
-    double potential_monthly_fees = user->transaction_count * DIGITAL_FEE;
-    printf("\nPotential monthly digital fees: ₹%.2f\n", potential_monthly_fees);
-    if (potential_monthly_fees > MONTHLY_PASS_COST) {
-        printf("💡 Tip: Monthly pass could save you ₹%.2f!\n", 
-               potential_monthly_fees - MONTHLY_PASS_COST);
+    // Rechecked under the lock: only one of two racing purchases counts
+    pthread_mutex_lock(&cohort_lock);
+    Cohort* cohort = cohort_row(joined, 0);
+    if (cohort && !(atomic_fetch_or_explicit(seen, bit, memory_order_relaxed) & bit)) {
+        cohort->active[offset][user->is_student != 0]++;
     }
+    pthread_mutex_unlock(&cohort_lock);
 }
 
 /**
- * Display Pricing Information
- * Shows complete pricing structure and cost optimization strategies
+ * Retention Matrix
+ * Share of each of the latest cohort_count cohorts (oldest first) that
+ * bought in weeks +0 .. +offsets-1, for filter 0 (everyone), 1 (students)
+ * or 2 (non-students). out is row-major [cohort][offset], -1 for weeks
+ * that haven't happened yet. Returns the number of rows filled.
  */
-void display_pricing_info() {
-    printf("\n=== PRICING & DISCOUNTS ===\n");
-    printf("Base Price: ₹%.2f per liter\n", WATER_PRICE_PER_LITER);
-    printf("Digital Payment Fee: ₹%.2f (when applicable)\n", DIGITAL_FEE);
-    
-    // Show fee avoidance strategies
-    printf("\n=== WAYS TO AVOID DIGITAL FEES ===\n");
-    printf("1. Weekly Pass (₹%.2f) - No fees for 7 days\n", WEEKLY_PASS_COST);
-    printf("2. Monthly Pass (₹%.2f) - No fees for 30 days\n", MONTHLY_PASS_COST);
-    printf("3. Bulk Purchase - Buy ≥%d liters (fee waived)\n", MIN_BULK_LITERS);
-    printf("4. Student Discount - 10%% off (may cover fee)\n");
-    printf("5. Loyalty Discount - Spend ≥₹%.2f total (5%% off)\n", LOYALTY_THRESHOLD);
-    
-    printf("\n=== WALLET BONUSES ===\n");
-    printf("• Top-up ≥₹100: Get 2%% bonus credit\n");
-    
-    printf("\n=== LOYALTY PROGRAM ===\n");
-    printf("• Earn 1 point per ₹1 spent\n");
-    printf("• 100 points = ₹5 discount on next purchase\n");
+int cohort_retention(int filter, int cohort_count, int offsets, double* out, int* weeks, int* registered) {
+    if (offsets > COHORT_OFFSETS) offsets = COHORT_OFFSETS;
+    if (cohort_count > COHORT_WEEKS) cohort_count = COHORT_WEEKS;
+    int now = cohort_week(time(NULL));
+    int rows = 0;
     
-    // Show cost comparison example
-    printf("\n=== COST COMPARISON EXAMPLE ===\n");
-    printf("Daily 5L purchase for 30 days:\n");
-    printf("• Cash: ₹%.2f\n", 30 * 5 * WATER_PRICE_PER_LITER);
-    printf("• Digital (no pass): ₹%.2f\n", 30 * (5 * WATER_PRICE_PER_LITER + DIGITAL_FEE));
-    printf("• Digital (monthly pass): ₹%.2f\n", MONTHLY_PASS_COST + 30 * 5 * WATER_PRICE_PER_LITER);
-    printf("• Savings with pass: ₹%.2f\n", 30 * DIGITAL_FEE - MONTHLY_PASS_COST);
+    pthread_mutex_lock(&cohort_lock);
+    for (int week = now - cohort_count + 1; week <= now; week++) {
+        const Cohort* cohort = cohort_row(week, 0);
+        int joined = 0;
+        for (int s = 0; s < 2; s++) {
+            if (cohort && filter != (s ? 2 : 1)) joined += cohort->registered[s];
+        }
+        if (joined == 0) continue;
+        weeks[rows] = week;
+        registered[rows] = joined;
+        for (int n = 0; n < offsets; n++) {
+            int active = 0;
+            for (int s = 0; s < 2; s++) {
+                if (filter != (s ? 2 : 1)) active += cohort->active[n][s];
+            }
+            out[rows * offsets + n] = week + n > now ? -1 : active * 100.0 / joined;
+        }
+        rows++;
+    }
+    pthread_mutex_unlock(&cohort_lock);
+    return rows;
 }
 
 /**
- * Admin Analytics
- * Displays comprehensive system analytics and business insights
+ * Cohort Retention (menu)
  */
-void admin_analytics() {
-    printf("\n=== ADMIN ANALYTICS ===\n");
-    
-    // User and transaction statistics
-    printf("Total Users: %d\n", user_count);
-    printf("Total Transactions: %d\n", transaction_count);
-    printf("Cash Transactions: %d (%.1f%%)\n", stats.cash_transactions, 
-           transaction_count > 0 ? (stats.cash_transactions * 100.0 / transaction_count) : 0);
-    printf("Digital Transactions: %d (%.1f%%)\n", stats.digital_transactions,
-           transaction_count > 0 ? (stats.digital_transactions * 100.0 / transaction_count) : 0);
-    printf("Bulk Purchases: %d\n", stats.bulk_purchases);
-    printf("Pass Holders: %d\n", stats.pass_holders);
-    
-    // Financial summary
-    printf("\n=== FINANCIAL SUMMARY ===\n");
-    printf("Total Revenue: ₹%.2f\n", stats.total_revenue);
-    printf("Fees Collected: ₹%.2f\n", stats.total_fees_collected);
-    printf("Discounts Given: ₹%.2f\n", stats.total_discounts_given);
-    printf("Net Revenue: ₹%.2f\n", stats.total_revenue + stats.total_fees_collected - stats.total_discounts_given);
+void cohort_menu() {
+    enum { SHOWN_COHORTS = 12, SHOWN_WEEKS = 9 };
+    double matrix[SHOWN_COHORTS * SHOWN_WEEKS];
+    int weeks[SHOWN_COHORTS], registered[SHOWN_COHORTS], filter;
     
-    // Business recommendations based on data
-    printf("\n=== RECOMMENDATIONS ===\n");
-    if (stats.digital_transactions < stats.cash_transactions) {
-        printf("• Consider promoting passes to increase digital adoption\n");
-        printf("• Bulk purchase incentives are working well\n");
+    printf("\n=== COHORT RETENTION ===\n");
+    printf("Customers (0: everyone, 1: students, 2: non-students): ");
+    scanf("%d", &filter);
+    int offsets = SHOWN_WEEKS < COHORT_OFFSETS ? SHOWN_WEEKS : COHORT_OFFSETS;
+    int rows = cohort_retention(filter, SHOWN_COHORTS, offsets, matrix, weeks, registered);
+    if (rows == 0) {
+        printf("No registrations in the last %d weeks\n", SHOWN_COHORTS);
+        return;
     }
-    if (stats.pass_holders < user_count * 0.3) {
-        printf("• Low pass adoption - consider promotional pricing\n");
+    
+    printf("\n%-12s %6s", "Week of", "Users");
+    for (int n = 0; n < offsets; n++) printf("  %4s%-2d", "+", n);
+    printf("\n");
+    for (int r = 0; r < rows; r++) {
+        char label[16];
+        time_t monday = (time_t)((long long)weeks[r] * 7 - 3) * 86400 - history.utc_offset + 43200;
+        struct tm local;
+        localtime_r(&monday, &local);
+        strftime(label, sizeof(label), "%Y-%m-%d", &local);
+        printf("%-12s %6d", label, registered[r]);
+        for (int n = 0; n < offsets; n++) {
+            double share = matrix[r * offsets + n];
+            if (share < 0) {
+                printf("  %6s", "");
+            } else {
+                printf("  %5.1f%%", share);
+            }
+        }
+        printf("\n");
     }
+    printf("(%% of each week's new customers who bought in week +n after registering)\n");
 }
 
-// =================== CALCULATION FUNCTIONS ===================
-
 /**
- * Calculate Total Discount
- * Combines all applicable discounts for a user's purchase
- * This is where the smart optimization happens
+ * Benchmark customer: weeks (bit n = week +n) they come back in, and how
+ * many purchases each; the chance of coming back decays, slower for students
  */
-double calculate_discount(User* user, double liters, char* payment_method) {
-    double discount = 0.0;
-    
-    // Student discount: 10% off base cost
-    if (user->is_student) {
-        discount += (liters * WATER_PRICE_PER_LITER) * 0.10;
+static uint32_t cohort_bench_plan(const User* user, int this_week, unsigned int* seed, int purchases[COHORT_OFFSETS]) {
+    int joined = cohort_week(id_timestamp(user->user_id));
+    uint32_t weeks = 0;
+    for (int n = 0; n < COHORT_OFFSETS && joined + n <= this_week; n++) {
+        int chance = n == 0 ? 90 : (user->is_student ? 70 : 50) - n * (user->is_student ? 2 : 3);
+        if ((int)(rand_r(seed) % 100) >= chance) continue;
+        weeks |= 1u << n;
+        purchases[n] = 1 + rand_r(seed) % 3;
     }
+    return weeks;
+}
+
+void cohort_benchmark(int user_total) {
+    if (user_total > MAX_USERS - user_count) user_total = MAX_USERS - user_count;
+    const int ms_shift = ID_KIOSK_BITS + ID_THREAD_BITS + ID_SEQUENCE_BITS;
+    int span = COHORT_OFFSETS;              // Registration weeks simulated
+    long long now = time(NULL);
+    int this_week = cohort_week(now);
+    unsigned int seed = 11;
     
-    // Bulk purchase discount: Fixed amount based on quantity
-    if (liters >= MIN_BULK_LITERS) {
-        discount += calculate_bulk_discount(liters);
+    // Users registered over the last `span` weeks (IDs carry the registration time)
+    int first = user_count;
+    for (int i = 0; i < user_total; i++) {
+        User* user = &users[user_count++];
+        long long joined = now - (long long)(i % span) * 7 * 86400 - rand_r(&seed) % (7 * 86400);
+        *user = (User){.is_student = i % 3 == 0};
+        user->user_id = ((joined * 1000 - ID_EPOCH_MS) << ms_shift) | (i & ((1 << ms_shift) - 1));
+        cohort_join(user);
     }
     
-    // Loyalty discount: Percentage of total lifetime spending
-    if (user->total_spent >= LOYALTY_THRESHOLD) {
-        discount += calculate_loyalty_discount(user);
+    unsigned int plan_seed = seed;
+    long long events = 0;
+    long long start = monotonic_ns();
+    for (int i = 0; i < user_total; i++) {
+        User* user = &users[first + i];
+        int purchases[COHORT_OFFSETS];
+        uint32_t weeks = cohort_bench_plan(user, this_week, &seed, purchases);
+        for (int n = 0; n < COHORT_OFFSETS; n++) {
+            if (!(weeks >> n & 1)) continue;
+            long long when = id_timestamp(user->user_id) + (long long)n * 7 * 86400;
+            for (int p = 0; p < purchases[n]; p++) cohort_activity(user, when < now ? when : now);
+            events += purchases[n];
+        }
     }
+    double event_ns = (monotonic_ns() - start) / (double)events;
     
-    // Loyalty points redemption: 100 points = ₹5
-    if (user->loyalty_points >= 100) {
-        discount += 5.0;
-        user->loyalty_points -= 100;    // Deduct redeemed points
+    // Render the full matrix for each filter
+    double matrix[COHORT_WEEKS * COHORT_OFFSETS];
+    int weeks[COHORT_WEEKS], registered[COHORT_WEEKS], rows = 0, renders = 1000;
+    start = monotonic_ns();
+    for (int r = 0; r < renders; r++) rows = cohort_retention(r % 3, COHORT_WEEKS, COHORT_OFFSETS, matrix, weeks, registered);
+    double render_us = (monotonic_ns() - start) / 1e3 / renders;
+    
+    // Same counts as joining each user to their own purchases (replayed from the seed)
+    int expected[COHORT_WEEKS][COHORT_OFFSETS][2];
+    memset(expected, 0, sizeof(expected));
+    for (int i = 0; i < user_total; i++) {
+        const User* user = &users[first + i];
+        int purchases[COHORT_OFFSETS];
+        uint32_t bought = cohort_bench_plan(user, this_week, &plan_seed, purchases);
+        int slot = cohort_week(id_timestamp(user->user_id)) % COHORT_WEEKS;
+        for (int n = 0; n < COHORT_OFFSETS; n++) expected[slot][n][user->is_student != 0] += bought >> n & 1;
+    }
+    int matches = 1;
+    for (int r = 0; r < COHORT_WEEKS; r++) {
+        for (int n = 0; n < COHORT_OFFSETS; n++) {
+            for (int s = 0; s < 2; s++) matches &= expected[r][n][s] == cohorts[r].active[n][s];
+        }
     }
     
-    return discount;
+    const Cohort* eight = cohort_row(this_week - 8, 0);
+    printf("\n=== COHORT RETENTION BENCHMARK ===\n");
+    printf("Users: %d over %d weeks, purchases: %lld at %.0f ns each\n", user_total, span, events, event_ns);
+    if (eight && eight->registered[0] && eight->registered[1]) {
+        printf("Registered 8 weeks ago: %d students, %d others; bought in week +8: %.1f%% / %.1f%%\n",
+               eight->registered[1], eight->registered[0], eight->active[8][1] * 100.0 / eight->registered[1],
+               eight->active[8][0] * 100.0 / eight->registered[0]);
+    }
+    printf("Full matrix (%d cohorts x %d weeks): %.2f µs to render\n", rows, COHORT_OFFSETS, render_us);
+    printf("Counters vs joining users to their purchases: %s\n", matches ? "identical" : "MISMATCH");
 }
 
-/**
- * Calculate Bulk Purchase Discount
- * Tiered discount system based on quantity
- */
-double calculate_bulk_discount(double liters) {
-    if (liters >= 20) return 4.0;      // ₹4 discount for 20L+
-    if (liters >= 15) return 3.0;      // ₹3 discount for 15L+
-    if (liters >= 10) return 2.0;      // ₹2 discount for 10L+
-    return 0.0;
-}
+// =================== MEMORY ACCOUNTING ===================
 
-/**
- * Calculate Loyalty Discount
- * Returns 5% of user's total lifetime spending as discount
+/*
+ * Nothing here allocates: every subsystem lives in fixed tables sized at
+ * build time (see --footprint), plus the files import and credit batches
+ * map for the length of a run. What changes is how much of each table is
+ * in use. Wherever an entry is taken or given back - a user registered, a
+ * sale recorded, an index slot filled, a session opened or evicted, a cube
+ * cell created, a receipt queued or printed, a file mapped - the owning
+ * subsystem's tag is charged or credited its size. Reserved bytes come from
+ * the footprint table, so the report shows for each subsystem how full its
+ * tables are and how close they came to full.
+ *
+ * Counters are relaxed atomics on their own cache line per tag: one
+ * uncontended add on the sale path, and a compare-and-swap only when a tag
+ * reaches a new peak.
  */
-double calculate_loyalty_discount(User* user) {
-    return (user->total_spent * 0.05);
+
+void mem_claim(int tag, size_t bytes) {
+    MemTag* use = &mem_tags[tag];
+    long long live = atomic_fetch_add_explicit(&use->live, (long long)bytes, memory_order_relaxed) + (long long)bytes;
+    atomic_fetch_add_explicit(&use->claims, 1, memory_order_relaxed);
+    long long peak = atomic_load_explicit(&use->peak, memory_order_relaxed);
+    while (live > peak &&
+           !atomic_compare_exchange_weak_explicit(&use->peak, &peak, live, memory_order_relaxed, memory_order_relaxed)) {
+    }
 }
 
-// =================== UTILITY FUNCTIONS ===================
+void mem_release(int tag, size_t bytes) {
+    atomic_fetch_sub_explicit(&mem_tags[tag].live, (long long)bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&mem_tags[tag].releases, 1, memory_order_relaxed);
+}
 
 /**
- * Check Pass Validity
- * Determines if user's pass is currently active
+ * Memory Report
+ * Reserved (static tables), live and peak bytes and claim counts per
+ * subsystem
  */
-int is_pass_valid(User* user) {
-    // Check if user has a pass and it hasn't expired
-    if ((user->has_weekly_pass || user->has_monthly_pass) && 
-        time(NULL) < user->pass_expiry) {
-        return 1;   // Pass is valid
+void mem_report() {
+    size_t reserved[MEM_TAGS] = {0};
+    for (size_t i = 0; i < sizeof(footprint_tables) / sizeof(footprint_tables[0]); i++) {
+        reserved[footprint_tables[i].tag] += footprint_tables[i].bytes;
     }
-    return 0;       // No valid pass
+    
+    printf("\n=== MEMORY BY SUBSYSTEM ===\n");
+    printf("%-13s %12s %12s %12s %6s %10s %10s\n", "Subsystem", "Reserved", "Live", "Peak", "Used", "Claims", "Releases");
+    long long total_live = 0, total_peak = 0;
+    size_t total_reserved = 0;
+    for (int tag = 0; tag < MEM_TAGS; tag++) {
+        const MemTag* use = &mem_tags[tag];
+        long long live = atomic_load_explicit(&use->live, memory_order_relaxed);
+        long long peak = atomic_load_explicit(&use->peak, memory_order_relaxed);
+        printf("%-13s %12zu %12lld %12lld %5.1f%% %10lld %10lld\n", mem_tag_names[tag], reserved[tag], live, peak,
+               reserved[tag] > 0 ? live * 100.0 / reserved[tag] : 0.0,
+               atomic_load_explicit(&use->claims, memory_order_relaxed),
+               atomic_load_explicit(&use->releases, memory_order_relaxed));
+        total_live += live;
+        total_peak += peak;
+        total_reserved += reserved[tag];
+    }
+    printf("%-13s %12zu %12lld %12lld %5.1f%%\n", "Total", total_reserved, total_live, total_peak,
+           total_live * 100.0 / total_reserved);
 }
 
+// =================== OPERATORS (TENANTS) ===================
+
+/*
+ * One process can host kiosks for several operators, each with its own
+ * prices, passes, customers and analytics. An operator is a slot in
+ * tenants[]: the prices that used to be compile-time constants, a quota of
+ * the user and transaction tables, and its own Analytics next to the
+ * process-wide stats. Every account carries its operator's index, so a
+ * sale prices itself from &tenants[user->tenant] - a field of a record the
+ * sale already has in cache, never a lookup by operator. The menus act for
+ * the operator the terminal is serving (active_tenant) and only find that
+ * operator's accounts, groups, cards and sales; phone numbers are unique
+ * per operator.
+ *
+ * Quotas are reserved, not first come first served: a quota given in the
+ * tenants file is set aside (a file whose quotas don't fit is refused), and
+ * operators without one split the rest evenly, so one operator filling up
+ * can't take rows another was promised. History replayed from the flash log
+ * counts against the quota of the operator this terminal serves. Without a
+ * tenants file there is one operator with the #define prices and the whole
+ * tables.
+ */
+
 /**
- * Update Loyalty Points
- * Awards points based on amount spent (1 point per rupee)
+ * Load Operators
+ * Reads "name,price_per_liter,digital_fee,min_bulk_liters,loyalty_threshold,
+ * weekly_pass,monthly_pass[,max_users,max_transactions]" lines, replacing
+ * the default operator. Call before any user is registered or the flash
+ * log is replayed. Returns the number of operators loaded (0 keeps the
+ * default, also when a price is invalid or the quotas don't fit the tables)
  */
-void update_loyalty_points(User* user, double amount) {
-    user->loyalty_points += (int)amount;
+int tenants_load(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) return 0;
+    Tenant loaded[MAX_TENANTS];
+    char line[256];
+    int count = 0;
+    while (count < MAX_TENANTS && fgets(line, sizeof(line), file)) {
+        Tenant* tenant = &loaded[count];
+        memset(tenant, 0, sizeof(*tenant));
+        if (line[0] == '#' ||
+            sscanf(line, " %31[^,],%lf,%lf,%d,%lf,%lf,%lf,%d,%d", tenant->name, &tenant->price_per_liter,
+                   &tenant->digital_fee, &tenant->min_bulk_liters, &tenant->loyalty_threshold,
+                   &tenant->weekly_pass_cost, &tenant->monthly_pass_cost, &tenant->max_users,
+                   &tenant->max_transactions) < 7) continue;
+        
+        // A NaN or negative price would sell water for free or pay the customer: refuse the file
+        double amounts[] = {tenant->price_per_liter, tenant->digital_fee, tenant->loyalty_threshold,
+                            tenant->weekly_pass_cost, tenant->monthly_pass_cost};
+        int valid = tenant->min_bulk_liters > 0 && tenant->max_users >= 0 && tenant->max_transactions >= 0;
+        for (int i = 0; i < 5; i++) valid = valid && isfinite(amounts[i]) && amounts[i] >= 0;
+        if (!valid) {
+            printf("Operator %s: prices must be non-negative numbers and the bulk minimum positive\n", tenant->name);
+            fclose(file);
+            return 0;
+        }
+        count++;
+    }
+    fclose(file);
+    if (count == 0) return 0;
+    
+    // Explicit quotas first, then an even split of what they left
+    int users_left = MAX_USERS, transactions_left = TXN_SALE_SLOTS;
+    int users_shared = 0, transactions_shared = 0;
+    for (int i = 0; i < count; i++) {
+        if (loaded[i].max_users > users_left || loaded[i].max_transactions > transactions_left) {
+            printf("Operator %s: quota larger than the %d users / %d transactions left\n", loaded[i].name,
+                   users_left, transactions_left);
+            return 0;
+        }
+        if (loaded[i].max_users > 0) {
+            users_left -= loaded[i].max_users;
+        } else {
+            users_shared++;
+        }
+        if (loaded[i].max_transactions > 0) {
+            transactions_left -= loaded[i].max_transactions;
+        } else {
+            transactions_shared++;
+        }
+    }
+    if ((users_shared > 0 && users_left < users_shared) ||
+        (transactions_shared > 0 && transactions_left < transactions_shared)) {
+        printf("Quotas leave no room for the operators without one\n");
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        if (loaded[i].max_users <= 0 && users_shared > 0) loaded[i].max_users = users_left / users_shared;
+        if (loaded[i].max_transactions <= 0 && transactions_shared > 0) {
+            loaded[i].max_transactions = transactions_left / transactions_shared;
+        }
+    }
+    memcpy(tenants, loaded, count * sizeof(Tenant));
+    tenant_count = count;
+    if (active_tenant >= count) active_tenant = 0;
+    return count;
 }
 
 /**
- * Save Transaction Record
- * Stores transaction details in system history
+ * Operators Report
+ * Each operator's accounts and history against its quotas, and its takings
  */
-void save_transaction(int user_id, double amount, double liters, char* method, double fee, double discount) {
-    // Check if transaction storage is full
-    if (transaction_count >= MAX_TRANSACTIONS) return;
-    
-    // Create new transaction record
-    Transaction* txn = &transactions[transaction_count];
-    txn->transaction_id = transaction_count + 1;
-    txn->user_id = user_id;
-    txn->amount = amount;
-    txn->liters = liters;
-    strcpy(txn->payment_method, method);
-    txn->fee_charged = fee;
-    txn->discount_applied = discount;
-    txn->timestamp = time(NULL);        // Current timestamp
-    
-    transaction_count++;                // Increment transaction counter
+void tenant_report() {
+    printf("\n=== OPERATORS ===\n");
+    printf("%-3s %-16s %15s %13s %11s %9s %10s %11s %7s\n", "#", "Operator", "Users", "History", "Revenue",
+           "Fees", "Discounts", "Net", "Refunds");
+    for (int i = 0; i < tenant_count; i++) {
+        const Tenant* tenant = &tenants[i];
+        const Analytics* s = &tenant->stats;
+        printf("%-3d %-16.16s %7d/%-7d %6d/%-6d %11.2f %9.2f %10.2f %11.2f %7d%s\n", i, tenant->name,
+               tenant->users, tenant->max_users, tenant->transactions, tenant->max_transactions,
+               s->total_revenue, s->total_fees_collected, s->total_discounts_given,
+               s->total_revenue + s->total_fees_collected - s->total_discounts_given, s->refunds,
+               i == active_tenant ? "  <- this terminal" : "");
+    }
 }
 
 /**
- * Find User by ID
- * Searches user array and returns pointer to user or NULL if not found
+ * Switch Operator (menu)
+ * Picks the operator this terminal serves from now on (operator PIN)
  */
-User* find_user(int user_id) {
-    // Linear search through user array
-    for (int i = 0; i < user_count; i++) {
-        if (users[i].user_id == user_id) {
-            return &users[i];           // Return pointer to found user
-        }
+void tenant_menu() {
+    int choice;
+    
+    printf("\n=== SWITCH OPERATOR ===\n");
+    for (int i = 0; i < tenant_count; i++) {
+        const Tenant* tenant = &tenants[i];
+        printf("%d. %s - ₹%.2f/L, fee ₹%.2f, passes ₹%.2f/₹%.2f, %d of %d users%s\n", i + 1, tenant->name,
+               tenant->price_per_liter, tenant->digital_fee, tenant->weekly_pass_cost, tenant->monthly_pass_cost,
+               tenant->users, tenant->max_users, i == active_tenant ? " (current)" : "");
     }
-    return NULL;                        // User not found
+    if (tenant_count == 1) {
+        printf("Only one operator is configured (set WATER_ATM_TENANTS)\n");
+        return;
+    }
+    if (!operator_authorize()) return;
+    printf("Choose operator: ");
+    if (scanf("%d", &choice) != 1 || choice < 1 || choice > tenant_count) {
+        printf("Invalid choice!\n");
+        return;
+    }
+    active_tenant = choice - 1;
+    printf("This terminal now serves %s\n", tenants[active_tenant].name);
 }